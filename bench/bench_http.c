@@ -0,0 +1,887 @@
+// HTTP/1.1 load generator. each thread drives its share of the connections
+// from its own epoll loop. prints the results as one JSON object on stdout.
+//
+// in the default closed-loop mode every connection keeps `pipeline` requests
+// in flight. with -r, requests are started on a fixed schedule instead, and
+// latency is measured from when a request should have been sent, so a
+// stalled server can't hide its stalls by slowing down the load generator
+// (coordinated omission).
+//
+// usage: http-bench [options] <host> <port> <path>...
+
+#include "http_metrics.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/epoll.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+#define BENCH_READ_BUFFER_SIZE (64 * 1024)
+#define BENCH_MAX_EVENTS 256
+
+typedef struct {
+    const char* scenario;
+    const char* host;
+    const char* port;
+    char** paths;
+    size_t paths_count;
+    // pre-rendered request for each path
+    char** requests;
+    size_t* request_sizes;
+    size_t connections;
+    size_t idle_connections;
+    size_t threads;
+    size_t pipeline;
+    double duration_s;
+    // total requests per second, 0 for closed-loop
+    double rate;
+    bool keep_alive;
+    struct addrinfo* addr;
+} bench_config;
+
+typedef enum {
+    RESPONSE_HEADER,
+    RESPONSE_BODY,
+    RESPONSE_CHUNK_SIZE,
+    RESPONSE_CHUNK_DATA,
+    RESPONSE_TRAILER,
+    RESPONSE_UNTIL_CLOSE,
+} response_state;
+
+typedef struct {
+    int fd;
+    bool connected;
+    // EPOLLOUT is registered
+    bool want_write;
+    bool idle;
+    // the server will close after the response being read
+    bool closing;
+    // requests sent, or about to be, whose responses haven't arrived
+    uint64_t* started_ns;
+    size_t inflight_head;
+    size_t inflight_count;
+    size_t next_path;
+    char* write_buffer;
+    size_t write_len;
+    size_t write_capacity;
+    char read_buffer[BENCH_READ_BUFFER_SIZE];
+    size_t read_len;
+    response_state state;
+    size_t remaining;
+    int status;
+} bench_conn;
+
+typedef struct {
+    uint64_t requests;
+    uint64_t errors;
+    uint64_t connects;
+    uint64_t idle_closed;
+    // fixed-rate requests which were due, but never got a free connection
+    uint64_t unsent;
+    uint64_t bytes;
+    // by status class, 1xx to 5xx
+    uint64_t status[6];
+    uint64_t max_ns;
+    uint64_t min_ns;
+    uint64_t sum_ns;
+    uint64_t latency[HTTP_METRICS_BUCKETS];
+} bench_stats;
+
+typedef struct {
+    const bench_config* config;
+    pthread_t thread;
+    int epoll_fd;
+    bench_conn* conns;
+    size_t conns_count;
+    bench_conn* idle;
+    size_t idle_count;
+    size_t next_conn;
+    // fixed-rate mode. epoll_wait's ms timeouts are too coarse to keep to
+    // the schedule, so a timerfd wakes the loop when the next request is due.
+    int timer_fd;
+    uint64_t interval_ns;
+    uint64_t next_send_ns;
+    uint64_t end_ns;
+    bench_stats stats;
+} bench_thread;
+
+static void usage(const char* argv0) {
+    fprintf(stderr,
+        "usage: %s [options] <host> <port> <path>...\n"
+        "  -c  connections. default: 50\n"
+        "  -t  threads. default: number of cpus, at most one per connection\n"
+        "  -d  duration in seconds. default: 10\n"
+        "  -p  requests in flight per connection (pipelining). default: 1\n"
+        "  -r  fixed total request rate per second, 0 for as fast as possible. default: 0\n"
+        "  -k  0 to close the connection after each request. default: 1\n"
+        "  -i  extra connections which connect, and then send nothing. default: 0\n"
+        "  -f  file with one path per line, in addition to the ones given\n"
+        "  -n  scenario name for the output. default: none\n",
+        argv0);
+}
+
+static void stats_record(bench_stats* stats, uint64_t latency_ns) {
+    ++stats->latency[http_metrics_bucket_index(latency_ns)];
+    stats->sum_ns += latency_ns;
+    if (latency_ns > stats->max_ns) {
+        stats->max_ns = latency_ns;
+    }
+    if (stats->min_ns == 0 || latency_ns < stats->min_ns) {
+        stats->min_ns = latency_ns;
+    }
+}
+
+static void set_events(bench_thread* self, bench_conn* conn, int op) {
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN | EPOLLRDHUP;
+    if (!conn->connected || conn->want_write) {
+        ev.events |= EPOLLOUT;
+    }
+    ev.data.ptr = conn;
+    if (epoll_ctl(self->epoll_fd, op, conn->fd, &ev) < 0) {
+        perror("epoll_ctl");
+    }
+}
+
+static bool conn_open(bench_thread* self, bench_conn* conn) {
+    const struct addrinfo* addr = self->config->addr;
+    conn->fd = socket(addr->ai_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (conn->fd < 0) {
+        perror("socket");
+        return false;
+    }
+    int one = 1;
+    setsockopt(conn->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    conn->connected = false;
+    conn->want_write = false;
+    conn->closing = false;
+    conn->read_len = 0;
+    conn->write_len = 0;
+    conn->inflight_count = 0;
+    conn->state = RESPONSE_HEADER;
+    if (connect(conn->fd, addr->ai_addr, addr->ai_addrlen) < 0 && errno != EINPROGRESS) {
+        perror("connect");
+        close(conn->fd);
+        conn->fd = -1;
+        return false;
+    }
+    ++self->stats.connects;
+    set_events(self, conn, EPOLL_CTL_ADD);
+    return true;
+}
+
+static void conn_close(bench_thread* self, bench_conn* conn) {
+    (void)self;
+    if (conn->fd >= 0) {
+        close(conn->fd);
+        conn->fd = -1;
+    }
+}
+
+static void conn_flush(bench_thread* self, bench_conn* conn) {
+    size_t sent = 0;
+    while (sent < conn->write_len) {
+        ssize_t n = send(conn->fd, conn->write_buffer + sent, conn->write_len - sent, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                // the read side will notice
+                conn->write_len = 0;
+                return;
+            }
+            break;
+        }
+        sent += (size_t)n;
+    }
+    memmove(conn->write_buffer, conn->write_buffer + sent, conn->write_len - sent);
+    conn->write_len -= sent;
+    bool want_write = conn->write_len > 0;
+    if (want_write != conn->want_write) {
+        conn->want_write = want_write;
+        set_events(self, conn, EPOLL_CTL_MOD);
+    }
+}
+
+// queues the next request, latency will be measured from `started_ns`
+static bool conn_queue_request(bench_thread* self, bench_conn* conn, uint64_t started_ns) {
+    const bench_config* config = self->config;
+    size_t path = conn->next_path;
+    conn->next_path = (conn->next_path + 1) % config->paths_count;
+    size_t size = config->request_sizes[path];
+    if (conn->write_len + size > conn->write_capacity) {
+        size_t capacity = (conn->write_len + size) * 2;
+        char* buffer = realloc(conn->write_buffer, capacity);
+        if (!buffer) {
+            ++self->stats.errors;
+            return false;
+        }
+        conn->write_buffer = buffer;
+        conn->write_capacity = capacity;
+    }
+    memcpy(conn->write_buffer + conn->write_len, config->requests[path], size);
+    conn->write_len += size;
+    size_t slot = (conn->inflight_head + conn->inflight_count) % config->pipeline;
+    conn->started_ns[slot] = started_ns;
+    ++conn->inflight_count;
+    return true;
+}
+
+static bool can_send(const bench_thread* self, const bench_conn* conn) {
+    return conn->fd >= 0 && !conn->closing && conn->inflight_count < self->config->pipeline
+        && (self->config->keep_alive || conn->inflight_count == 0);
+}
+
+// closed-loop: top up to the pipeline depth
+static void conn_fill(bench_thread* self, bench_conn* conn, uint64_t now) {
+    if (self->interval_ns != 0 || now >= self->end_ns) {
+        return;
+    }
+    bool queued = false;
+    while (can_send(self, conn) && conn_queue_request(self, conn, now)) {
+        queued = true;
+    }
+    if (queued && conn->connected) {
+        conn_flush(self, conn);
+    }
+}
+
+static void conn_reopen(bench_thread* self, bench_conn* conn, uint64_t now) {
+    // whatever was in flight is lost
+    self->stats.errors += conn->inflight_count;
+    conn_close(self, conn);
+    if (now < self->end_ns && conn_open(self, conn)) {
+        conn_fill(self, conn, now);
+    }
+}
+
+// parses `Content-Length`, chunked and close framing from a complete header
+static void begin_response(bench_conn* conn, const char* header, size_t size) {
+    conn->status = 0;
+    if (size > 12 && memcmp(header, "HTTP/1.", 7) == 0) {
+        conn->status = atoi(header + 9);
+    }
+    bool chunked = false;
+    bool has_length = false;
+    size_t length = 0;
+    const char* line = memchr(header, '\n', size);
+    const char* end = header + size;
+    while (line && line + 1 < end) {
+        ++line;
+        const char* next = memchr(line, '\n', (size_t)(end - line));
+        size_t len = next ? (size_t)(next - line) : (size_t)(end - line);
+        if (len > 15 && strncasecmp(line, "Content-Length:", 15) == 0) {
+            has_length = true;
+            length = strtoull(line + 15, NULL, 10);
+        } else if (len > 18 && strncasecmp(line, "Transfer-Encoding:", 18) == 0) {
+            chunked = memmem(line, len, "chunked", 7) != NULL;
+        } else if (len > 11 && strncasecmp(line, "Connection:", 11) == 0) {
+            if (memmem(line, len, "close", 5)) {
+                conn->closing = true;
+            }
+        }
+        line = next;
+    }
+    if (chunked) {
+        conn->state = RESPONSE_CHUNK_SIZE;
+    } else if (has_length) {
+        conn->state = RESPONSE_BODY;
+        conn->remaining = length;
+    } else {
+        conn->state = RESPONSE_UNTIL_CLOSE;
+        conn->closing = true;
+    }
+}
+
+static void end_response(bench_thread* self, bench_conn* conn, uint64_t now) {
+    if (conn->inflight_count > 0) {
+        stats_record(&self->stats, now - conn->started_ns[conn->inflight_head]);
+        conn->inflight_head = (conn->inflight_head + 1) % self->config->pipeline;
+        --conn->inflight_count;
+    }
+    ++self->stats.requests;
+    int class = conn->status / 100;
+    if (class >= 1 && class <= 5) {
+        ++self->stats.status[class];
+    } else {
+        ++self->stats.errors;
+    }
+    conn->state = RESPONSE_HEADER;
+}
+
+// consumes as many (parts of) responses as are in the read buffer. returns
+// false if the connection is unusable.
+static bool conn_parse(bench_thread* self, bench_conn* conn, uint64_t now) {
+    size_t pos = 0;
+    while (pos < conn->read_len) {
+        char* data = conn->read_buffer + pos;
+        size_t avail = conn->read_len - pos;
+        switch (conn->state) {
+        case RESPONSE_HEADER: {
+            char* end = memmem(data, avail, "\r\n\r\n", 4);
+            if (!end) {
+                goto incomplete;
+            }
+            size_t size = (size_t)(end - data) + 4;
+            begin_response(conn, data, size);
+            pos += size;
+            if (conn->state == RESPONSE_BODY && conn->remaining == 0) {
+                end_response(self, conn, now);
+            }
+            break;
+        }
+        case RESPONSE_BODY:
+        case RESPONSE_CHUNK_DATA: {
+            size_t n = avail < conn->remaining ? avail : conn->remaining;
+            pos += n;
+            conn->remaining -= n;
+            if (conn->remaining == 0) {
+                if (conn->state == RESPONSE_BODY) {
+                    end_response(self, conn, now);
+                } else {
+                    conn->state = RESPONSE_CHUNK_SIZE;
+                }
+            }
+            break;
+        }
+        case RESPONSE_CHUNK_SIZE: {
+            char* eol = memmem(data, avail, "\r\n", 2);
+            if (!eol) {
+                goto incomplete;
+            }
+            size_t size = strtoull(data, NULL, 16);
+            pos += (size_t)(eol - data) + 2;
+            if (size == 0) {
+                conn->state = RESPONSE_TRAILER;
+            } else {
+                conn->state = RESPONSE_CHUNK_DATA;
+                // the chunk's data is followed by CRLF
+                conn->remaining = size + 2;
+            }
+            break;
+        }
+        case RESPONSE_TRAILER: {
+            char* eol = memmem(data, avail, "\r\n", 2);
+            if (!eol) {
+                goto incomplete;
+            }
+            pos += (size_t)(eol - data) + 2;
+            if (eol == data) {
+                end_response(self, conn, now);
+            }
+            break;
+        }
+        case RESPONSE_UNTIL_CLOSE:
+            pos = conn->read_len;
+            break;
+        }
+    }
+incomplete:
+    if (pos == 0 && conn->read_len == sizeof(conn->read_buffer)) {
+        fprintf(stderr, "response header too large\n");
+        return false;
+    }
+    memmove(conn->read_buffer, conn->read_buffer + pos, conn->read_len - pos);
+    conn->read_len -= pos;
+    return true;
+}
+
+static void conn_readable(bench_thread* self, bench_conn* conn) {
+    bool eof = false;
+    uint64_t now = 0;
+    for (;;) {
+        ssize_t n = read(conn->fd, conn->read_buffer + conn->read_len, sizeof(conn->read_buffer) - conn->read_len);
+        if (n > 0) {
+            self->stats.bytes += (size_t)n;
+            conn->read_len += (size_t)n;
+            now = http_metrics_now_ns();
+            if (!conn_parse(self, conn, now)) {
+                eof = true;
+                break;
+            }
+            continue;
+        }
+        if (n == 0) {
+            eof = true;
+        } else if (errno == EINTR) {
+            continue;
+        } else if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            eof = true;
+        }
+        break;
+    }
+    if (now == 0) {
+        now = http_metrics_now_ns();
+    }
+    if (eof) {
+        if (conn->state == RESPONSE_UNTIL_CLOSE) {
+            end_response(self, conn, now);
+        }
+        conn_reopen(self, conn, now);
+        return;
+    }
+    if (conn->closing && conn->inflight_count == 0) {
+        // the server is about to close, don't race it
+        conn_reopen(self, conn, now);
+        return;
+    }
+    conn_fill(self, conn, now);
+}
+
+static void conn_writable(bench_thread* self, bench_conn* conn) {
+    if (!conn->connected) {
+        int error = 0;
+        socklen_t len = sizeof(error);
+        getsockopt(conn->fd, SOL_SOCKET, SO_ERROR, &error, &len);
+        if (error != 0) {
+            errno = error;
+            perror("connect");
+            ++self->stats.errors;
+            conn_close(self, conn);
+            return;
+        }
+        conn->connected = true;
+        if (conn->idle) {
+            set_events(self, conn, EPOLL_CTL_MOD);
+            return;
+        }
+        // EPOLLOUT is still registered from connecting, the flush below
+        // drops it once everything is written
+        conn->want_write = true;
+        if (self->interval_ns == 0 && http_metrics_now_ns() < self->end_ns) {
+            uint64_t now = http_metrics_now_ns();
+            while (can_send(self, conn) && conn_queue_request(self, conn, now)) {
+            }
+        }
+    }
+    conn_flush(self, conn);
+}
+
+// fixed-rate: start every request whose time has come on a free connection.
+// if none is free, they stay due, and their latency keeps growing.
+static void send_due(bench_thread* self, uint64_t now) {
+    while (self->next_send_ns <= now && self->next_send_ns < self->end_ns) {
+        bench_conn* conn = NULL;
+        for (size_t i = 0; i < self->conns_count; ++i) {
+            bench_conn* candidate = &self->conns[(self->next_conn + i) % self->conns_count];
+            if (candidate->connected && can_send(self, candidate)) {
+                conn = candidate;
+                self->next_conn = (self->next_conn + i + 1) % self->conns_count;
+                break;
+            }
+        }
+        if (!conn) {
+            return;
+        }
+        if (!conn_queue_request(self, conn, self->next_send_ns)) {
+            return;
+        }
+        conn_flush(self, conn);
+        self->next_send_ns += self->interval_ns;
+    }
+}
+
+static void* bench_thread_main(void* arg) {
+    bench_thread* self = arg;
+    if (self->interval_ns != 0) {
+        // wake up on time, not up to 50us later
+        prctl(PR_SET_TIMERSLACK, 1UL);
+        self->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        struct epoll_event ev = { .events = EPOLLIN, .data.ptr = self };
+        if (self->timer_fd < 0 || epoll_ctl(self->epoll_fd, EPOLL_CTL_ADD, self->timer_fd, &ev) < 0) {
+            perror("timerfd");
+            return NULL;
+        }
+    }
+    for (size_t i = 0; i < self->conns_count; ++i) {
+        if (!conn_open(self, &self->conns[i])) {
+            ++self->stats.errors;
+        }
+    }
+    for (size_t i = 0; i < self->idle_count; ++i) {
+        self->idle[i].idle = true;
+        if (!conn_open(self, &self->idle[i])) {
+            ++self->stats.errors;
+        }
+    }
+    struct epoll_event events[BENCH_MAX_EVENTS];
+    for (;;) {
+        uint64_t now = http_metrics_now_ns();
+        if (now >= self->end_ns) {
+            break;
+        }
+        uint64_t wait_ns = self->end_ns - now;
+        if (self->interval_ns != 0) {
+            send_due(self, now);
+            // when behind schedule, a response freeing a connection wakes us
+            if (self->next_send_ns > now && self->next_send_ns < self->end_ns) {
+                struct itimerspec when;
+                memset(&when, 0, sizeof(when));
+                when.it_value.tv_sec = (time_t)(self->next_send_ns / 1000000000ULL);
+                when.it_value.tv_nsec = (long)(self->next_send_ns % 1000000000ULL);
+                timerfd_settime(self->timer_fd, TFD_TIMER_ABSTIME, &when, NULL);
+            }
+        }
+        int timeout_ms = (int)((wait_ns + 999999) / 1000000);
+        int n = epoll_wait(self->epoll_fd, events, BENCH_MAX_EVENTS, timeout_ms);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("epoll_wait");
+            break;
+        }
+        for (int i = 0; i < n; ++i) {
+            if (events[i].data.ptr == self) {
+                uint64_t expirations;
+                ssize_t ret = read(self->timer_fd, &expirations, sizeof(expirations));
+                (void)ret;
+                continue;
+            }
+            bench_conn* conn = events[i].data.ptr;
+            if (conn->fd < 0) {
+                continue;
+            }
+            if (conn->idle) {
+                if (!conn->connected && (events[i].events & EPOLLOUT)) {
+                    conn_writable(self, conn);
+                } else if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+                    // the server gave up on it
+                    ++self->stats.idle_closed;
+                    conn_close(self, conn);
+                }
+                continue;
+            }
+            if (events[i].events & EPOLLOUT) {
+                conn_writable(self, conn);
+            }
+            if (conn->fd >= 0 && (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))) {
+                conn_readable(self, conn);
+            }
+        }
+    }
+    for (size_t i = 0; i < self->conns_count; ++i) {
+        conn_close(self, &self->conns[i]);
+    }
+    for (size_t i = 0; i < self->idle_count; ++i) {
+        conn_close(self, &self->idle[i]);
+    }
+    if (self->interval_ns != 0) {
+        if (self->next_send_ns < self->end_ns) {
+            self->stats.unsent += (self->end_ns - self->next_send_ns + self->interval_ns - 1) / self->interval_ns;
+        }
+        close(self->timer_fd);
+    }
+    return NULL;
+}
+
+static char* read_file(const char* path) {
+    FILE* file = fopen(path, "r");
+    if (!file) {
+        perror(path);
+        return NULL;
+    }
+    size_t capacity = 4096;
+    size_t size = 0;
+    char* data = malloc(capacity);
+    size_t n;
+    while (data && (n = fread(data + size, 1, capacity - size - 1, file)) > 0) {
+        size += n;
+        if (capacity - size == 1) {
+            capacity *= 2;
+            char* bigger = realloc(data, capacity);
+            if (!bigger) {
+                free(data);
+            }
+            data = bigger;
+        }
+    }
+    fclose(file);
+    if (data) {
+        data[size] = '\0';
+    }
+    return data;
+}
+
+static bool add_path(bench_config* config, char* path) {
+    char** paths = realloc(config->paths, (config->paths_count + 1) * sizeof(char*));
+    if (!paths) {
+        return false;
+    }
+    config->paths = paths;
+    config->paths[config->paths_count++] = path;
+    return true;
+}
+
+static void merge_stats(bench_stats* into, const bench_stats* from) {
+    into->requests += from->requests;
+    into->errors += from->errors;
+    into->connects += from->connects;
+    into->idle_closed += from->idle_closed;
+    into->unsent += from->unsent;
+    into->bytes += from->bytes;
+    for (size_t i = 0; i < 6; ++i) {
+        into->status[i] += from->status[i];
+    }
+    if (from->max_ns > into->max_ns) {
+        into->max_ns = from->max_ns;
+    }
+    if (from->min_ns != 0 && (into->min_ns == 0 || from->min_ns < into->min_ns)) {
+        into->min_ns = from->min_ns;
+    }
+    into->sum_ns += from->sum_ns;
+    for (size_t i = 0; i < HTTP_METRICS_BUCKETS; ++i) {
+        into->latency[i] += from->latency[i];
+    }
+}
+
+static double percentile_us(const bench_stats* stats, uint64_t count, double q) {
+    if (count == 0) {
+        return 0;
+    }
+    uint64_t rank = (uint64_t)(q * (double)count);
+    uint64_t seen = 0;
+    for (size_t i = 0; i < HTTP_METRICS_BUCKETS; ++i) {
+        seen += stats->latency[i];
+        if (seen > rank) {
+            uint64_t upper = http_metrics_bucket_upper(i);
+            // never report more than was actually seen
+            return (double)(upper - 1 < stats->max_ns ? upper - 1 : stats->max_ns) / 1e3;
+        }
+    }
+    return (double)stats->max_ns / 1e3;
+}
+
+static void print_json_string(const char* str) {
+    putchar('"');
+    for (; str && *str; ++str) {
+        if (*str == '"' || *str == '\\') {
+            putchar('\\');
+        }
+        if ((unsigned char)*str < 0x20) {
+            printf("\\u%04x", *str);
+        } else {
+            putchar(*str);
+        }
+    }
+    putchar('"');
+}
+
+int main(int argc, char** argv) {
+    signal(SIGPIPE, SIG_IGN);
+    bench_config config;
+    memset(&config, 0, sizeof(config));
+    config.connections = 50;
+    config.pipeline = 1;
+    config.duration_s = 10;
+    config.keep_alive = true;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    config.threads = cpus > 0 ? (size_t)cpus : 1;
+    const char* paths_file = NULL;
+    int opt;
+    while ((opt = getopt(argc, argv, "c:t:d:p:r:k:i:f:n:")) != -1) {
+        switch (opt) {
+        case 'c':
+            config.connections = strtoull(optarg, NULL, 10);
+            break;
+        case 't':
+            config.threads = strtoull(optarg, NULL, 10);
+            break;
+        case 'd':
+            config.duration_s = strtod(optarg, NULL);
+            break;
+        case 'p':
+            config.pipeline = strtoull(optarg, NULL, 10);
+            break;
+        case 'r':
+            config.rate = strtod(optarg, NULL);
+            break;
+        case 'k':
+            config.keep_alive = atoi(optarg) != 0;
+            break;
+        case 'i':
+            config.idle_connections = strtoull(optarg, NULL, 10);
+            break;
+        case 'f':
+            paths_file = optarg;
+            break;
+        case 'n':
+            config.scenario = optarg;
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (argc - optind < 2 || config.pipeline == 0 || config.threads == 0 || config.duration_s <= 0) {
+        usage(argv[0]);
+        return 1;
+    }
+    config.host = argv[optind];
+    config.port = argv[optind + 1];
+    for (int i = optind + 2; i < argc; ++i) {
+        add_path(&config, argv[i]);
+    }
+    if (paths_file) {
+        char* data = read_file(paths_file);
+        if (!data) {
+            return 1;
+        }
+        for (char* line = strtok(data, "\r\n"); line; line = strtok(NULL, "\r\n")) {
+            if (line[0] != '\0' && line[0] != '#') {
+                add_path(&config, line);
+            }
+        }
+    }
+    if (config.paths_count == 0) {
+        fprintf(stderr, "no paths given\n");
+        return 1;
+    }
+    if (!config.keep_alive) {
+        config.pipeline = 1;
+    }
+    if (config.threads > config.connections && config.connections > 0) {
+        config.threads = config.connections;
+    }
+
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_socktype = SOCK_STREAM;
+    int ret = getaddrinfo(config.host, config.port, &hints, &config.addr);
+    if (ret != 0) {
+        fprintf(stderr, "%s: %s\n", config.host, gai_strerror(ret));
+        return 1;
+    }
+
+    config.requests = calloc(config.paths_count, sizeof(char*));
+    config.request_sizes = calloc(config.paths_count, sizeof(size_t));
+    if (!config.requests || !config.request_sizes) {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+    for (size_t i = 0; i < config.paths_count; ++i) {
+        int n = asprintf(&config.requests[i],
+            "GET %s HTTP/1.1\r\n"
+            "Host: %s:%s\r\n"
+            "User-Agent: http-bench\r\n"
+            "Accept: */*\r\n"
+            "%s"
+            "\r\n",
+            config.paths[i], config.host, config.port, config.keep_alive ? "" : "Connection: close\r\n");
+        if (n < 0) {
+            fprintf(stderr, "out of memory\n");
+            return 1;
+        }
+        config.request_sizes[i] = (size_t)n;
+    }
+
+    bench_thread* threads = calloc(config.threads, sizeof(bench_thread));
+    if (!threads) {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+    uint64_t start_ns = http_metrics_now_ns();
+    uint64_t end_ns = start_ns + (uint64_t)(config.duration_s * 1e9);
+    for (size_t t = 0; t < config.threads; ++t) {
+        bench_thread* self = &threads[t];
+        self->config = &config;
+        self->end_ns = end_ns;
+        self->conns_count = config.connections / config.threads + (t < config.connections % config.threads);
+        self->idle_count = config.idle_connections / config.threads + (t < config.idle_connections % config.threads);
+        self->conns = calloc(self->conns_count + 1, sizeof(bench_conn));
+        self->idle = calloc(self->idle_count + 1, sizeof(bench_conn));
+        self->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        if (!self->conns || !self->idle || self->epoll_fd < 0) {
+            fprintf(stderr, "failed to set up thread %zu\n", t);
+            return 1;
+        }
+        for (size_t i = 0; i < self->conns_count; ++i) {
+            bench_conn* conn = &self->conns[i];
+            conn->fd = -1;
+            conn->started_ns = calloc(config.pipeline, sizeof(uint64_t));
+            // spread the connections over the paths
+            conn->next_path = (t + i * config.threads) % config.paths_count;
+            if (!conn->started_ns) {
+                fprintf(stderr, "out of memory\n");
+                return 1;
+            }
+        }
+        for (size_t i = 0; i < self->idle_count; ++i) {
+            self->idle[i].fd = -1;
+        }
+        if (config.rate > 0) {
+            double thread_rate = config.rate / (double)config.threads;
+            self->interval_ns = (uint64_t)(1e9 / thread_rate);
+            if (self->interval_ns == 0) {
+                self->interval_ns = 1;
+            }
+            // threads take turns, instead of all sending at once
+            self->next_send_ns = start_ns + self->interval_ns * t / config.threads;
+        }
+        if (pthread_create(&self->thread, NULL, bench_thread_main, self) != 0) {
+            fprintf(stderr, "failed to start thread %zu\n", t);
+            return 1;
+        }
+    }
+    bench_stats* total = calloc(1, sizeof(bench_stats));
+    if (!total) {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+    for (size_t t = 0; t < config.threads; ++t) {
+        pthread_join(threads[t].thread, NULL);
+        merge_stats(total, &threads[t].stats);
+    }
+    double elapsed_s = (double)(http_metrics_now_ns() - start_ns) / 1e9;
+    uint64_t measured = 0;
+    for (size_t i = 0; i < HTTP_METRICS_BUCKETS; ++i) {
+        measured += total->latency[i];
+    }
+
+    printf("{\"scenario\":");
+    print_json_string(config.scenario);
+    printf(",\"paths\":[");
+    for (size_t i = 0; i < config.paths_count; ++i) {
+        if (i > 0) {
+            putchar(',');
+        }
+        print_json_string(config.paths[i]);
+    }
+    printf("],\"connections\":%zu,\"idle_connections\":%zu,\"threads\":%zu,\"pipeline\":%zu,"
+           "\"keep_alive\":%s,\"rate\":%.0f,\"duration_s\":%.3f,",
+        config.connections, config.idle_connections, config.threads, config.pipeline,
+        config.keep_alive ? "true" : "false", config.rate, elapsed_s);
+    printf("\"requests\":%llu,\"errors\":%llu,\"connects\":%llu,\"idle_closed\":%llu,\"unsent\":%llu,"
+           "\"requests_per_s\":%.1f,\"bytes_per_s\":%.1f,",
+        (unsigned long long)total->requests, (unsigned long long)total->errors,
+        (unsigned long long)total->connects, (unsigned long long)total->idle_closed,
+        (unsigned long long)total->unsent,
+        (double)total->requests / elapsed_s, (double)total->bytes / elapsed_s);
+    printf("\"status\":{\"1xx\":%llu,\"2xx\":%llu,\"3xx\":%llu,\"4xx\":%llu,\"5xx\":%llu},",
+        (unsigned long long)total->status[1], (unsigned long long)total->status[2],
+        (unsigned long long)total->status[3], (unsigned long long)total->status[4],
+        (unsigned long long)total->status[5]);
+    printf("\"latency_us\":{\"min\":%.1f,\"mean\":%.1f,\"p50\":%.1f,\"p90\":%.1f,\"p99\":%.1f,"
+           "\"p999\":%.1f,\"max\":%.1f}}\n",
+        (double)total->min_ns / 1e3, measured ? (double)total->sum_ns / (double)measured / 1e3 : 0,
+        percentile_us(total, measured, 0.5), percentile_us(total, measured, 0.9),
+        percentile_us(total, measured, 0.99), percentile_us(total, measured, 0.999),
+        (double)total->max_ns / 1e3);
+    freeaddrinfo(config.addr);
+    return total->requests > 0 ? 0 : 1;
+}
@@ -0,0 +1,218 @@
+// enqueue/dequeue throughput of http_thread_pool's lock-free job queue,
+// compared against the previous design (one mutex+condvar protected job slot
+// per worker, which producers scan until they find a free one).
+//
+// usage: http-bench-job-queue [jobs] [producers]
+
+#include "http_server.h"
+#include "logging.h"
+#include "memory.h"
+
+#include <stdlib.h>
+#include <time.h>
+
+static atomic_size_t jobs_done;
+
+static void count_job(void* arg) {
+    (void)arg;
+    atomic_fetch_add_explicit(&jobs_done, 1, memory_order_relaxed);
+}
+
+static double now_s(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static void wait_for_jobs(size_t n) {
+    while (atomic_load(&jobs_done) < n) {
+        sched_yield();
+    }
+}
+
+// the previous thread pool, kept here verbatim (minus logging) for comparison
+typedef struct {
+    pthread_t threads[HTTP_THREAD_POOL_SIZE];
+    http_thread_pool_fn_t jobs[HTTP_THREAD_POOL_SIZE];
+    void* args[HTTP_THREAD_POOL_SIZE];
+    pthread_mutex_t jobs_mutexes[HTTP_THREAD_POOL_SIZE];
+    pthread_cond_t condition_vars[HTTP_THREAD_POOL_SIZE];
+    atomic_bool shutdown;
+} legacy_pool;
+
+typedef struct {
+    legacy_pool* pool;
+    size_t index;
+} legacy_pool_main_args;
+
+static void* legacy_pool_main(void* args_ptr) {
+    legacy_pool_main_args* args = args_ptr;
+    legacy_pool* pool = args->pool;
+    size_t index = args->index;
+    struct timespec wait;
+    while (!atomic_load(&pool->shutdown)) {
+        clock_gettime(CLOCK_REALTIME, &wait);
+        if (wait.tv_nsec > 500) {
+            wait.tv_sec += 1;
+            wait.tv_nsec = 0;
+        } else {
+            wait.tv_nsec += HTTP_MS_TO_NS(500);
+        }
+        http_thread_pool_fn_t fn = NULL;
+        void* arg = NULL;
+        pthread_mutex_lock(&pool->jobs_mutexes[index]);
+        pthread_cond_timedwait(&pool->condition_vars[index], &pool->jobs_mutexes[index], &wait);
+        if (pool->jobs[index]) {
+            fn = pool->jobs[index];
+            arg = pool->args[index];
+            pool->args[index] = NULL;
+        }
+        pthread_mutex_unlock(&pool->jobs_mutexes[index]);
+        if (fn) {
+            fn(arg);
+            pthread_mutex_lock(&pool->jobs_mutexes[index]);
+            pool->jobs[index] = NULL;
+            pthread_mutex_unlock(&pool->jobs_mutexes[index]);
+        } else {
+            sched_yield();
+        }
+    }
+    free(args);
+    return NULL;
+}
+
+static void legacy_pool_add_job(legacy_pool* pool, http_thread_pool_fn_t job, void* arg) {
+    static size_t last_i = 0;
+    size_t i = (last_i) % HTTP_THREAD_POOL_SIZE;
+    for (;;) {
+        if (!pool->jobs[i]) {
+            pthread_mutex_lock(&pool->jobs_mutexes[i]);
+            if (!pool->jobs[i]) {
+                pool->jobs[i] = job;
+                pool->args[i] = arg;
+                last_i = 0;
+                pthread_mutex_unlock(&pool->jobs_mutexes[i]);
+                pthread_cond_signal(&pool->condition_vars[i]);
+                break;
+            }
+            pthread_mutex_unlock(&pool->jobs_mutexes[i]);
+        }
+        ++i;
+        i %= HTTP_THREAD_POOL_SIZE;
+    }
+    last_i = i;
+}
+
+static double bench_legacy(size_t n) {
+    legacy_pool* pool = calloc(1, sizeof(legacy_pool));
+    for (size_t i = 0; i < HTTP_THREAD_POOL_SIZE; ++i) {
+        pthread_mutex_init(&pool->jobs_mutexes[i], NULL);
+        pthread_cond_init(&pool->condition_vars[i], NULL);
+        legacy_pool_main_args* args = malloc(sizeof(legacy_pool_main_args));
+        args->pool = pool;
+        args->index = i;
+        pthread_create(&pool->threads[i], NULL, legacy_pool_main, args);
+    }
+    atomic_store(&jobs_done, 0);
+    double start = now_s();
+    for (size_t i = 0; i < n; ++i) {
+        legacy_pool_add_job(pool, count_job, NULL);
+    }
+    wait_for_jobs(n);
+    double elapsed = now_s() - start;
+    atomic_store(&pool->shutdown, true);
+    for (size_t i = 0; i < HTTP_THREAD_POOL_SIZE; ++i) {
+        pthread_join(pool->threads[i], NULL);
+        pthread_mutex_destroy(&pool->jobs_mutexes[i]);
+        pthread_cond_destroy(&pool->condition_vars[i]);
+    }
+    free(pool);
+    return elapsed;
+}
+
+typedef struct {
+    http_thread_pool* pool;
+    size_t n;
+    size_t full;
+} producer_args;
+
+static void* producer_main(void* args_ptr) {
+    producer_args* args = args_ptr;
+    http_error_t err = http_new_error_ok();
+    for (size_t i = 0; i < args->n; ++i) {
+        http_thread_pool_add_job(args->pool, count_job, NULL, &err);
+        while (http_is_error(err)) {
+            // the queue is full; a real producer would drop the job instead
+            ++args->full;
+            sched_yield();
+            http_thread_pool_add_job(args->pool, count_job, NULL, &err);
+        }
+    }
+    return NULL;
+}
+
+static double bench_pool(size_t n, size_t producers, size_t* full) {
+    http_error_t err = http_new_error_ok();
+    http_thread_pool* pool = http_thread_pool_new(&err);
+    if (http_is_error(err)) {
+        http_print_error(err);
+        exit(1);
+    }
+    pthread_t threads[producers];
+    producer_args args[producers];
+    atomic_store(&jobs_done, 0);
+    double start = now_s();
+    for (size_t i = 0; i < producers; ++i) {
+        args[i] = (producer_args) { pool, n / producers, 0 };
+        pthread_create(&threads[i], NULL, producer_main, &args[i]);
+    }
+    *full = 0;
+    for (size_t i = 0; i < producers; ++i) {
+        pthread_join(threads[i], NULL);
+        *full += args[i].full;
+    }
+    wait_for_jobs((n / producers) * producers);
+    double elapsed = now_s() - start;
+    http_thread_pool_destroy(pool);
+    return elapsed;
+}
+
+static double bench_queue_single_thread(size_t n) {
+    http_error_t err = http_new_error_ok();
+    http_job_queue queue;
+    http_job_queue_init(&queue, HTTP_JOB_QUEUE_SIZE, &err);
+    http_thread_pool_fn_t fn;
+    void* arg;
+    double start = now_s();
+    for (size_t i = 0; i < n; ++i) {
+        http_job_queue_try_push(&queue, count_job, NULL);
+        http_job_queue_try_pop(&queue, &fn, &arg);
+    }
+    double elapsed = now_s() - start;
+    http_job_queue_destroy(&queue);
+    return elapsed;
+}
+
+int main(int argc, char** argv) {
+    size_t n = 1000000;
+    size_t producers = 4;
+    if (argc > 1) {
+        n = strtoull(argv[1], NULL, 10);
+    }
+    if (argc > 2) {
+        producers = strtoull(argv[2], NULL, 10);
+    }
+    // the legacy pool loses wakeups and then sleeps until the next full
+    // second, so it gets far fewer jobs to keep the run time sane
+    size_t legacy_n = n / 50;
+
+    double t = bench_queue_single_thread(n);
+    printf("queue push+pop, 1 thread:          %12.0f ops/s\n", n / t);
+    size_t full = 0;
+    t = bench_pool(n, 1, &full);
+    printf("lock-free pool, 1 producer:        %12.0f jobs/s (queue full %zu times)\n", n / t, full);
+    t = bench_pool(n, producers, &full);
+    printf("lock-free pool, %zu producers:       %12.0f jobs/s (queue full %zu times)\n", producers, (n / producers) * producers / t, full);
+    t = bench_legacy(legacy_n);
+    printf("legacy slot pool, 1 producer:      %12.0f jobs/s\n", legacy_n / t);
+}
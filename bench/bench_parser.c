@@ -0,0 +1,105 @@
+// request header parsing throughput on one core, once for each scanning
+// kernel the cpu supports (see http_scan.h).
+//
+// usage: http-bench-parser [iterations]
+
+#include "http_parser.h"
+#include "http_scan.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static const char curl_request[] =
+    "GET /index.html HTTP/1.1\r\n"
+    "Host: localhost:8080\r\n"
+    "User-Agent: curl/7.88.1\r\n"
+    "Accept: */*\r\n"
+    "\r\n";
+
+static const char browser_request[] =
+    "GET /assets/css/style.css?v=20240611 HTTP/1.1\r\n"
+    "Host: www.example.com\r\n"
+    "Connection: keep-alive\r\n"
+    "sec-ch-ua: \"Chromium\";v=\"124\", \"Google Chrome\";v=\"124\", \"Not-A.Brand\";v=\"99\"\r\n"
+    "sec-ch-ua-mobile: ?0\r\n"
+    "User-Agent: Mozilla/5.0 (Windows NT 10.0; Win64; x64) AppleWebKit/537.36 (KHTML, like Gecko) "
+    "Chrome/124.0.0.0 Safari/537.36\r\n"
+    "sec-ch-ua-platform: \"Windows\"\r\n"
+    "Accept: text/css,*/*;q=0.1\r\n"
+    "Sec-Fetch-Site: same-origin\r\n"
+    "Sec-Fetch-Mode: no-cors\r\n"
+    "Sec-Fetch-Dest: style\r\n"
+    "Referer: https://www.example.com/blog/2024/06/some-article-with-a-long-slug.html\r\n"
+    "Accept-Encoding: gzip, deflate, br, zstd\r\n"
+    "Accept-Language: en-US,en;q=0.9,de;q=0.8\r\n"
+    "Cookie: _ga=GA1.1.1234567890.1700000000; session=3f9a8c7e6d5b4a3928170f1e2d3c4b5a; "
+    "theme=dark; _ga_ABCDEF1234=GS1.1.1718000000.12.1.1718000100.0.0.0\r\n"
+    "If-None-Match: \"5f3a-61a8c2b4e9f00\"\r\n"
+    "If-Modified-Since: Tue, 11 Jun 2024 08:15:00 GMT\r\n"
+    "\r\n";
+
+static volatile size_t sink;
+
+static double now_s(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static double bench_parse(const char* request, size_t size, size_t n) {
+    http_parser parser;
+    double start = now_s();
+    for (size_t i = 0; i < n; ++i) {
+        http_parser_reset(&parser);
+        if (http_parser_feed(&parser, request, size) != HTTP_PARSER_DONE) {
+            fprintf(stderr, "failed to parse request: %s\n", parser.error ? parser.error : "incomplete");
+            exit(1);
+        }
+        sink += parser.fields_count;
+    }
+    return now_s() - start;
+}
+
+static double bench_terminator(const char* request, size_t size, size_t n) {
+    double start = now_s();
+    for (size_t i = 0; i < n; ++i) {
+        sink += http_scan_find_terminator(request, size);
+    }
+    return now_s() - start;
+}
+
+int main(int argc, char** argv) {
+    size_t n = 2000000;
+    if (argc > 1) {
+        n = strtoull(argv[1], NULL, 10);
+    }
+    struct {
+        const char* name;
+        const char* request;
+        size_t size;
+    } requests[] = {
+        { "curl", curl_request, sizeof(curl_request) - 1 },
+        { "browser", browser_request, sizeof(browser_request) - 1 },
+    };
+    http_scan_level best = http_scan_best_level();
+    printf("best scanning kernel: %s\n", http_scan_level_name(best));
+    for (size_t r = 0; r < sizeof(requests) / sizeof(requests[0]); ++r) {
+        printf("%s request (%zu bytes):\n", requests[r].name, requests[r].size);
+        double scalar_rate = 0;
+        for (http_scan_level level = HTTP_SCAN_SCALAR; level <= best; ++level) {
+            http_scan_use_level(level);
+            double t = bench_parse(requests[r].request, requests[r].size, n);
+            double rate = n / t;
+            if (level == HTTP_SCAN_SCALAR) {
+                scalar_rate = rate;
+            }
+            double term_t = bench_terminator(requests[r].request, requests[r].size, n);
+            printf("  %-6s  parse %12.0f req/s (%5.2fx, %7.1f MB/s)  \\r\\n\\r\\n scan %12.0f/s\n",
+                http_scan_level_name(level), rate, rate / scalar_rate,
+                rate * requests[r].size / 1e6, n / term_t);
+        }
+    }
+    http_scan_use_level(best);
+}
@@ -0,0 +1,74 @@
+#!/usr/bin/env bash
+# runs http-bench scenarios against a local http-server serving a generated
+# document root, and prints the results as a JSON array.
+#
+# usage: bench/scenarios.sh [build_dir] [duration_s] [port]
+
+set -euo pipefail
+
+build_dir=${1:-build}
+duration=${2:-10}
+port=${3:-8181}
+server="$build_dir/http-server"
+bench="$build_dir/http-bench"
+
+for bin in "$server" "$bench"; do
+    if [ ! -x "$bin" ]; then
+        echo "$bin not found, build first" >&2
+        exit 1
+    fi
+done
+server=$(realpath "$server")
+bench=$(realpath "$bench")
+
+# the idle connections scenario needs more than the usual 1024 fds
+ulimit -n 65536 2>/dev/null || true
+
+root=$(mktemp -d)
+server_pid=
+cleanup() {
+    if [ -n "$server_pid" ]; then
+        kill -INT "$server_pid" 2>/dev/null || true
+        wait "$server_pid" 2>/dev/null || true
+    fi
+    rm -rf "$root"
+}
+trap cleanup EXIT
+
+# 1 KiB page, 16 MiB file, a directory with 200 entries
+head -c 1024 /dev/urandom | base64 -w 76 | head -c 1024 > "$root/small.html"
+head -c $((16 * 1024 * 1024)) /dev/urandom > "$root/large.bin"
+mkdir "$root/listing"
+for i in $(seq 1 200); do
+    echo "$i" > "$root/listing/file-$i.txt"
+done
+printf '/small.html\n/listing/\n/listing/file-1.txt\n/missing.html\n' > "$root/mixed.txt"
+
+(cd "$root" && exec "$server" -v warning "$port" > "$root/server.log" 2>&1) &
+server_pid=$!
+for _ in $(seq 1 50); do
+    if (exec 3<>"/dev/tcp/127.0.0.1/$port") 2>/dev/null; then
+        break
+    fi
+    sleep 0.1
+done
+
+run() {
+    local name=$1
+    shift
+    echo "running $name" >&2
+    "$bench" -n "$name" -d "$duration" "$@"
+}
+
+results=()
+results+=("$(run small-static -c 50 127.0.0.1 "$port" /small.html)")
+results+=("$(run small-static-pipelined -c 50 -p 16 127.0.0.1 "$port" /small.html)")
+results+=("$(run small-static-no-keepalive -c 50 -k 0 127.0.0.1 "$port" /small.html)")
+results+=("$(run small-static-fixed-rate -c 50 -r 10000 127.0.0.1 "$port" /small.html)")
+results+=("$(run large-file -c 8 127.0.0.1 "$port" /large.bin)")
+results+=("$(run directory-listing -c 50 127.0.0.1 "$port" /listing/)")
+results+=("$(run 404-storm -c 50 127.0.0.1 "$port" /missing-1.html /missing-2.html /a/b/c/missing.js)")
+results+=("$(run mixed -c 50 -f "$root/mixed.txt" 127.0.0.1 "$port")")
+results+=("$(run idle-connections -c 10 -i 5000 127.0.0.1 "$port" /small.html)")
+
+(IFS=,; echo "[${results[*]}]")
@@ -0,0 +1,21 @@
+#pragma once
+
+#include "error_t.h"
+#include "http_server.h"
+#include "memory.h"
+
+#include <stdbool.h>
+
+// smaller bodies aren't worth compressing
+#ifndef HTTP_COMPRESS_MIN_SIZE
+#define HTTP_COMPRESS_MIN_SIZE 256
+#endif
+
+// whether this build can produce the encoding, depends on the libraries built in
+bool http_compress_supported(http_encoding);
+// compresses `in`, at the highest level with `best`, which is only worth it
+// offline. with an `arena`, the result and the compressor's state come from
+// it, which only zlib's encodings (gzip and deflate) support. otherwise the
+// result is malloc'd.
+char* http_compress(http_encoding, const char* in, size_t in_size, bool best, http_arena* arena,
+    size_t* out_size, http_error_t*);
@@ -0,0 +1,27 @@
+#pragma once
+
+#include <stddef.h>
+#include <time.h>
+
+// an IMF-fixdate, "Sun, 06 Nov 1994 08:49:37 GMT", without the NUL
+#define HTTP_DATE_LEN 29
+// "Date: <IMF-fixdate>\r\n"
+#define HTTP_DATE_LINE_LEN (sizeof("Date: ") - 1 + HTTP_DATE_LEN + 2)
+
+#ifndef HTTP_DATE_SLOTS
+// how many past seconds stay readable, see http_date_line
+#define HTTP_DATE_SLOTS 64
+#endif
+
+// writes `t` as an IMF-fixdate and a NUL to `out`, without gmtime() or
+// strftime(). years outside of 0000-9999 are clamped.
+void http_date_format(time_t t, char out[HTTP_DATE_LEN + 1]);
+
+// renders the Date line for the current second, if that hasn't happened
+// yet. called by the event loops on every wakeup, and must be called once
+// before http_date_line.
+void http_date_update(void);
+// copies the Date line for the current second to `out`, without a NUL.
+// lock-free: the line is rendered once per second into the next of
+// HTTP_DATE_SLOTS slots, and readers copy the latest one.
+void http_date_line(char out[HTTP_DATE_LINE_LEN]);
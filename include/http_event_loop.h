@@ -0,0 +1,81 @@
+#pragma once
+
+#include "http_io_uring.h"
+#include "http_server.h"
+#include "http_timer_wheel.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+
+#ifndef HTTP_EVENT_LOOP_MAX_EVENTS
+#define HTTP_EVENT_LOOP_MAX_EVENTS 256
+#endif
+// completion queue size of the io_uring backend. it holds at most one
+// completion per client, and overflows are kept by the kernel, so this only
+// has to cover a busy wakeup.
+#ifndef HTTP_EVENT_LOOP_URING_CQ_ENTRIES
+#define HTTP_EVENT_LOOP_URING_CQ_ENTRIES 4096
+#endif
+
+typedef enum {
+    // readiness with epoll, then accept4() and read()
+    HTTP_EVENT_LOOP_EPOLL,
+    // accept and recv are submitted to an io_uring, and complete in batches
+    HTTP_EVENT_LOOP_IO_URING,
+} http_event_loop_backend;
+
+// edge-triggered epoll reactor which owns the listening socket and all
+// idle client sockets. a client is only handed to `on_request` (and from
+// there to a worker) once its read buffer holds a complete request header,
+// or, if a worker left output pending, once its socket is writable again.
+// while a worker owns a client, the reactor receives no events for it
+// (EPOLLONESHOT), and the worker gives it back via http_event_loop_rearm()
+// or http_event_loop_close_client().
+// idle clients have a timer in `timers`, and are closed once it expires, see
+// the *_timeout_ms fields of http_server.
+// with the io_uring backend, the reactor owns idle clients the same way, but
+// instead of waiting for readiness it has a recv in flight for each of them,
+// and a multishot accept for the listening socket. clients waiting to be
+// writable have a poll in flight instead.
+typedef struct http_event_loop {
+    http_event_loop_backend backend;
+    // HTTP_EVENT_LOOP_EPOLL
+    int epoll_fd;
+    // HTTP_EVENT_LOOP_IO_URING, only used by the thread running the loop
+    http_io_uring ring;
+    // clients given back by workers, for the reactor to submit a recv (or
+    // poll, see http_event_loop_wait_writable) for. linked through rearm_next.
+    _Atomic(http_client*) rearmed;
+    // false once the kernel turned down IORING_ACCEPT_MULTISHOT
+    bool multishot_accept;
+    // where the io_uring backend reads wake_fd to
+    uint64_t wake_value;
+    // written to by http_event_loop_stop() to wake up the reactor
+    int wake_fd;
+    http_server* server;
+    http_client_connect_cb on_request;
+    // not used by the event loop
+    void* user_data;
+    atomic_bool shutdown;
+    // workers schedule timers when they rearm a client, so access to the
+    // wheel is serialized with this
+    pthread_mutex_t timers_mutex;
+    http_timer_wheel timers;
+} http_event_loop;
+
+// falls back to epoll if `backend` is io_uring, but that isn't available
+http_event_loop* http_event_loop_new(http_server*, http_event_loop_backend backend, http_client_connect_cb on_request, http_error_t*);
+void http_event_loop_free(http_event_loop*);
+// runs until http_event_loop_stop() is called
+void http_event_loop_run(http_event_loop*, http_error_t*);
+// async-signal-safe
+void http_event_loop_stop(http_event_loop*);
+// hands a client back to the reactor, to wait for its next request. starts
+// the keep-alive timeout, or the header timeout if part of a request is buffered.
+void http_event_loop_rearm(http_event_loop*, http_client*, http_error_t*);
+// hands a client with pending output back to the reactor, which passes it
+// to `on_request` again once the socket is writable. closes it if that takes
+// longer than the server's write_timeout_ms.
+void http_event_loop_wait_writable(http_event_loop*, http_client*, http_error_t*);
+// also frees the client's pending output
+void http_event_loop_close_client(http_event_loop*, http_client*);
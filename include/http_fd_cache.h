@@ -0,0 +1,93 @@
+#pragma once
+
+#include "error_t.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/stat.h>
+
+#ifndef HTTP_FD_CACHE_SHARDS
+// must be a power of two
+#define HTTP_FD_CACHE_SHARDS 16
+#endif
+#ifndef HTTP_FD_CACHE_BUCKETS
+// per shard, must be a power of two
+#define HTTP_FD_CACHE_BUCKETS 256
+#endif
+#ifndef HTTP_FD_CACHE_IDLE_MS
+// how long an fd nobody asked for is kept open
+#define HTTP_FD_CACHE_IDLE_MS 10000
+#endif
+// the cache never takes more than this share of RLIMIT_NOFILE, the rest is
+// for clients
+#define HTTP_FD_CACHE_NOFILE_DIVISOR 4
+
+// an open file, together with what fstat() said when it was opened.
+// refcounted, so that it stays open while it's being sent from, even after
+// being evicted or invalidated.
+typedef struct http_fd_cache_entry {
+    atomic_size_t refcount;
+    uint64_t hash;
+    int fd;
+    struct stat st;
+    // CLOCK_MONOTONIC_COARSE milliseconds of the last stat() which matched
+    atomic_llong validated_at_ms;
+    // guarded by the owning shard's mutex, like everything below
+    long long used_at_ms;
+    // whether a watcher reports changes to this path, see http_file_cache_entry.watched
+    bool watched;
+    // the cache's generation before the file was opened
+    size_t generation;
+    struct http_fd_cache_entry* hash_next;
+    struct http_fd_cache_entry* lru_prev;
+    struct http_fd_cache_entry* lru_next;
+    bool in_cache;
+    char path[];
+} http_fd_cache_entry;
+
+typedef struct {
+    pthread_mutex_t mutex;
+    http_fd_cache_entry* buckets[HTTP_FD_CACHE_BUCKETS];
+    // most recently used first
+    http_fd_cache_entry* lru_head;
+    http_fd_cache_entry* lru_tail;
+    size_t count;
+} http_fd_cache_shard;
+
+// open fds of files too large for the file cache, keyed by path, bounded in
+// number with LRU eviction. fds which aren't used for HTTP_FD_CACHE_IDLE_MS
+// are closed by http_fd_cache_expire.
+typedef struct {
+    // max number of fds held by the cache, not counting evicted ones in use
+    size_t capacity;
+    atomic_size_t count;
+    atomic_size_t hits;
+    atomic_size_t misses;
+    atomic_size_t evictions;
+    atomic_size_t expirations;
+    // bumped on every invalidation, to catch entries opened while their file changed
+    atomic_size_t generation;
+    // set while a watcher reports all changes
+    atomic_bool watched;
+    // CLOCK_MONOTONIC_COARSE milliseconds, see http_fd_cache_expire
+    atomic_llong next_expire_ms;
+    http_fd_cache_shard shards[HTTP_FD_CACHE_SHARDS];
+} http_fd_cache;
+
+// `capacity` is lowered to a share of RLIMIT_NOFILE if that's lower
+http_fd_cache* http_fd_cache_new(size_t capacity, http_error_t*);
+void http_fd_cache_free(http_fd_cache*);
+// returns a referenced entry, or NULL. entries whose file changed are dropped.
+http_fd_cache_entry* http_fd_cache_get(http_fd_cache*, const char* path);
+// takes ownership of `fd`. returns a referenced entry, which is only cached
+// if nothing changed since `generation` was read. fails if out of memory,
+// `fd` is closed then.
+http_fd_cache_entry* http_fd_cache_insert(http_fd_cache*, const char* path, int fd, const struct stat*,
+    bool watched, size_t generation, http_error_t*);
+// drops `path`, and if `recursive`, everything beneath it. NULL drops everything.
+void http_fd_cache_invalidate(http_fd_cache*, const char* path, bool recursive);
+// closes idle fds. cheap to call often, does the work at most every
+// HTTP_FD_CACHE_IDLE_MS / 4.
+void http_fd_cache_expire(http_fd_cache*);
+// closes the fd once the last reference is gone
+void http_fd_cache_entry_release(http_fd_cache_entry*);
@@ -0,0 +1,128 @@
+#pragma once
+
+#include "error_t.h"
+#include "http_date.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+
+#ifndef HTTP_FILE_CACHE_SHARDS
+// must be a power of two
+#define HTTP_FILE_CACHE_SHARDS 16
+#endif
+#ifndef HTTP_FILE_CACHE_BUCKETS
+// per shard, must be a power of two
+#define HTTP_FILE_CACHE_BUCKETS 1024
+#endif
+#ifndef HTTP_FILE_CACHE_MAX_ENTRY_SIZE
+// default size limit for a single cached file
+#define HTTP_FILE_CACHE_MAX_ENTRY_SIZE (1024 * 1024)
+#endif
+#ifndef HTTP_FILE_CACHE_REVALIDATE_MS
+// how long a cached entry is trusted before its file is stat'd again
+#define HTTP_FILE_CACHE_REVALIDATE_MS 1000
+#endif
+
+#define HTTP_ETAG_SIZE 64
+#define HTTP_DATE_SIZE 32
+_Static_assert(HTTP_DATE_SIZE > HTTP_DATE_LEN, "HTTP_DATE_SIZE too small");
+
+// what conditional requests are checked against, derived from stat()
+typedef struct {
+    // quoted and strong, from inode, size and mtime
+    char etag[HTTP_ETAG_SIZE];
+    size_t etag_len;
+    // HTTP-date of mtime
+    char last_modified[HTTP_DATE_SIZE];
+    time_t mtime;
+} http_file_validators;
+
+void http_file_validators_init(http_file_validators*, const struct stat*);
+
+// which of the pre-rendered headers to send, see http_file_cache_entry
+typedef enum {
+    HTTP_FILE_CACHE_KEEP_ALIVE = 0,
+    HTTP_FILE_CACHE_CLOSE = 1,
+    HTTP_FILE_CACHE_HEADER_COUNT,
+} http_file_cache_header_kind;
+
+// a file's contents, together with the response headers to serve them with.
+// entries are refcounted and immutable once inserted, so they can be sent
+// from after being evicted or replaced.
+typedef struct http_file_cache_entry {
+    atomic_size_t refcount;
+    uint64_t hash;
+    char* path;
+    // what the file looked like when it was read
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
+    // also in the pre-rendered headers
+    http_file_validators validators;
+    // CLOCK_MONOTONIC_COARSE milliseconds of the last stat() which matched
+    atomic_llong validated_at_ms;
+    // whether a watcher reports changes to this path, so it needs no stat().
+    // only true if `path` is the file's real path, which events refer to.
+    bool watched;
+    // the cache's generation before the file was read
+    size_t generation;
+    // bit per http_encoding whose precompressed sibling existed when the
+    // entry was filled
+    uint8_t encodings;
+    char* headers[HTTP_FILE_CACHE_HEADER_COUNT];
+    size_t header_sizes[HTTP_FILE_CACHE_HEADER_COUNT];
+    char* body;
+    size_t body_size;
+    // total allocation size, counted against the cache capacity
+    size_t alloc_size;
+    // guarded by the owning shard's mutex
+    struct http_file_cache_entry* hash_next;
+    struct http_file_cache_entry* lru_prev;
+    struct http_file_cache_entry* lru_next;
+    bool in_cache;
+} http_file_cache_entry;
+
+typedef struct {
+    pthread_mutex_t mutex;
+    http_file_cache_entry* buckets[HTTP_FILE_CACHE_BUCKETS];
+    // most recently used first
+    http_file_cache_entry* lru_head;
+    http_file_cache_entry* lru_tail;
+    size_t size;
+} http_file_cache_shard;
+
+// content cache keyed by path, bounded in bytes with LRU eviction
+typedef struct {
+    size_t capacity;
+    // files larger than this are never cached
+    size_t max_entry_size;
+    atomic_size_t hits;
+    atomic_size_t misses;
+    atomic_size_t evictions;
+    atomic_size_t invalidations;
+    // bumped on every invalidation, to catch entries filled while their file changed
+    atomic_size_t generation;
+    // set while a watcher reports all changes, see http_file_cache_entry.watched
+    atomic_bool watched;
+    http_file_cache_shard shards[HTTP_FILE_CACHE_SHARDS];
+} http_file_cache;
+
+http_file_cache* http_file_cache_new(size_t capacity, size_t max_entry_size, http_error_t*);
+void http_file_cache_free(http_file_cache*);
+// returns a referenced entry, or NULL. entries whose file changed are dropped.
+http_file_cache_entry* http_file_cache_get(http_file_cache*, const char* path);
+// allocates an entry with room for `body_size` bytes of body, which the caller fills in
+http_file_cache_entry* http_file_cache_entry_new(const char* path, const struct stat*,
+    const char* const headers[HTTP_FILE_CACHE_HEADER_COUNT],
+    const size_t header_sizes[HTTP_FILE_CACHE_HEADER_COUNT], size_t body_size, http_error_t*);
+// adds a reference to the entry and makes it visible, replacing any entry
+// with the same path, and evicting the least recently used ones if over capacity
+void http_file_cache_insert(http_file_cache*, http_file_cache_entry*);
+void http_file_cache_remove(http_file_cache*, const char* path);
+// drops `path`, and if `recursive`, everything beneath it. NULL drops everything.
+void http_file_cache_invalidate(http_file_cache*, const char* path, bool recursive);
+void http_file_cache_entry_release(http_file_cache_entry*);
@@ -0,0 +1,54 @@
+#pragma once
+
+#include "error_t.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+
+#ifndef HTTP_FS_WATCHER_MAX_CALLBACKS
+#define HTTP_FS_WATCHER_MAX_CALLBACKS 8
+#endif
+
+typedef enum {
+    // the path itself changed (contents, metadata, or entries if it's a directory)
+    HTTP_FS_WATCHER_CHANGED,
+    // the path and everything beneath it changed (e.g. a directory was moved)
+    HTTP_FS_WATCHER_CHANGED_TREE,
+    // events were lost, anything may have changed
+    HTTP_FS_WATCHER_RESET,
+    // the tree can no longer be fully watched (e.g. out of inotify watches),
+    // from now on changes may go unnoticed
+    HTTP_FS_WATCHER_LOST,
+} http_fs_watcher_event;
+
+// `path` is absolute, or NULL for RESET and LOST
+typedef void (*http_fs_watcher_cb)(void* user_data, http_fs_watcher_event, const char* path);
+
+// watches a directory tree with inotify from a background thread, and tells
+// the registered callbacks (on that thread) whenever something in it changes
+typedef struct {
+    int inotify_fd;
+    // written to by http_fs_watcher_free() to stop the thread
+    int wake_fd;
+    pthread_t thread;
+    bool thread_started;
+    // index is the watch descriptor, NULL if unused
+    char** wd_paths;
+    size_t wd_paths_size;
+    http_fs_watcher_cb callbacks[HTTP_FS_WATCHER_MAX_CALLBACKS];
+    void* callbacks_user_data[HTTP_FS_WATCHER_MAX_CALLBACKS];
+    size_t callbacks_count;
+    atomic_size_t watched_dirs;
+    // number of changes reported to the callbacks
+    atomic_size_t invalidations;
+    atomic_size_t overflows;
+    // false once a directory couldn't be watched
+    atomic_bool complete;
+} http_fs_watcher;
+
+// `root` must be an absolute path without symlinks, like getcwd() returns
+http_fs_watcher* http_fs_watcher_new(const char* root, http_error_t*);
+// must be called before http_fs_watcher_start()
+void http_fs_watcher_add_callback(http_fs_watcher*, http_fs_watcher_cb, void* user_data);
+void http_fs_watcher_start(http_fs_watcher*, http_error_t*);
+void http_fs_watcher_free(http_fs_watcher*);
@@ -0,0 +1,55 @@
+#pragma once
+
+#include "error_t.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// from <linux/io_uring.h>, if it was there at build time
+struct io_uring_sqe;
+struct io_uring_cqe;
+
+// just enough of io_uring for the event loop, set up with the raw syscalls.
+// the rings are shared with the kernel, and only the thread which called
+// http_io_uring_enable may submit to and reap from them.
+typedef struct {
+    int fd;
+    // IORING_SETUP_* the ring was created with
+    unsigned flags;
+    // submission queue
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    struct io_uring_sqe* sqes;
+    // filled in by http_io_uring_get_sqe, but not yet seen by the kernel
+    unsigned sq_pending;
+    // completion queue
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe* cqes;
+    // mappings, for munmap. cq_ring is sq_ring with IORING_FEAT_SINGLE_MMAP.
+    void* sq_ring;
+    size_t sq_ring_size;
+    void* cq_ring;
+    size_t cq_ring_size;
+    size_t sqes_size;
+} http_io_uring;
+
+// whether this build can use io_uring at all
+bool http_io_uring_available(void);
+// fails if the kernel doesn't have io_uring, or lacks a feature the event
+// loop needs. the ring stays disabled until http_io_uring_enable.
+void http_io_uring_init(http_io_uring*, unsigned sq_entries, unsigned cq_entries, http_error_t*);
+// makes the calling thread the only one submitting to the ring
+void http_io_uring_enable(http_io_uring*, http_error_t*);
+void http_io_uring_free(http_io_uring*);
+// a zeroed sqe, submitted with the next http_io_uring_submit_and_wait. if the
+// queue is full, what's in it is submitted first.
+struct io_uring_sqe* http_io_uring_get_sqe(http_io_uring*, http_error_t*);
+// submits pending sqes, then waits up to `timeout_ms` (-1 for ever) for at
+// least one completion. interrupted or timed out waits aren't errors.
+void http_io_uring_submit_and_wait(http_io_uring*, int timeout_ms, http_error_t*);
+// copies the oldest completion to `cqe` and removes it, false if there is none
+bool http_io_uring_pop_cqe(http_io_uring*, struct io_uring_cqe* cqe);
@@ -0,0 +1,51 @@
+#pragma once
+
+#include "error_t.h"
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifndef HTTP_JOB_QUEUE_SIZE
+// must be a power of two
+#define HTTP_JOB_QUEUE_SIZE 1024
+#endif
+
+#define HTTP_CACHE_LINE_SIZE 64
+
+typedef void (*http_thread_pool_fn_t)(void*);
+
+typedef struct {
+    atomic_size_t sequence;
+    http_thread_pool_fn_t fn;
+    void* arg;
+} http_job_queue_cell;
+
+// bounded lock-free multi-producer/multi-consumer ring queue (after Dmitry
+// Vyukov's design), with futex-based parking for consumers. pushing never
+// waits: if the queue is full, it fails.
+typedef struct {
+    http_job_queue_cell* cells;
+    size_t mask;
+    _Alignas(HTTP_CACHE_LINE_SIZE) atomic_size_t enqueue_pos;
+    _Alignas(HTTP_CACHE_LINE_SIZE) atomic_size_t dequeue_pos;
+    // futex word, bumped whenever a parked consumer needs waking
+    _Alignas(HTTP_CACHE_LINE_SIZE) atomic_uint_least32_t wake_seq;
+    atomic_size_t parked;
+    atomic_bool closed;
+} http_job_queue;
+
+// `capacity` must be a power of two
+void http_job_queue_init(http_job_queue*, size_t capacity, http_error_t*);
+void http_job_queue_destroy(http_job_queue*);
+// false if the queue is full
+bool http_job_queue_try_push(http_job_queue*, http_thread_pool_fn_t fn, void* arg);
+// false if the queue is empty
+bool http_job_queue_try_pop(http_job_queue*, http_thread_pool_fn_t* fn, void** arg);
+// like try_push, but wakes up a parked consumer
+bool http_job_queue_push(http_job_queue*, http_thread_pool_fn_t fn, void* arg);
+// parks until a job is available; false once the queue is closed
+bool http_job_queue_pop(http_job_queue*, http_thread_pool_fn_t* fn, void** arg);
+// wakes up all parked consumers, which then return false from pop
+void http_job_queue_close(http_job_queue*);
@@ -0,0 +1,72 @@
+#pragma once
+
+#include "error_t.h"
+#include "memory.h"
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+// counters and latency histograms, kept per thread so recording is a few
+// uncontended stores, and summed up when they're rendered.
+
+#ifndef HTTP_METRICS_PATH
+// requests for this target are answered with the metrics instead of a file
+#define HTTP_METRICS_PATH "/__metrics"
+#endif
+
+#ifndef HTTP_METRICS_EXTERNAL_MAX
+// counters and gauges owned by other modules, see http_metrics_add_counter
+#define HTTP_METRICS_EXTERNAL_MAX 32
+#endif
+
+// histograms are log-linear like HdrHistogram: 2^HTTP_METRICS_SUB_BITS buckets
+// per power of two, so any recorded value is off by at most 1/16th
+#define HTTP_METRICS_SUB_BITS 4
+// durations are in ns, anything above 2^40 ns (~18 minutes) is clamped
+#define HTTP_METRICS_MAX_BITS 40
+#define HTTP_METRICS_BUCKETS ((HTTP_METRICS_MAX_BITS - HTTP_METRICS_SUB_BITS + 1) << HTTP_METRICS_SUB_BITS)
+
+typedef enum {
+    // accept() until the first request is handed to a worker
+    HTTP_STAGE_ACCEPT,
+    // handed to a worker until the worker picks it up
+    HTTP_STAGE_QUEUE,
+    // first byte of a request until its header is complete
+    HTTP_STAGE_HEADER,
+    // target to cache entry or resolved, stat'd path
+    HTTP_STAGE_RESOLVE,
+    // reading the file and writing or queueing the response
+    HTTP_STAGE_SEND,
+    // writing out the batched responses of one wakeup
+    HTTP_STAGE_FLUSH,
+    // first byte of a request until its response was written
+    HTTP_STAGE_TOTAL,
+    HTTP_STAGE_COUNT,
+} http_metrics_stage;
+
+// histogram bucket a value falls into, and the exclusive upper bound of a bucket
+size_t http_metrics_bucket_index(uint64_t value);
+uint64_t http_metrics_bucket_upper(size_t index);
+
+// CLOCK_MONOTONIC in ns
+uint64_t http_metrics_now_ns(void);
+void http_metrics_record(http_metrics_stage stage, uint64_t duration_ns);
+// `since_ns` is a http_metrics_now_ns() timestamp, nothing is recorded if it's 0
+void http_metrics_record_since(http_metrics_stage stage, uint64_t since_ns, uint64_t now_ns);
+void http_metrics_count_response(int status);
+void http_metrics_count_bytes(size_t bytes);
+void http_metrics_count_accept(void);
+uint64_t http_metrics_requests(void);
+// exports a value kept elsewhere, like a cache's hit count. `labels` is
+// e.g. `cache="file"`, or NULL. the strings and `value` must stay valid until
+// http_metrics_free(). not thread-safe, meant to be called before serving.
+// returns false once HTTP_METRICS_EXTERNAL_MAX values were added.
+bool http_metrics_add_counter(const char* name, const char* labels, const char* help, const atomic_size_t* value);
+// like http_metrics_add_counter, for a value which may also go down
+bool http_metrics_add_gauge(const char* name, const char* labels, const char* help, const atomic_size_t* value);
+// prometheus text exposition format, allocated from `arena`
+char* http_metrics_render(http_arena* arena, size_t* size, http_error_t* ep);
+// frees every thread's counters and forgets the added ones. must only be
+// called once no other thread records anything anymore.
+void http_metrics_free(void);
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// longer extensions are never in the table
+#define HTTP_MIME_EXTENSION_MAX 16
+
+typedef struct {
+    const char* extension;
+    const char* content_type;
+    // text-like, so precompressed siblings are worth looking for
+    bool compressible;
+} http_mime_type;
+
+extern const http_mime_type http_mime_type_unknown;
+// directory listings are cached under the directory's path with a trailing slash
+extern const http_mime_type http_mime_type_listing;
+
+// the type of a file by its extension, case-insensitive, or
+// application/octet-stream. paths ending in '/' are directory listings.
+const http_mime_type* http_mime_type_of(const char* path);
+
+// the table in src/http_mime_types.txt is turned into a perfect hash by
+// tools/http_mime_gen.c at build time: the extension's hash with seed 0
+// picks a bucket, and that bucket's seed the slot. this is shared by both.
+static inline uint32_t http_mime_hash(const char* ext, size_t len, uint32_t seed) {
+    // FNV-1a
+    uint32_t hash = 2166136261u ^ seed;
+    for (size_t i = 0; i < len; ++i) {
+        hash ^= (unsigned char)ext[i];
+        hash *= 16777619u;
+    }
+    // so that the low bits depend on all of the above
+    hash ^= hash >> 16;
+    hash *= 0x85ebca6bu;
+    hash ^= hash >> 13;
+    hash *= 0xc2b2ae35u;
+    hash ^= hash >> 16;
+    return hash;
+}
@@ -0,0 +1,76 @@
+#pragma once
+
+#include "error_t.h"
+
+#include <stddef.h>
+
+#ifndef HTTP_HEADER_FIELDS_MAX
+#define HTTP_HEADER_FIELDS_MAX 64
+#endif
+
+typedef enum {
+    HTTP_PARSER_REQUEST_LINE,
+    HTTP_PARSER_HEADERS,
+    HTTP_PARSER_DONE,
+    HTTP_PARSER_ERROR,
+} http_parser_state;
+
+// header fields the server looks at, found in O(1) once parsed
+typedef enum {
+    HTTP_HEADER_HOST,
+    HTTP_HEADER_CONNECTION,
+    HTTP_HEADER_CONTENT_LENGTH,
+    HTTP_HEADER_TRANSFER_ENCODING,
+    HTTP_HEADER_ACCEPT_ENCODING,
+    HTTP_HEADER_IF_NONE_MATCH,
+    HTTP_HEADER_IF_MODIFIED_SINCE,
+    HTTP_HEADER_RANGE,
+    HTTP_HEADER_IF_RANGE,
+    HTTP_HEADER_KNOWN_COUNT,
+    HTTP_HEADER_UNKNOWN = HTTP_HEADER_KNOWN_COUNT,
+} http_header_id;
+
+// a range of bytes in the buffer being parsed
+typedef struct {
+    size_t offset;
+    size_t len;
+} http_slice;
+
+// one "name: value" line, as offsets into the buffer. the value has no
+// leading or trailing whitespace.
+typedef struct {
+    uint16_t name_offset;
+    uint16_t name_len;
+    uint16_t value_offset;
+    uint16_t value_len;
+} http_header_field;
+
+// resumable request header parser. it's fed the same, growing buffer as
+// bytes arrive, and only looks at each byte of a complete line once.
+typedef struct {
+    http_parser_state state;
+    // everything before this has been parsed
+    size_t pos;
+    http_slice method;
+    http_slice target;
+    http_slice version;
+    // offset of the first header line
+    size_t start_of_headers;
+    // size of the request line and headers, including the final empty line.
+    // only valid once DONE.
+    size_t header_size;
+    // only valid once ERROR
+    const char* error;
+    http_header_field fields[HTTP_HEADER_FIELDS_MAX];
+    size_t fields_count;
+    // index into fields + 1 of the first field with that id, 0 if not present
+    uint8_t known[HTTP_HEADER_KNOWN_COUNT];
+} http_parser;
+
+void http_parser_reset(http_parser*);
+// parses all complete lines in buf[parser->pos, size). `buf` must start with
+// the same bytes as on previous calls since the last reset, and must not be
+// longer than UINT16_MAX.
+http_parser_state http_parser_feed(http_parser*, const char* buf, size_t size);
+// case-insensitive
+http_header_id http_header_id_from_name(const char* name, size_t len);
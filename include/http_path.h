@@ -0,0 +1,100 @@
+#pragma once
+
+#include "error_t.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/stat.h>
+
+#ifndef HTTP_PATH_CACHE_SHARDS
+// must be a power of two
+#define HTTP_PATH_CACHE_SHARDS 16
+#endif
+#ifndef HTTP_PATH_CACHE_BUCKETS
+// per shard, must be a power of two
+#define HTTP_PATH_CACHE_BUCKETS 512
+#endif
+#ifndef HTTP_PATH_CACHE_ENTRIES
+// default number of paths remembered
+#define HTTP_PATH_CACHE_ENTRIES (16 * 1024)
+#endif
+
+// turns a request target into a path relative to the served root, starting
+// with '/': decodes %XX escapes, drops the query and fragment, merges
+// repeated slashes and removes "." and ".." segments. a trailing slash is
+// kept. false if the target is malformed, would leave the root, contains an
+// escaped '/' or NUL, or doesn't fit.
+bool http_path_normalize(const char* target, char* out, size_t out_size);
+
+typedef enum {
+    HTTP_PATH_FILE,
+    HTTP_PATH_DIRECTORY,
+    HTTP_PATH_MISSING,
+    // outside of the root, through a symlink, or neither file nor directory
+    HTTP_PATH_FORBIDDEN,
+} http_path_kind;
+
+// what a normalized path refers to
+typedef struct {
+    http_path_kind kind;
+    // there are no symlinks on the way, so root + path is the real path,
+    // which is what file system watchers report changes for
+    bool canonical;
+    // for files and directories
+    struct stat st;
+} http_path_info;
+
+// opens `path`, a normalized path, beneath `root_fd`, the served directory
+// whose real path is `root`. symlinks are followed as long as they stay
+// inside. if `canonical` is given, it's set to whether there were none.
+// returns -1 with errno set on failure, EXDEV if the path leads outside.
+int http_path_open(int root_fd, const char* root, const char* path, int flags, bool* canonical);
+// like http_path_open, but only looks at what's there
+void http_path_resolve(int root_fd, const char* root, const char* path, http_path_info* info);
+
+typedef struct http_path_cache_entry {
+    uint64_t hash;
+    http_path_info info;
+    // CLOCK_MONOTONIC_COARSE milliseconds
+    long long resolved_at_ms;
+    // the cache's generation before the path was resolved
+    size_t generation;
+    // guarded by the owning shard's mutex
+    struct http_path_cache_entry* hash_next;
+    struct http_path_cache_entry* lru_prev;
+    struct http_path_cache_entry* lru_next;
+    char path[];
+} http_path_cache_entry;
+
+typedef struct {
+    pthread_mutex_t mutex;
+    http_path_cache_entry* buckets[HTTP_PATH_CACHE_BUCKETS];
+    // most recently used first
+    http_path_cache_entry* lru_head;
+    http_path_cache_entry* lru_tail;
+    size_t count;
+} http_path_cache_shard;
+
+// normalized path -> http_path_info, bounded in entries with LRU eviction.
+// a change anywhere may change what a path resolves to, through symlinks,
+// so instead of being dropped one by one, all entries go stale at once when
+// the generation is bumped.
+typedef struct {
+    size_t capacity;
+    atomic_size_t hits;
+    atomic_size_t misses;
+    atomic_size_t generation;
+    // set while a watcher reports all changes. otherwise, entries are
+    // resolved again after HTTP_FILE_CACHE_REVALIDATE_MS.
+    atomic_bool watched;
+    http_path_cache_shard shards[HTTP_PATH_CACHE_SHARDS];
+} http_path_cache;
+
+http_path_cache* http_path_cache_new(size_t capacity, http_error_t*);
+void http_path_cache_free(http_path_cache*);
+// copies the info to `info`, false if `path` isn't known or may have changed
+bool http_path_cache_get(http_path_cache*, const char* path, http_path_info* info);
+// `generation` is the cache's generation from before `path` was resolved
+void http_path_cache_put(http_path_cache*, const char* path, const http_path_info* info, size_t generation);
+// forgets what every path resolved to
+void http_path_cache_invalidate(http_path_cache*);
@@ -0,0 +1,18 @@
+#pragma once
+
+#include "error_t.h"
+
+#include <stdbool.h>
+
+// larger files are skipped, they're read into memory whole
+#ifndef HTTP_PRECOMPRESS_MAX_SIZE
+#define HTTP_PRECOMPRESS_MAX_SIZE (256 * 1024 * 1024)
+#endif
+
+// whether any encoding can be written, depends on the libraries built in
+bool http_precompress_available(void);
+// writes precompressed siblings (see http_encoding) next to every file under
+// `root` whose type is compressible, at the highest compression level, unless
+// there already is one at least as new as the file. siblings which don't come
+// out smaller than the file aren't kept.
+void http_precompress_tree(const char* root, http_error_t*);
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// byte scanning kernels for the parser's inner loops. the best implementation
+// the cpu supports is picked at startup, and can be changed for benchmarks.
+typedef enum {
+    HTTP_SCAN_SCALAR,
+    HTTP_SCAN_SSE2,
+    HTTP_SCAN_AVX2,
+    HTTP_SCAN_LEVEL_COUNT,
+} http_scan_level;
+
+typedef struct {
+    // index of the first `a` or `b`, or `size` if there is none
+    size_t (*find2)(const char* buf, size_t size, char a, char b);
+    // index of the first "\r\n\r\n", or `size` if there is none
+    size_t (*find_terminator)(const char* buf, size_t size);
+} http_scan_impl;
+
+extern http_scan_impl http_scan;
+
+http_scan_level http_scan_best_level(void);
+// false if the cpu doesn't support `level`. not thread safe, only meant to
+// be called before any scanning happens.
+bool http_scan_use_level(http_scan_level level);
+const char* http_scan_level_name(http_scan_level level);
+
+static inline size_t http_scan_find(const char* buf, size_t size, char c) {
+    return http_scan.find2(buf, size, c, c);
+}
+
+static inline size_t http_scan_find2(const char* buf, size_t size, char a, char b) {
+    return http_scan.find2(buf, size, a, b);
+}
+
+static inline size_t http_scan_find_terminator(const char* buf, size_t size) {
+    return http_scan.find_terminator(buf, size);
+}
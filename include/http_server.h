@@ -1,31 +1,168 @@
 #pragma once
 
 #include "error_t.h"
+#include "http_fd_cache.h"
+#include "http_file_cache.h"
+#include "http_job_queue.h"
+#include "http_parser.h"
+#include "http_path.h"
+#include "http_timer_wheel.h"
+#include "memory.h"
 
+#include <limits.h>
 #include <netinet/in.h>
 #include <pthread.h>
 #include <stdatomic.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 
 #define CRLF "\r\n"
 #define HTTP_HEADER_SIZE_MAX 4096
+// http_header_field uses 16 bit offsets
+_Static_assert(HTTP_HEADER_SIZE_MAX <= UINT16_MAX, "HTTP_HEADER_SIZE_MAX too large");
+// max number of body buffers passed to http_client_serve_iov
+#define HTTP_SERVE_IOV_MAX 16
+// max ranges in one Range header, beyond that the whole file is served
+#ifndef HTTP_RANGES_MAX
+#define HTTP_RANGES_MAX 16
+#endif
 typedef int socket_t;
 
 typedef struct {
     socket_t socket;
     int backlog;
-    char cwd[128];
+    // max connections accepted per wakeup of the event loop, 0 for no limit
+    int accept_batch;
+    // allows several servers to listen on the same port, see SO_REUSEPORT
+    bool reuse_port;
+    // the served directory, a real path
+    char cwd[PATH_MAX];
+    // what requested paths are appended to, 0 if cwd is "/"
+    size_t cwd_len;
+    // cwd, opened with O_PATH, which files are opened beneath
+    int root_fd;
     bool show_root_page;
+    // shared between servers, not owned. NULL if disabled.
+    http_file_cache* file_cache;
+    // files compressed on the fly, keyed by path, version and encoding, so
+    // entries never go stale. shared and not owned like file_cache, NULL if
+    // disabled.
+    http_file_cache* variant_cache;
+    // what requested paths resolve to, shared and not owned like
+    // file_cache, NULL if disabled
+    http_path_cache* path_cache;
+    // open fds of files too large for file_cache, shared and not owned like
+    // file_cache, NULL if disabled
+    http_fd_cache* fd_cache;
+    // idle time allowed between requests on a keep-alive connection
+    unsigned int keep_alive_timeout_ms;
+    // time allowed for a request header to arrive, from its first byte
+    // (or from accept)
+    unsigned int header_timeout_ms;
+    // time a response may make no progress because the client doesn't read
+    unsigned int write_timeout_ms;
+    // http_client objects, allocated on accept and freed on close
+    http_slab clients;
 } http_server;
 
-// server-side info about a client
+struct http_event_loop;
+
+#ifndef HTTP_RESPONSE_BATCH_IOV_MAX
+#define HTTP_RESPONSE_BATCH_IOV_MAX 64
+#endif
+#ifndef HTTP_RESPONSE_BATCH_BUFFER_SIZE
+#define HTTP_RESPONSE_BATCH_BUFFER_SIZE (16 * 1024)
+#endif
+
+// responses to pipelined requests, collected so that they go out with as few
+// sendmsg() calls as possible. lives on the stack of whoever handles the requests.
 typedef struct {
+    struct iovec iov[HTTP_RESPONSE_BATCH_IOV_MAX];
+    size_t iov_count;
+    // cache entries which iov points into, released once sent
+    http_file_cache_entry* entries[HTTP_RESPONSE_BATCH_IOV_MAX];
+    size_t entries_count;
+    // copies of small responses
+    size_t buffer_len;
+    char buffer[HTTP_RESPONSE_BATCH_BUFFER_SIZE];
+} http_response_batch;
+
+// what the client's timer is waiting for
+typedef enum {
+    HTTP_CLIENT_TIMER_NONE,
+    // the next request, on a keep-alive connection
+    HTTP_CLIENT_TIMER_IDLE,
+    // the rest of a request header
+    HTTP_CLIENT_TIMER_HEADER,
+    // the socket to become writable, for the client's pending output
+    HTTP_CLIENT_TIMER_WRITE,
+} http_client_timer;
+
+// part of a response which couldn't be sent without blocking. either memory,
+// which is a reference into `entry` or the owned `copy`, or a range of a file.
+typedef struct http_pending_output {
+    struct http_pending_output* next;
+    const char* data;
+    // a reference, released once sent. NULL if `data` points to `copy`.
+    http_file_cache_entry* entry;
+    // a dup of the file to sendfile() from, owned. -1 for memory.
+    int fd;
+    off_t offset;
+    // bytes left
+    size_t size;
+    char copy[];
+} http_pending_output;
+
+// server-side info about a client
+typedef struct http_client {
     struct sockaddr address;
     socklen_t address_len;
     socket_t socket;
-    // none if zero
-    struct timeval rcv_timeout;
+    // reactor which owns this client while it's idle
+    struct http_event_loop* loop;
+    // pending while the reactor owns the client, see http_client_timer
+    http_timer timer;
+    http_client_timer timer_kind;
+    // next client handed back to an io_uring reactor, see http_event_loop.rearmed
+    struct http_client* rearm_next;
+    // bytes received, but not yet consumed by http_client_receive_header
+    char read_buffer[HTTP_HEADER_SIZE_MAX];
+    size_t read_buffer_len;
+    // body bytes of the last request which are yet to arrive, and will be discarded
+    size_t body_remaining;
+    // the last request's body can't be skipped, so nothing after it can be parsed
+    bool body_unknown;
+    // parse state of the request at the start of read_buffer
+    http_parser parser;
+    // responses are queued here instead of being sent right away, if set
+    http_response_batch* batch;
+    // output left over once the socket's send buffer filled up, in order.
+    // anything sent after that is appended, and the reactor waits for the
+    // socket to become writable instead of a worker, see
+    // http_event_loop_wait_writable.
+    http_pending_output* pending;
+    http_pending_output* pending_tail;
+    // whether the connection stays open once the pending output is sent
+    bool keep_alive;
+    // scratch memory for the requests being handled, set by whoever handles them
+    http_arena* arena;
+    // http_metrics_now_ns() timestamps, 0 if not taken
+    uint64_t accepted_ns;
+    // first byte of the request at the start of read_buffer arrived
+    uint64_t request_started_ns;
+    // handed to a worker by the event loop
+    uint64_t dispatched_ns;
+    // http_client_serve_file found the cache entry or stat'd the file
+    uint64_t resolved_ns;
+    // the request being handled is a HEAD: responses go out without a body
+    bool head_only;
+    // the header of the HEAD response was sent, whatever follows is dropped
+    bool head_done;
+    // requests handled on this connection
+    size_t requests_count;
+    // status code of the last response, 0 if none was sent
+    int status;
 } http_client;
 
 // buffers for header data to be received into
@@ -34,55 +171,143 @@ typedef struct {
     char target[128];
     char version[16];
     char host[64];
-    char buffer[HTTP_HEADER_SIZE_MAX];
+    // +1 for the null terminator
+    char buffer[HTTP_HEADER_SIZE_MAX + 1];
+    size_t size;
     size_t start_of_headers;
+    // every header line, as parsed by http_parser
+    http_header_field fields[HTTP_HEADER_FIELDS_MAX];
+    size_t fields_count;
+    // see http_parser.known
+    uint8_t known[HTTP_HEADER_KNOWN_COUNT];
 } http_header;
 
+// bytes [start, end) of a file
+typedef struct {
+    uint64_t start;
+    uint64_t end;
+} http_byte_range;
+
+// directory listings too large to cache are sent in chunks of this size
+#ifndef HTTP_LISTING_CHUNK_SIZE
+#define HTTP_LISTING_CHUNK_SIZE (64 * 1024)
+#endif
+
+// content codings which are served from precompressed siblings, e.g.
+// "app.js.br" for "app.js", or compressed on the fly. in order of preference.
+typedef enum {
+    HTTP_ENCODING_BR,
+    HTTP_ENCODING_ZSTD,
+    HTTP_ENCODING_GZIP,
+    // only compressed on the fly, there are no siblings
+    HTTP_ENCODING_DEFLATE,
+    HTTP_ENCODING_COUNT,
+} http_encoding;
+
+#define HTTP_ENCODING_ALL ((1u << HTTP_ENCODING_COUNT) - 1)
+
 // used in *_serve functions to provide header data
 typedef struct {
     int status_code;
-    const char* status_message;
     const char* content_type;
     const char* connection;
     const char* additional_headers;
+    // header lines specific to this response, e.g. Allow, or NULL
+    const char* extra_headers;
 } http_header_data;
 
-typedef struct {
-    char* data;
-    size_t len;
-} http_char_buffer_t;
-
 typedef void (*http_client_connect_cb)(http_server*, http_client*);
 
 //TODO most ptr parameters can be const
 http_server* http_server_new(http_error_t*);
 void http_server_free(http_server*);
 void http_server_start(http_server*, uint16_t port, http_error_t*);
-void http_server_accept_client(http_server*, http_client_connect_cb, http_error_t*);
+// non-blocking, returns NULL without error if there is no pending connection
+http_client* http_server_accept_client(http_server*, http_error_t*);
+// for a connection accepted by someone else. takes ownership of `fd`, which
+// must be non-blocking.
+http_client* http_server_add_client(http_server*, socket_t fd, http_error_t*);
 void http_client_serve(http_client*, const char* body, size_t body_size, http_header_data*, http_error_t*);
-void http_client_set_rcv_timeout(http_client*, time_t seconds, suseconds_t microseconds, http_error_t*);
+// until http_client_end_batch, responses are queued in `batch` where possible,
+// and sent together. the end flushes them.
+void http_client_begin_batch(http_client*, http_response_batch* batch);
+void http_client_end_batch(http_client*, http_error_t*);
+void http_client_flush(http_client*, http_error_t*);
+// whether some output is waiting for the socket to become writable
+bool http_client_has_pending(const http_client*);
+// sends as much of the pending output as the socket takes without blocking
+void http_client_send_pending(http_client*, http_error_t*);
+// frees the pending output without sending it
+void http_client_drop_pending(http_client*);
+// serves the concatenation of `body`, without copying it
+void http_client_serve_iov(http_client*, const struct iovec* body, size_t body_count, http_header_data*, http_error_t*);
+// serves `size` bytes of `fd` starting at `offset` with sendfile(), doesn't close `fd`
+void http_client_serve_fd(http_client*, int fd, off_t offset, size_t size, http_header_data*, http_error_t*);
+// whether the client's read buffer holds at least one complete request header,
+// or one which can't be parsed
+bool http_client_has_complete_header(const http_client*);
+// to be called after bytes were appended to the client's read buffer
+void http_client_parse_received(http_client*);
+// parses and consumes the next request header from the client's read buffer
 void http_client_receive_header(http_client*, http_header*, http_error_t*);
+// copies the field's value, null-terminated, into value_buf
 void http_header_parse_field(http_header*, char* value_buf, size_t value_buf_size, const char* fieldname, http_error_t*);
+// the field's value (not null-terminated) and its length, or NULL if not present. O(1).
+const char* http_header_get_known(const http_header*, http_header_id, size_t* value_len);
+// like http_header_get_known, but for any field name. case-insensitive.
+const char* http_header_get(const http_header*, const char* fieldname, size_t* value_len);
+// whether the comma-separated value of the field contains `token`, case-insensitive
+bool http_header_has_token(const http_header*, http_header_id, const char* token);
+
+// the Content-Encoding token, and the suffix of the precompressed sibling,
+// or NULL if there are none
+const char* http_encoding_name(http_encoding);
+const char* http_encoding_suffix(http_encoding);
+// whether the file's type is worth compressing, judging by its extension
+bool http_path_is_compressible(const char* path);
+// if `path` is a precompressed sibling, writes the path of the file it's
+// a sibling of to `original`
+bool http_precompressed_original(const char* path, char* original, size_t original_size);
+
+typedef enum {
+    HTTP_FIXED_ROOT_PAGE,
+    HTTP_FIXED_400,
+    HTTP_FIXED_403,
+    HTTP_FIXED_404,
+    HTTP_FIXED_405,
+    HTTP_FIXED_500,
+    HTTP_FIXED_RESPONSE_COUNT,
+} http_fixed_response;
+
+#ifndef HTTP_FIXED_RESPONSE_SIZE_MAX
+// header and body of a fixed response
+#define HTTP_FIXED_RESPONSE_SIZE_MAX 2048
+#endif
 
+// renders the root and error pages once, header and body, for keep-alive
+// and close. must be called before any server starts. responses with other
+// additional headers are still formatted each time.
+void http_fixed_responses_init(const char* additional_headers, http_error_t*);
+// sends a page rendered by http_fixed_responses_init, with the current date
+void http_client_serve_fixed(http_client*, http_fixed_response, const http_header_data* template_hdr_data, http_error_t*);
 // a few helpers for common error pages
+void http_client_serve_400(http_client* client, const http_header_data* template_hdr_data, http_error_t*);
 void http_client_serve_404(http_client* client, const http_header_data* template_hdr_data, http_error_t*);
 void http_client_serve_403(http_client* client, const http_header_data* template_hdr_data, http_error_t*);
+// for methods other than GET and HEAD, with an Allow header
+void http_client_serve_405(http_client* client, const http_header_data* template_hdr_data, http_error_t*);
 void http_client_serve_500(http_client* client, const http_header_data* template_hdr_data, http_error_t*);
-void http_client_serve_file(http_client*, http_server*, const char* target, const http_header_data* template_hdr_data, http_error_t*);
+// serves the file or directory listing at the request's target, or 304 if
+// the request's conditionals say the client has it already
+void http_client_serve_file(http_client*, http_server*, const http_header* request, const http_header_data* template_hdr_data, http_error_t*);
 
 #ifndef HTTP_THREAD_POOL_SIZE
 #define HTTP_THREAD_POOL_SIZE 8
 #endif
-typedef void (*http_thread_pool_fn_t)(void*);
 typedef struct {
     pthread_t threads[HTTP_THREAD_POOL_SIZE];
     pthread_attr_t attrs[HTTP_THREAD_POOL_SIZE];
-    http_thread_pool_fn_t jobs[HTTP_THREAD_POOL_SIZE];
-    void* args[HTTP_THREAD_POOL_SIZE];
-    pthread_mutex_t jobs_mutexes[HTTP_THREAD_POOL_SIZE];
-    pthread_mutexattr_t jobs_mutexes_attrs[HTTP_THREAD_POOL_SIZE];
-    pthread_cond_t condition_vars[HTTP_THREAD_POOL_SIZE];
-    pthread_condattr_t condition_vars_attrs[HTTP_THREAD_POOL_SIZE];
+    http_job_queue jobs;
     atomic_bool shutdown;
 } http_thread_pool;
 
@@ -95,7 +320,12 @@ typedef struct {
 
 http_thread_pool* http_thread_pool_new(http_error_t* ep);
 void* http_thread_pool_main(void* args_ptr);
+// scratch memory of the calling pool thread, reset by its jobs once they're
+// done with it. NULL on other threads.
+http_arena* http_thread_pool_arena(void);
+// stops the workers once all queued jobs have run, and joins them
 void http_thread_pool_destroy(http_thread_pool* pool);
+// never blocks, fails if the job queue is full
 void http_thread_pool_add_job(http_thread_pool* pool, http_thread_pool_fn_t job, void* arg, http_error_t* ep);
 
 // utils
@@ -106,10 +336,14 @@ void http_sleep_ms(long ms);
 
 extern const char http_server_rootpage[];
 extern const size_t http_server_rootpage_size;
+extern const char http_server_err_400_page[];
+extern const size_t http_server_err_400_page_size;
 extern const char http_server_err_404_page[];
 extern const size_t http_server_err_404_page_size;
 extern const char http_server_err_403_page[];
 extern const size_t http_server_err_403_page_size;
+extern const char http_server_err_405_page[];
+extern const size_t http_server_err_405_page_size;
 extern const char http_server_err_500_page[];
 extern const size_t http_server_err_500_page_size;
 
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifndef HTTP_TIMER_WHEEL_TICK_MS
+#define HTTP_TIMER_WHEEL_TICK_MS 100
+#endif
+
+// 64 slots per level, each level's slot spans a whole lower level. with
+// 100ms ticks, four levels reach about 19 days.
+#define HTTP_TIMER_WHEEL_SLOT_BITS 6
+#define HTTP_TIMER_WHEEL_SLOTS (1 << HTTP_TIMER_WHEEL_SLOT_BITS)
+#define HTTP_TIMER_WHEEL_LEVELS 4
+
+// embedded in whatever has a deadline. zero-initialized means not pending.
+typedef struct http_timer {
+    struct http_timer* next;
+    struct http_timer* prev;
+    // in ticks since the wheel started
+    uint64_t expires;
+} http_timer;
+
+// hierarchical timing wheel: adding and cancelling are O(1), and advancing
+// is O(1) per tick plus the timers which expire or move down a level. not
+// thread safe.
+typedef struct {
+    uint64_t start_ms;
+    uint64_t tick_ms;
+    // everything before this has been expired
+    uint64_t now_tick;
+    size_t count;
+    // list heads
+    http_timer slots[HTTP_TIMER_WHEEL_LEVELS][HTTP_TIMER_WHEEL_SLOTS];
+} http_timer_wheel;
+
+// CLOCK_MONOTONIC_COARSE in ms, cheap enough to call per event
+uint64_t http_timer_now_ms(void);
+
+void http_timer_wheel_init(http_timer_wheel*, uint64_t tick_ms, uint64_t now_ms);
+// (re)schedules `timer` to expire at `deadline_ms`, rounded up to the next tick
+void http_timer_wheel_add(http_timer_wheel*, http_timer*, uint64_t deadline_ms);
+// does nothing if the timer isn't pending
+void http_timer_wheel_cancel(http_timer_wheel*, http_timer*);
+bool http_timer_pending(const http_timer*);
+// returns every timer which expired up to `now_ms`, linked through `next`.
+// they are no longer pending.
+http_timer* http_timer_wheel_advance(http_timer_wheel*, uint64_t now_ms);
+// how long a poller may sleep before the next advance is needed, -1 for ever
+int http_timer_wheel_timeout_ms(const http_timer_wheel*);
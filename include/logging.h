@@ -1,8 +1,63 @@
 #pragma once
 
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdio.h>
-#include <unistd.h>
 
-#define log_info(fmt, ...) printf("%d %.20s info: " fmt "\n", gettid(), __func__, __VA_ARGS__)
-#define log_error(fmt, ...) printf("%d %.20s error: " fmt "\n", gettid(), __func__, __VA_ARGS__)
-#define log_warning(fmt, ...) printf("%d %.20s warning: " fmt "\n", gettid(), __func__, __VA_ARGS__)
+// messages are formatted on the calling thread into a per-thread ring, and
+// written out in batches by a background thread once http_log_start() was
+// called. before that (and after http_log_stop()) they're written directly.
+
+#ifndef HTTP_LOG_RING_SIZE
+// records per thread, must be a power of two
+#define HTTP_LOG_RING_SIZE 512
+#endif
+
+#ifndef HTTP_LOG_RECORD_SIZE
+// longer messages are truncated
+#define HTTP_LOG_RECORD_SIZE 256
+#endif
+
+#ifndef HTTP_LOG_FLUSH_INTERVAL_MS
+// the writer sleeps until a message arrives, then this long to batch more
+#define HTTP_LOG_FLUSH_INTERVAL_MS 10
+#endif
+
+typedef enum {
+    HTTP_LOG_DEBUG,
+    HTTP_LOG_INFO,
+    HTTP_LOG_WARNING,
+    HTTP_LOG_ERROR,
+    HTTP_LOG_OFF,
+} http_log_level;
+
+// messages below this level are dropped before their arguments are evaluated
+extern atomic_int http_log_min_level;
+
+#define http_log_enabled(level) ((int)(level) >= atomic_load_explicit(&http_log_min_level, memory_order_relaxed))
+
+#define http_log(level, fmt, ...)                                \
+    do {                                                         \
+        if (http_log_enabled(level)) {                           \
+            http_log_write(level, __func__, fmt, __VA_ARGS__);   \
+        }                                                        \
+    } while (0)
+
+#define log_debug(fmt, ...) http_log(HTTP_LOG_DEBUG, fmt, __VA_ARGS__)
+#define log_info(fmt, ...) http_log(HTTP_LOG_INFO, fmt, __VA_ARGS__)
+#define log_warning(fmt, ...) http_log(HTTP_LOG_WARNING, fmt, __VA_ARGS__)
+#define log_error(fmt, ...) http_log(HTTP_LOG_ERROR, fmt, __VA_ARGS__)
+
+__attribute__((format(printf, 3, 4))) void http_log_write(http_log_level, const char* func, const char* fmt, ...);
+
+// starts the background writer, returns false if the thread couldn't be created
+bool http_log_start(void);
+// writes out everything still queued and stops the background writer. safe
+// while other threads still log: their messages are written directly again,
+// or lost if they were queued after the last drain.
+void http_log_stop(void);
+// number of messages dropped because a thread's ring was full
+size_t http_log_dropped(void);
+// "debug", "info", "warning", "error" or "off", returns false if unknown
+bool http_log_parse_level(const char* name, http_log_level* out);
@@ -1,6 +1,75 @@
 #pragma once
 
 #include "error_t.h"
+#include <pthread.h>
+#include <stdatomic.h>
 #include <string.h>
 
 void* safe_malloc(size_t size, http_error_t*);
+
+#ifndef HTTP_SLAB_BATCH
+#define HTTP_SLAB_BATCH 32
+#endif
+// number of slabs a thread keeps a cache for, others go through the depot
+#ifndef HTTP_SLAB_THREAD_CACHES
+#define HTTP_SLAB_THREAD_CACHES 4
+#endif
+
+// pool of fixed-size objects. each thread allocates from and frees to its own
+// cache, and only takes the lock to move HTTP_SLAB_BATCH objects between its
+// cache and the shared depot, so objects can be allocated on one thread and
+// freed on another. memory is only given back by http_slab_destroy.
+typedef struct {
+    size_t object_size;
+    // never reused, identifies the slab in thread caches
+    uint64_t id;
+    pthread_mutex_t mutex;
+    // free objects not cached by any thread, linked through their first bytes
+    void* depot;
+    // malloc'd blocks of HTTP_SLAB_BATCH objects
+    void* chunks;
+    atomic_size_t chunks_count;
+} http_slab;
+
+void http_slab_init(http_slab*, size_t object_size);
+// frees all memory, objects which are still allocated included. threads must
+// not use the slab anymore.
+void http_slab_destroy(http_slab*);
+// not zeroed
+void* http_slab_alloc(http_slab*, http_error_t*);
+void http_slab_free(http_slab*, void*);
+
+#ifndef HTTP_ARENA_BLOCK_SIZE
+#define HTTP_ARENA_BLOCK_SIZE (64 * 1024)
+#endif
+// memory kept by http_arena_reset, beyond that it shrinks back to one block
+#ifndef HTTP_ARENA_RETAIN_MAX
+#define HTTP_ARENA_RETAIN_MAX (1024 * 1024)
+#endif
+
+typedef struct http_arena_block {
+    struct http_arena_block* next;
+    size_t size;
+    size_t used;
+    _Alignas(16) char data[];
+} http_arena_block;
+
+// bump allocator for memory which lives as long as one request. there is no
+// free, everything is released at once with http_arena_reset, which keeps
+// the memory around for the next request. zero-initialized is empty.
+typedef struct {
+    // the block allocated from, older ones follow
+    http_arena_block* blocks;
+    // start of the last allocation, which http_arena_grow can extend in place
+    char* last;
+    // size of the next block, 0 for HTTP_ARENA_BLOCK_SIZE
+    size_t block_size;
+} http_arena;
+
+// 16-byte aligned, not zeroed
+void* http_arena_alloc(http_arena*, size_t size, http_error_t*);
+// like realloc, but the old memory stays valid until the arena is reset
+void* http_arena_grow(http_arena*, void* ptr, size_t old_size, size_t new_size, http_error_t*);
+// invalidates everything allocated from the arena
+void http_arena_reset(http_arena*);
+void http_arena_free(http_arena*);
@@ -0,0 +1,165 @@
+#include "http_compress.h"
+
+#include <limits.h>
+#include <stdlib.h>
+
+#ifdef HTTP_HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef HTTP_HAVE_BROTLI
+#include <brotli/encode.h>
+#endif
+#ifdef HTTP_HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+bool http_compress_supported(http_encoding encoding) {
+    switch (encoding) {
+#ifdef HTTP_HAVE_BROTLI
+    case HTTP_ENCODING_BR:
+        return true;
+#endif
+#ifdef HTTP_HAVE_ZSTD
+    case HTTP_ENCODING_ZSTD:
+        return true;
+#endif
+#ifdef HTTP_HAVE_ZLIB
+    case HTTP_ENCODING_GZIP:
+    case HTTP_ENCODING_DEFLATE:
+        return true;
+#endif
+    default:
+        return false;
+    }
+}
+
+static void* alloc_out(http_arena* arena, size_t size, http_error_t* ep) {
+    return arena ? http_arena_alloc(arena, size, ep) : safe_malloc(size, ep);
+}
+
+#ifdef HTTP_HAVE_ZLIB
+static voidpf arena_zalloc(voidpf opaque, uInt items, uInt size) {
+    http_error_t err = http_new_error_ok();
+    void* ptr = http_arena_alloc(opaque, (size_t)items * size, &err);
+    return http_is_ok(err) ? ptr : Z_NULL;
+}
+
+static void arena_zfree(voidpf opaque, voidpf ptr) {
+    // released with the arena
+    (void)opaque;
+    (void)ptr;
+}
+
+static char* compress_zlib(http_encoding encoding, const char* in, size_t in_size, bool best, http_arena* arena,
+    size_t* out_size, http_error_t* ep) {
+    if (in_size > UINT_MAX) {
+        *ep = http_new_error_error("too large for zlib");
+        return NULL;
+    }
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    if (arena) {
+        zs.zalloc = arena_zalloc;
+        zs.zfree = arena_zfree;
+        zs.opaque = arena;
+    }
+    // 16 on top of the window bits asks for a gzip wrapper, "deflate" is zlib's
+    int window_bits = encoding == HTTP_ENCODING_GZIP ? 15 + 16 : 15;
+    int level = best ? Z_BEST_COMPRESSION : Z_DEFAULT_COMPRESSION;
+    if (deflateInit2(&zs, level, Z_DEFLATED, window_bits, best ? 9 : 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        *ep = http_new_error_error("deflateInit2() failed");
+        return NULL;
+    }
+    size_t bound = deflateBound(&zs, (uLong)in_size);
+    char* out = alloc_out(arena, bound, ep);
+    if (http_is_error(*ep)) {
+        deflateEnd(&zs);
+        return NULL;
+    }
+    zs.next_in = (Bytef*)in;
+    zs.avail_in = (uInt)in_size;
+    zs.next_out = (Bytef*)out;
+    zs.avail_out = (uInt)bound;
+    int ret = deflate(&zs, Z_FINISH);
+    *out_size = zs.total_out;
+    deflateEnd(&zs);
+    if (ret != Z_STREAM_END) {
+        if (!arena) {
+            free(out);
+        }
+        *ep = http_new_error_error("deflate() failed");
+        return NULL;
+    }
+    return out;
+}
+#endif
+
+#ifdef HTTP_HAVE_BROTLI
+static char* compress_br(const char* in, size_t in_size, bool best, size_t* out_size, http_error_t* ep) {
+    size_t bound = BrotliEncoderMaxCompressedSize(in_size);
+    if (bound == 0) {
+        *ep = http_new_error_error("too large for brotli");
+        return NULL;
+    }
+    char* out = safe_malloc(bound, ep);
+    if (http_is_error(*ep)) {
+        return NULL;
+    }
+    *out_size = bound;
+    if (!BrotliEncoderCompress(best ? BROTLI_MAX_QUALITY : BROTLI_DEFAULT_QUALITY, BROTLI_DEFAULT_WINDOW,
+            BROTLI_MODE_GENERIC, in_size, (const uint8_t*)in, out_size, (uint8_t*)out)) {
+        free(out);
+        *ep = http_new_error_error("BrotliEncoderCompress() failed");
+        return NULL;
+    }
+    return out;
+}
+#endif
+
+#ifdef HTTP_HAVE_ZSTD
+static char* compress_zstd(const char* in, size_t in_size, bool best, size_t* out_size, http_error_t* ep) {
+    size_t bound = ZSTD_compressBound(in_size);
+    char* out = safe_malloc(bound, ep);
+    if (http_is_error(*ep)) {
+        return NULL;
+    }
+    *out_size = ZSTD_compress(out, bound, in, in_size, best ? 19 : 3);
+    if (ZSTD_isError(*out_size)) {
+        free(out);
+        *ep = http_new_error_error("ZSTD_compress() failed");
+        return NULL;
+    }
+    return out;
+}
+#endif
+
+char* http_compress(http_encoding encoding, const char* in, size_t in_size, bool best, http_arena* arena,
+    size_t* out_size, http_error_t* ep) {
+    *ep = http_new_error_ok();
+    *out_size = 0;
+    switch (encoding) {
+#ifdef HTTP_HAVE_ZLIB
+    case HTTP_ENCODING_GZIP:
+    case HTTP_ENCODING_DEFLATE:
+        return compress_zlib(encoding, in, in_size, best, arena, out_size, ep);
+#endif
+#ifdef HTTP_HAVE_BROTLI
+    case HTTP_ENCODING_BR:
+        if (!arena) {
+            return compress_br(in, in_size, best, out_size, ep);
+        }
+        break;
+#endif
+#ifdef HTTP_HAVE_ZSTD
+    case HTTP_ENCODING_ZSTD:
+        if (!arena) {
+            return compress_zstd(in, in_size, best, out_size, ep);
+        }
+        break;
+#endif
+    default:
+        break;
+    }
+    *ep = http_new_error_error("encoding not supported");
+    return NULL;
+}
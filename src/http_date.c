@@ -0,0 +1,108 @@
+#include "http_date.h"
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <string.h>
+
+typedef struct {
+    time_t second;
+    char line[HTTP_DATE_LINE_LEN];
+} http_date_slot;
+
+// a slot is only written HTTP_DATE_SLOTS - 1 seconds after it stopped being
+// the current one, so a reader which loaded the index has that long to copy
+static http_date_slot s_slots[HTTP_DATE_SLOTS];
+static atomic_uint s_current = 0;
+// held by whoever renders the next slot
+static atomic_flag s_updating = ATOMIC_FLAG_INIT;
+
+static void put2(char* out, unsigned value) {
+    out[0] = (char)('0' + value / 10);
+    out[1] = (char)('0' + value % 10);
+}
+
+void http_date_format(time_t t, char out[HTTP_DATE_LEN + 1]) {
+    static const char weekdays[7][4] = { "Thu", "Fri", "Sat", "Sun", "Mon", "Tue", "Wed" };
+    static const char months[12][4] = { "Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec" };
+    // 0000-01-01T00:00:00 and 9999-12-31T23:59:59
+    const int64_t min = -62167219200LL;
+    const int64_t max = 253402300799LL;
+    int64_t s = (int64_t)t < min ? min : (int64_t)t > max ? max : (int64_t)t;
+    int64_t days = s / 86400;
+    int64_t rem = s % 86400;
+    if (rem < 0) {
+        rem += 86400;
+        --days;
+    }
+    // 1970-01-01 was a thursday
+    unsigned weekday = (unsigned)(((days % 7) + 7) % 7);
+    // days to civil, see http://howardhinnant.github.io/date_algorithms.html
+    int64_t z = days + 719468;
+    int64_t era = (z >= 0 ? z : z - 146096) / 146097;
+    unsigned doe = (unsigned)(z - era * 146097);
+    unsigned yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+    int64_t year = (int64_t)yoe + era * 400;
+    unsigned doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+    unsigned mp = (5 * doy + 2) / 153;
+    unsigned day = doy - (153 * mp + 2) / 5 + 1;
+    unsigned month = mp < 10 ? mp + 3 : mp - 9;
+    year += month <= 2;
+    memcpy(out, weekdays[weekday], 3);
+    out[3] = ',';
+    out[4] = ' ';
+    put2(out + 5, day);
+    out[7] = ' ';
+    memcpy(out + 8, months[month - 1], 3);
+    out[11] = ' ';
+    put2(out + 12, (unsigned)(year / 100));
+    put2(out + 14, (unsigned)(year % 100));
+    out[16] = ' ';
+    put2(out + 17, (unsigned)(rem / 3600));
+    out[19] = ':';
+    put2(out + 20, (unsigned)(rem / 60 % 60));
+    out[22] = ':';
+    put2(out + 23, (unsigned)(rem % 60));
+    memcpy(out + 25, " GMT", 5);
+}
+
+static time_t now_s(void) {
+    struct timespec ts;
+    // vDSO, no syscall
+    clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+    return ts.tv_sec;
+}
+
+static void http_date_update_to(time_t now) {
+    if (atomic_flag_test_and_set_explicit(&s_updating, memory_order_acquire)) {
+        // someone else is at it, the current slot is at most a second old
+        return;
+    }
+    unsigned current = atomic_load_explicit(&s_current, memory_order_relaxed);
+    if (s_slots[current].second != now) {
+        unsigned next = (current + 1) % HTTP_DATE_SLOTS;
+        http_date_slot* slot = &s_slots[next];
+        char date[HTTP_DATE_LEN + 1];
+        http_date_format(now, date);
+        memcpy(slot->line, "Date: ", 6);
+        memcpy(slot->line + 6, date, HTTP_DATE_LEN);
+        memcpy(slot->line + 6 + HTTP_DATE_LEN, "\r\n", 2);
+        slot->second = now;
+        atomic_store_explicit(&s_current, next, memory_order_release);
+    }
+    atomic_flag_clear_explicit(&s_updating, memory_order_release);
+}
+
+void http_date_update(void) {
+    http_date_update_to(now_s());
+}
+
+void http_date_line(char out[HTTP_DATE_LINE_LEN]) {
+    time_t now = now_s();
+    unsigned current = atomic_load_explicit(&s_current, memory_order_acquire);
+    if (s_slots[current].second != now) {
+        // the event loop hasn't woken up this second
+        http_date_update_to(now);
+        current = atomic_load_explicit(&s_current, memory_order_acquire);
+    }
+    memcpy(out, s_slots[current].line, HTTP_DATE_LINE_LEN);
+}
@@ -0,0 +1,568 @@
+#include "http_event_loop.h"
+
+#include "http_date.h"
+#include "http_metrics.h"
+#include "logging.h"
+#include "memory.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <poll.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#ifdef HTTP_HAVE_IO_URING
+#include <linux/io_uring.h>
+#endif
+
+#define HTTP_EVENT_LOOP_CLIENT_EVENTS (EPOLLIN | EPOLLRDHUP | EPOLLET | EPOLLONESHOT)
+#define HTTP_EVENT_LOOP_WRITABLE_EVENTS (EPOLLOUT | EPOLLET | EPOLLONESHOT)
+
+// user_data of io_uring requests which aren't a client's recv or poll, whose
+// user_data is the client
+#define HTTP_EVENT_LOOP_URING_ACCEPT 1
+#define HTTP_EVENT_LOOP_URING_WAKE 2
+
+static void http_event_loop_init_epoll(http_event_loop* loop, http_error_t* ep) {
+    *ep = http_new_error_ok();
+    loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (loop->epoll_fd < 0) {
+        perror("epoll_create1");
+        *ep = http_new_error_error("epoll_create1() failed");
+        return;
+    }
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = loop;
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, loop->wake_fd, &ev) < 0) {
+        perror("epoll_ctl");
+        *ep = http_new_error_error("failed to add wake fd to epoll");
+        return;
+    }
+    // the listening socket is identified by data.ptr == server. it's level-
+    // triggered, so that pending connections beyond one accept batch are
+    // reported again on the next epoll_wait.
+    ev.events = EPOLLIN;
+    ev.data.ptr = loop->server;
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, loop->server->socket, &ev) < 0) {
+        perror("epoll_ctl");
+        *ep = http_new_error_error("failed to add server socket to epoll");
+        return;
+    }
+}
+
+http_event_loop* http_event_loop_new(http_server* server, http_event_loop_backend backend, http_client_connect_cb on_request, http_error_t* ep) {
+    assert(server);
+    assert(on_request);
+    *ep = http_new_error_ok();
+    http_event_loop* loop = safe_malloc(sizeof(http_event_loop), ep);
+    if (http_is_error(*ep)) {
+        return NULL;
+    }
+    memset(loop, 0, sizeof(http_event_loop));
+    loop->server = server;
+    loop->on_request = on_request;
+    loop->epoll_fd = -1;
+    loop->ring.fd = -1;
+    atomic_store(&loop->shutdown, false);
+    atomic_store(&loop->rearmed, NULL);
+    pthread_mutex_init(&loop->timers_mutex, NULL);
+    http_timer_wheel_init(&loop->timers, HTTP_TIMER_WHEEL_TICK_MS, http_timer_now_ms());
+    loop->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (loop->wake_fd < 0) {
+        perror("eventfd");
+        *ep = http_new_error_error("eventfd() failed");
+        pthread_mutex_destroy(&loop->timers_mutex);
+        free(loop);
+        return NULL;
+    }
+    if (backend == HTTP_EVENT_LOOP_IO_URING) {
+        http_io_uring_init(&loop->ring, HTTP_EVENT_LOOP_MAX_EVENTS, HTTP_EVENT_LOOP_URING_CQ_ENTRIES, ep);
+        if (http_is_ok(*ep)) {
+            loop->backend = HTTP_EVENT_LOOP_IO_URING;
+            loop->multishot_accept = true;
+            return loop;
+        }
+        log_warning("io_uring not available (%s), falling back to epoll", ep->error);
+        *ep = http_new_error_ok();
+    }
+    loop->backend = HTTP_EVENT_LOOP_EPOLL;
+    http_event_loop_init_epoll(loop, ep);
+    if (http_is_error(*ep)) {
+        http_event_loop_free(loop);
+        return NULL;
+    }
+    return loop;
+}
+
+void http_event_loop_free(http_event_loop* loop) {
+    if (loop) {
+        close(loop->wake_fd);
+        if (loop->epoll_fd >= 0) {
+            close(loop->epoll_fd);
+        }
+        http_io_uring_free(&loop->ring);
+        pthread_mutex_destroy(&loop->timers_mutex);
+    }
+    free(loop);
+}
+
+static void http_event_loop_wake(http_event_loop* loop) {
+    uint64_t one = 1;
+    // can only fail if the counter overflows, in which case we're awake anyways
+    ssize_t ret = write(loop->wake_fd, &one, sizeof(one));
+    (void)ret;
+}
+
+void http_event_loop_stop(http_event_loop* loop) {
+    atomic_store(&loop->shutdown, true);
+    http_event_loop_wake(loop);
+}
+
+// schedules (or cancels) the client's timer. requires timers_mutex.
+static void http_event_loop_set_timer(http_event_loop* loop, http_client* client, http_client_timer kind, uint64_t now_ms) {
+    unsigned int timeout_ms = 0;
+    switch (kind) {
+    case HTTP_CLIENT_TIMER_IDLE:
+        timeout_ms = loop->server->keep_alive_timeout_ms;
+        break;
+    case HTTP_CLIENT_TIMER_HEADER:
+        timeout_ms = loop->server->header_timeout_ms;
+        break;
+    case HTTP_CLIENT_TIMER_WRITE:
+        timeout_ms = loop->server->write_timeout_ms;
+        break;
+    case HTTP_CLIENT_TIMER_NONE:
+        break;
+    }
+    client->timer_kind = kind;
+    if (timeout_ms == 0) {
+        http_timer_wheel_cancel(&loop->timers, &client->timer);
+        return;
+    }
+    http_timer_wheel_add(&loop->timers, &client->timer, now_ms + timeout_ms);
+}
+
+// waits for the client to become readable, or writable if it's waiting for that
+static void http_event_loop_arm(http_event_loop* loop, http_client* client, int op, http_error_t* ep) {
+    *ep = http_new_error_ok();
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = client->timer_kind == HTTP_CLIENT_TIMER_WRITE ? HTTP_EVENT_LOOP_WRITABLE_EVENTS : HTTP_EVENT_LOOP_CLIENT_EVENTS;
+    ev.data.ptr = client;
+    if (epoll_ctl(loop->epoll_fd, op, client->socket, &ev) < 0) {
+        perror("epoll_ctl");
+        *ep = http_new_error_error("failed to arm client socket");
+    }
+}
+
+#ifdef HTTP_HAVE_IO_URING
+// called by the reactor only, like everything touching the ring
+static void http_event_loop_submit_recv(http_event_loop* loop, http_client* client, http_error_t* ep) {
+    struct io_uring_sqe* sqe = http_io_uring_get_sqe(&loop->ring, ep);
+    if (http_is_error(*ep)) {
+        return;
+    }
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = client->socket;
+    sqe->addr = (uint64_t)(uintptr_t)(client->read_buffer + client->read_buffer_len);
+    sqe->len = (uint32_t)(sizeof(client->read_buffer) - client->read_buffer_len);
+    sqe->user_data = (uint64_t)(uintptr_t)client;
+}
+
+static void http_event_loop_submit_poll_out(http_event_loop* loop, http_client* client, http_error_t* ep) {
+    struct io_uring_sqe* sqe = http_io_uring_get_sqe(&loop->ring, ep);
+    if (http_is_error(*ep)) {
+        return;
+    }
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = client->socket;
+    sqe->poll32_events = POLLOUT;
+    sqe->user_data = (uint64_t)(uintptr_t)client;
+}
+
+// what a client handed back by a worker waits for
+static void http_event_loop_submit_wait(http_event_loop* loop, http_client* client, http_error_t* ep) {
+    if (client->timer_kind == HTTP_CLIENT_TIMER_WRITE) {
+        http_event_loop_submit_poll_out(loop, client, ep);
+    } else {
+        http_event_loop_submit_recv(loop, client, ep);
+    }
+}
+#endif
+
+// waits for more of the client's request, with the timer already set
+static void http_event_loop_wait_for(http_event_loop* loop, http_client* client, int op, http_error_t* ep) {
+#ifdef HTTP_HAVE_IO_URING
+    if (loop->backend == HTTP_EVENT_LOOP_IO_URING) {
+        http_event_loop_submit_recv(loop, client, ep);
+        return;
+    }
+#endif
+    http_event_loop_arm(loop, client, op, ep);
+}
+
+// hands a client back from a worker to the reactor, which waits for what
+// the timer `kind` is for
+static void http_event_loop_hand_back(http_event_loop* loop, http_client* client, http_client_timer kind, http_error_t* ep) {
+    if (loop->backend == HTTP_EVENT_LOOP_IO_URING) {
+        *ep = http_new_error_ok();
+        pthread_mutex_lock(&loop->timers_mutex);
+        http_event_loop_set_timer(loop, client, kind, http_timer_now_ms());
+        pthread_mutex_unlock(&loop->timers_mutex);
+        // only the reactor submits to the ring, so it's told to. it takes
+        // every client handed back until it gets to it, so only the first
+        // one has to wake it.
+        http_client* head = atomic_load(&loop->rearmed);
+        do {
+            client->rearm_next = head;
+        } while (!atomic_compare_exchange_weak(&loop->rearmed, &head, client));
+        if (!head) {
+            http_event_loop_wake(loop);
+        }
+        return;
+    }
+    // the timer has to be in place before the reactor can see the client again
+    pthread_mutex_lock(&loop->timers_mutex);
+    bool was_empty = loop->timers.count == 0;
+    http_event_loop_set_timer(loop, client, kind, http_timer_now_ms());
+    http_event_loop_arm(loop, client, EPOLL_CTL_MOD, ep);
+    if (http_is_error(*ep)) {
+        http_timer_wheel_cancel(&loop->timers, &client->timer);
+    }
+    bool wake = was_empty && http_timer_pending(&client->timer);
+    pthread_mutex_unlock(&loop->timers_mutex);
+    if (wake) {
+        // the reactor may be sleeping without a timeout
+        http_event_loop_wake(loop);
+    }
+}
+
+void http_event_loop_rearm(http_event_loop* loop, http_client* client, http_error_t* ep) {
+    http_client_timer kind = client->read_buffer_len > 0 ? HTTP_CLIENT_TIMER_HEADER : HTTP_CLIENT_TIMER_IDLE;
+    http_event_loop_hand_back(loop, client, kind, ep);
+}
+
+void http_event_loop_wait_writable(http_event_loop* loop, http_client* client, http_error_t* ep) {
+    http_event_loop_hand_back(loop, client, HTTP_CLIENT_TIMER_WRITE, ep);
+}
+
+void http_event_loop_close_client(http_event_loop* loop, http_client* client) {
+    pthread_mutex_lock(&loop->timers_mutex);
+    http_timer_wheel_cancel(&loop->timers, &client->timer);
+    pthread_mutex_unlock(&loop->timers_mutex);
+    // closing the fd also removes it from the epoll set
+    shutdown(client->socket, SHUT_RDWR);
+    close(client->socket);
+    http_client_drop_pending(client);
+    http_slab_free(&loop->server->clients, client);
+}
+
+static void http_event_loop_accept(http_event_loop* loop) {
+    http_error_t err = http_new_error_ok();
+    int batch = loop->server->accept_batch;
+    for (int i = 0; batch <= 0 || i < batch; ++i) {
+        http_client* client = http_server_accept_client(loop->server, &err);
+        if (http_is_error(err)) {
+            http_print_error(err);
+            break;
+        }
+        if (!client) {
+            break;
+        }
+        client->loop = loop;
+        http_parser_reset(&client->parser);
+        pthread_mutex_lock(&loop->timers_mutex);
+        http_event_loop_set_timer(loop, client, HTTP_CLIENT_TIMER_HEADER, http_timer_now_ms());
+        http_event_loop_arm(loop, client, EPOLL_CTL_ADD, &err);
+        pthread_mutex_unlock(&loop->timers_mutex);
+        if (http_is_error(err)) {
+            http_print_error(err);
+            err = http_new_error_ok();
+            http_event_loop_close_client(loop, client);
+        }
+    }
+}
+
+// after bytes were added to the client's read buffer, or it was closed.
+// hands the client on once it has a complete header, or waits for more.
+static void http_event_loop_received(http_event_loop* loop, http_client* client, bool closed) {
+    uint64_t now = http_metrics_now_ns();
+    if (client->request_started_ns == 0 && client->read_buffer_len > 0) {
+        client->request_started_ns = now;
+    }
+    http_client_parse_received(client);
+    if (http_client_has_complete_header(client)) {
+        // the client now belongs to whoever handles the request. if the peer
+        // closed, the next read after rearming will tell us again.
+        pthread_mutex_lock(&loop->timers_mutex);
+        http_timer_wheel_cancel(&loop->timers, &client->timer);
+        pthread_mutex_unlock(&loop->timers_mutex);
+        client->timer_kind = HTTP_CLIENT_TIMER_NONE;
+        client->dispatched_ns = now;
+        loop->on_request(loop->server, client);
+        return;
+    }
+    if (closed) {
+        http_event_loop_close_client(loop, client);
+        return;
+    }
+    http_error_t err = http_new_error_ok();
+    pthread_mutex_lock(&loop->timers_mutex);
+    if (client->read_buffer_len > 0 && client->timer_kind != HTTP_CLIENT_TIMER_HEADER) {
+        // the idle connection started sending a request. otherwise the header
+        // deadline stays, so that trickling bytes doesn't extend it.
+        http_event_loop_set_timer(loop, client, HTTP_CLIENT_TIMER_HEADER, http_timer_now_ms());
+    }
+    http_event_loop_wait_for(loop, client, EPOLL_CTL_MOD, &err);
+    pthread_mutex_unlock(&loop->timers_mutex);
+    if (http_is_error(err)) {
+        http_print_error(err);
+        http_event_loop_close_client(loop, client);
+    }
+}
+
+// hands the client back to a worker, to send more of its pending output.
+// if the peer went away, that's when sending fails.
+static void http_event_loop_writable(http_event_loop* loop, http_client* client) {
+    pthread_mutex_lock(&loop->timers_mutex);
+    http_timer_wheel_cancel(&loop->timers, &client->timer);
+    pthread_mutex_unlock(&loop->timers_mutex);
+    client->timer_kind = HTTP_CLIENT_TIMER_NONE;
+    client->dispatched_ns = http_metrics_now_ns();
+    loop->on_request(loop->server, client);
+}
+
+static void http_event_loop_read_client(http_event_loop* loop, http_client* client) {
+    bool closed = false;
+    // edge-triggered, so read until EAGAIN or until the buffer is full
+    while (client->read_buffer_len < sizeof(client->read_buffer)) {
+        ssize_t n = read(client->socket, client->read_buffer + client->read_buffer_len,
+            sizeof(client->read_buffer) - client->read_buffer_len);
+        if (n > 0) {
+            client->read_buffer_len += (size_t)n;
+        } else if (n == 0) {
+            closed = true;
+            break;
+        } else if (errno == EINTR) {
+            continue;
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            break;
+        } else {
+            perror("read");
+            closed = true;
+            break;
+        }
+    }
+    http_event_loop_received(loop, client, closed);
+}
+
+// how long the reactor may sleep, -1 for as long as it takes
+static int http_event_loop_timeout_ms(http_event_loop* loop) {
+    pthread_mutex_lock(&loop->timers_mutex);
+    int timeout = http_timer_wheel_timeout_ms(&loop->timers);
+    pthread_mutex_unlock(&loop->timers_mutex);
+    http_fd_cache* fd_cache = loop->server->fd_cache;
+    if (fd_cache && atomic_load_explicit(&fd_cache->count, memory_order_relaxed) > 0
+        && (timeout < 0 || timeout > HTTP_FD_CACHE_IDLE_MS / 4)) {
+        // idle fds are closed even when no client is left
+        timeout = HTTP_FD_CACHE_IDLE_MS / 4;
+    }
+    return timeout;
+}
+
+// closes every client whose timer expired, and idle cached fds. also keeps
+// the Date header current, so that workers rarely have to render it.
+static void http_event_loop_expire(http_event_loop* loop) {
+    http_date_update();
+    if (loop->server->fd_cache) {
+        http_fd_cache_expire(loop->server->fd_cache);
+    }
+    pthread_mutex_lock(&loop->timers_mutex);
+    http_timer* expired = http_timer_wheel_advance(&loop->timers, http_timer_now_ms());
+    pthread_mutex_unlock(&loop->timers_mutex);
+    // these are all idle, so nobody else can touch them anymore
+    while (expired) {
+        http_client* client = (http_client*)((char*)expired - offsetof(http_client, timer));
+        expired = expired->next;
+        log_debug("closing fd %d, %s timed out", client->socket,
+            client->timer_kind == HTTP_CLIENT_TIMER_IDLE ? "keep-alive"
+                : client->timer_kind == HTTP_CLIENT_TIMER_WRITE ? "write"
+                : "request header");
+        if (loop->backend == HTTP_EVENT_LOOP_IO_URING) {
+            // its recv or poll is still in flight, and holds on to the socket.
+            // this completes it, and the client is closed: a recv gets 0, and
+            // sending the pending output fails.
+            shutdown(client->socket, SHUT_RDWR);
+            continue;
+        }
+        http_event_loop_close_client(loop, client);
+    }
+}
+
+#ifdef HTTP_HAVE_IO_URING
+static void http_event_loop_submit_accept(http_event_loop* loop, http_error_t* ep) {
+    struct io_uring_sqe* sqe = http_io_uring_get_sqe(&loop->ring, ep);
+    if (http_is_error(*ep)) {
+        return;
+    }
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = loop->server->socket;
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    if (loop->multishot_accept) {
+        // one completion per connection, until it fails
+        sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    }
+    sqe->user_data = HTTP_EVENT_LOOP_URING_ACCEPT;
+}
+
+static void http_event_loop_submit_wake(http_event_loop* loop, http_error_t* ep) {
+    struct io_uring_sqe* sqe = http_io_uring_get_sqe(&loop->ring, ep);
+    if (http_is_error(*ep)) {
+        return;
+    }
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = loop->wake_fd;
+    sqe->addr = (uint64_t)(uintptr_t)&loop->wake_value;
+    sqe->len = sizeof(loop->wake_value);
+    sqe->user_data = HTTP_EVENT_LOOP_URING_WAKE;
+}
+
+static void http_event_loop_accepted(http_event_loop* loop, const struct io_uring_cqe* cqe, http_error_t* ep) {
+    *ep = http_new_error_ok();
+    if (cqe->res >= 0) {
+        http_error_t err = http_new_error_ok();
+        http_client* client = http_server_add_client(loop->server, cqe->res, &err);
+        if (client) {
+            client->loop = loop;
+            http_parser_reset(&client->parser);
+            pthread_mutex_lock(&loop->timers_mutex);
+            http_event_loop_set_timer(loop, client, HTTP_CLIENT_TIMER_HEADER, http_timer_now_ms());
+            http_event_loop_submit_recv(loop, client, &err);
+            pthread_mutex_unlock(&loop->timers_mutex);
+            if (http_is_error(err)) {
+                http_event_loop_close_client(loop, client);
+            }
+        }
+        if (http_is_error(err)) {
+            http_print_error(err);
+        }
+    } else if (cqe->res == -EINVAL && loop->multishot_accept) {
+        // before linux 5.19, accept one at a time
+        loop->multishot_accept = false;
+    } else if (cqe->res != -EINTR && cqe->res != -EAGAIN && cqe->res != -ECONNABORTED) {
+        errno = -cqe->res;
+        perror("accept");
+    }
+    if (!(cqe->flags & IORING_CQE_F_MORE)) {
+        http_event_loop_submit_accept(loop, ep);
+    }
+}
+
+static void http_event_loop_recv_done(http_event_loop* loop, http_client* client, int res) {
+    bool closed = false;
+    if (res > 0) {
+        client->read_buffer_len += (size_t)res;
+    } else if (res == 0) {
+        closed = true;
+    } else if (res != -EINTR && res != -EAGAIN) {
+        errno = -res;
+        perror("recv");
+        closed = true;
+    }
+    http_event_loop_received(loop, client, closed);
+}
+
+static void http_event_loop_run_uring(http_event_loop* loop, http_error_t* ep) {
+    http_io_uring_enable(&loop->ring, ep);
+    if (http_is_error(*ep)) {
+        return;
+    }
+    http_event_loop_submit_accept(loop, ep);
+    if (http_is_ok(*ep)) {
+        http_event_loop_submit_wake(loop, ep);
+    }
+    while (http_is_ok(*ep) && !atomic_load(&loop->shutdown)) {
+        http_client* rearmed = atomic_exchange(&loop->rearmed, NULL);
+        while (rearmed) {
+            http_client* client = rearmed;
+            rearmed = client->rearm_next;
+            http_error_t err = http_new_error_ok();
+            http_event_loop_submit_wait(loop, client, &err);
+            if (http_is_error(err)) {
+                http_print_error(err);
+                http_event_loop_close_client(loop, client);
+            }
+        }
+        int timeout = http_event_loop_timeout_ms(loop);
+        http_io_uring_submit_and_wait(&loop->ring, timeout, ep);
+        struct io_uring_cqe cqe;
+        while (http_is_ok(*ep) && http_io_uring_pop_cqe(&loop->ring, &cqe)) {
+            switch (cqe.user_data) {
+            case HTTP_EVENT_LOOP_URING_WAKE:
+                http_event_loop_submit_wake(loop, ep);
+                break;
+            case HTTP_EVENT_LOOP_URING_ACCEPT:
+                http_event_loop_accepted(loop, &cqe, ep);
+                break;
+            default: {
+                http_client* client = (http_client*)(uintptr_t)cqe.user_data;
+                if (client->timer_kind == HTTP_CLIENT_TIMER_WRITE) {
+                    http_event_loop_writable(loop, client);
+                } else {
+                    http_event_loop_recv_done(loop, client, cqe.res);
+                }
+                break;
+            }
+            }
+        }
+        // after the batch, so none of its completions point to a closed client
+        http_event_loop_expire(loop);
+    }
+}
+#endif
+
+void http_event_loop_run(http_event_loop* loop, http_error_t* ep) {
+    *ep = http_new_error_ok();
+#ifdef HTTP_HAVE_IO_URING
+    if (loop->backend == HTTP_EVENT_LOOP_IO_URING) {
+        http_event_loop_run_uring(loop, ep);
+        return;
+    }
+#endif
+    struct epoll_event events[HTTP_EVENT_LOOP_MAX_EVENTS];
+    while (!atomic_load(&loop->shutdown)) {
+        int timeout = http_event_loop_timeout_ms(loop);
+        int n = epoll_wait(loop->epoll_fd, events, HTTP_EVENT_LOOP_MAX_EVENTS, timeout);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("epoll_wait");
+            *ep = http_new_error_error("epoll_wait() failed");
+            return;
+        }
+        for (int i = 0; i < n; ++i) {
+            void* ptr = events[i].data.ptr;
+            if (ptr == loop) {
+                uint64_t value;
+                ssize_t ret = read(loop->wake_fd, &value, sizeof(value));
+                (void)ret;
+            } else if (ptr == loop->server) {
+                http_event_loop_accept(loop);
+            } else if (((http_client*)ptr)->timer_kind == HTTP_CLIENT_TIMER_WRITE) {
+                // errors and hangups show up as failing writes
+                http_event_loop_writable(loop, (http_client*)ptr);
+            } else {
+                // errors and hangups show up as failing reads
+                http_event_loop_read_client(loop, (http_client*)ptr);
+            }
+        }
+        // after the batch, so none of its events point to a closed client
+        http_event_loop_expire(loop);
+    }
+}
@@ -0,0 +1,318 @@
+#include "http_fd_cache.h"
+
+#include "http_file_cache.h"
+#include "logging.h"
+#include "memory.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+
+// FNV-1a
+static uint64_t hash_path(const char* path) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (; *path; ++path) {
+        hash ^= (unsigned char)*path;
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+static long long now_ms(void) {
+    struct timespec ts;
+    // vDSO, no syscall
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static http_fd_cache_shard* shard_of(http_fd_cache* cache, uint64_t hash) {
+    return &cache->shards[hash & (HTTP_FD_CACHE_SHARDS - 1)];
+}
+
+static http_fd_cache_entry** bucket_of(http_fd_cache_shard* shard, uint64_t hash) {
+    // the low bits already picked the shard
+    return &shard->buckets[(hash >> 32) & (HTTP_FD_CACHE_BUCKETS - 1)];
+}
+
+http_fd_cache* http_fd_cache_new(size_t capacity, http_error_t* ep) {
+    *ep = http_new_error_ok();
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur != RLIM_INFINITY
+        && capacity > limit.rlim_cur / HTTP_FD_CACHE_NOFILE_DIVISOR) {
+        log_info("keeping at most %llu files open, a share of RLIMIT_NOFILE (%llu)",
+            (unsigned long long)(limit.rlim_cur / HTTP_FD_CACHE_NOFILE_DIVISOR), (unsigned long long)limit.rlim_cur);
+        capacity = limit.rlim_cur / HTTP_FD_CACHE_NOFILE_DIVISOR;
+    }
+    http_fd_cache* cache = safe_malloc(sizeof(http_fd_cache), ep);
+    if (http_is_error(*ep)) {
+        return NULL;
+    }
+    memset(cache, 0, sizeof(http_fd_cache));
+    cache->capacity = capacity;
+    for (size_t i = 0; i < HTTP_FD_CACHE_SHARDS; ++i) {
+        if (pthread_mutex_init(&cache->shards[i].mutex, NULL) != 0) {
+            *ep = http_new_error_error("failed to init mutex");
+            free(cache);
+            return NULL;
+        }
+    }
+    return cache;
+}
+
+static void lru_unlink(http_fd_cache_shard* shard, http_fd_cache_entry* entry) {
+    if (entry->lru_prev) {
+        entry->lru_prev->lru_next = entry->lru_next;
+    } else {
+        shard->lru_head = entry->lru_next;
+    }
+    if (entry->lru_next) {
+        entry->lru_next->lru_prev = entry->lru_prev;
+    } else {
+        shard->lru_tail = entry->lru_prev;
+    }
+    entry->lru_prev = NULL;
+    entry->lru_next = NULL;
+}
+
+static void lru_push_front(http_fd_cache_shard* shard, http_fd_cache_entry* entry) {
+    entry->lru_prev = NULL;
+    entry->lru_next = shard->lru_head;
+    if (shard->lru_head) {
+        shard->lru_head->lru_prev = entry;
+    } else {
+        shard->lru_tail = entry;
+    }
+    shard->lru_head = entry;
+}
+
+// unlinks from hash chain and lru list, caller releases the cache's reference
+static void shard_unlink(http_fd_cache* cache, http_fd_cache_shard* shard, http_fd_cache_entry* entry) {
+    http_fd_cache_entry** link = bucket_of(shard, entry->hash);
+    while (*link && *link != entry) {
+        link = &(*link)->hash_next;
+    }
+    assert(*link == entry);
+    *link = entry->hash_next;
+    entry->hash_next = NULL;
+    lru_unlink(shard, entry);
+    --shard->count;
+    atomic_fetch_sub(&cache->count, 1);
+    entry->in_cache = false;
+}
+
+static http_fd_cache_entry* shard_find(http_fd_cache_shard* shard, uint64_t hash, const char* path) {
+    for (http_fd_cache_entry* entry = *bucket_of(shard, hash); entry; entry = entry->hash_next) {
+        if (entry->hash == hash && strcmp(entry->path, path) == 0) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+// releases entries chained through hash_next, outside of any lock, since
+// that may close their fds
+static void release_all(http_fd_cache_entry* entry) {
+    while (entry) {
+        http_fd_cache_entry* next = entry->hash_next;
+        http_fd_cache_entry_release(entry);
+        entry = next;
+    }
+}
+
+void http_fd_cache_free(http_fd_cache* cache) {
+    if (!cache) {
+        return;
+    }
+    for (size_t i = 0; i < HTTP_FD_CACHE_SHARDS; ++i) {
+        http_fd_cache_shard* shard = &cache->shards[i];
+        while (shard->lru_head) {
+            http_fd_cache_entry* entry = shard->lru_head;
+            shard_unlink(cache, shard, entry);
+            http_fd_cache_entry_release(entry);
+        }
+        pthread_mutex_destroy(&shard->mutex);
+    }
+    free(cache);
+}
+
+static bool entry_matches(const http_fd_cache_entry* entry, const struct stat* st) {
+    return entry->st.st_dev == st->st_dev
+        && entry->st.st_ino == st->st_ino
+        && entry->st.st_size == st->st_size
+        && entry->st.st_mtim.tv_sec == st->st_mtim.tv_sec
+        && entry->st.st_mtim.tv_nsec == st->st_mtim.tv_nsec;
+}
+
+static void http_fd_cache_remove(http_fd_cache* cache, const char* path) {
+    uint64_t hash = hash_path(path);
+    http_fd_cache_shard* shard = shard_of(cache, hash);
+    pthread_mutex_lock(&shard->mutex);
+    http_fd_cache_entry* entry = shard_find(shard, hash, path);
+    if (entry) {
+        shard_unlink(cache, shard, entry);
+    }
+    pthread_mutex_unlock(&shard->mutex);
+    http_fd_cache_entry_release(entry);
+}
+
+http_fd_cache_entry* http_fd_cache_get(http_fd_cache* cache, const char* path) {
+    uint64_t hash = hash_path(path);
+    http_fd_cache_shard* shard = shard_of(cache, hash);
+    long long now = now_ms();
+    pthread_mutex_lock(&shard->mutex);
+    http_fd_cache_entry* entry = shard_find(shard, hash, path);
+    if (entry) {
+        atomic_fetch_add(&entry->refcount, 1);
+        entry->used_at_ms = now;
+        lru_unlink(shard, entry);
+        lru_push_front(shard, entry);
+    }
+    pthread_mutex_unlock(&shard->mutex);
+    if (!entry) {
+        atomic_fetch_add_explicit(&cache->misses, 1, memory_order_relaxed);
+        return NULL;
+    }
+    if (!(entry->watched && atomic_load(&cache->watched))
+        && now - atomic_load(&entry->validated_at_ms) >= HTTP_FILE_CACHE_REVALIDATE_MS) {
+        // the fd still refers to the file which was opened, which may have
+        // been replaced or changed since
+        struct stat st;
+        if (stat(path, &st) < 0 || !entry_matches(entry, &st)) {
+            http_fd_cache_entry_release(entry);
+            http_fd_cache_remove(cache, path);
+            atomic_fetch_add_explicit(&cache->misses, 1, memory_order_relaxed);
+            return NULL;
+        }
+        atomic_store(&entry->validated_at_ms, now);
+    }
+    atomic_fetch_add_explicit(&cache->hits, 1, memory_order_relaxed);
+    return entry;
+}
+
+http_fd_cache_entry* http_fd_cache_insert(http_fd_cache* cache, const char* path, int fd, const struct stat* st,
+    bool watched, size_t generation, http_error_t* ep) {
+    *ep = http_new_error_ok();
+    size_t path_size = strlen(path) + 1;
+    http_fd_cache_entry* entry = safe_malloc(sizeof(http_fd_cache_entry) + path_size, ep);
+    if (http_is_error(*ep)) {
+        close(fd);
+        return NULL;
+    }
+    memset(entry, 0, sizeof(http_fd_cache_entry));
+    atomic_init(&entry->refcount, 1);
+    entry->hash = hash_path(path);
+    entry->fd = fd;
+    entry->st = *st;
+    long long now = now_ms();
+    atomic_init(&entry->validated_at_ms, now);
+    entry->used_at_ms = now;
+    entry->watched = watched;
+    entry->generation = generation;
+    memcpy(entry->path, path, path_size);
+    if (cache->capacity == 0) {
+        return entry;
+    }
+    size_t shard_capacity = cache->capacity / HTTP_FD_CACHE_SHARDS;
+    if (shard_capacity == 0) {
+        shard_capacity = 1;
+    }
+    http_fd_cache_shard* shard = shard_of(cache, entry->hash);
+    http_fd_cache_entry* evicted = NULL;
+    pthread_mutex_lock(&shard->mutex);
+    // a change which happened while the file was being opened may have been
+    // reported already
+    if (atomic_load(&cache->generation) == generation) {
+        http_fd_cache_entry* old = shard_find(shard, entry->hash, path);
+        if (old) {
+            shard_unlink(cache, shard, old);
+            old->hash_next = evicted;
+            evicted = old;
+        }
+        while (shard->lru_tail && shard->count >= shard_capacity) {
+            http_fd_cache_entry* victim = shard->lru_tail;
+            shard_unlink(cache, shard, victim);
+            victim->hash_next = evicted;
+            evicted = victim;
+            atomic_fetch_add_explicit(&cache->evictions, 1, memory_order_relaxed);
+        }
+        atomic_fetch_add(&entry->refcount, 1);
+        http_fd_cache_entry** bucket = bucket_of(shard, entry->hash);
+        entry->hash_next = *bucket;
+        *bucket = entry;
+        lru_push_front(shard, entry);
+        ++shard->count;
+        atomic_fetch_add(&cache->count, 1);
+        entry->in_cache = true;
+    }
+    pthread_mutex_unlock(&shard->mutex);
+    release_all(evicted);
+    return entry;
+}
+
+static bool is_under(const char* path, const char* dir, size_t dir_len) {
+    return strncmp(path, dir, dir_len) == 0 && (path[dir_len] == '\0' || path[dir_len] == '/');
+}
+
+void http_fd_cache_invalidate(http_fd_cache* cache, const char* path, bool recursive) {
+    atomic_fetch_add(&cache->generation, 1);
+    if (path && !recursive) {
+        http_fd_cache_remove(cache, path);
+        return;
+    }
+    size_t path_len = path ? strlen(path) : 0;
+    for (size_t i = 0; i < HTTP_FD_CACHE_SHARDS; ++i) {
+        http_fd_cache_shard* shard = &cache->shards[i];
+        http_fd_cache_entry* dropped = NULL;
+        pthread_mutex_lock(&shard->mutex);
+        http_fd_cache_entry* entry = shard->lru_head;
+        while (entry) {
+            http_fd_cache_entry* next = entry->lru_next;
+            if (!path || is_under(entry->path, path, path_len)) {
+                shard_unlink(cache, shard, entry);
+                entry->hash_next = dropped;
+                dropped = entry;
+            }
+            entry = next;
+        }
+        pthread_mutex_unlock(&shard->mutex);
+        release_all(dropped);
+    }
+}
+
+void http_fd_cache_expire(http_fd_cache* cache) {
+    if (atomic_load_explicit(&cache->count, memory_order_relaxed) == 0) {
+        return;
+    }
+    long long now = now_ms();
+    long long next = atomic_load(&cache->next_expire_ms);
+    // one caller at a time does the work
+    if (now < next || !atomic_compare_exchange_strong(&cache->next_expire_ms, &next, now + HTTP_FD_CACHE_IDLE_MS / 4)) {
+        return;
+    }
+    for (size_t i = 0; i < HTTP_FD_CACHE_SHARDS; ++i) {
+        http_fd_cache_shard* shard = &cache->shards[i];
+        http_fd_cache_entry* expired = NULL;
+        pthread_mutex_lock(&shard->mutex);
+        // least recently used last, so the idle ones are at the end
+        while (shard->lru_tail && now - shard->lru_tail->used_at_ms >= HTTP_FD_CACHE_IDLE_MS) {
+            http_fd_cache_entry* entry = shard->lru_tail;
+            shard_unlink(cache, shard, entry);
+            entry->hash_next = expired;
+            expired = entry;
+            atomic_fetch_add_explicit(&cache->expirations, 1, memory_order_relaxed);
+        }
+        pthread_mutex_unlock(&shard->mutex);
+        release_all(expired);
+    }
+}
+
+void http_fd_cache_entry_release(http_fd_cache_entry* entry) {
+    if (entry && atomic_fetch_sub(&entry->refcount, 1) == 1) {
+        close(entry->fd);
+        free(entry);
+    }
+}
@@ -0,0 +1,312 @@
+#include "http_file_cache.h"
+
+#include "logging.h"
+#include "memory.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// FNV-1a
+static uint64_t hash_path(const char* path) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (; *path; ++path) {
+        hash ^= (unsigned char)*path;
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+static long long now_ms(void) {
+    struct timespec ts;
+    // vDSO, no syscall
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static http_file_cache_shard* shard_of(http_file_cache* cache, uint64_t hash) {
+    return &cache->shards[hash & (HTTP_FILE_CACHE_SHARDS - 1)];
+}
+
+static http_file_cache_entry** bucket_of(http_file_cache_shard* shard, uint64_t hash) {
+    // the low bits already picked the shard
+    return &shard->buckets[(hash >> 32) & (HTTP_FILE_CACHE_BUCKETS - 1)];
+}
+
+http_file_cache* http_file_cache_new(size_t capacity, size_t max_entry_size, http_error_t* ep) {
+    *ep = http_new_error_ok();
+    http_file_cache* cache = safe_malloc(sizeof(http_file_cache), ep);
+    if (http_is_error(*ep)) {
+        return NULL;
+    }
+    memset(cache, 0, sizeof(http_file_cache));
+    cache->capacity = capacity;
+    cache->max_entry_size = max_entry_size;
+    for (size_t i = 0; i < HTTP_FILE_CACHE_SHARDS; ++i) {
+        if (pthread_mutex_init(&cache->shards[i].mutex, NULL) != 0) {
+            *ep = http_new_error_error("failed to init mutex");
+            free(cache);
+            return NULL;
+        }
+    }
+    return cache;
+}
+
+static void lru_unlink(http_file_cache_shard* shard, http_file_cache_entry* entry) {
+    if (entry->lru_prev) {
+        entry->lru_prev->lru_next = entry->lru_next;
+    } else {
+        shard->lru_head = entry->lru_next;
+    }
+    if (entry->lru_next) {
+        entry->lru_next->lru_prev = entry->lru_prev;
+    } else {
+        shard->lru_tail = entry->lru_prev;
+    }
+    entry->lru_prev = NULL;
+    entry->lru_next = NULL;
+}
+
+static void lru_push_front(http_file_cache_shard* shard, http_file_cache_entry* entry) {
+    entry->lru_prev = NULL;
+    entry->lru_next = shard->lru_head;
+    if (shard->lru_head) {
+        shard->lru_head->lru_prev = entry;
+    } else {
+        shard->lru_tail = entry;
+    }
+    shard->lru_head = entry;
+}
+
+// unlinks from hash chain and lru list, caller releases the cache's reference
+static void shard_unlink(http_file_cache_shard* shard, http_file_cache_entry* entry) {
+    http_file_cache_entry** link = bucket_of(shard, entry->hash);
+    while (*link && *link != entry) {
+        link = &(*link)->hash_next;
+    }
+    assert(*link == entry);
+    *link = entry->hash_next;
+    entry->hash_next = NULL;
+    lru_unlink(shard, entry);
+    shard->size -= entry->alloc_size;
+    entry->in_cache = false;
+}
+
+static http_file_cache_entry* shard_find(http_file_cache_shard* shard, uint64_t hash, const char* path) {
+    for (http_file_cache_entry* entry = *bucket_of(shard, hash); entry; entry = entry->hash_next) {
+        if (entry->hash == hash && strcmp(entry->path, path) == 0) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+void http_file_cache_free(http_file_cache* cache) {
+    if (!cache) {
+        return;
+    }
+    for (size_t i = 0; i < HTTP_FILE_CACHE_SHARDS; ++i) {
+        http_file_cache_shard* shard = &cache->shards[i];
+        while (shard->lru_head) {
+            http_file_cache_entry* entry = shard->lru_head;
+            shard_unlink(shard, entry);
+            http_file_cache_entry_release(entry);
+        }
+        pthread_mutex_destroy(&shard->mutex);
+    }
+    free(cache);
+}
+
+static bool entry_matches(const http_file_cache_entry* entry, const struct stat* st) {
+    return entry->dev == st->st_dev
+        && entry->ino == st->st_ino
+        && entry->size == st->st_size
+        && entry->mtime.tv_sec == st->st_mtim.tv_sec
+        && entry->mtime.tv_nsec == st->st_mtim.tv_nsec;
+}
+
+http_file_cache_entry* http_file_cache_get(http_file_cache* cache, const char* path) {
+    uint64_t hash = hash_path(path);
+    http_file_cache_shard* shard = shard_of(cache, hash);
+    pthread_mutex_lock(&shard->mutex);
+    http_file_cache_entry* entry = shard_find(shard, hash, path);
+    if (entry) {
+        atomic_fetch_add(&entry->refcount, 1);
+        lru_unlink(shard, entry);
+        lru_push_front(shard, entry);
+    }
+    pthread_mutex_unlock(&shard->mutex);
+    if (!entry) {
+        atomic_fetch_add_explicit(&cache->misses, 1, memory_order_relaxed);
+        return NULL;
+    }
+    if (entry->watched && atomic_load(&cache->watched)) {
+        // any change would have invalidated it
+        atomic_fetch_add_explicit(&cache->hits, 1, memory_order_relaxed);
+        return entry;
+    }
+    // recently validated entries are trusted without touching the file system
+    long long now = now_ms();
+    if (now - atomic_load(&entry->validated_at_ms) >= HTTP_FILE_CACHE_REVALIDATE_MS) {
+        struct stat st;
+        if (stat(path, &st) < 0 || !entry_matches(entry, &st)) {
+            http_file_cache_entry_release(entry);
+            http_file_cache_remove(cache, path);
+            atomic_fetch_add_explicit(&cache->misses, 1, memory_order_relaxed);
+            return NULL;
+        }
+        atomic_store(&entry->validated_at_ms, now);
+    }
+    atomic_fetch_add_explicit(&cache->hits, 1, memory_order_relaxed);
+    return entry;
+}
+
+void http_file_validators_init(http_file_validators* validators, const struct stat* st) {
+    unsigned long long mtime_ns = (unsigned long long)st->st_mtim.tv_sec * 1000000000ull + (unsigned long long)st->st_mtim.tv_nsec;
+    int n = snprintf(validators->etag, sizeof(validators->etag), "\"%llx-%llx-%llx\"",
+        (unsigned long long)st->st_ino, (unsigned long long)st->st_size, mtime_ns);
+    validators->etag_len = n > 0 ? (size_t)n : 0;
+    validators->mtime = st->st_mtim.tv_sec;
+    http_date_format(validators->mtime, validators->last_modified);
+}
+
+http_file_cache_entry* http_file_cache_entry_new(const char* path, const struct stat* st,
+    const char* const headers[HTTP_FILE_CACHE_HEADER_COUNT],
+    const size_t header_sizes[HTTP_FILE_CACHE_HEADER_COUNT], size_t body_size, http_error_t* ep) {
+    *ep = http_new_error_ok();
+    // one allocation: entry, path, headers, body
+    size_t path_size = strlen(path) + 1;
+    size_t alloc_size = sizeof(http_file_cache_entry) + path_size + body_size;
+    for (size_t i = 0; i < HTTP_FILE_CACHE_HEADER_COUNT; ++i) {
+        alloc_size += header_sizes[i];
+    }
+    http_file_cache_entry* entry = safe_malloc(alloc_size, ep);
+    if (http_is_error(*ep)) {
+        return NULL;
+    }
+    memset(entry, 0, sizeof(http_file_cache_entry));
+    atomic_init(&entry->refcount, 1);
+    char* ptr = (char*)(entry + 1);
+    entry->path = ptr;
+    memcpy(entry->path, path, path_size);
+    ptr += path_size;
+    for (size_t i = 0; i < HTTP_FILE_CACHE_HEADER_COUNT; ++i) {
+        entry->headers[i] = ptr;
+        entry->header_sizes[i] = header_sizes[i];
+        memcpy(ptr, headers[i], header_sizes[i]);
+        ptr += header_sizes[i];
+    }
+    entry->body = ptr;
+    entry->body_size = body_size;
+    entry->hash = hash_path(path);
+    entry->dev = st->st_dev;
+    entry->ino = st->st_ino;
+    entry->size = st->st_size;
+    entry->mtime = st->st_mtim;
+    http_file_validators_init(&entry->validators, st);
+    atomic_init(&entry->validated_at_ms, now_ms());
+    entry->alloc_size = alloc_size;
+    return entry;
+}
+
+void http_file_cache_insert(http_file_cache* cache, http_file_cache_entry* entry) {
+    assert(!entry->in_cache);
+    if (entry->alloc_size > cache->capacity / HTTP_FILE_CACHE_SHARDS) {
+        // would evict the whole shard, or not fit at all
+        return;
+    }
+    http_file_cache_shard* shard = shard_of(cache, entry->hash);
+    // evicted entries are released outside the lock
+    http_file_cache_entry* evicted = NULL;
+    pthread_mutex_lock(&shard->mutex);
+    http_file_cache_entry* old = shard_find(shard, entry->hash, entry->path);
+    if (old) {
+        shard_unlink(shard, old);
+        old->hash_next = evicted;
+        evicted = old;
+    }
+    while (shard->lru_tail && shard->size + entry->alloc_size > cache->capacity / HTTP_FILE_CACHE_SHARDS) {
+        http_file_cache_entry* victim = shard->lru_tail;
+        shard_unlink(shard, victim);
+        victim->hash_next = evicted;
+        evicted = victim;
+        atomic_fetch_add_explicit(&cache->evictions, 1, memory_order_relaxed);
+    }
+    atomic_fetch_add(&entry->refcount, 1);
+    http_file_cache_entry** bucket = bucket_of(shard, entry->hash);
+    entry->hash_next = *bucket;
+    *bucket = entry;
+    lru_push_front(shard, entry);
+    shard->size += entry->alloc_size;
+    entry->in_cache = true;
+    // the invalidation for a change which happened while the file was being
+    // read may have come before the insert. it bumped the generation first.
+    if (entry->watched && atomic_load(&cache->generation) != entry->generation) {
+        shard_unlink(shard, entry);
+        entry->hash_next = evicted;
+        evicted = entry;
+    }
+    pthread_mutex_unlock(&shard->mutex);
+    while (evicted) {
+        http_file_cache_entry* next = evicted->hash_next;
+        http_file_cache_entry_release(evicted);
+        evicted = next;
+    }
+}
+
+void http_file_cache_remove(http_file_cache* cache, const char* path) {
+    uint64_t hash = hash_path(path);
+    http_file_cache_shard* shard = shard_of(cache, hash);
+    pthread_mutex_lock(&shard->mutex);
+    http_file_cache_entry* entry = shard_find(shard, hash, path);
+    if (entry) {
+        shard_unlink(shard, entry);
+    }
+    pthread_mutex_unlock(&shard->mutex);
+    if (entry) {
+        http_file_cache_entry_release(entry);
+    }
+}
+
+void http_file_cache_entry_release(http_file_cache_entry* entry) {
+    if (entry && atomic_fetch_sub(&entry->refcount, 1) == 1) {
+        free(entry);
+    }
+}
+
+static bool is_under(const char* path, const char* dir, size_t dir_len) {
+    return strncmp(path, dir, dir_len) == 0 && (path[dir_len] == '\0' || path[dir_len] == '/');
+}
+
+void http_file_cache_invalidate(http_file_cache* cache, const char* path, bool recursive) {
+    atomic_fetch_add(&cache->generation, 1);
+    atomic_fetch_add_explicit(&cache->invalidations, 1, memory_order_relaxed);
+    if (path && !recursive) {
+        http_file_cache_remove(cache, path);
+        return;
+    }
+    size_t path_len = path ? strlen(path) : 0;
+    for (size_t i = 0; i < HTTP_FILE_CACHE_SHARDS; ++i) {
+        http_file_cache_shard* shard = &cache->shards[i];
+        http_file_cache_entry* dropped = NULL;
+        pthread_mutex_lock(&shard->mutex);
+        http_file_cache_entry* entry = shard->lru_head;
+        while (entry) {
+            http_file_cache_entry* next = entry->lru_next;
+            if (!path || is_under(entry->path, path, path_len)) {
+                shard_unlink(shard, entry);
+                entry->hash_next = dropped;
+                dropped = entry;
+            }
+            entry = next;
+        }
+        pthread_mutex_unlock(&shard->mutex);
+        while (dropped) {
+            http_file_cache_entry* next = dropped->hash_next;
+            http_file_cache_entry_release(dropped);
+            dropped = next;
+        }
+    }
+}
@@ -0,0 +1,281 @@
+#include "http_fs_watcher.h"
+
+#include "logging.h"
+#include "memory.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define HTTP_FS_WATCHER_MASK (IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE | IN_DELETE \
+    | IN_DELETE_SELF | IN_MOVED_FROM | IN_MOVED_TO | IN_MOVE_SELF | IN_ONLYDIR | IN_DONT_FOLLOW)
+
+static void notify(http_fs_watcher* watcher, http_fs_watcher_event event, const char* path) {
+    atomic_fetch_add_explicit(&watcher->invalidations, 1, memory_order_relaxed);
+    for (size_t i = 0; i < watcher->callbacks_count; ++i) {
+        watcher->callbacks[i](watcher->callbacks_user_data[i], event, path);
+    }
+}
+
+// "<dir>/<name>", without doubling the slash when serving from "/", so that
+// paths match what http_server builds from its cwd. false if it doesn't fit.
+static bool join_path(char* out, size_t size, const char* dir, const char* name) {
+    const char* sep = strcmp(dir, "/") == 0 ? "" : "/";
+    int n = snprintf(out, size, "%s%s%s", dir, sep, name);
+    return n >= 0 && (size_t)n < size;
+}
+
+static void lose_track(http_fs_watcher* watcher) {
+    if (atomic_exchange(&watcher->complete, false)) {
+        log_warning("%s", "can't watch the whole tree anymore, caches will revalidate with stat()");
+        notify(watcher, HTTP_FS_WATCHER_LOST, NULL);
+    }
+}
+
+static void remember_wd(http_fs_watcher* watcher, int wd, const char* path) {
+    if ((size_t)wd >= watcher->wd_paths_size) {
+        size_t new_size = watcher->wd_paths_size * 2;
+        while (new_size <= (size_t)wd) {
+            new_size *= 2;
+        }
+        char** new_paths = realloc(watcher->wd_paths, new_size * sizeof(char*));
+        if (!new_paths) {
+            lose_track(watcher);
+            return;
+        }
+        memset(new_paths + watcher->wd_paths_size, 0, (new_size - watcher->wd_paths_size) * sizeof(char*));
+        watcher->wd_paths = new_paths;
+        watcher->wd_paths_size = new_size;
+    }
+    if (!watcher->wd_paths[wd]) {
+        atomic_fetch_add(&watcher->watched_dirs, 1);
+    }
+    // the same directory may be added twice, e.g. when it's created while
+    // its parent is being scanned
+    free(watcher->wd_paths[wd]);
+    watcher->wd_paths[wd] = strdup(path);
+    if (!watcher->wd_paths[wd]) {
+        lose_track(watcher);
+    }
+}
+
+// adds watches for `path` and all directories beneath it
+static void watch_tree(http_fs_watcher* watcher, const char* path) {
+    int wd = inotify_add_watch(watcher->inotify_fd, path, HTTP_FS_WATCHER_MASK);
+    if (wd < 0) {
+        if (errno != ENOENT && errno != ENOTDIR) {
+            perror("inotify_add_watch");
+            lose_track(watcher);
+        }
+        return;
+    }
+    remember_wd(watcher, wd, path);
+    DIR* dir = opendir(path);
+    if (!dir) {
+        // may have been removed already, which we'll hear about
+        return;
+    }
+    struct dirent* entry;
+    while ((entry = readdir(dir))) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+            continue;
+        }
+        unsigned char type = entry->d_type;
+        if (type == DT_UNKNOWN) {
+            // some file systems don't fill in d_type
+            struct stat st;
+            if (fstatat(dirfd(dir), entry->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0) {
+                type = S_ISDIR(st.st_mode) ? DT_DIR : DT_UNKNOWN;
+            } else if (errno != ENOENT) {
+                // can't tell whether it's a directory which needs watching
+                perror("fstatat");
+                lose_track(watcher);
+            }
+        }
+        if (type != DT_DIR) {
+            continue;
+        }
+        char child[PATH_MAX];
+        if (!join_path(child, sizeof(child), path, entry->d_name)) {
+            lose_track(watcher);
+            continue;
+        }
+        watch_tree(watcher, child);
+    }
+    closedir(dir);
+}
+
+http_fs_watcher* http_fs_watcher_new(const char* root, http_error_t* ep) {
+    *ep = http_new_error_ok();
+    http_fs_watcher* watcher = safe_malloc(sizeof(http_fs_watcher), ep);
+    if (http_is_error(*ep)) {
+        return NULL;
+    }
+    memset(watcher, 0, sizeof(http_fs_watcher));
+    watcher->inotify_fd = -1;
+    watcher->wake_fd = -1;
+    atomic_init(&watcher->complete, true);
+    watcher->wd_paths_size = 64;
+    watcher->wd_paths = calloc(watcher->wd_paths_size, sizeof(char*));
+    if (!watcher->wd_paths) {
+        *ep = http_new_error_error("out of memory");
+        free(watcher);
+        return NULL;
+    }
+    watcher->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (watcher->inotify_fd < 0) {
+        perror("inotify_init1");
+        *ep = http_new_error_error("inotify_init1() failed");
+        http_fs_watcher_free(watcher);
+        return NULL;
+    }
+    watcher->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (watcher->wake_fd < 0) {
+        perror("eventfd");
+        *ep = http_new_error_error("eventfd() failed");
+        http_fs_watcher_free(watcher);
+        return NULL;
+    }
+    watch_tree(watcher, root);
+    if (!atomic_load(&watcher->complete)) {
+        *ep = http_new_error_error("failed to watch the whole tree");
+        http_fs_watcher_free(watcher);
+        return NULL;
+    }
+    log_info("watching %zu directories under '%s'", atomic_load(&watcher->watched_dirs), root);
+    return watcher;
+}
+
+void http_fs_watcher_add_callback(http_fs_watcher* watcher, http_fs_watcher_cb cb, void* user_data) {
+    if (watcher->callbacks_count == HTTP_FS_WATCHER_MAX_CALLBACKS) {
+        log_error("%s", "too many fs watcher callbacks");
+        return;
+    }
+    watcher->callbacks[watcher->callbacks_count] = cb;
+    watcher->callbacks_user_data[watcher->callbacks_count] = user_data;
+    ++watcher->callbacks_count;
+}
+
+static void handle_event(http_fs_watcher* watcher, const struct inotify_event* ev) {
+    if (ev->mask & IN_Q_OVERFLOW) {
+        atomic_fetch_add(&watcher->overflows, 1);
+        log_warning("%s", "inotify queue overflowed, resetting caches");
+        notify(watcher, HTTP_FS_WATCHER_RESET, NULL);
+        return;
+    }
+    if (ev->wd < 0 || (size_t)ev->wd >= watcher->wd_paths_size || !watcher->wd_paths[ev->wd]) {
+        return;
+    }
+    const char* dir_path = watcher->wd_paths[ev->wd];
+    if (ev->mask & IN_IGNORED) {
+        // watch removed, because the directory is gone
+        free(watcher->wd_paths[ev->wd]);
+        watcher->wd_paths[ev->wd] = NULL;
+        atomic_fetch_sub(&watcher->watched_dirs, 1);
+        return;
+    }
+    if (ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF)) {
+        notify(watcher, HTTP_FS_WATCHER_CHANGED_TREE, dir_path);
+        return;
+    }
+    if (ev->len == 0) {
+        // the directory's own metadata changed
+        notify(watcher, HTTP_FS_WATCHER_CHANGED, dir_path);
+        return;
+    }
+    char path[PATH_MAX];
+    if (!join_path(path, sizeof(path), dir_path, ev->name)) {
+        notify(watcher, HTTP_FS_WATCHER_RESET, NULL);
+        return;
+    }
+    bool is_dir = ev->mask & IN_ISDIR;
+    notify(watcher, is_dir ? HTTP_FS_WATCHER_CHANGED_TREE : HTTP_FS_WATCHER_CHANGED, path);
+    if (ev->mask & (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO)) {
+        // the directory's listing changed
+        notify(watcher, HTTP_FS_WATCHER_CHANGED, dir_path);
+    }
+    if (is_dir && (ev->mask & (IN_CREATE | IN_MOVED_TO))) {
+        watch_tree(watcher, path);
+    }
+}
+
+static void* http_fs_watcher_main(void* arg) {
+    http_fs_watcher* watcher = arg;
+    // large enough for many events, aligned for struct inotify_event
+    _Alignas(struct inotify_event) char buf[64 * 1024];
+    struct pollfd fds[2] = {
+        { .fd = watcher->inotify_fd, .events = POLLIN },
+        { .fd = watcher->wake_fd, .events = POLLIN },
+    };
+    for (;;) {
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("poll");
+            lose_track(watcher);
+            break;
+        }
+        if (fds[1].revents) {
+            break;
+        }
+        ssize_t n = read(watcher->inotify_fd, buf, sizeof(buf));
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EINTR) {
+                continue;
+            }
+            perror("read");
+            lose_track(watcher);
+            break;
+        }
+        for (char* ptr = buf; ptr < buf + n;) {
+            const struct inotify_event* ev = (const struct inotify_event*)ptr;
+            handle_event(watcher, ev);
+            ptr += sizeof(struct inotify_event) + ev->len;
+        }
+    }
+    return NULL;
+}
+
+void http_fs_watcher_start(http_fs_watcher* watcher, http_error_t* ep) {
+    *ep = http_new_error_ok();
+    int ret = pthread_create(&watcher->thread, NULL, http_fs_watcher_main, watcher);
+    if (ret != 0) {
+        errno = ret;
+        perror("pthread_create");
+        *ep = http_new_error_error("failed to create fs watcher thread");
+        return;
+    }
+    watcher->thread_started = true;
+}
+
+void http_fs_watcher_free(http_fs_watcher* watcher) {
+    if (!watcher) {
+        return;
+    }
+    if (watcher->thread_started) {
+        uint64_t one = 1;
+        ssize_t ret = write(watcher->wake_fd, &one, sizeof(one));
+        (void)ret;
+        pthread_join(watcher->thread, NULL);
+    }
+    if (watcher->wake_fd >= 0) {
+        close(watcher->wake_fd);
+    }
+    if (watcher->inotify_fd >= 0) {
+        close(watcher->inotify_fd);
+    }
+    for (size_t i = 0; i < watcher->wd_paths_size; ++i) {
+        free(watcher->wd_paths[i]);
+    }
+    free(watcher->wd_paths);
+    free(watcher);
+}
@@ -0,0 +1,260 @@
+#include "http_io_uring.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+#ifdef HTTP_HAVE_IO_URING
+
+#include <linux/io_uring.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+// the event loop waits with a timeout, and doesn't want completions dropped
+// when the completion queue is full
+#define HTTP_IO_URING_FEATURES (IORING_FEAT_EXT_ARG | IORING_FEAT_NODROP)
+
+static int io_uring_setup(unsigned entries, struct io_uring_params* params) {
+    return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags, void* arg, size_t arg_size) {
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, arg_size);
+}
+
+static int io_uring_register(int fd, unsigned opcode, void* arg, unsigned nr_args) {
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+bool http_io_uring_available(void) {
+    return true;
+}
+
+void http_io_uring_init(http_io_uring* ring, unsigned sq_entries, unsigned cq_entries, http_error_t* ep) {
+    *ep = http_new_error_ok();
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = -1;
+    struct io_uring_params params;
+    // completions are only processed when the submitting thread waits for
+    // them, instead of interrupting it (6.1+). the thread which runs the
+    // loop isn't the one creating it, so the ring starts disabled.
+    unsigned flags_tried[] = {
+        IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL | IORING_SETUP_R_DISABLED
+            | IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN,
+        IORING_SETUP_CQSIZE,
+    };
+    int fd = -1;
+    for (size_t i = 0; i < sizeof(flags_tried) / sizeof(*flags_tried) && fd < 0; ++i) {
+        memset(&params, 0, sizeof(params));
+        params.flags = flags_tried[i];
+        params.cq_entries = cq_entries;
+        fd = io_uring_setup(sq_entries, &params);
+        if (fd < 0 && errno != EINVAL) {
+            break;
+        }
+    }
+    if (fd < 0) {
+        perror("io_uring_setup");
+        *ep = http_new_error_error("io_uring_setup() failed");
+        return;
+    }
+    ring->fd = fd;
+    ring->flags = params.flags;
+    if ((params.features & HTTP_IO_URING_FEATURES) != HTTP_IO_URING_FEATURES) {
+        *ep = http_new_error_error("kernel's io_uring is too old");
+        http_io_uring_free(ring);
+        return;
+    }
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_ring_size > ring->sq_ring_size) {
+            ring->sq_ring_size = ring->cq_ring_size;
+        }
+        ring->cq_ring_size = ring->sq_ring_size;
+    }
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ring == MAP_FAILED) {
+        ring->sq_ring = NULL;
+        perror("mmap");
+        *ep = http_new_error_error("failed to map io_uring submission queue");
+        http_io_uring_free(ring);
+        return;
+    }
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cq_ring = ring->sq_ring;
+    } else {
+        ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+        if (ring->cq_ring == MAP_FAILED) {
+            ring->cq_ring = NULL;
+            perror("mmap");
+            *ep = http_new_error_error("failed to map io_uring completion queue");
+            http_io_uring_free(ring);
+            return;
+        }
+    }
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        ring->sqes = NULL;
+        perror("mmap");
+        *ep = http_new_error_error("failed to map io_uring sqes");
+        http_io_uring_free(ring);
+        return;
+    }
+    char* sq = ring->sq_ring;
+    ring->sq_head = (unsigned*)(sq + params.sq_off.head);
+    ring->sq_tail = (unsigned*)(sq + params.sq_off.tail);
+    ring->sq_mask = *(unsigned*)(sq + params.sq_off.ring_mask);
+    ring->sq_entries = params.sq_entries;
+    // sqes are always used in order, so the indirection array is the identity
+    unsigned* array = (unsigned*)(sq + params.sq_off.array);
+    for (unsigned i = 0; i < params.sq_entries; ++i) {
+        array[i] = i;
+    }
+    char* cq = ring->cq_ring;
+    ring->cq_head = (unsigned*)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned*)(cq + params.cq_off.tail);
+    ring->cq_mask = *(unsigned*)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+}
+
+void http_io_uring_enable(http_io_uring* ring, http_error_t* ep) {
+    *ep = http_new_error_ok();
+    if (!(ring->flags & IORING_SETUP_R_DISABLED)) {
+        return;
+    }
+    if (io_uring_register(ring->fd, IORING_REGISTER_ENABLE_RINGS, NULL, 0) < 0) {
+        perror("io_uring_register");
+        *ep = http_new_error_error("failed to enable io_uring");
+    }
+}
+
+void http_io_uring_free(http_io_uring* ring) {
+    if (ring->sqes) {
+        munmap(ring->sqes, ring->sqes_size);
+    }
+    if (ring->cq_ring && ring->cq_ring != ring->sq_ring) {
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    }
+    if (ring->sq_ring) {
+        munmap(ring->sq_ring, ring->sq_ring_size);
+    }
+    if (ring->fd >= 0) {
+        close(ring->fd);
+    }
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = -1;
+}
+
+// makes the pending sqes visible to the kernel
+static unsigned http_io_uring_flush(http_io_uring* ring) {
+    unsigned pending = ring->sq_pending;
+    if (pending > 0) {
+        unsigned tail = *ring->sq_tail;
+        atomic_store_explicit((_Atomic unsigned*)ring->sq_tail, tail + pending, memory_order_release);
+        ring->sq_pending = 0;
+    }
+    return pending;
+}
+
+struct io_uring_sqe* http_io_uring_get_sqe(http_io_uring* ring, http_error_t* ep) {
+    *ep = http_new_error_ok();
+    unsigned head = atomic_load_explicit((_Atomic unsigned*)ring->sq_head, memory_order_acquire);
+    unsigned tail = *ring->sq_tail + ring->sq_pending;
+    if (tail - head >= ring->sq_entries) {
+        unsigned to_submit = http_io_uring_flush(ring);
+        int ret;
+        do {
+            ret = io_uring_enter(ring->fd, to_submit, 0, 0, NULL, 0);
+        } while (ret < 0 && errno == EINTR);
+        if (ret < 0) {
+            perror("io_uring_enter");
+            *ep = http_new_error_error("io_uring_enter() failed");
+            return NULL;
+        }
+        head = atomic_load_explicit((_Atomic unsigned*)ring->sq_head, memory_order_acquire);
+        if (tail - head >= ring->sq_entries) {
+            *ep = http_new_error_error("io_uring submission queue is full");
+            return NULL;
+        }
+    }
+    struct io_uring_sqe* sqe = &ring->sqes[tail & ring->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    ++ring->sq_pending;
+    return sqe;
+}
+
+void http_io_uring_submit_and_wait(http_io_uring* ring, int timeout_ms, http_error_t* ep) {
+    *ep = http_new_error_ok();
+    unsigned to_submit = http_io_uring_flush(ring);
+    struct __kernel_timespec ts = {
+        .tv_sec = timeout_ms / 1000,
+        .tv_nsec = (long long)(timeout_ms % 1000) * 1000000,
+    };
+    struct io_uring_getevents_arg arg;
+    memset(&arg, 0, sizeof(arg));
+    arg.ts = timeout_ms >= 0 ? (uint64_t)(uintptr_t)&ts : 0;
+    int ret = io_uring_enter(ring->fd, to_submit, 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+    if (ret < 0 && errno != EINTR && errno != ETIME && errno != EBUSY) {
+        perror("io_uring_enter");
+        *ep = http_new_error_error("io_uring_enter() failed");
+    }
+}
+
+bool http_io_uring_pop_cqe(http_io_uring* ring, struct io_uring_cqe* cqe) {
+    unsigned head = *ring->cq_head;
+    unsigned tail = atomic_load_explicit((_Atomic unsigned*)ring->cq_tail, memory_order_acquire);
+    if (head == tail) {
+        return false;
+    }
+    *cqe = ring->cqes[head & ring->cq_mask];
+    atomic_store_explicit((_Atomic unsigned*)ring->cq_head, head + 1, memory_order_release);
+    return true;
+}
+
+#else
+
+bool http_io_uring_available(void) {
+    return false;
+}
+
+void http_io_uring_init(http_io_uring* ring, unsigned sq_entries, unsigned cq_entries, http_error_t* ep) {
+    (void)sq_entries;
+    (void)cq_entries;
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = -1;
+    *ep = http_new_error_error("built without io_uring");
+}
+
+void http_io_uring_enable(http_io_uring* ring, http_error_t* ep) {
+    (void)ring;
+    *ep = http_new_error_error("built without io_uring");
+}
+
+void http_io_uring_free(http_io_uring* ring) {
+    (void)ring;
+}
+
+struct io_uring_sqe* http_io_uring_get_sqe(http_io_uring* ring, http_error_t* ep) {
+    (void)ring;
+    *ep = http_new_error_error("built without io_uring");
+    return NULL;
+}
+
+void http_io_uring_submit_and_wait(http_io_uring* ring, int timeout_ms, http_error_t* ep) {
+    (void)ring;
+    (void)timeout_ms;
+    *ep = http_new_error_error("built without io_uring");
+}
+
+bool http_io_uring_pop_cqe(http_io_uring* ring, struct io_uring_cqe* cqe) {
+    (void)ring;
+    (void)cqe;
+    return false;
+}
+
+#endif
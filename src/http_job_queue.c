@@ -0,0 +1,136 @@
+#include "http_job_queue.h"
+
+#include "memory.h"
+
+#include <assert.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <stdlib.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+static void futex_wait(atomic_uint_least32_t* addr, uint32_t expected) {
+    // returns early on EAGAIN (value changed) or EINTR, callers re-check
+    syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, expected, NULL, NULL, 0);
+}
+
+static void futex_wake(atomic_uint_least32_t* addr, int count) {
+    syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0);
+}
+
+void http_job_queue_init(http_job_queue* queue, size_t capacity, http_error_t* ep) {
+    *ep = http_new_error_ok();
+    assert(capacity >= 2 && (capacity & (capacity - 1)) == 0);
+    queue->cells = safe_malloc(capacity * sizeof(http_job_queue_cell), ep);
+    if (http_is_error(*ep)) {
+        return;
+    }
+    for (size_t i = 0; i < capacity; ++i) {
+        atomic_init(&queue->cells[i].sequence, i);
+        queue->cells[i].fn = NULL;
+        queue->cells[i].arg = NULL;
+    }
+    queue->mask = capacity - 1;
+    atomic_init(&queue->enqueue_pos, 0);
+    atomic_init(&queue->dequeue_pos, 0);
+    atomic_init(&queue->wake_seq, 0);
+    atomic_init(&queue->parked, 0);
+    atomic_init(&queue->closed, false);
+}
+
+void http_job_queue_destroy(http_job_queue* queue) {
+    free(queue->cells);
+    queue->cells = NULL;
+}
+
+bool http_job_queue_try_push(http_job_queue* queue, http_thread_pool_fn_t fn, void* arg) {
+    size_t pos = atomic_load_explicit(&queue->enqueue_pos, memory_order_relaxed);
+    for (;;) {
+        http_job_queue_cell* cell = &queue->cells[pos & queue->mask];
+        size_t seq = atomic_load_explicit(&cell->sequence, memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+        if (diff == 0) {
+            // cell is free for this lap, try to claim it
+            if (atomic_compare_exchange_weak_explicit(&queue->enqueue_pos, &pos, pos + 1,
+                    memory_order_relaxed, memory_order_relaxed)) {
+                cell->fn = fn;
+                cell->arg = arg;
+                atomic_store_explicit(&cell->sequence, pos + 1, memory_order_release);
+                return true;
+            }
+            // lost the race, pos was reloaded by the failed CAS
+        } else if (diff < 0) {
+            // cell still holds last lap's job: full
+            return false;
+        } else {
+            pos = atomic_load_explicit(&queue->enqueue_pos, memory_order_relaxed);
+        }
+    }
+}
+
+bool http_job_queue_try_pop(http_job_queue* queue, http_thread_pool_fn_t* fn, void** arg) {
+    size_t pos = atomic_load_explicit(&queue->dequeue_pos, memory_order_relaxed);
+    for (;;) {
+        http_job_queue_cell* cell = &queue->cells[pos & queue->mask];
+        size_t seq = atomic_load_explicit(&cell->sequence, memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&queue->dequeue_pos, &pos, pos + 1,
+                    memory_order_relaxed, memory_order_relaxed)) {
+                *fn = cell->fn;
+                *arg = cell->arg;
+                // free the cell for the next lap
+                atomic_store_explicit(&cell->sequence, pos + queue->mask + 1, memory_order_release);
+                return true;
+            }
+        } else if (diff < 0) {
+            // empty
+            return false;
+        } else {
+            pos = atomic_load_explicit(&queue->dequeue_pos, memory_order_relaxed);
+        }
+    }
+}
+
+bool http_job_queue_push(http_job_queue* queue, http_thread_pool_fn_t fn, void* arg) {
+    if (!http_job_queue_try_push(queue, fn, arg)) {
+        return false;
+    }
+    // pairs with the parked increment in http_job_queue_pop: either we see
+    // the consumer as parked, or it sees our job when it re-checks
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load(&queue->parked) > 0) {
+        atomic_fetch_add(&queue->wake_seq, 1);
+        futex_wake(&queue->wake_seq, 1);
+    }
+    return true;
+}
+
+bool http_job_queue_pop(http_job_queue* queue, http_thread_pool_fn_t* fn, void** arg) {
+    for (;;) {
+        if (http_job_queue_try_pop(queue, fn, arg)) {
+            return true;
+        }
+        if (atomic_load(&queue->closed)) {
+            return false;
+        }
+        uint32_t seq = atomic_load(&queue->wake_seq);
+        atomic_fetch_add(&queue->parked, 1);
+        atomic_thread_fence(memory_order_seq_cst);
+        // a producer may have pushed before it could see us parked
+        if (http_job_queue_try_pop(queue, fn, arg)) {
+            atomic_fetch_sub(&queue->parked, 1);
+            return true;
+        }
+        if (!atomic_load(&queue->closed)) {
+            futex_wait(&queue->wake_seq, seq);
+        }
+        atomic_fetch_sub(&queue->parked, 1);
+    }
+}
+
+void http_job_queue_close(http_job_queue* queue) {
+    atomic_store(&queue->closed, true);
+    atomic_fetch_add(&queue->wake_seq, 1);
+    futex_wake(&queue->wake_seq, INT_MAX);
+}
@@ -0,0 +1,375 @@
+#include "http_metrics.h"
+
+#include "http_job_queue.h"
+#include "memory.h"
+
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define HTTP_METRICS_STATUS_MAX 600
+
+typedef struct {
+    atomic_uint_fast64_t counts[HTTP_METRICS_BUCKETS];
+    atomic_uint_fast64_t sum_ns;
+} http_histogram;
+
+// written only by the owning thread, read by whoever renders
+typedef struct http_metrics_shard {
+    http_histogram stages[HTTP_STAGE_COUNT];
+    atomic_uint_fast64_t responses[HTTP_METRICS_STATUS_MAX];
+    atomic_uint_fast64_t bytes_sent;
+    atomic_uint_fast64_t accepted;
+    struct http_metrics_shard* next;
+} http_metrics_shard;
+
+static _Atomic(http_metrics_shard*) shards;
+static _Thread_local http_metrics_shard* thread_shard;
+
+typedef struct {
+    const char* name;
+    const char* labels;
+    const char* help;
+    const char* type;
+    const atomic_size_t* value;
+} http_metrics_external;
+
+static http_metrics_external externals[HTTP_METRICS_EXTERNAL_MAX];
+static size_t externals_count = 0;
+
+static const char* const stage_names[HTTP_STAGE_COUNT] = {
+    [HTTP_STAGE_ACCEPT] = "accept",
+    [HTTP_STAGE_QUEUE] = "queue",
+    [HTTP_STAGE_HEADER] = "header",
+    [HTTP_STAGE_RESOLVE] = "resolve",
+    [HTTP_STAGE_SEND] = "send",
+    [HTTP_STAGE_FLUSH] = "flush",
+    [HTTP_STAGE_TOTAL] = "total",
+};
+
+// prometheus bucket boundaries, in seconds
+static const double bucket_bounds[] = {
+    0.000001, 0.0000025, 0.000005, 0.00001, 0.000025, 0.00005, 0.0001, 0.00025, 0.0005,
+    0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10,
+};
+
+static const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+
+static http_metrics_shard* get_thread_shard(void) {
+    if (thread_shard) {
+        return thread_shard;
+    }
+    http_metrics_shard* shard = aligned_alloc(HTTP_CACHE_LINE_SIZE,
+        (sizeof(http_metrics_shard) + HTTP_CACHE_LINE_SIZE - 1) / HTTP_CACHE_LINE_SIZE * HTTP_CACHE_LINE_SIZE);
+    if (!shard) {
+        return NULL;
+    }
+    memset(shard, 0, sizeof(http_metrics_shard));
+    http_metrics_shard* head = atomic_load(&shards);
+    do {
+        shard->next = head;
+    } while (!atomic_compare_exchange_weak(&shards, &head, shard));
+    thread_shard = shard;
+    return shard;
+}
+
+// single writer, so no atomic read-modify-write needed
+static void bump(atomic_uint_fast64_t* counter, uint64_t n) {
+    atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + n, memory_order_relaxed);
+}
+
+size_t http_metrics_bucket_index(uint64_t value) {
+    if (value >= (1ULL << HTTP_METRICS_MAX_BITS)) {
+        value = (1ULL << HTTP_METRICS_MAX_BITS) - 1;
+    }
+    if (value < (1ULL << HTTP_METRICS_SUB_BITS)) {
+        return (size_t)value;
+    }
+    unsigned msb = 63 - (unsigned)__builtin_clzll(value);
+    unsigned shift = msb - HTTP_METRICS_SUB_BITS;
+    size_t sub = (size_t)(value >> shift) & ((1u << HTTP_METRICS_SUB_BITS) - 1);
+    return ((size_t)(shift + 1) << HTTP_METRICS_SUB_BITS) + sub;
+}
+
+uint64_t http_metrics_bucket_upper(size_t index) {
+    size_t group = index >> HTTP_METRICS_SUB_BITS;
+    uint64_t sub = index & ((1u << HTTP_METRICS_SUB_BITS) - 1);
+    if (group == 0) {
+        return sub + 1;
+    }
+    unsigned shift = (unsigned)group - 1;
+    return ((sub + (1u << HTTP_METRICS_SUB_BITS)) << shift) + (1ULL << shift);
+}
+
+uint64_t http_metrics_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+void http_metrics_record(http_metrics_stage stage, uint64_t duration_ns) {
+    http_metrics_shard* shard = get_thread_shard();
+    if (!shard) {
+        return;
+    }
+    http_histogram* histogram = &shard->stages[stage];
+    bump(&histogram->counts[http_metrics_bucket_index(duration_ns)], 1);
+    bump(&histogram->sum_ns, duration_ns);
+}
+
+void http_metrics_record_since(http_metrics_stage stage, uint64_t since_ns, uint64_t now_ns) {
+    if (since_ns != 0 && now_ns >= since_ns) {
+        http_metrics_record(stage, now_ns - since_ns);
+    }
+}
+
+void http_metrics_count_response(int status) {
+    http_metrics_shard* shard = get_thread_shard();
+    if (shard && status > 0 && status < HTTP_METRICS_STATUS_MAX) {
+        bump(&shard->responses[status], 1);
+    }
+}
+
+void http_metrics_count_bytes(size_t bytes) {
+    http_metrics_shard* shard = get_thread_shard();
+    if (shard) {
+        bump(&shard->bytes_sent, bytes);
+    }
+}
+
+void http_metrics_count_accept(void) {
+    http_metrics_shard* shard = get_thread_shard();
+    if (shard) {
+        bump(&shard->accepted, 1);
+    }
+}
+
+uint64_t http_metrics_requests(void) {
+    uint64_t total = 0;
+    for (http_metrics_shard* shard = atomic_load(&shards); shard; shard = shard->next) {
+        for (size_t i = 0; i < HTTP_METRICS_STATUS_MAX; ++i) {
+            total += atomic_load_explicit(&shard->responses[i], memory_order_relaxed);
+        }
+    }
+    return total;
+}
+
+static bool add_external(const char* name, const char* labels, const char* help, const char* type, const atomic_size_t* value) {
+    if (externals_count == HTTP_METRICS_EXTERNAL_MAX) {
+        return false;
+    }
+    externals[externals_count++] = (http_metrics_external) { name, labels, help, type, value };
+    return true;
+}
+
+bool http_metrics_add_counter(const char* name, const char* labels, const char* help, const atomic_size_t* value) {
+    return add_external(name, labels, help, "counter", value);
+}
+
+bool http_metrics_add_gauge(const char* name, const char* labels, const char* help, const atomic_size_t* value) {
+    return add_external(name, labels, help, "gauge", value);
+}
+
+void http_metrics_free(void) {
+    externals_count = 0;
+    http_metrics_shard* shard = atomic_exchange(&shards, NULL);
+    while (shard) {
+        http_metrics_shard* next = shard->next;
+        free(shard);
+        shard = next;
+    }
+    thread_shard = NULL;
+}
+
+typedef struct {
+    http_arena* arena;
+    char* data;
+    size_t size;
+    size_t capacity;
+    bool failed;
+} text_buffer;
+
+__attribute__((format(printf, 2, 3))) static void append(text_buffer* buf, const char* fmt, ...) {
+    if (buf->failed) {
+        return;
+    }
+    for (;;) {
+        va_list args;
+        va_start(args, fmt);
+        int n = vsnprintf(buf->data + buf->size, buf->capacity - buf->size, fmt, args);
+        va_end(args);
+        if (n < 0) {
+            buf->failed = true;
+            return;
+        }
+        if ((size_t)n < buf->capacity - buf->size) {
+            buf->size += (size_t)n;
+            return;
+        }
+        size_t new_capacity = buf->capacity * 2;
+        http_error_t err = http_new_error_ok();
+        char* new_data = http_arena_grow(buf->arena, buf->data, buf->size, new_capacity, &err);
+        if (http_is_error(err)) {
+            buf->failed = true;
+            return;
+        }
+        buf->data = new_data;
+        buf->capacity = new_capacity;
+    }
+}
+
+// one stage summed over all threads
+typedef struct {
+    uint64_t counts[HTTP_METRICS_BUCKETS];
+    uint64_t count;
+    uint64_t sum_ns;
+} merged_histogram;
+
+static void merge_stage(http_metrics_stage stage, merged_histogram* out) {
+    memset(out, 0, sizeof(merged_histogram));
+    for (http_metrics_shard* shard = atomic_load(&shards); shard; shard = shard->next) {
+        http_histogram* histogram = &shard->stages[stage];
+        for (size_t i = 0; i < HTTP_METRICS_BUCKETS; ++i) {
+            uint64_t n = atomic_load_explicit(&histogram->counts[i], memory_order_relaxed);
+            out->counts[i] += n;
+            out->count += n;
+        }
+        out->sum_ns += atomic_load_explicit(&histogram->sum_ns, memory_order_relaxed);
+    }
+}
+
+static double quantile_seconds(const merged_histogram* histogram, double q) {
+    if (histogram->count == 0) {
+        return 0;
+    }
+    uint64_t rank = (uint64_t)(q * (double)histogram->count);
+    uint64_t seen = 0;
+    for (size_t i = 0; i < HTTP_METRICS_BUCKETS; ++i) {
+        seen += histogram->counts[i];
+        if (seen > rank) {
+            return (double)http_metrics_bucket_upper(i) / 1e9;
+        }
+    }
+    return (double)http_metrics_bucket_upper(HTTP_METRICS_BUCKETS - 1) / 1e9;
+}
+
+char* http_metrics_render(http_arena* arena, size_t* size, http_error_t* ep) {
+    *ep = http_new_error_ok();
+    // allocated first, so that the text can grow in place
+    merged_histogram* merged = http_arena_alloc(arena, sizeof(merged_histogram) * HTTP_STAGE_COUNT, ep);
+    if (http_is_error(*ep)) {
+        return NULL;
+    }
+    text_buffer buf = { .arena = arena, .capacity = 16 * 1024 };
+    buf.data = http_arena_alloc(arena, buf.capacity, ep);
+    if (http_is_error(*ep)) {
+        return NULL;
+    }
+
+    uint64_t accepted = 0;
+    uint64_t bytes_sent = 0;
+    uint64_t responses[HTTP_METRICS_STATUS_MAX] = { 0 };
+    for (http_metrics_shard* shard = atomic_load(&shards); shard; shard = shard->next) {
+        accepted += atomic_load_explicit(&shard->accepted, memory_order_relaxed);
+        bytes_sent += atomic_load_explicit(&shard->bytes_sent, memory_order_relaxed);
+        for (size_t i = 0; i < HTTP_METRICS_STATUS_MAX; ++i) {
+            responses[i] += atomic_load_explicit(&shard->responses[i], memory_order_relaxed);
+        }
+    }
+    uint64_t requests = 0;
+    for (size_t i = 0; i < HTTP_METRICS_STATUS_MAX; ++i) {
+        requests += responses[i];
+    }
+
+    append(&buf, "# HELP http_connections_accepted_total Connections accepted.\n"
+                 "# TYPE http_connections_accepted_total counter\n"
+                 "http_connections_accepted_total %llu\n",
+        (unsigned long long)accepted);
+    append(&buf, "# HELP http_requests_total Requests answered.\n"
+                 "# TYPE http_requests_total counter\n"
+                 "http_requests_total %llu\n",
+        (unsigned long long)requests);
+    append(&buf, "# HELP http_responses_total Responses by status code.\n"
+                 "# TYPE http_responses_total counter\n");
+    for (size_t i = 0; i < HTTP_METRICS_STATUS_MAX; ++i) {
+        if (responses[i] > 0) {
+            append(&buf, "http_responses_total{code=\"%zu\"} %llu\n", i, (unsigned long long)responses[i]);
+        }
+    }
+    append(&buf, "# HELP http_sent_bytes_total Bytes written to clients, headers included.\n"
+                 "# TYPE http_sent_bytes_total counter\n"
+                 "http_sent_bytes_total %llu\n",
+        (unsigned long long)bytes_sent);
+
+    for (size_t stage = 0; stage < HTTP_STAGE_COUNT; ++stage) {
+        merge_stage((http_metrics_stage)stage, &merged[stage]);
+    }
+    append(&buf, "# HELP http_stage_duration_seconds Time spent per request stage.\n"
+                 "# TYPE http_stage_duration_seconds histogram\n");
+    for (size_t stage = 0; stage < HTTP_STAGE_COUNT; ++stage) {
+        const merged_histogram* histogram = &merged[stage];
+        const char* name = stage_names[stage];
+        uint64_t cumulative = 0;
+        size_t bucket = 0;
+        for (size_t b = 0; b < sizeof(bucket_bounds) / sizeof(bucket_bounds[0]); ++b) {
+            // exact within the resolution of the log-linear buckets
+            uint64_t bound_ns = (uint64_t)(bucket_bounds[b] * 1e9);
+            while (bucket < HTTP_METRICS_BUCKETS && http_metrics_bucket_upper(bucket) <= bound_ns + 1) {
+                cumulative += histogram->counts[bucket];
+                ++bucket;
+            }
+            append(&buf, "http_stage_duration_seconds_bucket{stage=\"%s\",le=\"%g\"} %llu\n",
+                name, bucket_bounds[b], (unsigned long long)cumulative);
+        }
+        append(&buf, "http_stage_duration_seconds_bucket{stage=\"%s\",le=\"+Inf\"} %llu\n"
+                     "http_stage_duration_seconds_sum{stage=\"%s\"} %.9f\n"
+                     "http_stage_duration_seconds_count{stage=\"%s\"} %llu\n",
+            name, (unsigned long long)histogram->count,
+            name, (double)histogram->sum_ns / 1e9,
+            name, (unsigned long long)histogram->count);
+    }
+    append(&buf, "# HELP http_stage_duration_quantile_seconds Upper bound of the quantile, per request stage.\n"
+                 "# TYPE http_stage_duration_quantile_seconds gauge\n");
+    for (size_t stage = 0; stage < HTTP_STAGE_COUNT; ++stage) {
+        for (size_t q = 0; q < sizeof(quantiles) / sizeof(quantiles[0]); ++q) {
+            append(&buf, "http_stage_duration_quantile_seconds{stage=\"%s\",quantile=\"%g\"} %.9f\n",
+                stage_names[stage], quantiles[q], quantile_seconds(&merged[stage], quantiles[q]));
+        }
+    }
+
+    for (size_t i = 0; i < externals_count; ++i) {
+        bool first = true;
+        for (size_t j = 0; j < i && first; ++j) {
+            first = strcmp(externals[j].name, externals[i].name) != 0;
+        }
+        if (!first) {
+            // already written along with the first one of that name
+            continue;
+        }
+        append(&buf, "# HELP %s %s\n"
+                     "# TYPE %s %s\n",
+            externals[i].name, externals[i].help, externals[i].name, externals[i].type);
+        for (size_t j = i; j < externals_count; ++j) {
+            const http_metrics_external* external = &externals[j];
+            if (strcmp(external->name, externals[i].name) != 0) {
+                continue;
+            }
+            size_t value = atomic_load_explicit(external->value, memory_order_relaxed);
+            if (external->labels) {
+                append(&buf, "%s{%s} %zu\n", external->name, external->labels, value);
+            } else {
+                append(&buf, "%s %zu\n", external->name, value);
+            }
+        }
+    }
+
+    if (buf.failed) {
+        *ep = http_new_error_error("failed to render metrics");
+        return NULL;
+    }
+    *size = buf.size;
+    return buf.data;
+}
@@ -0,0 +1,39 @@
+#include "http_mime.h"
+
+#include <string.h>
+
+// generated at build time, see tools/http_mime_gen.c
+#include "http_mime_table.h"
+
+const http_mime_type http_mime_type_unknown = { "", "application/octet-stream", false };
+const http_mime_type http_mime_type_listing = { "", "text/html", true };
+
+const http_mime_type* http_mime_type_of(const char* path) {
+    const char* name = strrchr(path, '/');
+    name = name ? name + 1 : path;
+    if (*name == '\0') {
+        return &http_mime_type_listing;
+    }
+    const char* dot = strrchr(name, '.');
+    if (!dot || dot == name) {
+        return &http_mime_type_unknown;
+    }
+    const char* ext = dot + 1;
+    char lower[HTTP_MIME_EXTENSION_MAX + 1];
+    size_t len = 0;
+    for (; ext[len]; ++len) {
+        if (len == HTTP_MIME_EXTENSION_MAX) {
+            return &http_mime_type_unknown;
+        }
+        char c = ext[len];
+        lower[len] = c >= 'A' && c <= 'Z' ? (char)(c - 'A' + 'a') : c;
+    }
+    lower[len] = '\0';
+    uint16_t seed = http_mime_seeds[http_mime_hash(lower, len, 0) & (HTTP_MIME_TABLE_BUCKETS - 1)];
+    int16_t index = http_mime_slots[http_mime_hash(lower, len, seed) & (HTTP_MIME_TABLE_SLOTS - 1)];
+    // anything else hashes somewhere too
+    if (index < 0 || strcmp(http_mime_types[index].extension, lower) != 0) {
+        return &http_mime_type_unknown;
+    }
+    return &http_mime_types[index];
+}
@@ -0,0 +1,188 @@
+#include "http_parser.h"
+
+#include "http_scan.h"
+
+#include <string.h>
+#include <strings.h>
+
+void http_parser_reset(http_parser* parser) {
+    // fields are only read up to fields_count, no need to clear them
+    memset(parser, 0, offsetof(http_parser, fields));
+    parser->fields_count = 0;
+    memset(parser->known, 0, sizeof(parser->known));
+    parser->state = HTTP_PARSER_REQUEST_LINE;
+}
+
+static http_parser_state fail(http_parser* parser, const char* error) {
+    parser->state = HTTP_PARSER_ERROR;
+    parser->error = error;
+    return parser->state;
+}
+
+http_header_id http_header_id_from_name(const char* name, size_t len) {
+    // the length alone rules out all but one or two candidates
+    switch (len) {
+    case 4:
+        if (strncasecmp(name, "Host", 4) == 0) {
+            return HTTP_HEADER_HOST;
+        }
+        break;
+    case 5:
+        if (strncasecmp(name, "Range", 5) == 0) {
+            return HTTP_HEADER_RANGE;
+        }
+        break;
+    case 8:
+        if (strncasecmp(name, "If-Range", 8) == 0) {
+            return HTTP_HEADER_IF_RANGE;
+        }
+        break;
+    case 10:
+        if (strncasecmp(name, "Connection", 10) == 0) {
+            return HTTP_HEADER_CONNECTION;
+        }
+        break;
+    case 13:
+        if (strncasecmp(name, "If-None-Match", 13) == 0) {
+            return HTTP_HEADER_IF_NONE_MATCH;
+        }
+        break;
+    case 14:
+        if (strncasecmp(name, "Content-Length", 14) == 0) {
+            return HTTP_HEADER_CONTENT_LENGTH;
+        }
+        break;
+    case 15:
+        if (strncasecmp(name, "Accept-Encoding", 15) == 0) {
+            return HTTP_HEADER_ACCEPT_ENCODING;
+        }
+        break;
+    case 17:
+        if (strncasecmp(name, "If-Modified-Since", 17) == 0) {
+            return HTTP_HEADER_IF_MODIFIED_SINCE;
+        }
+        if (strncasecmp(name, "Transfer-Encoding", 17) == 0) {
+            return HTTP_HEADER_TRANSFER_ENCODING;
+        }
+        break;
+    }
+    return HTTP_HEADER_UNKNOWN;
+}
+
+static bool is_whitespace(char c) {
+    return c == ' ' || c == '\t';
+}
+
+// METHOD SP TARGET SP VERSION, `len` excludes the line ending
+static http_parser_state parse_request_line(http_parser* parser, const char* line, size_t offset, size_t len) {
+    size_t method_len = http_scan_find(line, len, ' ');
+    if (method_len == len || method_len == 0) {
+        return fail(parser, "failed to parse METHOD");
+    }
+    const char* target = line + method_len + 1;
+    size_t target_max = len - method_len - 1;
+    size_t target_len = http_scan_find(target, target_max, ' ');
+    if (target_len == target_max || target_len == 0) {
+        return fail(parser, "failed to parse TARGET");
+    }
+    size_t version_len = len - method_len - target_len - 2;
+    if (version_len == 0) {
+        return fail(parser, "failed to parse VERSION");
+    }
+    parser->method = (http_slice) { offset, method_len };
+    parser->target = (http_slice) { offset + method_len + 1, target_len };
+    parser->version = (http_slice) { offset + method_len + target_len + 2, version_len };
+    parser->state = HTTP_PARSER_HEADERS;
+    return parser->state;
+}
+
+// `colon` is the offset of the first colon, `end` that of the line ending
+static http_parser_state add_field(http_parser* parser, const char* buf, size_t start, size_t colon, size_t end) {
+    if (colon == start) {
+        return fail(parser, "empty header field name");
+    }
+    if (is_whitespace(buf[colon - 1])) {
+        // not allowed, see RFC 9112 section 5.1
+        return fail(parser, "whitespace between header field name and colon");
+    }
+    if (parser->fields_count == HTTP_HEADER_FIELDS_MAX) {
+        return fail(parser, "too many header fields");
+    }
+    size_t value_start = colon + 1;
+    while (value_start < end && is_whitespace(buf[value_start])) {
+        ++value_start;
+    }
+    size_t value_end = end;
+    while (value_end > value_start && is_whitespace(buf[value_end - 1])) {
+        --value_end;
+    }
+    http_header_field* field = &parser->fields[parser->fields_count];
+    field->name_offset = (uint16_t)start;
+    field->name_len = (uint16_t)(colon - start);
+    field->value_offset = (uint16_t)value_start;
+    field->value_len = (uint16_t)(value_end - value_start);
+    ++parser->fields_count;
+    http_header_id id = http_header_id_from_name(buf + start, colon - start);
+    if (id != HTTP_HEADER_UNKNOWN) {
+        if (parser->known[id] == 0) {
+            parser->known[id] = (uint8_t)parser->fields_count;
+        } else if (id == HTTP_HEADER_CONTENT_LENGTH || id == HTTP_HEADER_HOST) {
+            // ambiguous, and the classic request smuggling vector
+            return fail(parser, "duplicate Content-Length or Host");
+        }
+    }
+    return parser->state;
+}
+
+http_parser_state http_parser_feed(http_parser* parser, const char* buf, size_t size) {
+    while (parser->state == HTTP_PARSER_REQUEST_LINE || parser->state == HTTP_PARSER_HEADERS) {
+        size_t line_start = parser->pos;
+        size_t remaining = size - line_start;
+        size_t colon = line_start + remaining;
+        size_t newline;
+        if (parser->state == HTTP_PARSER_HEADERS) {
+            // one pass over the line finds the colon, then the rest of the line
+            colon = line_start + http_scan_find2(buf + line_start, remaining, ':', '\n');
+            if (colon == size) {
+                break;
+            }
+            if (buf[colon] == '\n') {
+                newline = colon;
+                colon = size;
+            } else {
+                newline = colon + http_scan_find(buf + colon, size - colon, '\n');
+            }
+        } else {
+            newline = line_start + http_scan_find(buf + line_start, remaining, '\n');
+        }
+        if (newline == size) {
+            // incomplete line, continue here once there's more
+            break;
+        }
+        size_t next = newline + 1;
+        // lines end in CRLF, but a bare LF is tolerated
+        size_t line_end = next - 1;
+        if (line_end > line_start && buf[line_end - 1] == '\r') {
+            --line_end;
+        }
+        parser->pos = next;
+        if (parser->state == HTTP_PARSER_REQUEST_LINE) {
+            if (line_end == line_start) {
+                // empty lines before the request line are allowed, and ignored
+                continue;
+            }
+            parse_request_line(parser, buf + line_start, line_start, line_end - line_start);
+            parser->start_of_headers = next;
+        } else if (line_end == line_start) {
+            parser->header_size = next;
+            parser->state = HTTP_PARSER_DONE;
+        } else if (is_whitespace(buf[line_start])) {
+            return fail(parser, "obsolete header line folding");
+        } else if (colon >= line_end) {
+            return fail(parser, "header line without colon");
+        } else {
+            add_field(parser, buf, line_start, colon, line_end);
+        }
+    }
+    return parser->state;
+}
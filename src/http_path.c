@@ -0,0 +1,373 @@
+#include "http_path.h"
+
+#include "http_file_cache.h"
+#include "logging.h"
+#include "memory.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef HTTP_HAVE_OPENAT2
+#include <linux/openat2.h>
+#endif
+
+static int hex_value(char c) {
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    }
+    if (c >= 'A' && c <= 'F') {
+        return c - 'A' + 10;
+    }
+    return -1;
+}
+
+bool http_path_normalize(const char* target, char* out, size_t out_size) {
+    if (target[0] != '/' || out_size < 2) {
+        return false;
+    }
+    size_t len = 0;
+    out[len++] = '/';
+    const char* p = target + 1;
+    for (;;) {
+        // decode one segment onto the end of out, then see what it was
+        size_t segment = len;
+        while (*p && *p != '/' && *p != '?' && *p != '#') {
+            char c = *p++;
+            if (c == '%') {
+                int hi = hex_value(p[0]);
+                int lo = hi < 0 ? -1 : hex_value(p[1]);
+                if (lo < 0) {
+                    return false;
+                }
+                c = (char)(hi * 16 + lo);
+                p += 2;
+                if (c == '\0' || c == '/') {
+                    return false;
+                }
+            }
+            if (len + 2 > out_size) {
+                return false;
+            }
+            out[len++] = c;
+        }
+        bool last = *p != '/';
+        size_t segment_len = len - segment;
+        if (segment_len == 1 && out[segment] == '.') {
+            len = segment;
+        } else if (segment_len == 2 && out[segment] == '.' && out[segment + 1] == '.') {
+            if (segment == 1) {
+                return false;
+            }
+            // back to the end of the segment before the previous one
+            len = segment - 1;
+            while (out[len - 1] != '/') {
+                --len;
+            }
+        } else if (segment_len > 0 && !last) {
+            out[len++] = '/';
+        }
+        if (last) {
+            break;
+        }
+        ++p;
+    }
+    out[len] = '\0';
+    return true;
+}
+
+static bool is_under(const char* path, const char* dir, size_t dir_len) {
+    return strncmp(path, dir, dir_len) == 0 && (path[dir_len] == '\0' || path[dir_len] == '/');
+}
+
+// without openat2, or for absolute symlinks, which it won't follow: the
+// real path has to be inside the root
+static int http_path_open_resolved(const char* root, const char* path, int flags, bool* canonical) {
+    char full[PATH_MAX];
+    size_t root_len = strcmp(root, "/") == 0 ? 0 : strlen(root);
+    int n = snprintf(full, sizeof(full), "%.*s%s", (int)root_len, root, path);
+    if (n < 0 || (size_t)n >= sizeof(full)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    char resolved[PATH_MAX];
+    if (!realpath(full, resolved)) {
+        return -1;
+    }
+    if (root_len > 0 && !is_under(resolved, root, root_len)) {
+        errno = EXDEV;
+        return -1;
+    }
+    if (canonical) {
+        // realpath() drops the trailing slash
+        size_t resolved_len = strlen(resolved);
+        *canonical = strncmp(resolved, full, resolved_len) == 0
+            && (full[resolved_len] == '\0' || (full[resolved_len] == '/' && full[resolved_len + 1] == '\0'));
+    }
+    return open(resolved, flags | O_CLOEXEC);
+}
+
+#ifdef HTTP_HAVE_OPENAT2
+// set once the kernel said it doesn't know openat2 (before 5.6)
+static atomic_bool s_no_openat2 = false;
+
+static int http_openat2(int dir_fd, const char* path, int flags, unsigned long long resolve) {
+    struct open_how how;
+    memset(&how, 0, sizeof(how));
+    how.flags = (unsigned long long)(flags | O_CLOEXEC);
+    how.resolve = resolve;
+    int fd;
+    do {
+        fd = (int)syscall(__NR_openat2, dir_fd, path, &how, sizeof(how));
+    } while (fd < 0 && errno == EAGAIN);
+    return fd;
+}
+#endif
+
+int http_path_open(int root_fd, const char* root, const char* path, int flags, bool* canonical) {
+    assert(path[0] == '/');
+#ifdef HTTP_HAVE_OPENAT2
+    if (!atomic_load_explicit(&s_no_openat2, memory_order_relaxed)) {
+        // relative to the root, "" would be ENOENT
+        const char* rel = path[1] ? path + 1 : ".";
+        unsigned long long resolve = RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS;
+        int fd = -1;
+        if (canonical) {
+            fd = http_openat2(root_fd, rel, flags, resolve | RESOLVE_NO_SYMLINKS);
+            *canonical = fd >= 0;
+        }
+        if (fd < 0 && (!canonical || errno == ELOOP)) {
+            fd = http_openat2(root_fd, rel, flags, resolve);
+        }
+        if (fd >= 0 || (errno != ENOSYS && errno != EXDEV)) {
+            return fd;
+        }
+        if (errno == ENOSYS) {
+            log_warning("%s", "openat2() not available, resolving paths with realpath()");
+            atomic_store(&s_no_openat2, true);
+        }
+    }
+#else
+    (void)root_fd;
+#endif
+    return http_path_open_resolved(root, path, flags, canonical);
+}
+
+void http_path_resolve(int root_fd, const char* root, const char* path, http_path_info* info) {
+    memset(info, 0, sizeof(*info));
+    // O_PATH doesn't open the file itself, so fifos and such can't block
+    int fd = http_path_open(root_fd, root, path, O_PATH, &info->canonical);
+    if (fd < 0) {
+        info->kind = errno == EXDEV || errno == EACCES ? HTTP_PATH_FORBIDDEN : HTTP_PATH_MISSING;
+        return;
+    }
+    if (fstat(fd, &info->st) < 0) {
+        perror("fstat");
+        info->kind = HTTP_PATH_MISSING;
+    } else if (S_ISDIR(info->st.st_mode)) {
+        info->kind = HTTP_PATH_DIRECTORY;
+    } else if (S_ISREG(info->st.st_mode)) {
+        // "file/" isn't the file
+        info->kind = path[strlen(path) - 1] == '/' ? HTTP_PATH_MISSING : HTTP_PATH_FILE;
+    } else {
+        info->kind = HTTP_PATH_FORBIDDEN;
+    }
+    close(fd);
+}
+
+// FNV-1a
+static uint64_t hash_path(const char* path) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (; *path; ++path) {
+        hash ^= (unsigned char)*path;
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+static long long now_ms(void) {
+    struct timespec ts;
+    // vDSO, no syscall
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static http_path_cache_shard* shard_of(http_path_cache* cache, uint64_t hash) {
+    return &cache->shards[hash & (HTTP_PATH_CACHE_SHARDS - 1)];
+}
+
+static http_path_cache_entry** bucket_of(http_path_cache_shard* shard, uint64_t hash) {
+    // the low bits already picked the shard
+    return &shard->buckets[(hash >> 32) & (HTTP_PATH_CACHE_BUCKETS - 1)];
+}
+
+http_path_cache* http_path_cache_new(size_t capacity, http_error_t* ep) {
+    *ep = http_new_error_ok();
+    http_path_cache* cache = safe_malloc(sizeof(http_path_cache), ep);
+    if (http_is_error(*ep)) {
+        return NULL;
+    }
+    memset(cache, 0, sizeof(http_path_cache));
+    cache->capacity = capacity;
+    for (size_t i = 0; i < HTTP_PATH_CACHE_SHARDS; ++i) {
+        if (pthread_mutex_init(&cache->shards[i].mutex, NULL) != 0) {
+            *ep = http_new_error_error("failed to init mutex");
+            free(cache);
+            return NULL;
+        }
+    }
+    return cache;
+}
+
+static void lru_unlink(http_path_cache_shard* shard, http_path_cache_entry* entry) {
+    if (entry->lru_prev) {
+        entry->lru_prev->lru_next = entry->lru_next;
+    } else {
+        shard->lru_head = entry->lru_next;
+    }
+    if (entry->lru_next) {
+        entry->lru_next->lru_prev = entry->lru_prev;
+    } else {
+        shard->lru_tail = entry->lru_prev;
+    }
+    entry->lru_prev = NULL;
+    entry->lru_next = NULL;
+}
+
+static void lru_push_front(http_path_cache_shard* shard, http_path_cache_entry* entry) {
+    entry->lru_prev = NULL;
+    entry->lru_next = shard->lru_head;
+    if (shard->lru_head) {
+        shard->lru_head->lru_prev = entry;
+    } else {
+        shard->lru_tail = entry;
+    }
+    shard->lru_head = entry;
+}
+
+// unlinks from hash chain and lru list, caller frees the entry
+static void shard_unlink(http_path_cache_shard* shard, http_path_cache_entry* entry) {
+    http_path_cache_entry** link = bucket_of(shard, entry->hash);
+    while (*link && *link != entry) {
+        link = &(*link)->hash_next;
+    }
+    assert(*link == entry);
+    *link = entry->hash_next;
+    entry->hash_next = NULL;
+    lru_unlink(shard, entry);
+    --shard->count;
+}
+
+static http_path_cache_entry* shard_find(http_path_cache_shard* shard, uint64_t hash, const char* path) {
+    for (http_path_cache_entry* entry = *bucket_of(shard, hash); entry; entry = entry->hash_next) {
+        if (entry->hash == hash && strcmp(entry->path, path) == 0) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+void http_path_cache_free(http_path_cache* cache) {
+    if (!cache) {
+        return;
+    }
+    for (size_t i = 0; i < HTTP_PATH_CACHE_SHARDS; ++i) {
+        http_path_cache_shard* shard = &cache->shards[i];
+        while (shard->lru_head) {
+            http_path_cache_entry* entry = shard->lru_head;
+            shard_unlink(shard, entry);
+            free(entry);
+        }
+        pthread_mutex_destroy(&shard->mutex);
+    }
+    free(cache);
+}
+
+bool http_path_cache_get(http_path_cache* cache, const char* path, http_path_info* info) {
+    uint64_t hash = hash_path(path);
+    http_path_cache_shard* shard = shard_of(cache, hash);
+    size_t generation = atomic_load(&cache->generation);
+    bool trusted = atomic_load(&cache->watched);
+    long long now = trusted ? 0 : now_ms();
+    bool found = false;
+    http_path_cache_entry* stale = NULL;
+    pthread_mutex_lock(&shard->mutex);
+    http_path_cache_entry* entry = shard_find(shard, hash, path);
+    if (entry) {
+        if (entry->generation != generation || (!trusted && now - entry->resolved_at_ms >= HTTP_FILE_CACHE_REVALIDATE_MS)) {
+            shard_unlink(shard, entry);
+            stale = entry;
+        } else {
+            *info = entry->info;
+            found = true;
+            lru_unlink(shard, entry);
+            lru_push_front(shard, entry);
+        }
+    }
+    pthread_mutex_unlock(&shard->mutex);
+    free(stale);
+    atomic_fetch_add_explicit(found ? &cache->hits : &cache->misses, 1, memory_order_relaxed);
+    return found;
+}
+
+void http_path_cache_put(http_path_cache* cache, const char* path, const http_path_info* info, size_t generation) {
+    if (atomic_load(&cache->generation) != generation) {
+        // something changed while the path was resolved
+        return;
+    }
+    size_t path_size = strlen(path) + 1;
+    http_error_t err = http_new_error_ok();
+    http_path_cache_entry* entry = safe_malloc(sizeof(http_path_cache_entry) + path_size, &err);
+    if (http_is_error(err)) {
+        return;
+    }
+    memset(entry, 0, sizeof(http_path_cache_entry));
+    entry->hash = hash_path(path);
+    entry->info = *info;
+    entry->resolved_at_ms = now_ms();
+    entry->generation = generation;
+    memcpy(entry->path, path, path_size);
+    size_t shard_capacity = cache->capacity / HTTP_PATH_CACHE_SHARDS;
+    http_path_cache_shard* shard = shard_of(cache, entry->hash);
+    // evicted entries are freed outside the lock
+    http_path_cache_entry* evicted = NULL;
+    pthread_mutex_lock(&shard->mutex);
+    http_path_cache_entry* old = shard_find(shard, entry->hash, path);
+    if (old) {
+        shard_unlink(shard, old);
+        old->hash_next = evicted;
+        evicted = old;
+    }
+    while (shard->lru_tail && shard->count >= shard_capacity) {
+        http_path_cache_entry* victim = shard->lru_tail;
+        shard_unlink(shard, victim);
+        victim->hash_next = evicted;
+        evicted = victim;
+    }
+    http_path_cache_entry** bucket = bucket_of(shard, entry->hash);
+    entry->hash_next = *bucket;
+    *bucket = entry;
+    lru_push_front(shard, entry);
+    ++shard->count;
+    pthread_mutex_unlock(&shard->mutex);
+    while (evicted) {
+        http_path_cache_entry* next = evicted->hash_next;
+        free(evicted);
+        evicted = next;
+    }
+}
+
+void http_path_cache_invalidate(http_path_cache* cache) {
+    // stale entries are dropped when they're looked up, or evicted
+    atomic_fetch_add(&cache->generation, 1);
+}
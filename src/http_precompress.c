@@ -0,0 +1,160 @@
+#include "http_precompress.h"
+
+#include "http_compress.h"
+#include "http_server.h"
+#include "logging.h"
+#include "memory.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// whether the encoding has siblings, and this build can write them
+static bool can_precompress(http_encoding encoding) {
+    return http_encoding_suffix(encoding) && http_compress_supported(encoding);
+}
+
+bool http_precompress_available(void) {
+    for (size_t e = 0; e < HTTP_ENCODING_COUNT; ++e) {
+        if (can_precompress((http_encoding)e)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// nftw() has no user data, and this only ever runs once, offline
+static struct {
+    size_t written;
+    size_t up_to_date;
+    size_t not_smaller;
+    size_t failed;
+} s_stats;
+
+static bool is_newer_or_same(const struct timespec* a, const struct timespec* b) {
+    return a->tv_sec > b->tv_sec || (a->tv_sec == b->tv_sec && a->tv_nsec >= b->tv_nsec);
+}
+
+// written next to the sibling, then renamed over it, so the server never
+// sees half a file
+static void write_sibling(const char* sibling, const char* data, size_t size, http_error_t* ep) {
+    *ep = http_new_error_ok();
+    char tmp[PATH_MAX];
+    int n = snprintf(tmp, sizeof(tmp), "%s.tmp", sibling);
+    if (n < 0 || (size_t)n >= sizeof(tmp)) {
+        *ep = http_new_error_error("path too long");
+        return;
+    }
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        perror("open");
+        *ep = http_new_error_error("couldn't create sibling");
+        return;
+    }
+    size_t done = 0;
+    while (done < size) {
+        ssize_t written = write(fd, data + done, size - done);
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (written <= 0) {
+            perror("write");
+            *ep = http_new_error_error("couldn't write sibling");
+            break;
+        }
+        done += (size_t)written;
+    }
+    if (close(fd) < 0 && http_is_ok(*ep)) {
+        perror("close");
+        *ep = http_new_error_error("couldn't write sibling");
+    }
+    if (http_is_ok(*ep) && rename(tmp, sibling) < 0) {
+        perror("rename");
+        *ep = http_new_error_error("couldn't rename sibling");
+    }
+    if (http_is_error(*ep)) {
+        unlink(tmp);
+    }
+}
+
+static int precompress_file(const char* path, const struct stat* st, int type, struct FTW* ftw) {
+    (void)ftw;
+    if (type != FTW_F || !S_ISREG(st->st_mode) || st->st_size < HTTP_COMPRESS_MIN_SIZE
+        || st->st_size > HTTP_PRECOMPRESS_MAX_SIZE || !http_path_is_compressible(path)) {
+        return 0;
+    }
+    // only mapped once a sibling turns out to be missing or stale
+    char* data = MAP_FAILED;
+    size_t size = (size_t)st->st_size;
+    for (size_t e = 0; e < HTTP_ENCODING_COUNT; ++e) {
+        if (!can_precompress((http_encoding)e)) {
+            continue;
+        }
+        char sibling[PATH_MAX];
+        int n = snprintf(sibling, sizeof(sibling), "%s%s", path, http_encoding_suffix((http_encoding)e));
+        if (n < 0 || (size_t)n >= sizeof(sibling)) {
+            continue;
+        }
+        struct stat sibling_st;
+        bool exists = stat(sibling, &sibling_st) == 0;
+        if (exists && is_newer_or_same(&sibling_st.st_mtim, &st->st_mtim)) {
+            ++s_stats.up_to_date;
+            continue;
+        }
+        if (data == MAP_FAILED) {
+            int fd = open(path, O_RDONLY | O_CLOEXEC);
+            if (fd >= 0) {
+                data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+                close(fd);
+            }
+            if (data == MAP_FAILED) {
+                log_error("couldn't read '%s'", path);
+                ++s_stats.failed;
+                return 0;
+            }
+        }
+        http_error_t err = http_new_error_ok();
+        size_t compressed_size = 0;
+        char* compressed = http_compress((http_encoding)e, data, size, true, NULL, &compressed_size, &err);
+        if (http_is_ok(err) && compressed_size >= size) {
+            // a stale sibling would otherwise still be served
+            if (exists) {
+                unlink(sibling);
+            }
+            ++s_stats.not_smaller;
+        } else if (http_is_ok(err)) {
+            write_sibling(sibling, compressed, compressed_size, &err);
+        }
+        free(compressed);
+        if (http_is_error(err)) {
+            log_error("couldn't write '%s'", sibling);
+            http_print_error(err);
+            ++s_stats.failed;
+        } else if (compressed_size < size) {
+            log_debug("wrote '%s', %zu bytes instead of %zu", sibling, compressed_size, size);
+            ++s_stats.written;
+        }
+    }
+    if (data != MAP_FAILED) {
+        munmap(data, size);
+    }
+    return 0;
+}
+
+void http_precompress_tree(const char* root, http_error_t* ep) {
+    *ep = http_new_error_ok();
+    memset(&s_stats, 0, sizeof(s_stats));
+    if (nftw(root, precompress_file, 64, FTW_PHYS) < 0) {
+        perror("nftw");
+        *ep = http_new_error_error("couldn't walk the directory tree");
+        return;
+    }
+    log_info("precompressed '%s': %zu siblings written, %zu up to date, %zu not smaller, %zu failed",
+        root, s_stats.written, s_stats.up_to_date, s_stats.not_smaller, s_stats.failed);
+}
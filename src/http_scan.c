@@ -0,0 +1,156 @@
+#include "http_scan.h"
+
+#include <stdint.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define HTTP_SCAN_X86 1
+#include <immintrin.h>
+#endif
+
+static size_t find2_scalar(const char* buf, size_t size, char a, char b) {
+    for (size_t i = 0; i < size; ++i) {
+        if (buf[i] == a || buf[i] == b) {
+            return i;
+        }
+    }
+    return size;
+}
+
+static size_t find_terminator_scalar(const char* buf, size_t size) {
+    for (size_t i = 0; i + 4 <= size; ++i) {
+        if (buf[i] == '\r' && buf[i + 1] == '\n' && buf[i + 2] == '\r' && buf[i + 3] == '\n') {
+            return i;
+        }
+    }
+    return size;
+}
+
+#ifdef HTTP_SCAN_X86
+
+// all loads are unaligned and never go past `size`, the scalar versions
+// handle what's left over
+
+__attribute__((target("sse2"))) static size_t find2_sse2(const char* buf, size_t size, char a, char b) {
+    const __m128i va = _mm_set1_epi8(a);
+    const __m128i vb = _mm_set1_epi8(b);
+    size_t i = 0;
+    for (; i + 16 <= size; i += 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i*)(buf + i));
+        __m128i eq = _mm_or_si128(_mm_cmpeq_epi8(chunk, va), _mm_cmpeq_epi8(chunk, vb));
+        unsigned mask = (unsigned)_mm_movemask_epi8(eq);
+        if (mask) {
+            return i + (size_t)__builtin_ctz(mask);
+        }
+    }
+    return i + find2_scalar(buf + i, size - i, a, b);
+}
+
+// bit j is set if "\r\n\r\n" starts at buf[j], looking at four shifted loads
+__attribute__((target("sse2"))) static size_t find_terminator_sse2(const char* buf, size_t size) {
+    const __m128i cr = _mm_set1_epi8('\r');
+    const __m128i lf = _mm_set1_epi8('\n');
+    size_t i = 0;
+    for (; i + 16 + 3 <= size; i += 16) {
+        __m128i c0 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(buf + i)), cr);
+        __m128i c1 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(buf + i + 1)), lf);
+        __m128i c2 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(buf + i + 2)), cr);
+        __m128i c3 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(buf + i + 3)), lf);
+        __m128i eq = _mm_and_si128(_mm_and_si128(c0, c1), _mm_and_si128(c2, c3));
+        unsigned mask = (unsigned)_mm_movemask_epi8(eq);
+        if (mask) {
+            return i + (size_t)__builtin_ctz(mask);
+        }
+    }
+    size_t rest = find_terminator_scalar(buf + i, size - i);
+    return rest == size - i ? size : i + rest;
+}
+
+__attribute__((target("avx2"))) static size_t find2_avx2(const char* buf, size_t size, char a, char b) {
+    const __m256i va = _mm256_set1_epi8(a);
+    const __m256i vb = _mm256_set1_epi8(b);
+    size_t i = 0;
+    for (; i + 32 <= size; i += 32) {
+        __m256i chunk = _mm256_loadu_si256((const __m256i*)(buf + i));
+        __m256i eq = _mm256_or_si256(_mm256_cmpeq_epi8(chunk, va), _mm256_cmpeq_epi8(chunk, vb));
+        uint32_t mask = (uint32_t)_mm256_movemask_epi8(eq);
+        if (mask) {
+            return i + (size_t)__builtin_ctz(mask);
+        }
+    }
+    // header lines are short, so the tail matters. the sse2 code isn't vex
+    // encoded, leaving the upper halves dirty would make it stall.
+    _mm256_zeroupper();
+    return i + find2_sse2(buf + i, size - i, a, b);
+}
+
+__attribute__((target("avx2"))) static size_t find_terminator_avx2(const char* buf, size_t size) {
+    const __m256i cr = _mm256_set1_epi8('\r');
+    const __m256i lf = _mm256_set1_epi8('\n');
+    size_t i = 0;
+    for (; i + 32 + 3 <= size; i += 32) {
+        __m256i c0 = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(buf + i)), cr);
+        __m256i c1 = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(buf + i + 1)), lf);
+        __m256i c2 = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(buf + i + 2)), cr);
+        __m256i c3 = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(buf + i + 3)), lf);
+        __m256i eq = _mm256_and_si256(_mm256_and_si256(c0, c1), _mm256_and_si256(c2, c3));
+        uint32_t mask = (uint32_t)_mm256_movemask_epi8(eq);
+        if (mask) {
+            return i + (size_t)__builtin_ctz(mask);
+        }
+    }
+    _mm256_zeroupper();
+    size_t rest = find_terminator_sse2(buf + i, size - i);
+    return rest == size - i ? size : i + rest;
+}
+
+#endif
+
+static const http_scan_impl impls[HTTP_SCAN_LEVEL_COUNT] = {
+    [HTTP_SCAN_SCALAR] = { find2_scalar, find_terminator_scalar },
+#ifdef HTTP_SCAN_X86
+    [HTTP_SCAN_SSE2] = { find2_sse2, find_terminator_sse2 },
+    [HTTP_SCAN_AVX2] = { find2_avx2, find_terminator_avx2 },
+#endif
+};
+
+// scalar until the constructor below has run
+http_scan_impl http_scan = { find2_scalar, find_terminator_scalar };
+
+http_scan_level http_scan_best_level(void) {
+#ifdef HTTP_SCAN_X86
+    // cpuid, which also checks that the os saves the ymm registers
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        return HTTP_SCAN_AVX2;
+    }
+    if (__builtin_cpu_supports("sse2")) {
+        return HTTP_SCAN_SSE2;
+    }
+#endif
+    return HTTP_SCAN_SCALAR;
+}
+
+bool http_scan_use_level(http_scan_level level) {
+    if (level >= HTTP_SCAN_LEVEL_COUNT || level > http_scan_best_level()) {
+        return false;
+    }
+    http_scan = impls[level];
+    return true;
+}
+
+const char* http_scan_level_name(http_scan_level level) {
+    switch (level) {
+    case HTTP_SCAN_SCALAR:
+        return "scalar";
+    case HTTP_SCAN_SSE2:
+        return "sse2";
+    case HTTP_SCAN_AVX2:
+        return "avx2";
+    default:
+        return "unknown";
+    }
+}
+
+__attribute__((constructor)) static void http_scan_init(void) {
+    http_scan_use_level(http_scan_best_level());
+}
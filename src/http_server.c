@@ -1,15 +1,26 @@
 #include "http_server.h"
 
+#include "http_compress.h"
+#include "http_date.h"
+#include "http_metrics.h"
+#include "http_mime.h"
+#include "http_scan.h"
 #include "logging.h"
 #include "memory.h"
 
 #include <assert.h>
 #include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <netdb.h>
+#include <stddef.h>
 #include <signal.h>
+#include <limits.h>
 #include <stdlib.h>
+#include <strings.h>
+#include <sys/sendfile.h>
 #include <sys/stat.h>
+#include <time.h>
 #include <unistd.h>
 
 http_server* http_server_new(http_error_t* ep) {
@@ -20,471 +31,2369 @@ http_server* http_server_new(http_error_t* ep) {
     }
     server->socket = 0;
     server->backlog = 1;
+    server->accept_batch = 0;
+    server->reuse_port = false;
+    server->file_cache = NULL;
+    server->variant_cache = NULL;
+    server->path_cache = NULL;
+    server->fd_cache = NULL;
+    server->keep_alive_timeout_ms = 0;
+    server->header_timeout_ms = 0;
+    server->write_timeout_ms = 0;
+    server->root_fd = -1;
+    http_slab_init(&server->clients, sizeof(http_client));
     if (getcwd(server->cwd, sizeof(server->cwd)) == NULL) {
         *ep = http_new_error_error("getcwd() failed, server's cwd is not set");
+        return server;
+    }
+    server->cwd_len = strcmp(server->cwd, "/") == 0 ? 0 : strlen(server->cwd);
+    server->root_fd = open(server->cwd, O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if (server->root_fd < 0) {
+        perror("open");
+        *ep = http_new_error_error("failed to open the server's cwd");
     }
     return server;
 }
 
 void http_server_free(http_server* server) {
+    if (server) {
+        if (server->root_fd >= 0) {
+            close(server->root_fd);
+        }
+        http_slab_destroy(&server->clients);
+    }
     free(server);
 }
 
-static void handle_sigalarm(int sig) {
-    (void)sig;
-    // do nothing
+static void handle_sigalarm(int sig) {
+    (void)sig;
+    // do nothing
+}
+
+void http_server_start(http_server* server, uint16_t port, http_error_t* ep) {
+    assert(server);
+    *ep = http_new_error_ok();
+    server->socket = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (server->socket == -1) {
+        perror("socket");
+        *ep = http_new_error_error("socket() failed");
+        return;
+    }
+    log_info("%s", "socket created");
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(struct sockaddr_in));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_ANY);
+    address.sin_port = htons(port);
+    int flag = 1;
+    if (setsockopt(server->socket, SOL_SOCKET, SO_REUSEADDR, &flag, sizeof(flag)) < 0) {
+        perror("setsockopt");
+        log_warning("%s", "failed to set SO_REUSEADDR");
+    }
+    if (server->reuse_port && setsockopt(server->socket, SOL_SOCKET, SO_REUSEPORT, &flag, sizeof(flag)) < 0) {
+        perror("setsockopt");
+        *ep = http_new_error_error("failed to set SO_REUSEPORT");
+        return;
+    }
+    int ret = bind(server->socket, (struct sockaddr*)&address, sizeof(address));
+    if (ret != 0) {
+        perror("bind");
+        *ep = http_new_error_error("bind() failed");
+        return;
+    }
+    log_info("socket bound to port %d", port);
+    ret = listen(server->socket, server->backlog);
+    if (ret != 0) {
+        perror("bind");
+        *ep = http_new_error_error("listen() failed");
+        return;
+    }
+    log_info("listening on port %d", port);
+}
+
+http_client* http_server_accept_client(http_server* server, http_error_t* ep) {
+    assert(server);
+    *ep = http_new_error_ok();
+    struct sockaddr address;
+    socklen_t address_len = sizeof(address);
+    int fd;
+    do {
+        fd = accept4(server->socket, &address, &address_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    } while (fd < 0 && errno == EINTR);
+    if (fd < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            // no more pending connections
+            return NULL;
+        }
+        perror("accept4");
+        *ep = http_new_error_error("accept() failed");
+        return NULL;
+    }
+    http_client* client = http_server_add_client(server, fd, ep);
+    if (client) {
+        client->address = address;
+        client->address_len = address_len;
+    }
+    return client;
+}
+
+http_client* http_server_add_client(http_server* server, socket_t fd, http_error_t* ep) {
+    assert(server);
+    *ep = http_new_error_ok();
+    http_client* client = http_slab_alloc(&server->clients, ep);
+    if (http_is_error(*ep)) {
+        close(fd);
+        return NULL;
+    }
+    memset(client, 0, sizeof(http_client));
+    client->socket = fd;
+    // all good
+    client->accepted_ns = http_metrics_now_ns();
+    http_metrics_count_accept();
+    log_debug("new client accepted, fd %d", client->socket);
+    return client;
+}
+
+bool http_client_has_complete_header(const http_client* client) {
+    return client->parser.state == HTTP_PARSER_DONE || client->parser.state == HTTP_PARSER_ERROR;
+}
+
+void http_client_parse_received(http_client* client) {
+    if (client->body_remaining > 0) {
+        // the rest of the last request's body, which nobody reads
+        size_t n = client->body_remaining < client->read_buffer_len ? client->body_remaining : client->read_buffer_len;
+        client->read_buffer_len -= n;
+        client->body_remaining -= n;
+        memmove(client->read_buffer, client->read_buffer + n, client->read_buffer_len);
+        if (client->body_remaining > 0) {
+            return;
+        }
+    }
+    if (client->body_unknown) {
+        return;
+    }
+    if (http_parser_feed(&client->parser, client->read_buffer, client->read_buffer_len) != HTTP_PARSER_DONE
+        && client->read_buffer_len == sizeof(client->read_buffer)) {
+        // the parser can't make progress until something is consumed
+        client->parser.state = HTTP_PARSER_ERROR;
+        client->parser.error = "request header too large";
+    }
+}
+
+// sets up skipping the body of the request that was just parsed. returns
+// false if there's no way to know where it ends.
+static bool http_client_skip_body(http_client* client, const http_header* header) {
+    size_t len = 0;
+    if (http_header_get_known(header, HTTP_HEADER_TRANSFER_ENCODING, &len)) {
+        client->body_unknown = true;
+        return false;
+    }
+    const char* value = http_header_get_known(header, HTTP_HEADER_CONTENT_LENGTH, &len);
+    if (!value) {
+        return true;
+    }
+    size_t content_length = 0;
+    for (size_t i = 0; i < len; ++i) {
+        if (value[i] < '0' || value[i] > '9' || content_length > (SIZE_MAX - 9) / 10) {
+            client->body_unknown = true;
+            return false;
+        }
+        content_length = content_length * 10 + (size_t)(value[i] - '0');
+    }
+    client->body_remaining = content_length;
+    return true;
+}
+
+static bool copy_slice(char* dest, size_t dest_size, const char* buf, http_slice slice) {
+    if (slice.len >= dest_size) {
+        return false;
+    }
+    memcpy(dest, buf + slice.offset, slice.len);
+    dest[slice.len] = '\0';
+    return true;
+}
+
+void http_client_receive_header(http_client* client, http_header* header, http_error_t* ep) {
+    assert(client);
+    assert(header);
+    *ep = http_new_error_ok();
+
+    memset(header, 0, sizeof(*header));
+
+    http_parser* parser = &client->parser;
+    if (parser->state == HTTP_PARSER_ERROR) {
+        *ep = http_new_error_error(parser->error);
+        return;
+    }
+    if (parser->state != HTTP_PARSER_DONE) {
+        *ep = http_new_error_error("incomplete header");
+        return;
+    }
+    size_t n = parser->header_size;
+    memcpy(header->buffer, client->read_buffer, n);
+    header->buffer[n] = '\0';
+    header->size = n;
+    header->start_of_headers = parser->start_of_headers;
+    memcpy(header->fields, parser->fields, parser->fields_count * sizeof(http_header_field));
+    header->fields_count = parser->fields_count;
+    memcpy(header->known, parser->known, sizeof(header->known));
+    if (!copy_slice(header->method, sizeof(header->method), header->buffer, parser->method)) {
+        *ep = http_new_error_error("failed to parse METHOD");
+    } else if (!copy_slice(header->target, sizeof(header->target), header->buffer, parser->target)) {
+        *ep = http_new_error_error("failed to parse TARGET");
+    } else if (!copy_slice(header->version, sizeof(header->version), header->buffer, parser->version)) {
+        *ep = http_new_error_error("failed to parse VERSION");
+    }
+
+    // keep whatever follows (pipelined requests) for the next call, and parse
+    // as much of it as is there
+    client->read_buffer_len -= n;
+    memmove(client->read_buffer, client->read_buffer + n, client->read_buffer_len);
+    http_parser_reset(parser);
+    if (!http_client_skip_body(client, header) && http_is_ok(*ep)) {
+        *ep = http_new_error_error("request body of unknown length");
+    }
+    http_client_parse_received(client);
+    if (http_is_error(*ep)) {
+        return;
+    }
+    //log_info("header: \nHEADER_START\n%s\nHEADER_END", header->buffer);
+
+    // Host is mandatory on HTTP/1.1
+    size_t host_len = 0;
+    const char* host = http_header_get_known(header, HTTP_HEADER_HOST, &host_len);
+    if (host && host_len < sizeof(header->host)) {
+        memcpy(header->host, host, host_len);
+        header->host[host_len] = '\0';
+    } else if (host || strcmp(header->version, "HTTP/1.1") == 0) {
+        *ep = http_new_error_error("missing or invalid Host");
+        return;
+    }
+    //log_info("parsed: '%s'", header->host);
+}
+
+ssize_t http_search_for_string(const char* in, size_t in_size, const char* what, size_t what_size) {
+    if (what_size == 0) {
+        return 0;
+    }
+    if (what_size == 4 && memcmp(what, "\r\n\r\n", 4) == 0) {
+        size_t i = http_scan_find_terminator(in, in_size);
+        return i == in_size ? -1 : (ssize_t)i;
+    }
+    // find candidates by their first byte, then compare the rest
+    size_t i = 0;
+    while (i + what_size <= in_size) {
+        i += http_scan_find(in + i, in_size - what_size + 1 - i, what[0]);
+        if (i + what_size > in_size) {
+            break;
+        }
+        if (memcmp(in + i + 1, what + 1, what_size - 1) == 0) {
+            return (ssize_t)i;
+        }
+        ++i;
+    }
+    return -1;
+}
+
+const char* http_header_get_known(const http_header* header, http_header_id id, size_t* value_len) {
+    if (id >= HTTP_HEADER_KNOWN_COUNT || header->known[id] == 0) {
+        return NULL;
+    }
+    const http_header_field* field = &header->fields[header->known[id] - 1];
+    *value_len = field->value_len;
+    return header->buffer + field->value_offset;
+}
+
+const char* http_header_get(const http_header* header, const char* fieldname, size_t* value_len) {
+    size_t name_len = strlen(fieldname);
+    http_header_id id = http_header_id_from_name(fieldname, name_len);
+    if (id != HTTP_HEADER_UNKNOWN) {
+        return http_header_get_known(header, id, value_len);
+    }
+    for (size_t i = 0; i < header->fields_count; ++i) {
+        const http_header_field* field = &header->fields[i];
+        if (field->name_len == name_len && strncasecmp(header->buffer + field->name_offset, fieldname, name_len) == 0) {
+            *value_len = field->value_len;
+            return header->buffer + field->value_offset;
+        }
+    }
+    return NULL;
+}
+
+bool http_header_has_token(const http_header* header, http_header_id id, const char* token) {
+    size_t len = 0;
+    const char* value = http_header_get_known(header, id, &len);
+    if (!value) {
+        return false;
+    }
+    size_t token_len = strlen(token);
+    const char* end = value + len;
+    while (value < end) {
+        while (value < end && (*value == ',' || *value == ' ' || *value == '\t')) {
+            ++value;
+        }
+        const char* item_end = value;
+        while (item_end < end && *item_end != ',') {
+            ++item_end;
+        }
+        const char* trimmed_end = item_end;
+        while (trimmed_end > value && (trimmed_end[-1] == ' ' || trimmed_end[-1] == '\t')) {
+            --trimmed_end;
+        }
+        if ((size_t)(trimmed_end - value) == token_len && strncasecmp(value, token, token_len) == 0) {
+            return true;
+        }
+        value = item_end;
+    }
+    return false;
+}
+
+void http_header_parse_field(http_header* header, char* value_buf, size_t value_buf_size, const char* fieldname, http_error_t* ep) {
+    *ep = http_new_error_ok();
+    size_t len = 0;
+    const char* value = http_header_get(header, fieldname, &len);
+    if (!value) {
+        *ep = http_new_error_error("field not found");
+        return;
+    }
+    if (value_buf_size <= len) {
+        *ep = http_new_error_error("buffer too small to fit value of field");
+        return;
+    }
+    memcpy(value_buf, value, len);
+    value_buf[len] = '\0';
+}
+
+// whether `iov` points into the memory of `entry`
+static bool http_file_cache_entry_holds(const http_file_cache_entry* entry, const struct iovec* iov) {
+    if (!entry) {
+        return false;
+    }
+    const char* base = iov->iov_base;
+    if (base >= entry->body && base + iov->iov_len <= entry->body + entry->body_size) {
+        return true;
+    }
+    for (size_t i = 0; i < HTTP_FILE_CACHE_HEADER_COUNT; ++i) {
+        if (base >= entry->headers[i] && base + iov->iov_len <= entry->headers[i] + entry->header_sizes[i]) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void http_client_append_pending(http_client* client, http_pending_output* output) {
+    output->next = NULL;
+    if (client->pending_tail) {
+        client->pending_tail->next = output;
+    } else {
+        client->pending = output;
+    }
+    client->pending_tail = output;
+}
+
+// queues `iov` behind the pending output. buffers which point into one of
+// `owners` are queued by reference, the rest is copied.
+static void http_client_queue_iov(http_client* client, const struct iovec* iov, size_t iov_count,
+    http_file_cache_entry* const* owners, size_t owners_count, http_error_t* ep) {
+    *ep = http_new_error_ok();
+    for (size_t i = 0; i < iov_count; ++i) {
+        if (iov[i].iov_len == 0) {
+            continue;
+        }
+        http_file_cache_entry* owner = NULL;
+        for (size_t k = 0; k < owners_count && !owner; ++k) {
+            if (http_file_cache_entry_holds(owners[k], &iov[i])) {
+                owner = owners[k];
+            }
+        }
+        http_pending_output* output = safe_malloc(sizeof(http_pending_output) + (owner ? 0 : iov[i].iov_len), ep);
+        if (http_is_error(*ep)) {
+            return;
+        }
+        if (owner) {
+            atomic_fetch_add(&owner->refcount, 1);
+            output->data = iov[i].iov_base;
+        } else {
+            memcpy(output->copy, iov[i].iov_base, iov[i].iov_len);
+            output->data = output->copy;
+        }
+        output->entry = owner;
+        output->fd = -1;
+        output->offset = 0;
+        output->size = iov[i].iov_len;
+        http_client_append_pending(client, output);
+    }
+}
+
+// queues `size` bytes of `fd` from `offset` behind the pending output.
+// `fd` stays the caller's, the queue keeps a dup of it.
+static void http_client_queue_file(http_client* client, int fd, off_t offset, size_t size, http_error_t* ep) {
+    *ep = http_new_error_ok();
+    http_pending_output* output = safe_malloc(sizeof(http_pending_output), ep);
+    if (http_is_error(*ep)) {
+        return;
+    }
+    output->fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+    if (output->fd < 0) {
+        perror("fcntl");
+        free(output);
+        *ep = http_new_error_error("failed to dup file for pending output");
+        return;
+    }
+    output->data = NULL;
+    output->entry = NULL;
+    output->offset = offset;
+    output->size = size;
+    http_client_append_pending(client, output);
+}
+
+static void http_pending_output_free(http_pending_output* output) {
+    if (output->fd >= 0) {
+        close(output->fd);
+    }
+    http_file_cache_entry_release(output->entry);
+    free(output);
+}
+
+bool http_client_has_pending(const http_client* client) {
+    return client->pending != NULL;
+}
+
+void http_client_drop_pending(http_client* client) {
+    while (client->pending) {
+        http_pending_output* next = client->pending->next;
+        http_pending_output_free(client->pending);
+        client->pending = next;
+    }
+    client->pending_tail = NULL;
+}
+
+// drops the first `n` bytes of the pending output
+static void http_client_consume_pending(http_client* client, size_t n) {
+    while (client->pending && n >= client->pending->size) {
+        n -= client->pending->size;
+        http_pending_output* next = client->pending->next;
+        http_pending_output_free(client->pending);
+        client->pending = next;
+    }
+    if (client->pending) {
+        client->pending->data += n;
+        client->pending->size -= n;
+    } else {
+        client->pending_tail = NULL;
+    }
+}
+
+void http_client_send_pending(http_client* client, http_error_t* ep) {
+    *ep = http_new_error_ok();
+    while (client->pending) {
+        http_pending_output* first = client->pending;
+        ssize_t sent;
+        if (first->fd >= 0) {
+            sent = sendfile(client->socket, first->fd, &first->offset, first->size);
+            if (sent == 0) {
+                *ep = http_new_error_error("sendfile() hit end of file early");
+                return;
+            }
+        } else {
+            // consecutive buffers go out together
+            struct iovec iov[HTTP_RESPONSE_BATCH_IOV_MAX];
+            size_t iov_count = 0;
+            for (http_pending_output* output = first; output && output->fd < 0 && iov_count < HTTP_RESPONSE_BATCH_IOV_MAX; output = output->next) {
+                iov[iov_count].iov_base = (void*)output->data;
+                iov[iov_count].iov_len = output->size;
+                ++iov_count;
+            }
+            struct msghdr msg;
+            memset(&msg, 0, sizeof(msg));
+            msg.msg_iov = iov;
+            msg.msg_iovlen = iov_count;
+            sent = sendmsg(client->socket, &msg, MSG_NOSIGNAL);
+        }
+        if (sent < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                // the reactor tells us when there's room again
+                return;
+            }
+            perror(first->fd >= 0 ? "sendfile" : "sendmsg");
+            *ep = http_new_error_error("failed to send pending output");
+            return;
+        }
+        http_metrics_count_bytes((size_t)sent);
+        if (first->fd >= 0) {
+            // sendfile advanced the offset
+            first->size -= (size_t)sent;
+            if (first->size == 0) {
+                http_client_consume_pending(client, 0);
+            }
+        } else {
+            http_client_consume_pending(client, (size_t)sent);
+        }
+    }
+}
+
+// sends `size` bytes of `fd` from `offset`, or queues what doesn't fit into
+// the socket's send buffer behind the pending output
+static void http_client_sendfile_all(http_client* client, int fd, off_t offset, size_t size, http_error_t* ep) {
+    *ep = http_new_error_ok();
+    if (client->head_only) {
+        // only ever a body
+        return;
+    }
+    while (size > 0 && !client->pending) {
+        // sendfile advances offset by however much it sent
+        ssize_t sent = sendfile(client->socket, fd, &offset, size);
+        if (sent < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            perror("sendfile");
+            *ep = http_new_error_error("sendfile() failed");
+            return;
+        }
+        if (sent == 0) {
+            // file shrunk since we stat'd it, the response can't be completed
+            *ep = http_new_error_error("sendfile() hit end of file early");
+            return;
+        }
+        size -= (size_t)sent;
+        http_metrics_count_bytes((size_t)sent);
+    }
+    if (size > 0) {
+        http_client_queue_file(client, fd, offset, size, ep);
+    }
+}
+
+typedef struct {
+    int code;
+    const char* line;
+    size_t size;
+} http_status_line;
+
+#define HTTP_STATUS_LINE(code, reason) \
+    { code, "HTTP/1.1 " #code " " reason CRLF, sizeof("HTTP/1.1 " #code " " reason CRLF) - 1 }
+
+// every status this server sends, pre-rendered
+static const http_status_line http_status_lines[] = {
+    HTTP_STATUS_LINE(200, "OK"),
+    HTTP_STATUS_LINE(206, "Partial Content"),
+    HTTP_STATUS_LINE(304, "Not Modified"),
+    HTTP_STATUS_LINE(400, "Bad Request"),
+    HTTP_STATUS_LINE(403, "Forbidden"),
+    HTTP_STATUS_LINE(404, "Not Found"),
+    HTTP_STATUS_LINE(405, "Method Not Allowed"),
+    HTTP_STATUS_LINE(416, "Range Not Satisfiable"),
+    HTTP_STATUS_LINE(500, "Internal Server Error"),
+};
+
+static const http_status_line* http_status_line_of(int code) {
+    for (size_t i = 0; i < sizeof(http_status_lines) / sizeof(http_status_lines[0]); ++i) {
+        if (http_status_lines[i].code == code) {
+            return &http_status_lines[i];
+        }
+    }
+    assert(!"status without a status line");
+    return &http_status_lines[sizeof(http_status_lines) / sizeof(http_status_lines[0]) - 1];
+}
+
+static const char http_connection_keep_alive_line[] = "Connection: keep-alive" CRLF;
+static const char http_connection_close_line[] = "Connection: close" CRLF;
+
+// appends `size` bytes of `src` at `*out`, false if that would pass `end`
+static bool http_append(char** out, const char* end, const char* src, size_t size) {
+    if ((size_t)(end - *out) < size) {
+        return false;
+    }
+    memcpy(*out, src, size);
+    *out += size;
+    return true;
+}
+
+static const char http_digit_pairs[] = "00010203040506070809"
+                                       "10111213141516171819"
+                                       "20212223242526272829"
+                                       "30313233343536373839"
+                                       "40414243444546474849"
+                                       "50515253545556575859"
+                                       "60616263646566676869"
+                                       "70717273747576777879"
+                                       "80818283848586878889"
+                                       "90919293949596979899";
+
+// writes `value` in decimal to `out`, without a NUL, and returns the number
+// of digits. two at a time, from the back.
+static size_t http_format_u64(char out[20], uint64_t value) {
+    char buf[20];
+    char* p = buf + sizeof(buf);
+    while (value >= 100) {
+        p -= 2;
+        memcpy(p, http_digit_pairs + (value % 100) * 2, 2);
+        value /= 100;
+    }
+    if (value >= 10) {
+        p -= 2;
+        memcpy(p, http_digit_pairs + value * 2, 2);
+    } else {
+        *--p = (char)('0' + value);
+    }
+    size_t len = (size_t)(buf + sizeof(buf) - p);
+    memcpy(out, p, len);
+    return len;
+}
+
+// the end of every header: the Date line, then the empty line
+#define HTTP_HEADER_TAIL_LEN (HTTP_DATE_LINE_LEN + 2)
+
+static void http_format_header_tail(char out[HTTP_HEADER_TAIL_LEN]) {
+    http_date_line(out);
+    memcpy(out + HTTP_DATE_LINE_LEN, CRLF, 2);
+}
+
+// returns the size of the header written into `header`. it always ends with
+// the Date line and an empty line, HTTP_HEADER_TAIL_LEN bytes which headers
+// rendered ahead of time replace with the current ones.
+static size_t http_format_header(char* header, size_t header_size, size_t body_size, const http_header_data* header_data) {
+    static const char content_type[] = "Content-Type: ";
+    static const char content_length[] = "Content-Length: ";
+    char* out = header;
+    const char* end = header + header_size;
+    const http_status_line* status = http_status_line_of(header_data->status_code);
+    bool ok = http_append(&out, end, status->line, status->size);
+    if (strcmp(header_data->connection, "close") == 0) {
+        ok = ok && http_append(&out, end, http_connection_close_line, sizeof(http_connection_close_line) - 1);
+    } else {
+        ok = ok && http_append(&out, end, http_connection_keep_alive_line, sizeof(http_connection_keep_alive_line) - 1);
+    }
+    // a 304 describes the representation the client already has, so no
+    // Content-Type or Content-Length
+    if (header_data->status_code != 304) {
+        char length[20];
+        size_t length_len = http_format_u64(length, body_size);
+        ok = ok && http_append(&out, end, content_type, sizeof(content_type) - 1)
+            && http_append(&out, end, header_data->content_type, strlen(header_data->content_type))
+            && http_append(&out, end, CRLF, 2)
+            && http_append(&out, end, content_length, sizeof(content_length) - 1)
+            && http_append(&out, end, length, length_len)
+            && http_append(&out, end, CRLF, 2);
+    }
+    if (header_data->extra_headers) {
+        ok = ok && http_append(&out, end, header_data->extra_headers, strlen(header_data->extra_headers));
+    }
+    ok = ok && http_append(&out, end, header_data->additional_headers, strlen(header_data->additional_headers));
+    if (!ok || (size_t)(end - out) < HTTP_HEADER_TAIL_LEN) {
+        return 0;
+    }
+    http_format_header_tail(out);
+    out += HTTP_HEADER_TAIL_LEN;
+    return (size_t)(out - header);
+}
+
+// sends all of `iov`, resuming after partial writes, or queues what doesn't
+// fit into the socket's send buffer behind the pending output, see
+// http_client_queue_iov for `owners`. modifies `iov`.
+static void http_client_send_iov_all(http_client* client, struct iovec* iov, size_t iov_count, int flags,
+    http_file_cache_entry* const* owners, size_t owners_count, http_error_t* ep) {
+    *ep = http_new_error_ok();
+    // skip leading empty buffers
+    while (iov_count > 0 && iov->iov_len == 0) {
+        ++iov;
+        --iov_count;
+    }
+    while (iov_count > 0 && !client->pending) {
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = iov_count < IOV_MAX ? iov_count : IOV_MAX;
+        ssize_t written = sendmsg(client->socket, &msg, flags | MSG_NOSIGNAL);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            perror("sendmsg");
+            *ep = http_new_error_error("sendmsg() failed");
+            return;
+        }
+        http_metrics_count_bytes((size_t)written);
+        // drop fully sent buffers, then advance into the partially sent one
+        size_t n = (size_t)written;
+        while (iov_count > 0 && n >= iov->iov_len) {
+            n -= iov->iov_len;
+            ++iov;
+            --iov_count;
+        }
+        if (iov_count > 0) {
+            iov->iov_base = (char*)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    if (iov_count > 0) {
+        http_client_queue_iov(client, iov, iov_count, owners, owners_count, ep);
+    }
+}
+
+void http_client_begin_batch(http_client* client, http_response_batch* batch) {
+    memset(batch, 0, offsetof(http_response_batch, buffer));
+    batch->buffer_len = 0;
+    client->batch = batch;
+}
+
+static void http_response_batch_reset(http_response_batch* batch) {
+    for (size_t i = 0; i < batch->entries_count; ++i) {
+        http_file_cache_entry_release(batch->entries[i]);
+    }
+    batch->entries_count = 0;
+    batch->iov_count = 0;
+    batch->buffer_len = 0;
+}
+
+// sends everything batched so far followed by `iov`, in one go. `entry`
+// is what `iov` may point into, or NULL.
+static void http_client_flush_with(http_client* client, const struct iovec* iov, size_t iov_count,
+    http_file_cache_entry* entry, int flags, http_error_t* ep) {
+    http_response_batch* batch = client->batch;
+    if (!batch || batch->iov_count == 0) {
+        if (iov_count == 0) {
+            return;
+        }
+        struct iovec copy[HTTP_SERVE_IOV_MAX + 1];
+        memcpy(copy, iov, iov_count * sizeof(struct iovec));
+        http_client_send_iov_all(client, copy, iov_count, flags, &entry, 1, ep);
+        return;
+    }
+    struct iovec all[HTTP_RESPONSE_BATCH_IOV_MAX + HTTP_SERVE_IOV_MAX + 1];
+    memcpy(all, batch->iov, batch->iov_count * sizeof(struct iovec));
+    memcpy(all + batch->iov_count, iov, iov_count * sizeof(struct iovec));
+    http_file_cache_entry* owners[HTTP_RESPONSE_BATCH_IOV_MAX + 1];
+    memcpy(owners, batch->entries, batch->entries_count * sizeof(http_file_cache_entry*));
+    owners[batch->entries_count] = entry;
+    http_client_send_iov_all(client, all, batch->iov_count + iov_count, flags, owners, batch->entries_count + 1, ep);
+    http_response_batch_reset(batch);
+}
+
+void http_client_flush(http_client* client, http_error_t* ep) {
+    *ep = http_new_error_ok();
+    http_client_flush_with(client, NULL, 0, NULL, 0, ep);
+}
+
+void http_client_end_batch(http_client* client, http_error_t* ep) {
+    http_client_flush(client, ep);
+    if (client->batch) {
+        // also releases references if the flush failed
+        http_response_batch_reset(client->batch);
+    }
+    client->batch = NULL;
+}
+
+// copies `iov` to the end of the batch's buffer, which must have room
+static void http_response_batch_copy(http_response_batch* batch, const struct iovec* iov) {
+    char* dest = batch->buffer + batch->buffer_len;
+    memcpy(dest, iov->iov_base, iov->iov_len);
+    struct iovec* last = batch->iov_count > 0 ? &batch->iov[batch->iov_count - 1] : NULL;
+    if (last && (char*)last->iov_base + last->iov_len == dest) {
+        // follows the previous copy, so one iovec covers both
+        last->iov_len += iov->iov_len;
+    } else {
+        batch->iov[batch->iov_count].iov_base = dest;
+        batch->iov[batch->iov_count].iov_len = iov->iov_len;
+        ++batch->iov_count;
+    }
+    batch->buffer_len += iov->iov_len;
+}
+
+// sends a response, or queues it if the client is batching. the parts of
+// `iov` which point into `entry` are queued by reference, keeping it alive,
+// the rest is copied if it's small enough. with `more`, the body follows in
+// another call, so it's sent right away.
+static void http_client_send_response(http_client* client, const struct iovec* iov, size_t iov_count,
+    http_file_cache_entry* entry, bool more, http_error_t* ep) {
+    *ep = http_new_error_ok();
+    struct iovec head[HTTP_SERVE_IOV_MAX + 1];
+    if (client->head_only) {
+        if (client->head_done) {
+            return;
+        }
+        // keep everything up to the empty line which ends the header
+        size_t i = 0;
+        const char* blank = NULL;
+        for (; i < iov_count && !blank; ++i) {
+            blank = memmem(iov[i].iov_base, iov[i].iov_len, CRLF CRLF, 4);
+        }
+        if (blank && i <= sizeof(head) / sizeof(head[0])) {
+            memcpy(head, iov, i * sizeof(struct iovec));
+            head[i - 1].iov_len = (size_t)(blank + 4 - (const char*)head[i - 1].iov_base);
+            iov = head;
+            iov_count = i;
+            more = false;
+            client->head_done = true;
+        }
+    }
+    http_response_batch* batch = client->batch;
+    if (batch && !more && batch->iov_count + iov_count <= HTTP_RESPONSE_BATCH_IOV_MAX
+        && (!entry || batch->entries_count < HTTP_RESPONSE_BATCH_IOV_MAX)) {
+        size_t copy_size = 0;
+        for (size_t i = 0; i < iov_count; ++i) {
+            if (!http_file_cache_entry_holds(entry, &iov[i])) {
+                copy_size += iov[i].iov_len;
+            }
+        }
+        if (copy_size <= sizeof(batch->buffer) - batch->buffer_len) {
+            for (size_t i = 0; i < iov_count; ++i) {
+                if (http_file_cache_entry_holds(entry, &iov[i])) {
+                    batch->iov[batch->iov_count++] = iov[i];
+                } else {
+                    http_response_batch_copy(batch, &iov[i]);
+                }
+            }
+            if (entry) {
+                atomic_fetch_add(&entry->refcount, 1);
+                batch->entries[batch->entries_count++] = entry;
+            }
+            return;
+        }
+    }
+    http_client_flush_with(client, iov, iov_count, entry, more ? MSG_MORE : 0, ep);
+}
+
+void http_client_serve(http_client* client, const char* body, size_t body_size, http_header_data* header_data, http_error_t* ep) {
+    struct iovec body_iov = { .iov_base = (void*)body, .iov_len = body_size };
+    http_client_serve_iov(client, &body_iov, 1, header_data, ep);
+}
+
+void http_client_serve_iov(http_client* client, const struct iovec* body, size_t body_count, http_header_data* header_data, http_error_t* ep) {
+    *ep = http_new_error_ok();
+    if (body_count > HTTP_SERVE_IOV_MAX) {
+        *ep = http_new_error_error("too many body buffers");
+        return;
+    }
+    size_t body_size = 0;
+    for (size_t i = 0; i < body_count; ++i) {
+        body_size += body[i].iov_len;
+    }
+    char header[HTTP_HEADER_SIZE_MAX];
+    size_t header_size = http_format_header(header, sizeof(header), body_size, header_data);
+    if (header_size == 0) {
+        *ep = http_new_error_error("response header too large");
+        return;
+    }
+    // header and body go out together, without being copied into one buffer
+    struct iovec iov[HTTP_SERVE_IOV_MAX + 1];
+    iov[0].iov_base = header;
+    iov[0].iov_len = header_size;
+    memcpy(iov + 1, body, body_count * sizeof(struct iovec));
+    client->status = header_data->status_code;
+    http_client_send_response(client, iov, body_count + 1, NULL, false, ep);
+}
+
+void http_client_serve_fd(http_client* client, int fd, off_t offset, size_t size, http_header_data* header_data, http_error_t* ep) {
+    *ep = http_new_error_ok();
+    char header[HTTP_HEADER_SIZE_MAX];
+    size_t header_size = http_format_header(header, sizeof(header), size, header_data);
+    if (header_size == 0) {
+        *ep = http_new_error_error("response header too large");
+        return;
+    }
+    // MSG_MORE lets the kernel put the start of the body in the same segment
+    struct iovec iov = { .iov_base = header, .iov_len = header_size };
+    client->status = header_data->status_code;
+    http_client_send_response(client, &iov, 1, NULL, size > 0, ep);
+    if (http_is_error(*ep)) {
+        return;
+    }
+    http_client_sendfile_all(client, fd, offset, size, ep);
+}
+
+// what the root and error pages are served with
+static const struct {
+    int status_code;
+    const char* body;
+    const size_t* body_size;
+    const char* extra_headers;
+} http_fixed_pages[HTTP_FIXED_RESPONSE_COUNT] = {
+    [HTTP_FIXED_ROOT_PAGE] = { 200, http_server_rootpage, &http_server_rootpage_size },
+    [HTTP_FIXED_400] = { 400, http_server_err_400_page, &http_server_err_400_page_size },
+    [HTTP_FIXED_403] = { 403, http_server_err_403_page, &http_server_err_403_page_size },
+    [HTTP_FIXED_404] = { 404, http_server_err_404_page, &http_server_err_404_page_size },
+    [HTTP_FIXED_405] = { 405, http_server_err_405_page, &http_server_err_405_page_size, "Allow: GET, HEAD" CRLF },
+    [HTTP_FIXED_500] = { 500, http_server_err_500_page, &http_server_err_500_page_size },
+};
+
+// header and body of each page, one per http_file_cache_header_kind.
+// written once before any server starts, read-only after that.
+static struct {
+    // what they were rendered with, NULL if they weren't
+    const char* additional_headers;
+    char data[HTTP_FIXED_RESPONSE_COUNT][HTTP_FILE_CACHE_HEADER_COUNT][HTTP_FIXED_RESPONSE_SIZE_MAX];
+    size_t header_sizes[HTTP_FIXED_RESPONSE_COUNT][HTTP_FILE_CACHE_HEADER_COUNT];
+    size_t sizes[HTTP_FIXED_RESPONSE_COUNT][HTTP_FILE_CACHE_HEADER_COUNT];
+} s_fixed_responses;
+
+void http_fixed_responses_init(const char* additional_headers, http_error_t* ep) {
+    *ep = http_new_error_ok();
+    s_fixed_responses.additional_headers = NULL;
+    const char* connections[HTTP_FILE_CACHE_HEADER_COUNT];
+    connections[HTTP_FILE_CACHE_KEEP_ALIVE] = "keep-alive";
+    connections[HTTP_FILE_CACHE_CLOSE] = "close";
+    for (size_t i = 0; i < HTTP_FIXED_RESPONSE_COUNT; ++i) {
+        size_t body_size = *http_fixed_pages[i].body_size;
+        for (size_t k = 0; k < HTTP_FILE_CACHE_HEADER_COUNT; ++k) {
+            http_header_data hdr = {
+                .status_code = http_fixed_pages[i].status_code,
+                .content_type = "text/html",
+                .connection = connections[k],
+                .additional_headers = additional_headers,
+                .extra_headers = http_fixed_pages[i].extra_headers,
+            };
+            char* data = s_fixed_responses.data[i][k];
+            size_t header_size = http_format_header(data, HTTP_FIXED_RESPONSE_SIZE_MAX, body_size, &hdr);
+            if (header_size == 0 || HTTP_FIXED_RESPONSE_SIZE_MAX - header_size < body_size) {
+                *ep = http_new_error_error("fixed response too large");
+                return;
+            }
+            memcpy(data + header_size, http_fixed_pages[i].body, body_size);
+            s_fixed_responses.header_sizes[i][k] = header_size;
+            s_fixed_responses.sizes[i][k] = header_size + body_size;
+        }
+    }
+    s_fixed_responses.additional_headers = additional_headers;
+}
+
+void http_client_serve_fixed(http_client* client, http_fixed_response response, const http_header_data* template_hdr_data, http_error_t* ep) {
+    *ep = http_new_error_ok();
+    if (!s_fixed_responses.additional_headers
+        || template_hdr_data->additional_headers != s_fixed_responses.additional_headers) {
+        http_header_data this_hdr = *template_hdr_data;
+        this_hdr.content_type = "text/html";
+        this_hdr.status_code = http_fixed_pages[response].status_code;
+        this_hdr.extra_headers = http_fixed_pages[response].extra_headers;
+        http_client_serve(client, http_fixed_pages[response].body, *http_fixed_pages[response].body_size, &this_hdr, ep);
+        return;
+    }
+    http_file_cache_header_kind kind = strcmp(template_hdr_data->connection, "close") == 0
+        ? HTTP_FILE_CACHE_CLOSE
+        : HTTP_FILE_CACHE_KEEP_ALIVE;
+    char* data = s_fixed_responses.data[response][kind];
+    size_t header_size = s_fixed_responses.header_sizes[response][kind];
+    // the date is the only part which isn't fixed
+    char tail[HTTP_HEADER_TAIL_LEN];
+    http_format_header_tail(tail);
+    struct iovec iov[3] = {
+        { .iov_base = data, .iov_len = header_size - HTTP_HEADER_TAIL_LEN },
+        { .iov_base = tail, .iov_len = HTTP_HEADER_TAIL_LEN },
+        { .iov_base = data + header_size, .iov_len = s_fixed_responses.sizes[response][kind] - header_size },
+    };
+    client->status = http_fixed_pages[response].status_code;
+    http_client_send_response(client, iov, 3, NULL, false, ep);
+}
+
+void http_client_serve_400(http_client* client, const http_header_data* template_hdr_data, http_error_t* ep) {
+    http_client_serve_fixed(client, HTTP_FIXED_400, template_hdr_data, ep);
+}
+
+void http_client_serve_404(http_client* client, const http_header_data* template_hdr_data, http_error_t* ep) {
+    http_client_serve_fixed(client, HTTP_FIXED_404, template_hdr_data, ep);
+}
+
+void http_client_serve_403(http_client* client, const http_header_data* template_hdr_data, http_error_t* ep) {
+    http_client_serve_fixed(client, HTTP_FIXED_403, template_hdr_data, ep);
+}
+
+void http_client_serve_405(http_client* client, const http_header_data* template_hdr_data, http_error_t* ep) {
+    http_client_serve_fixed(client, HTTP_FIXED_405, template_hdr_data, ep);
+}
+
+void http_client_serve_500(http_client* client, const http_header_data* template_hdr_data, http_error_t* ep) {
+    http_client_serve_fixed(client, HTTP_FIXED_500, template_hdr_data, ep);
+}
+
+typedef struct {
+    const char* name;
+    size_t len;
+    bool is_dir;
+    // of its "<li>", see http_listing_init
+    size_t rendered_size;
+} http_listing_item;
+
+static int http_compare_listing_items(const void* a, const void* b) {
+    return strcmp(((const http_listing_item*)a)->name, ((const http_listing_item*)b)->name);
+}
+
+// reads the directory's subdirectories and regular files into `arena`, sorted
+// by name. `st` is what the directory looked like before it was read.
+// takes ownership of `fd`, the directory at `path`
+static http_listing_item* http_read_listing(int fd, const char* path, bool is_root, http_arena* arena, struct stat* st,
+    size_t* count, http_error_t* ep) {
+    *ep = http_new_error_ok();
+    *count = 0;
+    DIR* dir = fdopendir(fd);
+    if (!dir) {
+        perror("fdopendir");
+        close(fd);
+        *ep = http_new_error_error("fdopendir() failed");
+        return NULL;
+    }
+    if (fstat(dirfd(dir), st) < 0) {
+        perror("fstat");
+        closedir(dir);
+        *ep = http_new_error_error("fstat() failed");
+        return NULL;
+    }
+    size_t capacity = 256;
+    http_listing_item* items = http_arena_alloc(arena, capacity * sizeof(http_listing_item), ep);
+    struct dirent* folder = NULL;
+    while (http_is_ok(*ep)) {
+        errno = 0;
+        folder = readdir(dir);
+        if (!folder) {
+            if (errno != 0) {
+                perror("readdir");
+                log_warning("failed to read an entry from '%s'", path);
+            }
+            break;
+        }
+        if (strcmp(folder->d_name, ".") == 0 || (is_root && strcmp(folder->d_name, "..") == 0)) {
+            continue;
+        }
+        unsigned char type = folder->d_type;
+        if (type == DT_UNKNOWN) {
+            // some file systems don't fill in d_type
+            struct stat entry_st;
+            if (fstatat(dirfd(dir), folder->d_name, &entry_st, AT_SYMLINK_NOFOLLOW) == 0) {
+                type = S_ISDIR(entry_st.st_mode) ? DT_DIR : S_ISREG(entry_st.st_mode) ? DT_REG : DT_UNKNOWN;
+            }
+        }
+        // only consider directories and regular files
+        if (type != DT_DIR && type != DT_REG) {
+            continue;
+        }
+        if (*count == capacity) {
+            items = http_arena_grow(arena, items, capacity * sizeof(http_listing_item), 2 * capacity * sizeof(http_listing_item), ep);
+            capacity *= 2;
+            if (http_is_error(*ep)) {
+                break;
+            }
+        }
+        size_t len = strlen(folder->d_name);
+        char* name = http_arena_alloc(arena, len + 1, ep);
+        if (http_is_error(*ep)) {
+            break;
+        }
+        memcpy(name, folder->d_name, len + 1);
+        items[*count] = (http_listing_item) { name, len, type == DT_DIR, 0 };
+        ++*count;
+    }
+    closedir(dir);
+    if (http_is_error(*ep)) {
+        return NULL;
+    }
+    qsort(items, *count, sizeof(http_listing_item), http_compare_listing_items);
+    return items;
+}
+
+// with `dest` NULL, only returns the size the escaped string would have
+static size_t html_escape(char* dest, const char* str, size_t len) {
+    size_t size = 0;
+    for (size_t i = 0; i < len; ++i) {
+        const char* entity = NULL;
+        switch (str[i]) {
+        case '&':
+            entity = "&amp;";
+            break;
+        case '<':
+            entity = "&lt;";
+            break;
+        case '>':
+            entity = "&gt;";
+            break;
+        case '"':
+            entity = "&quot;";
+            break;
+        case '\'':
+            entity = "&#39;";
+            break;
+        }
+        size_t entity_len = entity ? strlen(entity) : 1;
+        if (dest) {
+            memcpy(dest + size, entity ? entity : str + i, entity_len);
+        }
+        size += entity_len;
+    }
+    return size;
+}
+
+// percent-encodes all but unreserved characters and `keep`, see RFC 3986 2.3.
+// with `dest` NULL, only returns the size the encoded string would have.
+static size_t url_escape(char* dest, const char* str, size_t len, char keep) {
+    static const char hex[] = "0123456789ABCDEF";
+    size_t size = 0;
+    for (size_t i = 0; i < len; ++i) {
+        unsigned char c = (unsigned char)str[i];
+        bool unreserved = (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9')
+            || c == '-' || c == '.' || c == '_' || c == '~' || (keep && c == (unsigned char)keep);
+        if (unreserved) {
+            if (dest) {
+                dest[size] = (char)c;
+            }
+            size += 1;
+        } else {
+            if (dest) {
+                dest[size] = '%';
+                dest[size + 1] = hex[c >> 4];
+                dest[size + 2] = hex[c & 0xf];
+            }
+            size += 3;
+        }
+    }
+    return size;
+}
+
+static const char http_listing_item_start[] = "<li><a href=\"";
+static const char http_listing_item_middle[] = "\">";
+static const char http_listing_item_end[] = "</a></li>";
+
+// one "<li>", links are absolute so they work without a trailing slash too.
+// with `dest` NULL, only returns its size.
+static size_t http_render_listing_item(char* dest, const http_listing_item* item, const char* base_href, size_t base_href_len) {
+    size_t size = 0;
+#define APPEND(str, len)                     \
+    do {                                     \
+        if (dest) {                          \
+            memcpy(dest + size, (str), len); \
+        }                                    \
+        size += len;                         \
+    } while (false)
+    APPEND(http_listing_item_start, sizeof(http_listing_item_start) - 1);
+    APPEND(base_href, base_href_len);
+    size += url_escape(dest ? dest + size : NULL, item->name, item->len, 0);
+    if (item->is_dir) {
+        APPEND("/", 1);
+    }
+    APPEND(http_listing_item_middle, sizeof(http_listing_item_middle) - 1);
+    size += html_escape(dest ? dest + size : NULL, item->name, item->len);
+    APPEND(http_listing_item_end, sizeof(http_listing_item_end) - 1);
+#undef APPEND
+    return size;
+}
+
+static const char http_listing_suffix[] = "</ul>" HTTP_SERVER_CREDIT "</body></html>";
+
+// a directory listing, rendered in one go or in chunks
+typedef struct {
+    http_listing_item* items;
+    size_t count;
+    // items before this have been rendered
+    size_t next;
+    const char* prefix;
+    size_t prefix_len;
+    const char* base_href;
+    size_t base_href_len;
+    // whether the prefix and suffix have been rendered
+    bool started;
+    bool done;
+    // of the whole document
+    size_t size;
+} http_listing;
+
+// `rel_dir` is the directory relative to the root, with leading and trailing
+// slashes
+static void http_listing_init(http_listing* listing, http_listing_item* items, size_t count, const char* rel_dir,
+    http_arena* arena, http_error_t* ep) {
+    *ep = http_new_error_ok();
+    memset(listing, 0, sizeof(*listing));
+    listing->items = items;
+    listing->count = count;
+    size_t rel_dir_len = strlen(rel_dir);
+    size_t title_len = html_escape(NULL, rel_dir, rel_dir_len);
+    static const char head[] = "<!DOCTYPE html><html><head><title>Listing of '";
+    static const char title_end[] = "'</title></head><body><h1>Listing of '";
+    static const char h1_end[] = "'</h1><ul>";
+    listing->prefix_len = sizeof(head) - 1 + title_len + sizeof(title_end) - 1 + title_len + sizeof(h1_end) - 1;
+    listing->base_href_len = url_escape(NULL, rel_dir, rel_dir_len, '/');
+    char* prefix = http_arena_alloc(arena, listing->prefix_len + listing->base_href_len, ep);
+    if (http_is_error(*ep)) {
+        return;
+    }
+    char* p = prefix;
+    memcpy(p, head, sizeof(head) - 1);
+    p += sizeof(head) - 1;
+    p += html_escape(p, rel_dir, rel_dir_len);
+    memcpy(p, title_end, sizeof(title_end) - 1);
+    p += sizeof(title_end) - 1;
+    p += html_escape(p, rel_dir, rel_dir_len);
+    memcpy(p, h1_end, sizeof(h1_end) - 1);
+    p += sizeof(h1_end) - 1;
+    url_escape(p, rel_dir, rel_dir_len, '/');
+    listing->prefix = prefix;
+    listing->base_href = p;
+    listing->size = listing->prefix_len + sizeof(http_listing_suffix) - 1;
+    for (size_t i = 0; i < count; ++i) {
+        items[i].rendered_size = http_render_listing_item(NULL, &items[i], listing->base_href, listing->base_href_len);
+        listing->size += items[i].rendered_size;
+    }
+}
+
+// renders as much of the listing as fits into `dest`, returns how much that
+// is. 0 means it's done, unless `dest_size` is smaller than one item.
+static size_t http_listing_render(http_listing* listing, char* dest, size_t dest_size) {
+    size_t size = 0;
+    if (!listing->started) {
+        if (listing->prefix_len > dest_size) {
+            return 0;
+        }
+        memcpy(dest, listing->prefix, listing->prefix_len);
+        size += listing->prefix_len;
+        listing->started = true;
+    }
+    while (listing->next < listing->count) {
+        const http_listing_item* item = &listing->items[listing->next];
+        if (item->rendered_size > dest_size - size) {
+            return size;
+        }
+        size += http_render_listing_item(dest + size, item, listing->base_href, listing->base_href_len);
+        ++listing->next;
+    }
+    if (!listing->done && sizeof(http_listing_suffix) - 1 <= dest_size - size) {
+        memcpy(dest + size, http_listing_suffix, sizeof(http_listing_suffix) - 1);
+        size += sizeof(http_listing_suffix) - 1;
+        listing->done = true;
+    }
+    return size;
+}
+
+bool http_path_is_compressible(const char* path) {
+    return http_mime_type_of(path)->compressible;
+}
+
+static const struct {
+    const char* name;
+    const char* suffix;
+} http_encodings[HTTP_ENCODING_COUNT] = {
+    [HTTP_ENCODING_BR] = { "br", ".br" },
+    [HTTP_ENCODING_ZSTD] = { "zstd", ".zst" },
+    [HTTP_ENCODING_GZIP] = { "gzip", ".gz" },
+    [HTTP_ENCODING_DEFLATE] = { "deflate", NULL },
+};
+
+const char* http_encoding_name(http_encoding encoding) {
+    return http_encodings[encoding].name;
+}
+
+const char* http_encoding_suffix(http_encoding encoding) {
+    return http_encodings[encoding].suffix;
+}
+
+bool http_precompressed_original(const char* path, char* original, size_t original_size) {
+    size_t len = strlen(path);
+    for (size_t e = 0; e < HTTP_ENCODING_COUNT; ++e) {
+        if (!http_encodings[e].suffix) {
+            continue;
+        }
+        size_t suffix_len = strlen(http_encodings[e].suffix);
+        if (len > suffix_len && len - suffix_len < original_size
+            && strcmp(path + len - suffix_len, http_encodings[e].suffix) == 0) {
+            memcpy(original, path, len - suffix_len);
+            original[len - suffix_len] = '\0';
+            return true;
+        }
+    }
+    return false;
+}
+
+// q-value in thousandths, -1 if malformed, see RFC 9110 12.4.2
+static int http_parse_qvalue(const char* value, size_t len) {
+    if (len == 0 || (value[0] != '0' && value[0] != '1')) {
+        return -1;
+    }
+    int q = (value[0] - '0') * 1000;
+    if (len == 1) {
+        return q;
+    }
+    if (value[1] != '.' || len > 5) {
+        return -1;
+    }
+    int scale = 100;
+    for (size_t i = 2; i < len; ++i) {
+        if (value[i] < '0' || value[i] > '9') {
+            return -1;
+        }
+        q += (value[i] - '0') * scale;
+        scale /= 10;
+    }
+    return q > 1000 ? -1 : q;
+}
+
+static bool is_ows(char c) {
+    return c == ' ' || c == '\t';
+}
+
+// the encodings with precompressed siblings which the request's
+// Accept-Encoding allows, by the client's preference, then by ours. returns
+// how many were written to `order`.
+static size_t http_accepted_encodings(const http_header* request, http_encoding order[HTTP_ENCODING_COUNT]) {
+    size_t len = 0;
+    const char* value = http_header_get_known(request, HTTP_HEADER_ACCEPT_ENCODING, &len);
+    if (!value) {
+        return 0;
+    }
+    int weights[HTTP_ENCODING_COUNT];
+    for (size_t e = 0; e < HTTP_ENCODING_COUNT; ++e) {
+        weights[e] = -1;
+    }
+    // applies to whatever isn't listed
+    int any = -1;
+    size_t i = 0;
+    while (i < len) {
+        size_t end = i;
+        while (end < len && value[end] != ',') {
+            ++end;
+        }
+        while (i < end && is_ows(value[i])) {
+            ++i;
+        }
+        size_t token_end = i;
+        while (token_end < end && value[token_end] != ';' && !is_ows(value[token_end])) {
+            ++token_end;
+        }
+        int weight = 1000;
+        const char* params = memchr(value + token_end, ';', end - token_end);
+        if (params) {
+            size_t p = (size_t)(params - value) + 1;
+            while (p < end && is_ows(value[p])) {
+                ++p;
+            }
+            // q is the only parameter there is
+            if (end - p >= 2 && (value[p] == 'q' || value[p] == 'Q') && value[p + 1] == '=') {
+                p += 2;
+                size_t q_end = p;
+                while (q_end < end && !is_ows(value[q_end]) && value[q_end] != ';') {
+                    ++q_end;
+                }
+                weight = http_parse_qvalue(value + p, q_end - p);
+            } else {
+                weight = -1;
+            }
+        }
+        size_t token_len = token_end - i;
+        if (weight >= 0 && token_len == 1 && value[i] == '*') {
+            any = weight;
+        } else if (weight >= 0) {
+            for (size_t e = 0; e < HTTP_ENCODING_COUNT; ++e) {
+                const char* name = http_encodings[e].name;
+                if ((token_len == strlen(name) && strncasecmp(value + i, name, token_len) == 0)
+                    || (e == HTTP_ENCODING_GZIP && token_len == 6 && strncasecmp(value + i, "x-gzip", 6) == 0)) {
+                    weights[e] = weight;
+                }
+            }
+        }
+        i = end + 1;
+    }
+    size_t count = 0;
+    int order_weights[HTTP_ENCODING_COUNT];
+    for (size_t e = 0; e < HTTP_ENCODING_COUNT; ++e) {
+        int weight = weights[e] >= 0 ? weights[e] : any;
+        if (weight <= 0) {
+            continue;
+        }
+        // insertion sort, ties keep our order
+        size_t at = count++;
+        while (at > 0 && order_weights[at - 1] < weight) {
+            order[at] = order[at - 1];
+            order_weights[at] = order_weights[at - 1];
+            --at;
+        }
+        order[at] = (http_encoding)e;
+        order_weights[at] = weight;
+    }
+    return count;
+}
+
+// which precompressed siblings of `path` exist, not counting ones older than
+// the file, which were made from something else
+static uint8_t http_probe_precompressed(const char* path, time_t mtime) {
+    uint8_t encodings = 0;
+    for (size_t e = 0; e < HTTP_ENCODING_COUNT; ++e) {
+        if (!http_encodings[e].suffix) {
+            continue;
+        }
+        char sibling[PATH_MAX];
+        struct stat st;
+        int n = snprintf(sibling, sizeof(sibling), "%s%s", path, http_encodings[e].suffix);
+        if (n > 0 && (size_t)n < sizeof(sibling) && stat(sibling, &st) == 0 && S_ISREG(st.st_mode)
+            && st.st_mtime >= mtime) {
+            encodings |= (uint8_t)(1u << e);
+        }
+    }
+    return encodings;
+}
+
+// a cache hit is one sendmsg() of memory shared with other requests
+static void http_client_serve_cache_entry(http_client* client, http_file_cache_entry* entry, const http_header_data* hdr, http_error_t* ep) {
+    http_file_cache_header_kind kind = strcmp(hdr->connection, "close") == 0
+        ? HTTP_FILE_CACHE_CLOSE
+        : HTTP_FILE_CACHE_KEEP_ALIVE;
+    // the pre-rendered header, with the current date
+    char tail[HTTP_HEADER_TAIL_LEN];
+    http_format_header_tail(tail);
+    struct iovec iov[3] = {
+        { .iov_base = entry->headers[kind], .iov_len = entry->header_sizes[kind] - HTTP_HEADER_TAIL_LEN },
+        { .iov_base = tail, .iov_len = HTTP_HEADER_TAIL_LEN },
+        { .iov_base = entry->body, .iov_len = entry->body_size },
+    };
+    client->status = 200;
+    http_client_send_response(client, iov, 3, entry, false, ep);
+}
+
+// renders the headers of a cache entry, one per http_file_cache_header_kind
+static bool http_format_entry_headers(char headers[HTTP_FILE_CACHE_HEADER_COUNT][HTTP_HEADER_SIZE_MAX],
+    const char* header_ptrs[HTTP_FILE_CACHE_HEADER_COUNT], size_t header_sizes[HTTP_FILE_CACHE_HEADER_COUNT],
+    size_t body_size, const http_header_data* hdr) {
+    const char* connections[HTTP_FILE_CACHE_HEADER_COUNT];
+    connections[HTTP_FILE_CACHE_KEEP_ALIVE] = "keep-alive";
+    connections[HTTP_FILE_CACHE_CLOSE] = "close";
+    for (size_t i = 0; i < HTTP_FILE_CACHE_HEADER_COUNT; ++i) {
+        http_header_data this_hdr = *hdr;
+        this_hdr.connection = connections[i];
+        header_sizes[i] = http_format_header(headers[i], HTTP_HEADER_SIZE_MAX, body_size, &this_hdr);
+        if (header_sizes[i] == 0) {
+            return false;
+        }
+        header_ptrs[i] = headers[i];
+    }
+    return true;
+}
+
+// reads the file into a new cache entry with pre-rendered headers, or returns
+// NULL if that fails for any reason, in which case it's served uncached
+static http_file_cache_entry* http_file_cache_fill(http_file_cache* cache, const char* path, int fd, const struct stat* st,
+    bool watched, size_t generation, const http_header_data* hdr, uint8_t encodings) {
+    http_error_t err = http_new_error_ok();
+    char headers[HTTP_FILE_CACHE_HEADER_COUNT][HTTP_HEADER_SIZE_MAX];
+    const char* header_ptrs[HTTP_FILE_CACHE_HEADER_COUNT];
+    size_t header_sizes[HTTP_FILE_CACHE_HEADER_COUNT];
+    if (!http_format_entry_headers(headers, header_ptrs, header_sizes, (size_t)st->st_size, hdr)) {
+        return NULL;
+    }
+    http_file_cache_entry* entry = http_file_cache_entry_new(path, st, header_ptrs, header_sizes, (size_t)st->st_size, &err);
+    if (http_is_error(err)) {
+        return NULL;
+    }
+    entry->watched = watched;
+    entry->generation = generation;
+    entry->encodings = encodings;
+    size_t done = 0;
+    while (done < entry->body_size) {
+        ssize_t n = pread(fd, entry->body + done, entry->body_size - done, (off_t)done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            // changed under us, don't cache a torn read
+            http_file_cache_entry_release(entry);
+            return NULL;
+        }
+        done += (size_t)n;
+    }
+    http_file_cache_insert(cache, entry);
+    return entry;
+}
+
+// sets the Content-Type, and writes the additional headers of `hdr` plus
+// ETag, Last-Modified and either Accept-Ranges, or Content-Encoding for a
+// precompressed sibling (`encoding` is HTTP_ENCODING_COUNT for the file
+// itself), to `buf`. types which may be served encoded get Vary either way.
+static bool http_add_file_headers(http_header_data* hdr, char* buf, size_t buf_size, const http_file_validators* validators,
+    const http_mime_type* type, http_encoding encoding) {
+    bool identity = encoding == HTTP_ENCODING_COUNT;
+    int n = snprintf(buf, buf_size, "%sETag: %s" CRLF "Last-Modified: %s" CRLF "%s%s%s%s",
+        hdr->additional_headers, validators->etag, validators->last_modified,
+        identity ? "Accept-Ranges: bytes" CRLF : "Content-Encoding: ",
+        identity ? "" : http_encodings[encoding].name,
+        identity ? "" : CRLF,
+        type->compressible ? "Vary: Accept-Encoding" CRLF : "");
+    if (n < 0 || (size_t)n >= buf_size) {
+        return false;
+    }
+    hdr->content_type = type->content_type;
+    hdr->additional_headers = buf;
+    return true;
+}
+
+// weak comparison against a list of entity tags, see RFC 9110 8.8.3.2
+static bool http_etag_list_matches(const char* list, size_t list_len, const http_file_validators* validators) {
+    size_t i = 0;
+    while (i < list_len) {
+        if (list[i] == ' ' || list[i] == '\t' || list[i] == ',') {
+            ++i;
+            continue;
+        }
+        if (list[i] == '*') {
+            return true;
+        }
+        if (list_len - i >= 2 && list[i] == 'W' && list[i + 1] == '/') {
+            i += 2;
+        }
+        if (i >= list_len || list[i] != '"') {
+            // malformed, nothing after this can be trusted
+            return false;
+        }
+        size_t start = i;
+        const char* end = memchr(list + i + 1, '"', list_len - i - 1);
+        if (!end) {
+            return false;
+        }
+        i = (size_t)(end - list) + 1;
+        if (i - start == validators->etag_len && memcmp(list + start, validators->etag, i - start) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// parses any of the three HTTP-date formats, see RFC 9110 5.6.7
+static bool http_parse_date(const char* value, size_t len, time_t* out) {
+    static const char* const formats[] = {
+        "%a, %d %b %Y %H:%M:%S GMT",
+        "%A, %d-%b-%y %H:%M:%S GMT",
+        "%a %b %e %H:%M:%S %Y",
+    };
+    char buf[64];
+    if (len >= sizeof(buf)) {
+        return false;
+    }
+    memcpy(buf, value, len);
+    buf[len] = '\0';
+    for (size_t i = 0; i < sizeof(formats) / sizeof(formats[0]); ++i) {
+        struct tm tm;
+        memset(&tm, 0, sizeof(tm));
+        const char* end = strptime(buf, formats[i], &tm);
+        if (end && *end == '\0') {
+            *out = timegm(&tm);
+            return true;
+        }
+    }
+    return false;
+}
+
+// whether the client's copy is still current. If-Modified-Since only counts
+// without If-None-Match, see RFC 9110 13.2.2.
+static bool http_request_not_modified(const http_header* request, const http_file_validators* validators) {
+    size_t len = 0;
+    const char* value = http_header_get_known(request, HTTP_HEADER_IF_NONE_MATCH, &len);
+    if (value) {
+        return http_etag_list_matches(value, len, validators);
+    }
+    value = http_header_get_known(request, HTTP_HEADER_IF_MODIFIED_SINCE, &len);
+    time_t since = 0;
+    if (value && http_parse_date(value, len, &since)) {
+        return validators->mtime <= since;
+    }
+    return false;
+}
+
+typedef enum {
+    // no usable Range, serve the whole file
+    HTTP_RANGES_NONE,
+    HTTP_RANGES_SATISFIABLE,
+    HTTP_RANGES_UNSATISFIABLE,
+} http_ranges_result;
+
+// saturates instead of overflowing, false if there are no digits at `*i`
+static bool http_parse_range_number(const char* value, size_t len, size_t* i, uint64_t* out) {
+    size_t start = *i;
+    uint64_t n = 0;
+    while (*i < len && value[*i] >= '0' && value[*i] <= '9') {
+        uint64_t digit = (uint64_t)(value[*i] - '0');
+        n = n > (UINT64_MAX - digit) / 10 ? UINT64_MAX : n * 10 + digit;
+        ++*i;
+    }
+    if (*i == start) {
+        return false;
+    }
+    *out = n;
+    return true;
+}
+
+static int http_compare_ranges(const void* a, const void* b) {
+    const http_byte_range* lhs = a;
+    const http_byte_range* rhs = b;
+    return (lhs->start > rhs->start) - (lhs->start < rhs->start);
+}
+
+// whether the If-Range validator, if any, still matches. only strong
+// validators count, see RFC 9110 13.1.5.
+static bool http_if_range_matches(const http_header* request, const http_file_validators* validators) {
+    size_t len = 0;
+    const char* value = http_header_get_known(request, HTTP_HEADER_IF_RANGE, &len);
+    if (!value) {
+        return true;
+    }
+    if (len > 0 && value[0] == '"') {
+        return len == validators->etag_len && memcmp(value, validators->etag, len) == 0;
+    }
+    time_t date = 0;
+    return http_parse_date(value, len, &date) && date == validators->mtime;
+}
+
+// parses the request's Range into ranges within `size`, sorted and with
+// overlapping ones merged. a malformed Range is ignored, see RFC 9110 14.2.
+static http_ranges_result http_parse_ranges(const http_header* request, const http_file_validators* validators,
+    uint64_t size, http_byte_range* ranges, size_t* count) {
+    *count = 0;
+    size_t len = 0;
+    const char* value = http_header_get_known(request, HTTP_HEADER_RANGE, &len);
+    static const char unit[] = "bytes=";
+    if (!value || len < sizeof(unit) - 1 || strncasecmp(value, unit, sizeof(unit) - 1) != 0) {
+        return HTTP_RANGES_NONE;
+    }
+    if (!http_if_range_matches(request, validators)) {
+        return HTTP_RANGES_NONE;
+    }
+    size_t i = sizeof(unit) - 1;
+    size_t specs = 0;
+    while (i < len) {
+        if (value[i] == ' ' || value[i] == '\t' || value[i] == ',') {
+            ++i;
+            continue;
+        }
+        if (++specs > HTTP_RANGES_MAX) {
+            // not worth the overhead, nor the potential for abuse
+            return HTTP_RANGES_NONE;
+        }
+        uint64_t first = 0;
+        uint64_t last = UINT64_MAX;
+        if (value[i] == '-') {
+            // suffix: the last n bytes
+            ++i;
+            uint64_t suffix = 0;
+            if (!http_parse_range_number(value, len, &i, &suffix)) {
+                return HTTP_RANGES_NONE;
+            }
+            if (suffix == 0 || size == 0) {
+                continue;
+            }
+            first = suffix < size ? size - suffix : 0;
+        } else {
+            if (!http_parse_range_number(value, len, &i, &first) || i >= len || value[i] != '-') {
+                return HTTP_RANGES_NONE;
+            }
+            ++i;
+            if (http_parse_range_number(value, len, &i, &last) && last < first) {
+                return HTTP_RANGES_NONE;
+            }
+            if (first >= size) {
+                continue;
+            }
+        }
+        if (i < len && value[i] != ',' && value[i] != ' ' && value[i] != '\t') {
+            return HTTP_RANGES_NONE;
+        }
+        ranges[*count].start = first;
+        ranges[*count].end = last < size - 1 ? last + 1 : size;
+        ++*count;
+    }
+    if (specs == 0) {
+        return HTTP_RANGES_NONE;
+    }
+    if (*count == 0) {
+        return HTTP_RANGES_UNSATISFIABLE;
+    }
+    // coalescing is allowed regardless of order, see RFC 9110 14.6
+    qsort(ranges, *count, sizeof(http_byte_range), http_compare_ranges);
+    size_t merged = 0;
+    for (size_t r = 1; r < *count; ++r) {
+        if (ranges[r].start <= ranges[merged].end) {
+            if (ranges[r].end > ranges[merged].end) {
+                ranges[merged].end = ranges[r].end;
+            }
+        } else {
+            ranges[++merged] = ranges[r];
+        }
+    }
+    *count = merged + 1;
+    return HTTP_RANGES_SATISFIABLE;
+}
+
+// sends bytes [start, end) of the file, from `body` if it's in memory
+static void http_client_send_file_part(http_client* client, const char* body, int fd, uint64_t start, uint64_t end, http_error_t* ep) {
+    if (body) {
+        struct iovec iov = { .iov_base = (void*)(body + start), .iov_len = (size_t)(end - start) };
+        http_client_send_response(client, &iov, 1, NULL, true, ep);
+    } else {
+        http_client_sendfile_all(client, fd, (off_t)start, (size_t)(end - start), ep);
+    }
+}
+
+static size_t http_format_multipart_header(char* buf, size_t buf_size, const char* boundary, const char* content_type,
+    const http_byte_range* range, uint64_t size) {
+    int n = snprintf(buf, buf_size, CRLF "--%s" CRLF "%s%s%sContent-Range: bytes %llu-%llu/%llu" CRLF CRLF,
+        boundary,
+        content_type ? "Content-Type: " : "", content_type ? content_type : "", content_type ? CRLF : "",
+        (unsigned long long)range->start, (unsigned long long)range->end - 1, (unsigned long long)size);
+    return n < 0 || (size_t)n >= buf_size ? 0 : (size_t)n;
+}
+
+// serves what the request's Range asks for with 206 (multipart/byteranges for
+// more than one range) or 416. returns false if the whole file should be
+// served instead. `file_hdr` is what the whole file would be served with.
+// the file's contents are sent from `body` if it's cached, otherwise from `fd`.
+static bool http_client_serve_ranges(http_client* client, const http_header* request, const http_header_data* file_hdr,
+    const http_file_validators* validators, const char* body, int fd, uint64_t size, http_error_t* ep) {
+    *ep = http_new_error_ok();
+    http_byte_range ranges[HTTP_RANGES_MAX];
+    size_t count = 0;
+    http_ranges_result result = http_parse_ranges(request, validators, size, ranges, &count);
+    if (result == HTTP_RANGES_NONE) {
+        return false;
+    }
+    http_header_data this_hdr = *file_hdr;
+    char additional_headers[HTTP_HEADER_SIZE_MAX / 2];
+    int n;
+    if (result == HTTP_RANGES_UNSATISFIABLE) {
+        this_hdr.status_code = 416;
+        this_hdr.content_type = "text/plain";
+        n = snprintf(additional_headers, sizeof(additional_headers), "%sContent-Range: bytes */%llu" CRLF,
+            file_hdr->additional_headers, (unsigned long long)size);
+        if (n < 0 || (size_t)n >= sizeof(additional_headers)) {
+            *ep = http_new_error_error("response header too large");
+            return true;
+        }
+        this_hdr.additional_headers = additional_headers;
+        http_client_serve(client, "", 0, &this_hdr, ep);
+        return true;
+    }
+    this_hdr.status_code = 206;
+    if (count == 1) {
+        // straight from the cache entry or the page cache, like a whole file
+        n = snprintf(additional_headers, sizeof(additional_headers), "%sContent-Range: bytes %llu-%llu/%llu" CRLF,
+            file_hdr->additional_headers, (unsigned long long)ranges[0].start,
+            (unsigned long long)ranges[0].end - 1, (unsigned long long)size);
+        if (n < 0 || (size_t)n >= sizeof(additional_headers)) {
+            *ep = http_new_error_error("response header too large");
+            return true;
+        }
+        this_hdr.additional_headers = additional_headers;
+        size_t len = (size_t)(ranges[0].end - ranges[0].start);
+        if (body) {
+            http_client_serve(client, body + ranges[0].start, len, &this_hdr, ep);
+        } else {
+            http_client_serve_fd(client, fd, (off_t)ranges[0].start, len, &this_hdr, ep);
+        }
+        return true;
+    }
+    char boundary[40];
+    snprintf(boundary, sizeof(boundary), "http-byteranges-%016llx",
+        (unsigned long long)(http_metrics_now_ns() ^ (uintptr_t)client));
+    char content_type[80];
+    snprintf(content_type, sizeof(content_type), "multipart/byteranges; boundary=%s", boundary);
+    this_hdr.content_type = content_type;
+    // the part headers are formatted twice, once here to know the length
+    char part_header[HTTP_HEADER_SIZE_MAX / 2];
+    char trailer[64];
+    size_t trailer_size = (size_t)snprintf(trailer, sizeof(trailer), CRLF "--%s--" CRLF, boundary);
+    uint64_t body_size = trailer_size;
+    for (size_t r = 0; r < count; ++r) {
+        size_t part_size = http_format_multipart_header(part_header, sizeof(part_header), boundary, file_hdr->content_type, &ranges[r], size);
+        if (part_size == 0) {
+            *ep = http_new_error_error("multipart header too large");
+            return true;
+        }
+        body_size += part_size + (ranges[r].end - ranges[r].start);
+    }
+    char header[HTTP_HEADER_SIZE_MAX];
+    size_t header_size = http_format_header(header, sizeof(header), (size_t)body_size, &this_hdr);
+    if (header_size == 0) {
+        *ep = http_new_error_error("response header too large");
+        return true;
+    }
+    client->status = this_hdr.status_code;
+    struct iovec iov = { .iov_base = header, .iov_len = header_size };
+    http_client_send_response(client, &iov, 1, NULL, true, ep);
+    for (size_t r = 0; r < count && http_is_ok(*ep); ++r) {
+        size_t part_size = http_format_multipart_header(part_header, sizeof(part_header), boundary, file_hdr->content_type, &ranges[r], size);
+        iov.iov_base = part_header;
+        iov.iov_len = part_size;
+        http_client_send_response(client, &iov, 1, NULL, true, ep);
+        if (http_is_ok(*ep)) {
+            http_client_send_file_part(client, body, fd, ranges[r].start, ranges[r].end, ep);
+        }
+    }
+    if (http_is_ok(*ep)) {
+        iov.iov_base = trailer;
+        iov.iov_len = trailer_size;
+        http_client_send_response(client, &iov, 1, NULL, false, ep);
+    }
+    return true;
+}
+
+// `file_hdr` is what the file would be served with
+static void http_client_serve_304(http_client* client, const http_header_data* file_hdr, http_error_t* ep) {
+    http_header_data this_hdr = *file_hdr;
+    this_hdr.status_code = 304;
+    http_client_serve(client, "", 0, &this_hdr, ep);
 }
 
-void http_server_start(http_server* server, uint16_t port, http_error_t* ep) {
-    assert(server);
+// like http_client_serve_cache_entry, but with headers rendered for this
+// response. only those are copied, the body is still queued by reference.
+static void http_client_serve_entry_with(http_client* client, http_file_cache_entry* entry, const http_header_data* hdr, http_error_t* ep) {
     *ep = http_new_error_ok();
-    server->socket = socket(AF_INET, SOCK_STREAM, 0);
-    if (server->socket == -1) {
-        perror("socket");
-        *ep = http_new_error_error("socket() failed");
+    char header[HTTP_HEADER_SIZE_MAX];
+    size_t header_size = http_format_header(header, sizeof(header), entry->body_size, hdr);
+    if (header_size == 0) {
+        *ep = http_new_error_error("response header too large");
         return;
     }
-    log_info("%s", "socket created");
-    struct sockaddr_in address;
-    memset(&address, 0, sizeof(struct sockaddr_in));
-    address.sin_family = AF_INET;
-    address.sin_addr.s_addr = htonl(INADDR_ANY);
-    address.sin_port = htons(port);
-    int flag = 1;
-    if (setsockopt(server->socket, SOL_SOCKET, SO_REUSEADDR, &flag, sizeof(flag)) < 0) {
-        perror("setsockopt");
-        log_warning("%s", "failed to set SO_REUSEADDR");
+    client->status = hdr->status_code;
+    struct iovec iov = { .iov_base = header, .iov_len = header_size };
+    http_client_send_response(client, &iov, 1, NULL, false, ep);
+    if (http_is_ok(*ep)) {
+        iov.iov_base = entry->body;
+        iov.iov_len = entry->body_size;
+        http_client_send_response(client, &iov, 1, entry, false, ep);
     }
-    int ret = bind(server->socket, (struct sockaddr*)&address, sizeof(address));
-    if (ret != 0) {
-        perror("bind");
-        *ep = http_new_error_error("bind() failed");
+}
+
+// the pre-rendered headers only fit a plain 200, anything else renders them again
+static void http_client_serve_file_entry(http_client* client, const http_header* request, http_file_cache_entry* entry,
+    const http_mime_type* type, const http_header_data* hdr, http_error_t* ep) {
+    size_t range_len = 0;
+    bool not_modified = http_request_not_modified(request, &entry->validators);
+    if (!not_modified && !http_header_get_known(request, HTTP_HEADER_RANGE, &range_len)) {
+        http_client_serve_cache_entry(client, entry, hdr, ep);
         return;
     }
-    log_info("socket bound to port %d", port);
-    ret = listen(server->socket, server->backlog);
-    if (ret != 0) {
-        perror("bind");
-        *ep = http_new_error_error("listen() failed");
+    http_header_data file_hdr = *hdr;
+    char additional_headers[HTTP_HEADER_SIZE_MAX / 2];
+    if (!http_add_file_headers(&file_hdr, additional_headers, sizeof(additional_headers), &entry->validators, type, HTTP_ENCODING_COUNT)) {
+        *ep = http_new_error_error("response header too large");
         return;
     }
-    log_info("listening on port %d", port);
+    if (not_modified) {
+        http_client_serve_304(client, &file_hdr, ep);
+    } else if (!http_client_serve_ranges(client, request, &file_hdr, &entry->validators, entry->body, -1, entry->body_size, ep)) {
+        http_client_serve_cache_entry(client, entry, hdr, ep);
+    }
 }
 
-void http_server_accept_client(http_server* server, http_client_connect_cb on_connect, http_error_t* ep) {
-    assert(server);
+// serves the `encoding` sibling of the file at `path` in its place, as a
+// file of `type`. returns false if there is no such sibling, or it's older
+// than the file's `mtime`.
+static bool http_client_serve_precompressed(http_client* client, http_server* server, const http_header* request,
+    const char* path, const http_mime_type* type, time_t mtime, http_encoding encoding, size_t cache_generation,
+    const http_header_data* hdr, http_error_t* ep) {
     *ep = http_new_error_ok();
-    http_client* client = (http_client*)safe_malloc(sizeof(http_client), ep);
-    memset(client, 0, sizeof(http_client));
-    if (http_is_error(*ep)) {
-        return;
+    if (!http_encodings[encoding].suffix) {
+        return false;
     }
-    fd_set set;
-    FD_ZERO(&set);
-    FD_SET(server->socket, &set);
-    struct timeval timeout;
-    timeout.tv_sec = 3;
-    timeout.tv_usec = 0;
-    int select_ret = select(server->socket + 1, &set, NULL, NULL, NULL);
-    if (select_ret == 0) {
-        // timed out
-        *ep = http_new_error_error("server socket timed out for accept()");
-        free(client);
-        return;
-    } else if (select_ret < 0) {
-        perror("select");
-        *ep = http_new_error_error("select() failed");
-        free(client);
-        return;
+    char sibling[PATH_MAX];
+    int n = snprintf(sibling, sizeof(sibling), "%s%s", path, http_encodings[encoding].suffix);
+    if (n < 0 || (size_t)n >= sizeof(sibling)) {
+        return false;
     }
-    client->socket = accept(server->socket, (struct sockaddr*)&client->address, &client->address_len);
-    if (client->socket < 0) {
-        perror("accept");
-        *ep = http_new_error_error("accept() failed");
-        free(client);
-        return;
+    http_file_cache_entry* entry = server->file_cache ? http_file_cache_get(server->file_cache, sibling) : NULL;
+    int fd = -1;
+    struct stat st;
+    http_file_validators validators;
+    if (entry) {
+        validators = entry->validators;
+        if (validators.mtime < mtime) {
+            http_file_cache_entry_release(entry);
+            return false;
+        }
+    } else {
+        // the sibling may be a link out of the root, like any other file
+        bool canonical = false;
+        fd = http_path_open(server->root_fd, server->cwd, sibling + server->cwd_len, O_RDONLY, &canonical);
+        if (fd < 0) {
+            return false;
+        }
+        if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || st.st_mtime < mtime) {
+            close(fd);
+            return false;
+        }
+        http_file_validators_init(&validators, &st);
+        if (server->file_cache && (size_t)st.st_size <= server->file_cache->max_entry_size) {
+            // cached as what a request for the sibling itself gets
+            http_header_data sibling_hdr = *hdr;
+            char sibling_headers[HTTP_HEADER_SIZE_MAX / 2];
+            if (http_add_file_headers(&sibling_hdr, sibling_headers, sizeof(sibling_headers), &validators,
+                    http_mime_type_of(sibling), HTTP_ENCODING_COUNT)) {
+                entry = http_file_cache_fill(server->file_cache, sibling, fd, &st, canonical, cache_generation, &sibling_hdr, 0);
+            }
+        }
     }
-    // all good
-    log_info("new client accepted, fd %d", client->socket);
-    on_connect(server, client);
+    http_header_data this_hdr = *hdr;
+    char additional_headers[HTTP_HEADER_SIZE_MAX / 2];
+    if (!http_add_file_headers(&this_hdr, additional_headers, sizeof(additional_headers), &validators, type, encoding)) {
+        *ep = http_new_error_error("response header too large");
+    } else if (http_request_not_modified(request, &validators)) {
+        http_client_serve_304(client, &this_hdr, ep);
+    } else if (entry) {
+        http_client_serve_entry_with(client, entry, &this_hdr, ep);
+    } else {
+        http_client_serve_fd(client, fd, 0, (size_t)st.st_size, &this_hdr, ep);
+    }
+    if (entry) {
+        http_file_cache_entry_release(entry);
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+    return true;
 }
 
-// index of `what`, or `-1` if none found
-static int find_next_in_buffer(char* buf, size_t size, char what) {
-    for (int i = 0; (size_t)i < size; ++i) {
-        if (buf[i] == what) {
-            return (int)i;
-        }
+// the file's validators, but a different representation needs a different
+// strong tag
+static bool http_encode_validators(http_file_validators* validators, http_encoding encoding) {
+    size_t left = sizeof(validators->etag) - validators->etag_len + 1;
+    int n = snprintf(validators->etag + validators->etag_len - 1, left, "-%s\"", http_encodings[encoding].name);
+    if (n < 0 || (size_t)n >= left) {
+        return false;
     }
-    return -1;
+    validators->etag_len += (size_t)n - 1;
+    return true;
 }
 
-static int find_next_crlf_in_buffer(char* buf, size_t size) {
-    for (int i = 0; (size_t)i < size; ++i) {
-        if (buf[i] == '\r' && (size_t)i + 1 < size && buf[i + 1] == '\n') {
-            return (int)i;
-        }
+static bool http_compressed_on_the_fly(http_encoding encoding) {
+    return (encoding == HTTP_ENCODING_GZIP || encoding == HTTP_ENCODING_DEFLATE) && http_compress_supported(encoding);
+}
+
+// compresses the file held by `entry` into a new entry of the variant cache.
+// output which isn't smaller is cached with an empty body, so it isn't
+// compressed again.
+static http_file_cache_entry* http_variant_cache_fill(http_client* client, http_file_cache* cache, const char* key,
+    http_file_cache_entry* entry, const http_mime_type* type, http_encoding encoding, const http_header_data* hdr) {
+    http_error_t err = http_new_error_ok();
+    size_t size = 0;
+    // the buffer and zlib's state only live until the batch is done
+    char* compressed = http_compress(encoding, entry->body, entry->body_size, false, client->arena, &size, &err);
+    if (http_is_error(err)) {
+        http_print_error(err);
+        return NULL;
     }
-    return -1;
+    if (size >= entry->body_size) {
+        size = 0;
+    }
+    struct stat st;
+    memset(&st, 0, sizeof(st));
+    st.st_dev = entry->dev;
+    st.st_ino = entry->ino;
+    st.st_size = entry->size;
+    st.st_mtim = entry->mtime;
+    http_file_validators validators;
+    http_file_validators_init(&validators, &st);
+    if (!http_encode_validators(&validators, encoding)) {
+        return NULL;
+    }
+    http_header_data variant_hdr = *hdr;
+    char additional_headers[HTTP_HEADER_SIZE_MAX / 2];
+    if (!http_add_file_headers(&variant_hdr, additional_headers, sizeof(additional_headers), &validators, type, encoding)) {
+        return NULL;
+    }
+    char headers[HTTP_FILE_CACHE_HEADER_COUNT][HTTP_HEADER_SIZE_MAX];
+    const char* header_ptrs[HTTP_FILE_CACHE_HEADER_COUNT];
+    size_t header_sizes[HTTP_FILE_CACHE_HEADER_COUNT];
+    if (!http_format_entry_headers(headers, header_ptrs, header_sizes, size, &variant_hdr)) {
+        return NULL;
+    }
+    http_file_cache_entry* variant = http_file_cache_entry_new(key, &st, header_ptrs, header_sizes, size, &err);
+    if (http_is_error(err)) {
+        return NULL;
+    }
+    variant->validators = validators;
+    memcpy(variant->body, compressed, size);
+    // nothing to revalidate, a new version of the file has a new key
+    variant->watched = true;
+    variant->generation = atomic_load(&cache->generation);
+    http_file_cache_insert(cache, variant);
+    return variant;
 }
 
-void http_client_receive_header(http_client* client, http_header* header, http_error_t* ep) {
-    assert(client);
-    assert(header);
+// serves the file held by `entry` compressed, from the variant cache if it
+// has been compressed before. returns false if it isn't worth compressing.
+static bool http_client_serve_compressed(http_client* client, http_server* server, const http_header* request,
+    http_file_cache_entry* entry, const http_mime_type* type, http_encoding encoding, const http_header_data* hdr,
+    http_error_t* ep) {
     *ep = http_new_error_ok();
-
-    memset(header, 0, sizeof(*header));
-
-    errno = 0;
-    ssize_t n = read(client->socket, header->buffer, HTTP_HEADER_SIZE_MAX);
-    if (n < 0 || errno != 0) {
-        perror("read");
-        *ep = http_new_error_error("read() failed");
-        return;
+    if (!server->variant_cache || !http_compressed_on_the_fly(encoding) || entry->body_size < HTTP_COMPRESS_MIN_SIZE) {
+        return false;
     }
-    if (n < 3) {
-        // can't be a valid one
-        log_error("%s", "got an invalid header (size < 3)");
-        *ep = http_new_error_error("invalid header");
-        return;
+    char key[512];
+    int n = snprintf(key, sizeof(key), "%s\n%s\n%s", entry->path, entry->validators.etag, http_encodings[encoding].name);
+    if (n < 0 || (size_t)n >= sizeof(key)) {
+        return false;
     }
-    header->buffer[n] = '\0';
-    //log_info("header: \nHEADER_START\n%s\nHEADER_END", header->buffer);
-    char* ptr = header->buffer;
-
-    // SPACE separated header fields
-    enum {
-        FIRST_HDR_METHOD,
-        FIRST_HDR_TARGET,
-        FIRST_HDR_SIZEOF
-    };
-
-    char* first_errors[FIRST_HDR_SIZEOF];
-    first_errors[FIRST_HDR_METHOD] = "failed to parse METHOD";
-    first_errors[FIRST_HDR_TARGET] = "failed to parse TARGET";
+    http_file_cache_entry* variant = http_file_cache_get(server->variant_cache, key);
+    if (!variant) {
+        variant = http_variant_cache_fill(client, server->variant_cache, key, entry, type, encoding, hdr);
+        if (!variant) {
+            return false;
+        }
+    }
+    if (variant->body_size == 0) {
+        http_file_cache_entry_release(variant);
+        return false;
+    }
+    if (http_request_not_modified(request, &variant->validators)) {
+        http_header_data variant_hdr = *hdr;
+        char additional_headers[HTTP_HEADER_SIZE_MAX / 2];
+        if (http_add_file_headers(&variant_hdr, additional_headers, sizeof(additional_headers), &variant->validators, type, encoding)) {
+            http_client_serve_304(client, &variant_hdr, ep);
+        } else {
+            *ep = http_new_error_error("response header too large");
+        }
+    } else {
+        http_client_serve_cache_entry(client, variant, hdr, ep);
+    }
+    http_file_cache_entry_release(variant);
+    return true;
+}
 
-    char* first_buffers[FIRST_HDR_SIZEOF];
-    first_buffers[FIRST_HDR_METHOD] = header->method;
-    first_buffers[FIRST_HDR_TARGET] = header->target;
+// serves the file with the best encoding the request accepts: from one of
+// the siblings in `encodings`, or compressed on the fly if the file is
+// cached as `entry` (may be NULL). ranges are always served from the file
+// itself.
+static bool http_client_serve_encoded(http_client* client, http_server* server, const http_header* request,
+    const char* path, const http_mime_type* type, time_t mtime, uint8_t encodings, http_file_cache_entry* entry,
+    size_t cache_generation, const http_header_data* hdr, http_error_t* ep) {
+    size_t range_len = 0;
+    if (!type->compressible || http_header_get_known(request, HTTP_HEADER_RANGE, &range_len)) {
+        return false;
+    }
+    http_encoding order[HTTP_ENCODING_COUNT];
+    size_t count = http_accepted_encodings(request, order);
+    for (size_t i = 0; i < count; ++i) {
+        if ((encodings & (1u << order[i]))
+            && http_client_serve_precompressed(client, server, request, path, type, mtime, order[i], cache_generation, hdr, ep)) {
+            return true;
+        }
+        if (entry && http_client_serve_compressed(client, server, request, entry, type, order[i], hdr, ep)) {
+            return true;
+        }
+    }
+    return false;
+}
 
-    for (size_t i = 0; i < FIRST_HDR_SIZEOF; ++i) {
-        int index = find_next_in_buffer(ptr, n, ' ');
-        if (index < 0) {
-            *ep = http_new_error_error(first_errors[i]);
+// without a cache, listings are compressed for every request
+static void http_client_serve_listing(http_client* client, const http_header* request, const struct iovec* body,
+    const http_file_validators* validators, const http_header_data* hdr, http_error_t* ep) {
+    *ep = http_new_error_ok();
+    http_header_data this_hdr = *hdr;
+    char additional_headers[HTTP_HEADER_SIZE_MAX / 2];
+    http_encoding order[HTTP_ENCODING_COUNT];
+    size_t count = body->iov_len >= HTTP_COMPRESS_MIN_SIZE ? http_accepted_encodings(request, order) : 0;
+    for (size_t i = 0; i < count; ++i) {
+        if (!http_compressed_on_the_fly(order[i])) {
+            continue;
+        }
+        http_file_validators encoded = *validators;
+        if (!http_encode_validators(&encoded, order[i])
+            || !http_add_file_headers(&this_hdr, additional_headers, sizeof(additional_headers), &encoded,
+                &http_mime_type_listing, order[i])) {
+            break;
+        }
+        if (http_request_not_modified(request, &encoded)) {
+            http_client_serve_304(client, &this_hdr, ep);
+            return;
+        }
+        size_t size = 0;
+        http_error_t err = http_new_error_ok();
+        char* compressed = http_compress(order[i], body->iov_base, body->iov_len, false, client->arena, &size, &err);
+        if (http_is_ok(err) && size < body->iov_len) {
+            http_client_serve(client, compressed, size, &this_hdr, ep);
             return;
         }
-        memcpy(first_buffers[i], ptr, index);
-        first_buffers[i][index] = 0;
-        ptr += index + 1;
-        //log_info("parsed: '%s'", first_buffers[i]);
+        break;
     }
-
-    int index = find_next_crlf_in_buffer(ptr, n);
-    if (index < 0) {
-        *ep = http_new_error_error("failed to parse VERSION");
+    this_hdr = *hdr;
+    if (!http_add_file_headers(&this_hdr, additional_headers, sizeof(additional_headers), validators,
+            &http_mime_type_listing, HTTP_ENCODING_COUNT)) {
+        *ep = http_new_error_error("response header too large");
         return;
     }
-    memcpy(header->version, ptr, index);
-    header->version[index] = 0;
-    //log_info("parsed: '%s'", header->version);
-    header->start_of_headers = index + 2; // crlf
-
-    // parse Host, which is mandatory on HTTP/1.1
-    http_header_parse_field(header, header->host, sizeof(header->host), "Host", ep);
-    if (http_is_error(*ep)) {
-        return;
+    if (http_request_not_modified(request, validators)) {
+        http_client_serve_304(client, &this_hdr, ep);
+    } else {
+        http_client_serve_iov(client, body, 1, &this_hdr, ep);
     }
-    //log_info("parsed: '%s'", header->host);
 }
 
-ssize_t http_search_for_string(const char* in, size_t in_size, const char* what, size_t what_size) {
-    for (size_t i = 0; i < in_size; ++i) {
-        bool match = true;
-        for (size_t k = 0; k < what_size; ++k) {
-            if (i + k >= in_size || in[i + k] != what[k]) {
-                match = false;
-                break;
-            }
-        }
-        if (match) {
-            return (ssize_t)i;
-        }
+// a listing's entry is served like a file's
+static void http_client_serve_listing_entry(http_client* client, http_server* server, const http_header* request,
+    http_file_cache_entry* entry, size_t cache_generation, const http_header_data* hdr, http_error_t* ep) {
+    if (!http_client_serve_encoded(client, server, request, entry->path, &http_mime_type_listing,
+            entry->validators.mtime, 0, entry, cache_generation, hdr, ep)) {
+        http_client_serve_file_entry(client, request, entry, &http_mime_type_listing, hdr, ep);
     }
-    return -1;
 }
 
-void http_header_parse_field(http_header* header, char* value_buf, size_t value_buf_size, const char* fieldname, http_error_t* ep) {
-    char* buf = header->buffer + header->start_of_headers;
-    size_t buf_len = HTTP_HEADER_SIZE_MAX - header->start_of_headers;
-    ssize_t index = http_search_for_string(buf, buf_len, fieldname, strlen(fieldname));
-    if (index < 0) {
-        log_info("field %s not found", fieldname);
-        *ep = http_new_error_error("field not found");
+// serves the listing of the directory at `path`, which is cached until the
+// directory changes. listings too large for that are streamed in chunks.
+// `path` is the server's cwd followed by a normalized path
+static void http_client_serve_directory(http_client* client, http_server* server, const http_header* request,
+    const char* path, bool canonical, size_t cache_generation, const http_header_data* hdr, http_error_t* ep) {
+    *ep = http_new_error_ok();
+    // with exactly one trailing slash, however it was asked for
+    char key[PATH_MAX];
+    size_t len = strlen(path);
+    while (len > 1 && path[len - 1] == '/') {
+        --len;
+    }
+    if (len + 2 > sizeof(key)) {
+        http_client_serve_404(client, hdr, ep);
+        return;
+    }
+    memcpy(key, path, len);
+    key[len] = '/';
+    key[len + 1] = '\0';
+    if (server->file_cache) {
+        http_file_cache_entry* entry = http_file_cache_get(server->file_cache, key);
+        if (entry) {
+            http_client_serve_listing_entry(client, server, request, entry, cache_generation, hdr, ep);
+            http_file_cache_entry_release(entry);
+            return;
+        }
+    }
+    const char* rel_dir = key + server->cwd_len;
+    int fd = http_path_open(server->root_fd, server->cwd, rel_dir, O_RDONLY | O_DIRECTORY, NULL);
+    if (fd < 0) {
+        perror("open");
+        http_client_serve_404(client, hdr, ep);
         return;
     }
-    ssize_t next_colon = find_next_in_buffer(buf + index, buf_len - index, ':');
-    if (next_colon < 0) {
-        *ep = http_new_error_error("fieldname found, but not followed by colon");
+    struct stat st;
+    size_t count = 0;
+    bool is_root = strcmp(rel_dir, "/") == 0;
+    http_listing_item* items = http_read_listing(fd, key, is_root, client->arena, &st, &count, ep);
+    http_listing listing;
+    if (http_is_ok(*ep)) {
+        http_listing_init(&listing, items, count, rel_dir, client->arena, ep);
+    }
+    if (http_is_error(*ep)) {
+        http_print_error(*ep);
+        http_client_serve_500(client, hdr, ep);
         return;
     }
-    // skip colon
-    next_colon++;
-    // skip whitespace, if there is any
-    if (buf[index + next_colon] == ' ') {
-        next_colon++;
+    http_file_validators validators;
+    http_file_validators_init(&validators, &st);
+    http_header_data this_hdr = *hdr;
+    char additional_headers[HTTP_HEADER_SIZE_MAX / 2];
+    if (!http_add_file_headers(&this_hdr, additional_headers, sizeof(additional_headers), &validators,
+            &http_mime_type_listing, HTTP_ENCODING_COUNT)) {
+        http_client_serve_500(client, hdr, ep);
+        return;
     }
-    ssize_t next_crlf = find_next_crlf_in_buffer(buf + index, buf_len - index);
-    if (next_crlf > -1) {
-        if (next_crlf > -1 && next_crlf < next_colon) {
-            *ep = http_new_error_error("fieldname found, but followed by crlf before colon");
+    if (server->file_cache && listing.size <= server->file_cache->max_entry_size) {
+        char headers[HTTP_FILE_CACHE_HEADER_COUNT][HTTP_HEADER_SIZE_MAX];
+        const char* header_ptrs[HTTP_FILE_CACHE_HEADER_COUNT];
+        size_t header_sizes[HTTP_FILE_CACHE_HEADER_COUNT];
+        http_error_t err = http_new_error_ok();
+        http_file_cache_entry* entry = NULL;
+        if (http_format_entry_headers(headers, header_ptrs, header_sizes, listing.size, &this_hdr)) {
+            entry = http_file_cache_entry_new(key, &st, header_ptrs, header_sizes, listing.size, &err);
+        }
+        if (entry) {
+            http_listing_render(&listing, entry->body, entry->body_size);
+            // watchers report changes by real path, see main's invalidation of listings
+            entry->watched = canonical;
+            entry->generation = cache_generation;
+            http_file_cache_insert(server->file_cache, entry);
+            http_client_serve_listing_entry(client, server, request, entry, cache_generation, hdr, ep);
+            http_file_cache_entry_release(entry);
             return;
         }
-    } else {
-        // TODO: this isn't necessary, right? since we end with crlf+crlf
-        next_crlf = buf_len;
     }
-    // copy value into buffer now
-
-    size_t result_len = next_crlf - next_colon;
-    if (value_buf_size < result_len) {
-        *ep = http_new_error_error("buffer too small to fit value of field");
+    if (listing.size <= HTTP_FILE_CACHE_MAX_ENTRY_SIZE) {
+        char* body = http_arena_alloc(client->arena, listing.size, ep);
+        if (http_is_error(*ep)) {
+            http_client_serve_500(client, hdr, ep);
+            return;
+        }
+        struct iovec iov = { .iov_base = body, .iov_len = http_listing_render(&listing, body, listing.size) };
+        http_client_serve_listing(client, request, &iov, &validators, hdr, ep);
         return;
     }
-
-    // copy everything between colon and crlf
-    memset(value_buf, 0, value_buf_size);
-    memcpy(value_buf, buf + index + next_colon, result_len);
-}
-
-void http_client_serve(http_client* client, const char* body, size_t body_size, http_header_data* header_data, http_error_t* ep) {
-    *ep = http_new_error_ok();
-    char header[HTTP_HEADER_SIZE_MAX];
-    memset(header, 0, sizeof(header));
-    const char header_fmt[] = "HTTP/1.1 %d %s" CRLF
-                              "Connection: %s" CRLF
-                              "Content-Type: %s" CRLF
-                              "Content-Length: %zu" CRLF
-                              "%s" CRLF;
-    size_t header_size = sprintf(header, header_fmt,
-        header_data->status_code,
-        header_data->status_message,
-        header_data->connection,
-        header_data->content_type,
-        body_size,
-        header_data->additional_headers);
-
-    // allocate buffer for entire response
-    size_t response_size = body_size + header_size;
-    char* response = safe_malloc(response_size * sizeof(char), ep);
+    if (http_request_not_modified(request, &validators)) {
+        http_client_serve_304(client, &this_hdr, ep);
+        return;
+    }
+    // never in memory as a whole, the size is known up front all the same
+    char* chunk = http_arena_alloc(client->arena, HTTP_LISTING_CHUNK_SIZE, ep);
     if (http_is_error(*ep)) {
+        http_client_serve_500(client, hdr, ep);
         return;
     }
-    memcpy(response, header, header_size);
-    memcpy(response + header_size, body, body_size);
-    ssize_t written = write(client->socket, response, response_size);
-    free(response);
-    if (written < 0) {
-        perror("write");
-        *ep = http_new_error_error("write() failed");
+    char header[HTTP_HEADER_SIZE_MAX];
+    size_t header_size = http_format_header(header, sizeof(header), listing.size, &this_hdr);
+    if (header_size == 0) {
+        *ep = http_new_error_error("response header too large");
         return;
     }
-}
-
-void http_client_set_rcv_timeout(http_client* client, time_t seconds, suseconds_t microseconds, http_error_t* ep) {
-    struct timeval tv;
-    tv.tv_sec = seconds;
-    tv.tv_usec = microseconds;
-    *ep = http_new_error_ok();
-    if (setsockopt(client->socket, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) < 0) {
-        *ep = http_new_error_error("failed to set rcv timeout");
-        perror("setsockopt");
+    client->status = this_hdr.status_code;
+    struct iovec iov = { .iov_base = header, .iov_len = header_size };
+    http_client_send_response(client, &iov, 1, NULL, true, ep);
+    while (http_is_ok(*ep) && !listing.done) {
+        iov.iov_base = chunk;
+        iov.iov_len = http_listing_render(&listing, chunk, HTTP_LISTING_CHUNK_SIZE);
+        if (iov.iov_len == 0) {
+            *ep = http_new_error_error("listing entry larger than a chunk");
+            break;
+        }
+        http_client_send_response(client, &iov, 1, NULL, !listing.done, ep);
     }
 }
 
-void http_client_serve_404(http_client* client, const http_header_data* template_hdr_data, http_error_t* ep) {
-    *ep = http_new_error_ok();
-    http_header_data this_hdr = *template_hdr_data;
-    this_hdr.content_type = "text/html";
-    this_hdr.status_code = 404;
-    this_hdr.status_message = "Not Found";
-    http_client_serve(client, http_server_err_404_page, http_server_err_404_page_size, &this_hdr, ep);
-}
-
-void http_client_serve_403(http_client* client, const http_header_data* template_hdr_data, http_error_t* ep) {
-    *ep = http_new_error_ok();
-    http_header_data this_hdr = *template_hdr_data;
-    this_hdr.content_type = "text/html";
-    this_hdr.status_code = 403;
-    this_hdr.status_message = "Forbidden";
-    http_client_serve(client, http_server_err_403_page, http_server_err_403_page_size, &this_hdr, ep);
-}
-
-void http_client_serve_500(http_client* client, const http_header_data* template_hdr_data, http_error_t* ep) {
-    *ep = http_new_error_ok();
-    http_header_data this_hdr = *template_hdr_data;
-    this_hdr.content_type = "text/html";
-    this_hdr.status_code = 500;
-    this_hdr.status_message = "Internal Server Error";
-    http_client_serve(client, http_server_err_500_page, http_server_err_500_page_size, &this_hdr, ep);
-}
-
-static size_t min_size_t(size_t a, size_t b) {
-    return a < b ? a : b;
+// closes `fd`, unless it belongs to `fd_entry`, which is released instead
+static void http_client_close_file(int fd, http_fd_cache_entry* fd_entry) {
+    if (fd_entry) {
+        http_fd_cache_entry_release(fd_entry);
+    } else {
+        close(fd);
+    }
 }
 
-static http_char_buffer_t build_directory_buffer(const char* path, http_error_t* ep) {
-    *ep = http_new_error_ok();
-    size_t buf_size = 16 * HTTP_KB;
-    char* buf = safe_malloc(buf_size, ep);
-    if (http_is_error(*ep)) {
-        return (http_char_buffer_t) { NULL, 0 };
-    }
-    memset(buf, 0, buf_size);
-    DIR* dir = opendir(path);
-    if (!dir) {
-        perror("opendir");
-        *ep = http_new_error_error("opendir() failed");
-        return (http_char_buffer_t) { NULL, 0 };
+void http_client_serve_file(http_client* client, http_server* server, const http_header* request, const http_header_data* hdr, http_error_t* ep) {
+    // the cwd, followed by the normalized target
+    char full_rel_path[PATH_MAX];
+    memcpy(full_rel_path, server->cwd, server->cwd_len);
+    char* rel_path = full_rel_path + server->cwd_len;
+    if (!http_path_normalize(request->target, rel_path, sizeof(full_rel_path) - server->cwd_len)) {
+        log_error("refusing to serve '%s'", request->target);
+        http_client_serve_403(client, hdr, ep);
+        return;
     }
-    struct dirent* folder = NULL;
-    size_t written = 0;
-    size_t n = 0;
-    do {
-        errno = 0;
-        folder = readdir(dir);
-        if (folder) {
-            // only consider directories and regular files
-            if (folder->d_type == DT_DIR || folder->d_type == DT_REG) {
-                char line[1 * HTTP_KB];
-                memset(line, 0, sizeof(line));
-                const char* maybe_slash = "";
-                if (folder->d_type == DT_DIR) {
-                    maybe_slash = "/";
-                }
-                n = sprintf(line, "<li><a href=\"%s%s\">%s</a></li>", folder->d_name, maybe_slash, folder->d_name);
-                if (strlen(line) < buf_size - written) {
-                    size_t grow_by = 16 * HTTP_KB;
-                    char* new_buf = realloc(buf, buf_size + grow_by);
-                    if (!new_buf) {
-                        perror("realloc");
-                        *ep = http_new_error_error("out of memory (realloc)");
-                        free(buf);
-                        return (http_char_buffer_t) { NULL, 0 };
-                    }
-                    buf = new_buf;
-                    memset(new_buf + buf_size, 0, grow_by);
-                    buf_size += grow_by;
-                }
-                memcpy(buf + written, line, strlen(line));
-                written += n;
-            }
-        } else {
-            if (errno != 0) {
-                perror("readdir");
-                log_warning("failed to read an entry from '%s'", path);
+    size_t cache_generation = 0;
+    if (server->file_cache) {
+        // before anything is read from the file system, see http_file_cache_insert
+        cache_generation = atomic_load(&server->file_cache->generation);
+        // entries are only ever added after the checks below passed
+        http_file_cache_entry* entry = http_file_cache_get(server->file_cache, full_rel_path);
+        if (entry) {
+            client->resolved_ns = http_metrics_now_ns();
+            const http_mime_type* type = http_mime_type_of(full_rel_path);
+            if (!http_client_serve_encoded(client, server, request, full_rel_path, type,
+                    entry->validators.mtime, entry->encodings, entry, cache_generation, hdr, ep)) {
+                http_client_serve_file_entry(client, request, entry, type, hdr, ep);
             }
+            http_file_cache_entry_release(entry);
+            return;
         }
-    } while (folder && n < buf_size);
-    closedir(dir);
-    return (http_char_buffer_t) { buf, written };
-}
-
-static const char* get_path_extension(const char* filename) {
-    const char* dot = strrchr(filename, '.');
-    if (!dot || dot == filename)
-        return "";
-    return dot + 1;
-}
-
-void http_client_serve_file(http_client* client, http_server* server, const char* target, const http_header_data* hdr, http_error_t* ep) {
-    const char* rel_path = target;
-    // validate path is a subpath of our root
-    char full_rel_path[256];
-    memset(full_rel_path, 0, sizeof(full_rel_path));
-    memcpy(full_rel_path, server->cwd, min_size_t(sizeof(server->cwd), sizeof(full_rel_path)));
-    strncat(full_rel_path, "/", sizeof(full_rel_path) - strlen(full_rel_path) - 1);
-    strncat(full_rel_path, rel_path, sizeof(full_rel_path) - strlen(full_rel_path) - 1);
-    log_info("checking if '%s' is under '%s'", full_rel_path, server->cwd);
-    char resolved[256];
-    memset(resolved, 0, sizeof(resolved));
-    realpath(full_rel_path, resolved);
-    if (strncmp(resolved, server->cwd, strlen(server->cwd)) != 0) {
-        log_error("attempt to access '%s', which isn't inside '%s' (forbidden)", resolved, server->cwd);
+    }
+    // what the path is, and whether it's inside the root
+    http_path_info info;
+    if (!server->path_cache || !http_path_cache_get(server->path_cache, rel_path, &info)) {
+        size_t path_generation = server->path_cache ? atomic_load(&server->path_cache->generation) : 0;
+        http_path_resolve(server->root_fd, server->cwd, rel_path, &info);
+        if (server->path_cache) {
+            http_path_cache_put(server->path_cache, rel_path, &info, path_generation);
+        }
+    }
+    if (info.kind == HTTP_PATH_FORBIDDEN) {
+        log_error("attempt to access '%s', which isn't inside '%s' or not a file (forbidden)", full_rel_path, server->cwd);
         http_client_serve_403(client, hdr, ep);
         return;
     }
-    struct stat st;
-    int ret = stat(full_rel_path, &st);
-    if (ret < 0) {
-        log_error("couldn't stat '%s'", full_rel_path);
+    if (info.kind == HTTP_PATH_MISSING) {
+        log_error("couldn't find '%s'", full_rel_path);
         http_client_serve_404(client, hdr, ep);
         return;
     }
-    if (S_ISDIR(st.st_mode)) {
-        // serve directory
-        http_char_buffer_t buf = build_directory_buffer(full_rel_path, ep);
-        if (http_is_error(*ep)) {
-            http_print_error(*ep);
-            http_client_serve_500(client, hdr, ep);
-            free(buf.data);
+    struct stat st = info.st;
+    client->resolved_ns = http_metrics_now_ns();
+    if (info.kind == HTTP_PATH_DIRECTORY) {
+        assert(client->arena);
+        http_client_serve_directory(client, server, request, full_rel_path, info.canonical, cache_generation, hdr, ep);
+        return;
+    } else {
+        const http_mime_type* type = http_mime_type_of(full_rel_path);
+        bool cacheable = server->file_cache && (size_t)st.st_size <= server->file_cache->max_entry_size;
+        if (!cacheable && http_client_serve_encoded(client, server, request, full_rel_path, type,
+                st.st_mtime, HTTP_ENCODING_ALL, NULL, cache_generation, hdr, ep)) {
+            // cached files only look for their siblings once, when filled
             return;
         }
-        size_t final_buffer_size = 512 + buf.len;
-        char* final_buffer = safe_malloc(final_buffer_size, ep);
-        if (http_is_error(*ep)) {
-            free(buf.data);
+        http_file_validators validators;
+        http_file_validators_init(&validators, &st);
+        http_header_data this_hdr = *hdr;
+        char additional_headers[HTTP_HEADER_SIZE_MAX / 2];
+        if (!http_add_file_headers(&this_hdr, additional_headers, sizeof(additional_headers), &validators, type, HTTP_ENCODING_COUNT)) {
+            http_client_serve_500(client, hdr, ep);
             return;
         }
-        memset(final_buffer, 0, final_buffer_size);
-        sprintf(final_buffer, "<!DOCTYPE html><html>"
-                              "<head><title>"
-                              "Listing of '/%s'"
-                              "</title></head>"
-                              "<body>"
-                              "<h1>Listing of '/%s'</h1>"
-                              "<ul>"
-                              "%s"
-                              "</ul>" HTTP_SERVER_CREDIT "</body>"
-                              "</html>",
-            target, target,
-            buf.data);
-        free(buf.data);
-        buf.data = NULL;
-        buf.len = 0;
-        http_header_data this_hdr = *hdr;
-        this_hdr.content_type = "text/html";
-        http_client_serve(client, final_buffer, final_buffer_size, &this_hdr, ep);
-        free(final_buffer);
-        return;
-    } else {
-        FILE* file = fopen(full_rel_path, "r");
-        if (!file) {
-            log_error("couldn't open '%s'", full_rel_path);
-            perror("fopen");
-            http_client_serve_404(client, hdr, ep);
+        if (http_request_not_modified(request, &validators)) {
+            // without opening or reading the file
+            http_client_serve_304(client, &this_hdr, ep);
             return;
         }
-        char* malloced_buf = (char*)safe_malloc(st.st_size, ep);
-        if (http_is_error(*ep)) {
-            fclose(file);
+        // files too large for the file cache keep their fd open instead
+        http_fd_cache_entry* fd_entry = !cacheable && server->fd_cache
+            ? http_fd_cache_get(server->fd_cache, full_rel_path)
+            : NULL;
+        int fd;
+        if (fd_entry) {
+            fd = fd_entry->fd;
+            st = fd_entry->st;
+        } else {
+            size_t fd_generation = server->fd_cache ? atomic_load(&server->fd_cache->generation) : 0;
+            fd = http_path_open(server->root_fd, server->cwd, rel_path, O_RDONLY, NULL);
+            if (fd < 0) {
+                log_error("couldn't open '%s'", full_rel_path);
+                perror("open");
+                http_client_serve_404(client, hdr, ep);
+                return;
+            }
+            if (fstat(fd, &st) < 0) {
+                perror("fstat");
+                close(fd);
+                http_client_serve_500(client, hdr, ep);
+                return;
+            }
+            if (server->fd_cache && !(server->file_cache && (size_t)st.st_size <= server->file_cache->max_entry_size)) {
+                http_error_t err;
+                fd_entry = http_fd_cache_insert(server->fd_cache, full_rel_path, fd, &st, info.canonical, fd_generation, &err);
+                if (http_is_error(err)) {
+                    // the fd was closed
+                    http_client_serve_500(client, hdr, ep);
+                    return;
+                }
+            }
+        }
+        // what is served, in case the file changed since stat()
+        http_file_validators_init(&validators, &st);
+        this_hdr = *hdr;
+        if (!http_add_file_headers(&this_hdr, additional_headers, sizeof(additional_headers), &validators, type, HTTP_ENCODING_COUNT)) {
+            http_client_close_file(fd, fd_entry);
+            http_client_serve_500(client, hdr, ep);
             return;
         }
-        size_t n = fread(malloced_buf, 1, st.st_size, file);
-        fclose(file);
-        http_header_data this_hdr = *hdr;
-        const char* ext = get_path_extension(full_rel_path);
-        if (strcmp(ext, "html") == 0) {
-            this_hdr.content_type = "text/html";
-        } else if (strcmp(ext, "css") == 0) {
-            this_hdr.content_type = "text/css";
-        } else if (strcmp(ext, "js") == 0) {
-            this_hdr.content_type = "text/js";
+        if (!fd_entry && server->file_cache && (size_t)st.st_size <= server->file_cache->max_entry_size) {
+            // watchers report changes by real path, so only those entries are watched
+            bool watched = info.canonical;
+            uint8_t encodings = type->compressible ? http_probe_precompressed(full_rel_path, st.st_mtime) : 0;
+            http_file_cache_entry* entry = http_file_cache_fill(server->file_cache, full_rel_path, fd, &st,
+                watched, cache_generation, &this_hdr, encodings);
+            if (entry) {
+                close(fd);
+                if (!http_client_serve_encoded(client, server, request, full_rel_path, type,
+                        entry->validators.mtime, entry->encodings, entry, cache_generation, hdr, ep)) {
+                    http_client_serve_file_entry(client, request, entry, type, hdr, ep);
+                }
+                http_file_cache_entry_release(entry);
+                return;
+            }
         }
-        http_client_serve(client, malloced_buf, n, &this_hdr, ep);
-        free(malloced_buf);
-        if (n != (size_t)st.st_size) {
-            log_warning("read %llu, expected to read %llu", (unsigned long long)n, (unsigned long long)st.st_size);
+        if (!http_client_serve_ranges(client, request, &this_hdr, &validators, NULL, fd, (uint64_t)st.st_size, ep)) {
+            // the body goes straight from the page cache to the socket
+            http_client_serve_fd(client, fd, 0, (size_t)st.st_size, &this_hdr, ep);
         }
+        http_client_close_file(fd, fd_entry);
     }
 }
 
@@ -502,6 +2411,19 @@ const char http_server_rootpage[] = "<!DOCTYPE html>"
                                     "</body>"
                                     "</html>";
 const size_t http_server_rootpage_size = sizeof(http_server_rootpage) - 1;
+const char http_server_err_400_page[] = "<!DOCTYPE html>"
+                                        "<html>"
+                                        "<head>"
+                                        "<title>400 Bad Request</title>"
+                                        "</head>"
+                                        "<body>"
+                                        "<h1>400 Bad Request</h1>"
+                                        "<p>"
+                                        "The server could not understand the request."
+                                        "</p>" HTTP_SERVER_CREDIT
+                                        "</body>"
+                                        "</html>";
+const size_t http_server_err_400_page_size = sizeof(http_server_err_400_page) - 1;
 const char http_server_err_404_page[] = "<!DOCTYPE html>"
                                         "<html>"
                                         "<head>"
@@ -515,6 +2437,19 @@ const char http_server_err_404_page[] = "<!DOCTYPE html>"
                                         "</body>"
                                         "</html>";
 const size_t http_server_err_404_page_size = sizeof(http_server_err_404_page) - 1;
+const char http_server_err_405_page[] = "<!DOCTYPE html>"
+                                        "<html>"
+                                        "<head>"
+                                        "<title>405 Method Not Allowed</title>"
+                                        "</head>"
+                                        "<body>"
+                                        "<h1>405 Method Not Allowed</h1>"
+                                        "<p>"
+                                        "Only GET and HEAD requests are supported."
+                                        "</p>" HTTP_SERVER_CREDIT
+                                        "</body>"
+                                        "</html>";
+const size_t http_server_err_405_page_size = sizeof(http_server_err_405_page) - 1;
 const char http_server_err_403_page[] = "<!DOCTYPE html>"
                                         "<html>"
                                         "<head>"
@@ -542,39 +2477,26 @@ const char http_server_err_500_page[] = "<!DOCTYPE html>"
                                         "</html>";
 const size_t http_server_err_500_page_size = sizeof(http_server_err_500_page) - 1;
 
+static _Thread_local http_arena* s_thread_arena = NULL;
+
+http_arena* http_thread_pool_arena(void) {
+    return s_thread_arena;
+}
+
 void* http_thread_pool_main(void* args_ptr) {
     http_thread_pool_main_args* args = args_ptr;
     http_thread_pool* pool = args->pool;
-    size_t index = args->index;
-    struct timespec wait;
-    http_sleep_ms(index * 250);
-    while (!atomic_load(&pool->shutdown)) {
-        clock_gettime(CLOCK_REALTIME, &wait);
-        if (wait.tv_nsec > 500) {
-            wait.tv_sec += 1;
-            wait.tv_nsec = 0;
-        } else {
-            wait.tv_nsec += HTTP_MS_TO_NS(500);
-        }
-        http_thread_pool_fn_t fn = NULL;
-        void* arg = NULL;
-        pthread_mutex_lock(&pool->jobs_mutexes[index]);
-        pthread_cond_timedwait(&pool->condition_vars[index], &pool->jobs_mutexes[index], &wait);
-        if (pool->jobs[index]) {
-            fn = pool->jobs[index];
-            arg = pool->args[index];
-            pool->args[index] = NULL;
-        }
-        pthread_mutex_unlock(&pool->jobs_mutexes[index]);
-        if (fn) {
-            fn(arg);
-            pthread_mutex_lock(&pool->jobs_mutexes[index]);
-            pool->jobs[index] = NULL;
-            pthread_mutex_unlock(&pool->jobs_mutexes[index]);
-        } else {
-            sched_yield();
-        }
+    http_thread_pool_fn_t fn = NULL;
+    void* arg = NULL;
+    http_arena arena;
+    memset(&arena, 0, sizeof(arena));
+    s_thread_arena = &arena;
+    // parks without using any cpu while there's nothing to do
+    while (http_job_queue_pop(&pool->jobs, &fn, &arg)) {
+        fn(arg);
     }
+    s_thread_arena = NULL;
+    http_arena_free(&arena);
     free(args);
     return NULL;
 }
@@ -586,32 +2508,12 @@ http_thread_pool* http_thread_pool_new(http_error_t* ep) {
         log_info("building thread pool of %d threads", HTTP_THREAD_POOL_SIZE);
         memset(pool, 0, sizeof(http_thread_pool));
         atomic_store(&pool->shutdown, false);
+        http_job_queue_init(&pool->jobs, HTTP_JOB_QUEUE_SIZE, ep);
+        if (http_is_error(*ep)) {
+            return NULL;
+        }
         for (size_t i = 0; i < HTTP_THREAD_POOL_SIZE; ++i) {
             int res;
-            res = pthread_condattr_init(&pool->condition_vars_attrs[i]);
-            if (res != 0) {
-                perror("pthread_condattr_init");
-                *ep = http_new_error_error("failed to init condattr");
-                return NULL;
-            }
-            res = pthread_cond_init(&pool->condition_vars[i], &pool->condition_vars_attrs[i]);
-            if (res != 0) {
-                perror("pthread_cond_init");
-                *ep = http_new_error_error("failed to init cond");
-                return NULL;
-            }
-            res = pthread_mutexattr_init(&pool->jobs_mutexes_attrs[i]);
-            if (res != 0) {
-                perror("pthread_mutexattr_init");
-                *ep = http_new_error_error("failed to init mutexattr");
-                return NULL;
-            }
-            res = pthread_mutex_init(&pool->jobs_mutexes[i], &pool->jobs_mutexes_attrs[i]);
-            if (res != 0) {
-                perror("pthread_mutex_init");
-                *ep = http_new_error_error("failed to init mutex");
-                return NULL;
-            }
             res = pthread_attr_init(&pool->attrs[i]);
             if (res != 0) {
                 perror("pthread_attr_init");
@@ -637,6 +2539,8 @@ http_thread_pool* http_thread_pool_new(http_error_t* ep) {
 
 void http_thread_pool_destroy(http_thread_pool* pool) {
     if (pool) {
+        atomic_store(&pool->shutdown, true);
+        http_job_queue_close(&pool->jobs);
         for (size_t i = 0; i < HTTP_THREAD_POOL_SIZE; ++i) {
             int detachstate = 0;
             pthread_attr_getdetachstate(&pool->attrs[i], &detachstate);
@@ -644,41 +2548,17 @@ void http_thread_pool_destroy(http_thread_pool* pool) {
                 log_info("joining thread %lu", pool->threads[i]);
                 pthread_join(pool->threads[i], NULL);
             }
-            pthread_mutexattr_destroy(&pool->jobs_mutexes_attrs[i]);
-            pthread_mutex_destroy(&pool->jobs_mutexes[i]);
-            pthread_cond_destroy(&pool->condition_vars[i]);
-            pthread_condattr_destroy(&pool->condition_vars_attrs[i]);
             pthread_attr_destroy(&pool->attrs[i]);
         }
+        http_job_queue_destroy(&pool->jobs);
     }
     free(pool);
 }
 
 void http_thread_pool_add_job(http_thread_pool* pool, http_thread_pool_fn_t job, void* arg, http_error_t* ep) {
     *ep = http_new_error_ok();
-    bool found = false;
-    static size_t last_i = 0;
-    size_t i = (last_i) % HTTP_THREAD_POOL_SIZE;
-    while (!found) {
-        if (!pool->jobs[i]) {
-            pthread_mutex_lock(&pool->jobs_mutexes[i]);
-            if (!pool->jobs[i]) {
-                pool->jobs[i] = job;
-                pool->args[i] = arg;
-                found = true;
-                last_i = 0;
-                pthread_mutex_unlock(&pool->jobs_mutexes[i]);
-                pthread_cond_signal(&pool->condition_vars[i]);
-                break;
-            }
-            pthread_mutex_unlock(&pool->jobs_mutexes[i]);
-        }
-        ++i;
-        i %= HTTP_THREAD_POOL_SIZE;
-    }
-    last_i = i;
-    if (!found) {
-        *ep = http_new_error_error("failed to find empty job slot");
+    if (!http_job_queue_push(&pool->jobs, job, arg)) {
+        *ep = http_new_error_error("job queue is full");
     }
 }
 
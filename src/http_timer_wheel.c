@@ -0,0 +1,134 @@
+#include "http_timer_wheel.h"
+
+#include <string.h>
+#include <time.h>
+
+#define SLOT_MASK (HTTP_TIMER_WHEEL_SLOTS - 1)
+
+uint64_t http_timer_now_ms(void) {
+    struct timespec ts;
+    // vDSO, no syscall
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+static void list_init(http_timer* head) {
+    head->next = head;
+    head->prev = head;
+}
+
+static void list_push(http_timer* head, http_timer* timer) {
+    timer->prev = head->prev;
+    timer->next = head;
+    head->prev->next = timer;
+    head->prev = timer;
+}
+
+static void list_unlink(http_timer* timer) {
+    timer->prev->next = timer->next;
+    timer->next->prev = timer->prev;
+    timer->next = NULL;
+    timer->prev = NULL;
+}
+
+void http_timer_wheel_init(http_timer_wheel* wheel, uint64_t tick_ms, uint64_t now_ms) {
+    memset(wheel, 0, sizeof(http_timer_wheel));
+    wheel->start_ms = now_ms;
+    wheel->tick_ms = tick_ms > 0 ? tick_ms : 1;
+    for (size_t level = 0; level < HTTP_TIMER_WHEEL_LEVELS; ++level) {
+        for (size_t slot = 0; slot < HTTP_TIMER_WHEEL_SLOTS; ++slot) {
+            list_init(&wheel->slots[level][slot]);
+        }
+    }
+}
+
+bool http_timer_pending(const http_timer* timer) {
+    // expired timers are returned linked through next, prev stays NULL
+    return timer->prev != NULL;
+}
+
+// the lowest level whose range covers the timer, relative to now
+static void place(http_timer_wheel* wheel, http_timer* timer) {
+    uint64_t delta = timer->expires - wheel->now_tick;
+    for (size_t level = 0; level < HTTP_TIMER_WHEEL_LEVELS; ++level) {
+        unsigned shift = (unsigned)level * HTTP_TIMER_WHEEL_SLOT_BITS;
+        if (delta < ((uint64_t)HTTP_TIMER_WHEEL_SLOTS << shift) || level == HTTP_TIMER_WHEEL_LEVELS - 1) {
+            uint64_t max = ((uint64_t)HTTP_TIMER_WHEEL_SLOTS << shift) - 1;
+            // beyond the wheel, gets placed again when its slot cascades
+            uint64_t at = delta > max ? wheel->now_tick + max : timer->expires;
+            list_push(&wheel->slots[level][(at >> shift) & SLOT_MASK], timer);
+            return;
+        }
+    }
+}
+
+void http_timer_wheel_add(http_timer_wheel* wheel, http_timer* timer, uint64_t deadline_ms) {
+    if (http_timer_pending(timer)) {
+        list_unlink(timer);
+    } else {
+        ++wheel->count;
+    }
+    uint64_t elapsed = deadline_ms > wheel->start_ms ? deadline_ms - wheel->start_ms : 0;
+    uint64_t expires = (elapsed + wheel->tick_ms - 1) / wheel->tick_ms;
+    // the current tick's slot has already been expired
+    timer->expires = expires > wheel->now_tick ? expires : wheel->now_tick + 1;
+    place(wheel, timer);
+}
+
+void http_timer_wheel_cancel(http_timer_wheel* wheel, http_timer* timer) {
+    if (http_timer_pending(timer)) {
+        list_unlink(timer);
+        --wheel->count;
+    }
+}
+
+// moves a higher level's slot down, now that its range is about to start
+static void cascade(http_timer_wheel* wheel, size_t level) {
+    unsigned shift = (unsigned)level * HTTP_TIMER_WHEEL_SLOT_BITS;
+    http_timer* head = &wheel->slots[level][(wheel->now_tick >> shift) & SLOT_MASK];
+    while (head->next != head) {
+        http_timer* timer = head->next;
+        list_unlink(timer);
+        place(wheel, timer);
+    }
+}
+
+http_timer* http_timer_wheel_advance(http_timer_wheel* wheel, uint64_t now_ms) {
+    uint64_t target = now_ms > wheel->start_ms ? (now_ms - wheel->start_ms) / wheel->tick_ms : 0;
+    if (wheel->count == 0) {
+        // nothing to expire, skip ahead
+        if (target > wheel->now_tick) {
+            wheel->now_tick = target;
+        }
+        return NULL;
+    }
+    http_timer* expired = NULL;
+    http_timer** tail = &expired;
+    while (wheel->now_tick < target && wheel->count > 0) {
+        ++wheel->now_tick;
+        for (size_t level = 1; level < HTTP_TIMER_WHEEL_LEVELS; ++level) {
+            unsigned shift = (unsigned)level * HTTP_TIMER_WHEEL_SLOT_BITS;
+            if ((wheel->now_tick & (((uint64_t)1 << shift) - 1)) != 0) {
+                break;
+            }
+            cascade(wheel, level);
+        }
+        http_timer* head = &wheel->slots[0][wheel->now_tick & SLOT_MASK];
+        while (head->next != head) {
+            http_timer* timer = head->next;
+            list_unlink(timer);
+            --wheel->count;
+            *tail = timer;
+            tail = &timer->next;
+        }
+    }
+    *tail = NULL;
+    if (wheel->now_tick < target) {
+        wheel->now_tick = target;
+    }
+    return expired;
+}
+
+int http_timer_wheel_timeout_ms(const http_timer_wheel* wheel) {
+    return wheel->count > 0 ? (int)wheel->tick_ms : -1;
+}
@@ -0,0 +1,271 @@
+#include "logging.h"
+
+#include "http_job_queue.h"
+
+#include <errno.h>
+#include <linux/futex.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+typedef struct {
+    unsigned short len;
+    char text[HTTP_LOG_RECORD_SIZE - sizeof(unsigned short)];
+} http_log_record;
+
+// single producer (the owning thread), single consumer (the writer thread)
+typedef struct http_log_ring {
+    _Alignas(HTTP_CACHE_LINE_SIZE) atomic_size_t head;
+    // producer's copy of tail, so it only reads the consumer's line when full
+    size_t cached_tail;
+    _Alignas(HTTP_CACHE_LINE_SIZE) atomic_size_t tail;
+    _Alignas(HTTP_CACHE_LINE_SIZE) atomic_size_t dropped;
+    struct http_log_ring* next;
+    http_log_record records[HTTP_LOG_RING_SIZE];
+} http_log_ring;
+
+_Static_assert((HTTP_LOG_RING_SIZE & (HTTP_LOG_RING_SIZE - 1)) == 0, "HTTP_LOG_RING_SIZE must be a power of two");
+
+atomic_int http_log_min_level = HTTP_LOG_INFO;
+
+static const char* const level_names[] = {
+    [HTTP_LOG_DEBUG] = "debug",
+    [HTTP_LOG_INFO] = "info",
+    [HTTP_LOG_WARNING] = "warning",
+    [HTTP_LOG_ERROR] = "error",
+    [HTTP_LOG_OFF] = "off",
+};
+
+static struct {
+    atomic_bool running;
+    atomic_bool stop;
+    pthread_t thread;
+    // every thread's ring, pushed lock-free on the thread's first message
+    _Atomic(http_log_ring*) rings;
+    // dropped before a ring existed
+    atomic_size_t dropped;
+    size_t dropped_reported;
+    // futex word the idle writer waits on, bumped by whoever wakes it
+    _Alignas(HTTP_CACHE_LINE_SIZE) atomic_uint_least32_t wake_seq;
+    atomic_bool parked;
+} logger;
+
+static _Thread_local http_log_ring* thread_ring;
+static _Thread_local pid_t thread_id;
+
+static void futex_wait(atomic_uint_least32_t* addr, uint32_t expected) {
+    // returns early on EAGAIN (value changed) or EINTR, callers re-check
+    syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, expected, NULL, NULL, 0);
+}
+
+static void futex_wake(atomic_uint_least32_t* addr, int count) {
+    syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0);
+}
+
+static void wake_writer(void) {
+    atomic_fetch_add(&logger.wake_seq, 1);
+    futex_wake(&logger.wake_seq, 1);
+}
+
+static http_log_ring* get_thread_ring(void) {
+    if (thread_ring) {
+        return thread_ring;
+    }
+    http_log_ring* ring = aligned_alloc(HTTP_CACHE_LINE_SIZE, sizeof(http_log_ring));
+    if (!ring) {
+        return NULL;
+    }
+    memset(ring, 0, offsetof(http_log_ring, records));
+    http_log_ring* head = atomic_load(&logger.rings);
+    do {
+        ring->next = head;
+    } while (!atomic_compare_exchange_weak(&logger.rings, &head, ring));
+    thread_ring = ring;
+    return ring;
+}
+
+// formats into `out`, always ending in a newline, returns the length
+static size_t format_record(char* out, size_t size, http_log_level level, const char* func, const char* fmt, va_list args) {
+    if (thread_id == 0) {
+        thread_id = gettid();
+    }
+    int n = snprintf(out, size, "%d %.20s %s: ", thread_id, func, level_names[level]);
+    size_t len = n < 0 ? 0 : (size_t)n;
+    if (len < size - 1) {
+        n = vsnprintf(out + len, size - 1 - len, fmt, args);
+        len += n < 0 ? 0 : (size_t)n;
+    }
+    if (len > size - 2) {
+        len = size - 2;
+    }
+    out[len++] = '\n';
+    out[len] = '\0';
+    return len;
+}
+
+void http_log_write(http_log_level level, const char* func, const char* fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    if (!atomic_load_explicit(&logger.running, memory_order_acquire)) {
+        char line[HTTP_LOG_RECORD_SIZE];
+        size_t len = format_record(line, sizeof(line), level, func, fmt, args);
+        va_end(args);
+        fwrite(line, 1, len, stdout);
+        return;
+    }
+    http_log_ring* ring = get_thread_ring();
+    if (!ring) {
+        va_end(args);
+        atomic_fetch_add_explicit(&logger.dropped, 1, memory_order_relaxed);
+        return;
+    }
+    size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    if (head - ring->cached_tail == HTTP_LOG_RING_SIZE) {
+        ring->cached_tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+        if (head - ring->cached_tail == HTTP_LOG_RING_SIZE) {
+            // never block the caller on the writer
+            va_end(args);
+            atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+            return;
+        }
+    }
+    http_log_record* record = &ring->records[head & (HTTP_LOG_RING_SIZE - 1)];
+    record->len = (unsigned short)format_record(record->text, sizeof(record->text), level, func, fmt, args);
+    va_end(args);
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+    // pairs with the parked store in http_log_main: either we see the writer
+    // as parked, or it sees this record when it re-checks
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&logger.parked, memory_order_relaxed)) {
+        atomic_store_explicit(&logger.parked, false, memory_order_relaxed);
+        wake_writer();
+    }
+}
+
+static void write_all(const char* buf, size_t size) {
+    while (size > 0) {
+        ssize_t n = write(STDOUT_FILENO, buf, size);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            // nowhere left to report this
+            return;
+        }
+        buf += n;
+        size -= (size_t)n;
+    }
+}
+
+// writes out all queued records, in order per thread
+static void drain(void) {
+    static char out[64 * 1024];
+    size_t out_len = 0;
+    size_t dropped = atomic_load_explicit(&logger.dropped, memory_order_relaxed);
+    for (http_log_ring* ring = atomic_load(&logger.rings); ring; ring = ring->next) {
+        size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+        size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+        for (; tail != head; ++tail) {
+            const http_log_record* record = &ring->records[tail & (HTTP_LOG_RING_SIZE - 1)];
+            if (out_len + record->len > sizeof(out)) {
+                write_all(out, out_len);
+                out_len = 0;
+            }
+            memcpy(out + out_len, record->text, record->len);
+            out_len += record->len;
+        }
+        atomic_store_explicit(&ring->tail, tail, memory_order_release);
+        dropped += atomic_load_explicit(&ring->dropped, memory_order_relaxed);
+    }
+    if (dropped != logger.dropped_reported) {
+        int n = snprintf(out + out_len, sizeof(out) - out_len, "logger: dropped %zu messages\n",
+            dropped - logger.dropped_reported);
+        if (n > 0 && (size_t)n < sizeof(out) - out_len) {
+            out_len += (size_t)n;
+        }
+        logger.dropped_reported = dropped;
+    }
+    write_all(out, out_len);
+}
+
+static bool any_queued(void) {
+    for (http_log_ring* ring = atomic_load(&logger.rings); ring; ring = ring->next) {
+        if (atomic_load_explicit(&ring->head, memory_order_relaxed)
+            != atomic_load_explicit(&ring->tail, memory_order_relaxed)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void* http_log_main(void* arg) {
+    (void)arg;
+    struct timespec interval = { 0, HTTP_LOG_FLUSH_INTERVAL_MS * 1000000L };
+    while (!atomic_load(&logger.stop)) {
+        drain();
+        uint32_t seq = atomic_load(&logger.wake_seq);
+        atomic_store(&logger.parked, true);
+        atomic_thread_fence(memory_order_seq_cst);
+        // a record may have been pushed before its producer could see us parked
+        if (!any_queued() && !atomic_load(&logger.stop)) {
+            futex_wait(&logger.wake_seq, seq);
+        }
+        atomic_store(&logger.parked, false);
+        // only one producer wakes us, the records behind it go in the same batch
+        nanosleep(&interval, NULL);
+    }
+    return NULL;
+}
+
+bool http_log_start(void) {
+    if (atomic_load(&logger.running)) {
+        return true;
+    }
+    // anything written directly so far goes first
+    fflush(stdout);
+    atomic_store(&logger.stop, false);
+    int ret = pthread_create(&logger.thread, NULL, http_log_main, NULL);
+    if (ret != 0) {
+        errno = ret;
+        perror("pthread_create");
+        return false;
+    }
+    atomic_store_explicit(&logger.running, true, memory_order_release);
+    return true;
+}
+
+void http_log_stop(void) {
+    if (!atomic_load(&logger.running)) {
+        return;
+    }
+    atomic_store(&logger.stop, true);
+    wake_writer();
+    pthread_join(logger.thread, NULL);
+    atomic_store(&logger.running, false);
+    drain();
+    // the rings stay allocated: this also runs from atexit() on early returns,
+    // when other threads may still be in the middle of a message
+}
+
+size_t http_log_dropped(void) {
+    size_t dropped = atomic_load(&logger.dropped);
+    for (http_log_ring* ring = atomic_load(&logger.rings); ring; ring = ring->next) {
+        dropped += atomic_load_explicit(&ring->dropped, memory_order_relaxed);
+    }
+    return dropped;
+}
+
+bool http_log_parse_level(const char* name, http_log_level* out) {
+    for (size_t i = 0; i < sizeof(level_names) / sizeof(level_names[0]); ++i) {
+        if (strcmp(name, level_names[i]) == 0) {
+            *out = (http_log_level)i;
+            return true;
+        }
+    }
+    return false;
+}
@@ -1,3 +1,8 @@
+#include "http_date.h"
+#include "http_event_loop.h"
+#include "http_fs_watcher.h"
+#include "http_metrics.h"
+#include "http_precompress.h"
 #include "http_server.h"
 #include "logging.h"
 #include "memory.h"
@@ -5,150 +10,587 @@
 #include <assert.h>
 #include <dirent.h>
 #include <errno.h>
+#include <limits.h>
+#include <sched.h>
 #include <stdatomic.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <sys/signal.h>
 #include <sys/stat.h>
 #include <time.h>
 #include <unistd.h>
 
-size_t requests_handled = 0;
+// sent with every response, built once the timeouts are known
+static char s_additional_headers[128] = "Server: lionkor/http" CRLF;
 
-typedef struct {
-    http_server* server;
-    http_client* client;
-} handle_request_arg;
+static void serve_metrics(http_client* client, const http_header_data* hdr, http_error_t* ep) {
+    size_t size = 0;
+    char* text = http_metrics_render(client->arena, &size, ep);
+    if (http_is_error(*ep)) {
+        http_print_error(*ep);
+        http_client_serve_500(client, hdr, ep);
+        return;
+    }
+    http_header_data this_hdr = *hdr;
+    this_hdr.content_type = "text/plain; version=0.0.4; charset=utf-8";
+    // small enough to be copied into the batch, or sent right away
+    http_client_serve(client, text, size, &this_hdr, ep);
+}
 
+// gives a worker's client back to the event loop: to wait until the socket
+// is writable if output is pending, or for the next request if the
+// connection is kept alive. closes it otherwise.
+static void hand_back(http_client* client, bool keep_alive) {
+    http_error_t err = http_new_error_ok();
+    if (http_client_has_pending(client)) {
+        client->keep_alive = keep_alive;
+        http_event_loop_wait_writable(client->loop, client, &err);
+    } else if (keep_alive) {
+        // wait for the next request without holding on to this thread
+        http_event_loop_rearm(client->loop, client, &err);
+    } else {
+        http_event_loop_close_client(client->loop, client);
+        return;
+    }
+    if (http_is_error(err)) {
+        http_print_error(err);
+        http_event_loop_close_client(client->loop, client);
+    }
+}
+
+// runs on a pool thread once the event loop has received a complete header,
+// or once a client with pending output is writable again. handles every
+// complete request in the client's buffer, then hands the client back to
+// the event loop (or closes it). a worker never waits for a slow reader:
+// what doesn't fit into the socket's send buffer is left pending.
 void handle_client_request_thread(void* arg_ptr) {
-    handle_request_arg* arg = arg_ptr;
-    http_client* client = arg->client;
-    http_server* server = arg->server;
+    http_client* client = arg_ptr;
+    http_server* server = client->loop->server;
     bool keep_alive = false;
     http_error_t err = http_new_error_ok();
 
-    http_client_set_rcv_timeout(client, 5, 0, &err);
-    if (http_is_error(err)) {
-        http_print_error(err);
-        log_error("%s", "socket will not timeout on rcv, high risk of locking up, aborting connection");
-        goto shutdown_and_free;
+    if (http_client_has_pending(client)) {
+        http_client_send_pending(client, &err);
+        if (http_is_error(err)) {
+            http_print_error(err);
+            http_event_loop_close_client(client->loop, client);
+            return;
+        }
+        if (http_client_has_pending(client) || !client->keep_alive || !http_client_has_complete_header(client)) {
+            hand_back(client, client->keep_alive);
+            return;
+        }
+        // pipelined requests which came in behind the response
     }
 
     http_header_data hdr;
     memset(&hdr, 0, sizeof(hdr));
-    hdr.additional_headers = "Keep-Alive: timeout=10" CRLF
-                             "Server: lionkor/http" CRLF;
+    hdr.additional_headers = s_additional_headers;
     hdr.connection = "close";
     hdr.status_code = 200;
-    hdr.status_message = "OK";
+
+    uint64_t picked_up_ns = http_metrics_now_ns();
+    http_metrics_record_since(HTTP_STAGE_QUEUE, client->dispatched_ns, picked_up_ns);
+    if (client->requests_count == 0) {
+        http_metrics_record_since(HTTP_STAGE_ACCEPT, client->accepted_ns, client->dispatched_ns);
+    }
+    // pipelined requests after the first arrived with it, or while it was waited for
+    http_metrics_record_since(HTTP_STAGE_HEADER, client->request_started_ns, client->dispatched_ns);
+    size_t handled = 0;
+
+    // responses to pipelined requests are sent together
+    http_response_batch batch;
+    http_client_begin_batch(client, &batch);
+    // listings and such, which have to live until the batch is flushed
+    client->arena = http_thread_pool_arena();
 
     do {
         err = http_new_error_ok();
+        client->status = 0;
+        client->resolved_ns = 0;
         //log_info("%s", "receiving and parsing header");
         http_header header;
 
         http_client_receive_header(client, &header, &err);
-        //log_info("errno is %d", errno);
         if (http_is_error(err)) {
-            if (errno == 11) {
-                log_info("client %p timed out", (void*)client);
-            } else {
-                log_error("%s", "request failed");
-            }
+            log_error("%s", "request failed");
             http_print_error(err);
-            // this could be a timeout or the client dropping,
-            // so we just cancel the keep-alive here
+            keep_alive = false;
+            hdr.connection = "close";
+            http_client_serve_400(client, &hdr, &err);
+            http_metrics_count_response(client->status);
+            ++handled;
             break;
         }
 
-        char buf[128];
-        http_header_parse_field(&header, buf, sizeof(buf), "Connection", &err);
-        if (http_is_error(err)) {
-            http_print_error(err);
-        } else {
-            if (strcmp(buf, "keep-alive") == 0) {
-                //log_info("%s", "keep alive");
-                keep_alive = true;
-                hdr.connection = "keep-alive";
-            } else {
-                //log_info("%s", "don't keep alive");
-                hdr.connection = "close";
-            }
+        // HTTP/1.1 connections are persistent unless the client says otherwise,
+        // HTTP/1.0 ones only if the client asks for it
+        keep_alive = strcmp(header.version, "HTTP/1.1") == 0;
+        if (http_header_has_token(&header, HTTP_HEADER_CONNECTION, "close")) {
+            keep_alive = false;
+        } else if (http_header_has_token(&header, HTTP_HEADER_CONNECTION, "keep-alive")) {
+            keep_alive = true;
         }
+        if (client->body_unknown) {
+            // whatever follows this request can't be told apart from its body
+            keep_alive = false;
+        }
+        hdr.connection = keep_alive ? "keep-alive" : "close";
 
-        log_info("serving %s %s", header.method, header.target);
+        log_debug("serving %s %s", header.method, header.target);
 
-        if (strcmp(header.method, "GET") == 0) {
-            if (server->show_root_page && strcmp(header.target, "/") == 0) {
-                http_header_data this_hdr = hdr;
-                this_hdr.content_type = "text/html";
-                http_client_serve(client, http_server_rootpage,
-                    http_server_rootpage_size, &this_hdr, &err);
-                if (http_is_error(err)) {
-                    http_print_error(err);
-                }
+        // HEAD is answered like GET, the sending functions drop the body
+        client->head_only = strcmp(header.method, "HEAD") == 0;
+        client->head_done = false;
+        if (client->head_only || strcmp(header.method, "GET") == 0) {
+            if (strcmp(header.target, HTTP_METRICS_PATH) == 0) {
+                serve_metrics(client, &hdr, &err);
+            } else if (server->show_root_page && strcmp(header.target, "/") == 0) {
+                http_client_serve_fixed(client, HTTP_FIXED_ROOT_PAGE, &hdr, &err);
             } else if (header.target[0] == '/') {
-                http_client_serve_file(client, server, header.target + 1, &hdr, &err);
-                if (http_is_error(err)) {
-                    http_print_error(err);
+                uint64_t serve_started_ns = http_metrics_now_ns();
+                http_client_serve_file(client, server, &header, &hdr, &err);
+                uint64_t served_ns = http_metrics_now_ns();
+                if (client->resolved_ns != 0) {
+                    http_metrics_record_since(HTTP_STAGE_RESOLVE, serve_started_ns, client->resolved_ns);
+                    http_metrics_record_since(HTTP_STAGE_SEND, client->resolved_ns, served_ns);
+                } else {
+                    // refused or not found
+                    http_metrics_record_since(HTTP_STAGE_RESOLVE, serve_started_ns, served_ns);
                 }
             } else {
                 http_client_serve_404(client, &hdr, &err);
-                if (http_is_error(err)) {
-                    http_print_error(err);
-                }
             }
+        } else {
+            http_client_serve_405(client, &hdr, &err);
         }
-        log_info("served %s %s", header.method, header.target);
-        ++requests_handled;
-        if (requests_handled % 1000 == 0) {
-            fprintf(stderr, "requests handled: %llu\n", (unsigned long long)requests_handled);
+        client->head_only = false;
+        if (http_is_error(err)) {
+            http_print_error(err);
+            // the response may be half-written, nothing more can be sent
+            keep_alive = false;
         }
-    } while (keep_alive);
+        if (client->status == 0) {
+            // whatever comes next would be taken as the answer to this one
+            keep_alive = false;
+        }
+        log_debug("served %s %s", header.method, header.target);
+        http_metrics_count_response(client->status);
+        ++handled;
+        ++client->requests_count;
+    } while (keep_alive && http_client_has_complete_header(client) && !http_client_has_pending(client));
 
-shutdown_and_free:
-    shutdown(client->socket, SHUT_RD);
-    close(client->socket);
-    free(client);
-    free(arg_ptr);
+    uint64_t flush_started_ns = http_metrics_now_ns();
+    http_client_end_batch(client, &err);
+    uint64_t flushed_ns = http_metrics_now_ns();
+    http_arena_reset(client->arena);
+    client->arena = NULL;
+    http_metrics_record_since(HTTP_STAGE_FLUSH, flush_started_ns, flushed_ns);
+    for (size_t i = 0; i < handled; ++i) {
+        http_metrics_record_since(HTTP_STAGE_TOTAL, client->request_started_ns, flushed_ns);
+    }
+    // whatever is left is the start of the next request
+    client->request_started_ns = client->read_buffer_len > 0 ? flushed_ns : 0;
+    if (http_is_error(err)) {
+        http_print_error(err);
+        http_event_loop_close_client(client->loop, client);
+        return;
+    }
+    hand_back(client, keep_alive);
 }
 
-http_thread_pool* pool = NULL;
+// one accept loop with its own workers. in multi-listener mode, each one
+// has its own SO_REUSEPORT socket and is pinned to a cpu.
+typedef struct {
+    http_server* server;
+    http_event_loop* loop;
+    http_thread_pool* pool;
+    pthread_t thread;
+    // -1 if not pinned
+    int cpu;
+} listener;
+
+listener* listeners = NULL;
+size_t listeners_count = 0;
 
 void handle_client_request(http_server* server, http_client* client) {
+    (void)server;
     http_error_t err = http_new_error_ok();
-    handle_request_arg* arg = safe_malloc(sizeof(handle_request_arg), &err);
+    listener* self = client->loop->user_data;
+    // the client knows its server through its loop
+    http_thread_pool_add_job(self->pool, handle_client_request_thread, client, &err);
     if (http_is_error(err)) {
         http_print_error(err);
-        return;
+        http_event_loop_close_client(client->loop, client);
     }
-    arg->client = client;
-    arg->server = server;
-    http_thread_pool_add_job(pool, handle_client_request_thread, (void*)arg, &err);
-    assert(http_is_ok(err));
 }
 
 void handle_signals(int sig) {
     switch (sig) {
     case SIGINT:
-        atomic_store(&pool->shutdown, true);
+        for (size_t i = 0; i < listeners_count; ++i) {
+            if (listeners[i].loop) {
+                http_event_loop_stop(listeners[i].loop);
+            }
+        }
         break;
     }
 }
 
-const char s_usage[] = "<port>";
+// a directory's listing is cached under its path with a trailing slash.
+// events don't say whether an entry was added or only written to, so any
+// change to one drops the listing.
+static void invalidate_listing_of(http_file_cache* cache, const char* path) {
+    const char* slash = strrchr(path, '/');
+    char dir[PATH_MAX];
+    if (!slash || (size_t)(slash - path) + 2 > sizeof(dir)) {
+        return;
+    }
+    size_t len = (size_t)(slash - path) + 1;
+    memcpy(dir, path, len);
+    dir[len] = '\0';
+    http_file_cache_invalidate(cache, dir, false);
+}
+
+static void invalidate_file_cache(void* user_data, http_fs_watcher_event event, const char* path) {
+    http_file_cache* cache = user_data;
+    switch (event) {
+    case HTTP_FS_WATCHER_CHANGED: {
+        http_file_cache_invalidate(cache, path, false);
+        invalidate_listing_of(cache, path);
+        // the original's entry remembers which siblings it has
+        char original[PATH_MAX];
+        if (http_precompressed_original(path, original, sizeof(original))) {
+            http_file_cache_invalidate(cache, original, false);
+        }
+        break;
+    }
+    case HTTP_FS_WATCHER_CHANGED_TREE:
+        http_file_cache_invalidate(cache, path, true);
+        invalidate_listing_of(cache, path);
+        break;
+    case HTTP_FS_WATCHER_LOST:
+        // fall back to revalidating with stat()
+        atomic_store(&cache->watched, false);
+        http_file_cache_invalidate(cache, NULL, true);
+        break;
+    case HTTP_FS_WATCHER_RESET:
+        http_file_cache_invalidate(cache, NULL, true);
+        break;
+    }
+}
+
+// any change may change what a path resolves to, through symlinks
+static void invalidate_path_cache(void* user_data, http_fs_watcher_event event, const char* path) {
+    (void)path;
+    http_path_cache* cache = user_data;
+    if (event == HTTP_FS_WATCHER_LOST) {
+        atomic_store(&cache->watched, false);
+    }
+    http_path_cache_invalidate(cache);
+}
+
+// cached fds keep the file they were opened for, which a changed path may
+// no longer refer to
+static void invalidate_fd_cache(void* user_data, http_fs_watcher_event event, const char* path) {
+    http_fd_cache* cache = user_data;
+    switch (event) {
+    case HTTP_FS_WATCHER_CHANGED:
+        http_fd_cache_invalidate(cache, path, false);
+        break;
+    case HTTP_FS_WATCHER_CHANGED_TREE:
+        http_fd_cache_invalidate(cache, path, true);
+        break;
+    case HTTP_FS_WATCHER_LOST:
+        atomic_store(&cache->watched, false);
+        http_fd_cache_invalidate(cache, NULL, true);
+        break;
+    case HTTP_FS_WATCHER_RESET:
+        http_fd_cache_invalidate(cache, NULL, true);
+        break;
+    }
+}
+
+// without a watcher, the caches still work, but revalidate with stat().
+// each cache may be NULL.
+static http_fs_watcher* start_fs_watcher(http_file_cache* cache, http_path_cache* path_cache, http_fd_cache* fd_cache) {
+    char cwd[PATH_MAX];
+    if (getcwd(cwd, sizeof(cwd)) == NULL) {
+        perror("getcwd");
+        return NULL;
+    }
+    http_error_t err = http_new_error_ok();
+    http_fs_watcher* watcher = http_fs_watcher_new(cwd, &err);
+    if (http_is_error(err)) {
+        http_print_error(err);
+        log_warning("%s", "not watching for file changes, caches will revalidate with stat()");
+        return NULL;
+    }
+    if (cache) {
+        http_fs_watcher_add_callback(watcher, invalidate_file_cache, cache);
+    }
+    if (path_cache) {
+        http_fs_watcher_add_callback(watcher, invalidate_path_cache, path_cache);
+    }
+    if (fd_cache) {
+        http_fs_watcher_add_callback(watcher, invalidate_fd_cache, fd_cache);
+    }
+    http_fs_watcher_start(watcher, &err);
+    if (http_is_error(err)) {
+        http_print_error(err);
+        http_fs_watcher_free(watcher);
+        return NULL;
+    }
+    if (cache) {
+        atomic_store(&cache->watched, true);
+    }
+    if (path_cache) {
+        atomic_store(&path_cache->watched, true);
+    }
+    if (fd_cache) {
+        atomic_store(&fd_cache->watched, true);
+    }
+    return watcher;
+}
+
+// served next to the request metrics. each of these may be NULL.
+static void add_cache_metrics(const http_server* config, const http_fs_watcher* watcher) {
+    const char* hits = "Lookups answered from the cache.";
+    const char* misses = "Lookups which had to go to the file system.";
+    const char* evictions = "Entries dropped to make room.";
+    if (config->file_cache) {
+        http_metrics_add_counter("http_cache_hits_total", "cache=\"file\"", hits, &config->file_cache->hits);
+        http_metrics_add_counter("http_cache_misses_total", "cache=\"file\"", misses, &config->file_cache->misses);
+        http_metrics_add_counter("http_cache_evictions_total", "cache=\"file\"", evictions, &config->file_cache->evictions);
+        http_metrics_add_counter("http_cache_invalidations_total", "cache=\"file\"",
+            "Entries dropped because their file changed.", &config->file_cache->invalidations);
+    }
+    if (config->variant_cache) {
+        http_metrics_add_counter("http_cache_hits_total", "cache=\"variant\"", hits, &config->variant_cache->hits);
+        http_metrics_add_counter("http_cache_misses_total", "cache=\"variant\"", misses, &config->variant_cache->misses);
+        http_metrics_add_counter("http_cache_evictions_total", "cache=\"variant\"", evictions, &config->variant_cache->evictions);
+    }
+    if (config->path_cache) {
+        http_metrics_add_counter("http_cache_hits_total", "cache=\"path\"", hits, &config->path_cache->hits);
+        http_metrics_add_counter("http_cache_misses_total", "cache=\"path\"", misses, &config->path_cache->misses);
+    }
+    if (config->fd_cache) {
+        http_metrics_add_counter("http_cache_hits_total", "cache=\"fd\"", hits, &config->fd_cache->hits);
+        http_metrics_add_counter("http_cache_misses_total", "cache=\"fd\"", misses, &config->fd_cache->misses);
+        http_metrics_add_counter("http_cache_evictions_total", "cache=\"fd\"", evictions, &config->fd_cache->evictions);
+        http_metrics_add_counter("http_fd_cache_expirations_total", NULL,
+            "Open files closed after going unused for a while.", &config->fd_cache->expirations);
+    }
+    if (watcher) {
+        http_metrics_add_counter("http_fs_watcher_invalidations_total", NULL,
+            "File changes passed on to the caches.", &watcher->invalidations);
+        http_metrics_add_counter("http_fs_watcher_overflows_total", NULL,
+            "Times events were lost and the caches reset.", &watcher->overflows);
+        http_metrics_add_gauge("http_fs_watcher_watched_dirs", NULL,
+            "Directories currently watched.", &watcher->watched_dirs);
+    }
+}
+
+static void pin_thread_to_cpu(pthread_t thread, int cpu) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    int ret = pthread_setaffinity_np(thread, sizeof(set), &set);
+    if (ret != 0) {
+        errno = ret;
+        perror("pthread_setaffinity_np");
+        log_warning("failed to pin thread to cpu %d", cpu);
+    }
+}
+
+void* listener_main(void* arg_ptr) {
+    listener* self = arg_ptr;
+    http_error_t err = http_new_error_ok();
+    if (self->cpu >= 0) {
+        pin_thread_to_cpu(pthread_self(), self->cpu);
+    }
+    http_event_loop_run(self->loop, &err);
+    if (http_is_error(err)) {
+        http_print_error(err);
+    }
+    return NULL;
+}
+
+static void listener_init(listener* self, const http_server* config, http_event_loop_backend backend, uint16_t port, int cpu, http_error_t* ep) {
+    memset(self, 0, sizeof(*self));
+    self->cpu = cpu;
+    self->server = http_server_new(ep);
+    if (http_is_error(*ep)) {
+        return;
+    }
+    self->server->backlog = config->backlog;
+    self->server->accept_batch = config->accept_batch;
+    self->server->reuse_port = config->reuse_port;
+    self->server->show_root_page = config->show_root_page;
+    self->server->file_cache = config->file_cache;
+    self->server->variant_cache = config->variant_cache;
+    self->server->path_cache = config->path_cache;
+    self->server->fd_cache = config->fd_cache;
+    self->server->keep_alive_timeout_ms = config->keep_alive_timeout_ms;
+    self->server->header_timeout_ms = config->header_timeout_ms;
+    self->server->write_timeout_ms = config->write_timeout_ms;
+    self->pool = http_thread_pool_new(ep);
+    if (http_is_error(*ep)) {
+        return;
+    }
+    if (cpu >= 0) {
+        for (size_t i = 0; i < HTTP_THREAD_POOL_SIZE; ++i) {
+            pin_thread_to_cpu(self->pool->threads[i], cpu);
+        }
+    }
+    http_server_start(self->server, port, ep);
+    if (http_is_error(*ep)) {
+        return;
+    }
+    self->loop = http_event_loop_new(self->server, backend, handle_client_request, ep);
+    if (http_is_error(*ep)) {
+        return;
+    }
+    self->loop->user_data = self;
+}
+
+static void listener_deinit(listener* self) {
+    http_thread_pool_destroy(self->pool);
+    http_event_loop_free(self->loop);
+    http_server_free(self->server);
+}
+
+const char s_usage[] = "[-l listeners] [-b backlog] [-a accept_batch] [-c cache_mib] [-f open_files]\n"
+                       "  [-p paths] [-k keep_alive_s] [-t header_timeout_s] [-w write_timeout_s] [-e backend]\n"
+                       "  [-v level] <port>\n"
+                       "  or: [-v level] -z\n"
+                       "  -l  number of SO_REUSEPORT listeners, each with its own accept loop\n"
+                       "      and workers pinned to a cpu. 0 means one per cpu. default: 1\n"
+                       "  -b  listen() backlog. default: SOMAXCONN\n"
+                       "  -a  max connections accepted per wakeup, 0 for unlimited (epoll only).\n"
+                       "      default: 64\n"
+                       "  -c  size of the in-memory file cache in MiB, 0 to disable. default: 64\n"
+                       "  -f  max number of larger files kept open between requests, 0 to disable.\n"
+                       "      at most a quarter of RLIMIT_NOFILE. default: 1024\n"
+                       "  -p  max number of resolved request paths cached, 0 to disable. default: 16384\n"
+                       "  -k  seconds an idle keep-alive connection is kept open, 0 for ever. default: 5\n"
+                       "  -t  seconds a client has to send a request header, 0 for ever. default: 10\n"
+                       "  -w  seconds a response may stall on a client which doesn't read, 0 for ever.\n"
+                       "      default: 30\n"
+                       "  -e  how connections are accepted and read from: epoll, or io_uring, which\n"
+                       "      falls back to epoll if not available. default: epoll\n"
+                       "  -v  lowest log level: debug, info, warning, error or off. default: info\n"
+                       "  -z  write precompressed siblings of the files in the current directory, then exit";
+
+static bool parse_backend(const char* str, http_event_loop_backend* out) {
+    if (strcmp(str, "epoll") == 0) {
+        *out = HTTP_EVENT_LOOP_EPOLL;
+    } else if (strcmp(str, "io_uring") == 0) {
+        *out = HTTP_EVENT_LOOP_IO_URING;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+static bool parse_uint(const char* str, unsigned int* out) {
+    char* end = NULL;
+    errno = 0;
+    unsigned long value = strtoul(str, &end, 10);
+    if (errno != 0 || end == str || *end != '\0' || value > UINT_MAX) {
+        return false;
+    }
+    *out = (unsigned int)value;
+    return true;
+}
 
 int main(int argc, char** argv) {
     signal(SIGINT, handle_signals);
-    if (argc != 2) {
+    // writes to clients which went away should fail, not kill the process
+    signal(SIGPIPE, SIG_IGN);
+    unsigned int listeners_arg = 1;
+    unsigned int backlog = SOMAXCONN;
+    unsigned int accept_batch = 64;
+    unsigned int cache_mib = 64;
+    unsigned int open_files = 1024;
+    unsigned int path_entries = HTTP_PATH_CACHE_ENTRIES;
+    unsigned int keep_alive_s = 5;
+    unsigned int header_timeout_s = 10;
+    unsigned int write_timeout_s = 30;
+    http_event_loop_backend backend = HTTP_EVENT_LOOP_EPOLL;
+    bool precompress = false;
+    int opt;
+    http_log_level log_level = HTTP_LOG_INFO;
+    while ((opt = getopt(argc, argv, "l:b:a:c:f:p:k:t:w:e:v:z")) != -1) {
+        bool ok = false;
+        switch (opt) {
+        case 'l':
+            ok = parse_uint(optarg, &listeners_arg);
+            break;
+        case 'b':
+            ok = parse_uint(optarg, &backlog) && backlog <= INT_MAX;
+            break;
+        case 'a':
+            ok = parse_uint(optarg, &accept_batch) && accept_batch <= INT_MAX;
+            break;
+        case 'c':
+            ok = parse_uint(optarg, &cache_mib);
+            break;
+        case 'f':
+            ok = parse_uint(optarg, &open_files);
+            break;
+        case 'p':
+            ok = parse_uint(optarg, &path_entries);
+            break;
+        case 'k':
+            ok = parse_uint(optarg, &keep_alive_s) && keep_alive_s <= INT_MAX / 1000;
+            break;
+        case 't':
+            ok = parse_uint(optarg, &header_timeout_s) && header_timeout_s <= INT_MAX / 1000;
+            break;
+        case 'w':
+            ok = parse_uint(optarg, &write_timeout_s) && write_timeout_s <= INT_MAX / 1000;
+            break;
+        case 'e':
+            ok = parse_backend(optarg, &backend);
+            break;
+        case 'v':
+            ok = http_log_parse_level(optarg, &log_level);
+            break;
+        case 'z':
+            precompress = true;
+            ok = true;
+            break;
+        }
+        if (!ok) {
+            log_error("%s: invalid arguments", argv[0]);
+            log_info("Usage:\n%s %s", argv[0], s_usage);
+            return __LINE__;
+        }
+    }
+    if (argc - optind != (precompress ? 0 : 1)) {
         log_error("%s: invalid arguments", argv[0]);
         log_info("Usage:\n%s %s", argv[0], s_usage);
         return __LINE__;
     }
+    if (precompress) {
+        atomic_store(&http_log_min_level, log_level);
+        if (!http_precompress_available()) {
+            log_error("%s", "built without any compression library");
+            return __LINE__;
+        }
+        http_error_t err = http_new_error_ok();
+        http_precompress_tree(".", &err);
+        if (http_is_error(err)) {
+            http_print_error(err);
+            return __LINE__;
+        }
+        return 0;
+    }
     // parse port
     unsigned int port = 0;
-    int n = sscanf(argv[1], "%u", &port);
-    if (n != 1) {
+    if (!parse_uint(argv[optind], &port)) {
         log_error("%s", "failed to parse <port> as number");
         return __LINE__;
     }
@@ -156,32 +598,155 @@ int main(int argc, char** argv) {
         log_error("port %u outside allowed range (%u-%u)", port, 0u, UINT16_MAX);
         return __LINE__;
     }
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cpus < 1) {
+        cpus = 1;
+    }
+    bool multi = listeners_arg != 1;
+    if (listeners_arg == 0) {
+        listeners_arg = (unsigned int)cpus;
+    }
+    atomic_store(&http_log_min_level, log_level);
+    if (http_log_start()) {
+        // so errors right before an early return still get written
+        atexit(http_log_stop);
+    } else {
+        log_warning("%s", "failed to start the logger thread, logging synchronously");
+    }
     log_info("%s", "welcome to http-server 1.0");
+
+    http_server config;
+    memset(&config, 0, sizeof(config));
+    config.backlog = (int)backlog;
+    config.accept_batch = (int)accept_batch;
+    config.reuse_port = multi;
+    config.show_root_page = false;
+    config.keep_alive_timeout_ms = keep_alive_s * 1000;
+    config.header_timeout_ms = header_timeout_s * 1000;
+    config.write_timeout_ms = write_timeout_s * 1000;
+    if (keep_alive_s > 0) {
+        // advertise what the event loop enforces
+        snprintf(s_additional_headers, sizeof(s_additional_headers),
+            "Keep-Alive: timeout=%u" CRLF "Server: lionkor/http" CRLF, keep_alive_s);
+    }
+
     http_error_t err = http_new_error_ok();
-    http_server* server = http_server_new(&err);
+    http_date_update();
+    http_fixed_responses_init(s_additional_headers, &err);
     if (http_is_error(err)) {
         http_print_error(err);
         return __LINE__;
     }
-    pool = http_thread_pool_new(&err);
-    if (http_is_error(err)) {
-        http_print_error(err);
-        return __LINE__;
+    http_fs_watcher* watcher = NULL;
+    if (cache_mib > 0) {
+        size_t capacity = (size_t)cache_mib * HTTP_MB;
+        config.file_cache = http_file_cache_new(capacity, HTTP_FILE_CACHE_MAX_ENTRY_SIZE, &err);
+        if (http_is_error(err)) {
+            http_print_error(err);
+            return __LINE__;
+        }
+        // a quarter on top, for files compressed on the fly
+        config.variant_cache = http_file_cache_new(capacity / 4, HTTP_FILE_CACHE_MAX_ENTRY_SIZE, &err);
+        if (http_is_error(err)) {
+            http_print_error(err);
+            return __LINE__;
+        }
+        // keys carry the file's version, see http_server.variant_cache
+        atomic_store(&config.variant_cache->watched, true);
     }
-    server->backlog = 10;
-    server->show_root_page = false;
-    http_server_start(server, port, &err);
-    if (http_is_error(err)) {
-        http_print_error(err);
+    if (path_entries > 0) {
+        config.path_cache = http_path_cache_new(path_entries, &err);
+        if (http_is_error(err)) {
+            http_print_error(err);
+            return __LINE__;
+        }
+    }
+    if (open_files > 0) {
+        config.fd_cache = http_fd_cache_new(open_files, &err);
+        if (http_is_error(err)) {
+            http_print_error(err);
+            return __LINE__;
+        }
+    }
+    if (config.file_cache || config.path_cache || config.fd_cache) {
+        watcher = start_fs_watcher(config.file_cache, config.path_cache, config.fd_cache);
+    }
+    add_cache_metrics(&config, watcher);
+    listeners = calloc(listeners_arg, sizeof(listener));
+    if (!listeners) {
+        log_error("%s", "out of memory");
         return __LINE__;
     }
-    while (!atomic_load(&pool->shutdown)) {
-        http_server_accept_client(server, handle_client_request, &err);
+    for (size_t i = 0; i < listeners_arg; ++i) {
+        listener_init(&listeners[i], &config, backend, port, multi ? (int)(i % cpus) : -1, &err);
+        ++listeners_count;
         if (http_is_error(err)) {
             http_print_error(err);
+            return __LINE__;
+        }
+    }
+    int exit_code = 0;
+    if (multi) {
+        log_info("running %zu listeners on %ld cpus", listeners_count, cpus);
+        size_t started = 0;
+        for (; started < listeners_count; ++started) {
+            int ret = pthread_create(&listeners[started].thread, NULL, listener_main, &listeners[started]);
+            if (ret != 0) {
+                errno = ret;
+                perror("pthread_create");
+                exit_code = __LINE__;
+                // shut down the ones already running, as on SIGINT
+                for (size_t i = 0; i < started; ++i) {
+                    http_event_loop_stop(listeners[i].loop);
+                }
+                break;
+            }
         }
+        for (size_t i = 0; i < started; ++i) {
+            pthread_join(listeners[i].thread, NULL);
+        }
+    } else {
+        listener_main(&listeners[0]);
+    }
+    for (size_t i = 0; i < listeners_count; ++i) {
+        listener_deinit(&listeners[i]);
+    }
+    free(listeners);
+    if (watcher) {
+        log_info("fs watcher: %zu invalidations, %zu overflows, %zu directories watched",
+            atomic_load(&watcher->invalidations), atomic_load(&watcher->overflows),
+            atomic_load(&watcher->watched_dirs));
     }
-    http_server_free(server);
-    http_thread_pool_destroy(pool);
+    http_fs_watcher_free(watcher);
+    if (config.file_cache) {
+        log_info("file cache: %zu hits, %zu misses, %zu evictions, %zu invalidations",
+            atomic_load(&config.file_cache->hits), atomic_load(&config.file_cache->misses),
+            atomic_load(&config.file_cache->evictions), atomic_load(&config.file_cache->invalidations));
+    }
+    if (config.variant_cache) {
+        log_info("variant cache: %zu hits, %zu misses, %zu evictions",
+            atomic_load(&config.variant_cache->hits), atomic_load(&config.variant_cache->misses),
+            atomic_load(&config.variant_cache->evictions));
+    }
+    if (config.path_cache) {
+        log_info("path cache: %zu hits, %zu misses",
+            atomic_load(&config.path_cache->hits), atomic_load(&config.path_cache->misses));
+    }
+    if (config.fd_cache) {
+        log_info("fd cache: %zu hits, %zu misses, %zu evictions, %zu expirations",
+            atomic_load(&config.fd_cache->hits), atomic_load(&config.fd_cache->misses),
+            atomic_load(&config.fd_cache->evictions), atomic_load(&config.fd_cache->expirations));
+    }
+    http_file_cache_free(config.file_cache);
+    http_file_cache_free(config.variant_cache);
+    http_path_cache_free(config.path_cache);
+    http_fd_cache_free(config.fd_cache);
+    log_info("%llu requests handled", (unsigned long long)http_metrics_requests());
+    http_metrics_free();
     log_info("%s", "http-server terminated");
+    http_log_stop();
+    if (http_log_dropped() > 0) {
+        fprintf(stderr, "logger dropped %zu messages\n", http_log_dropped());
+    }
+    return exit_code;
 }
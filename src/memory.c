@@ -9,3 +9,229 @@ void* safe_malloc(size_t size, http_error_t* ep) {
     }
     return ptr;
 }
+
+static size_t align16(size_t size) {
+    return (size + 15) & ~(size_t)15;
+}
+
+typedef struct {
+    uint64_t slab_id;
+    void* head;
+    size_t count;
+} http_slab_cache;
+
+static _Thread_local http_slab_cache s_slab_caches[HTTP_SLAB_THREAD_CACHES];
+static atomic_uint_fast64_t s_slab_next_id = 1;
+
+typedef struct http_slab_chunk {
+    struct http_slab_chunk* next;
+    _Alignas(16) char objects[];
+} http_slab_chunk;
+
+void http_slab_init(http_slab* slab, size_t object_size) {
+    memset(slab, 0, sizeof(http_slab));
+    // free objects hold the free list link
+    slab->object_size = align16(object_size < sizeof(void*) ? sizeof(void*) : object_size);
+    slab->id = atomic_fetch_add(&s_slab_next_id, 1);
+    pthread_mutex_init(&slab->mutex, NULL);
+}
+
+void http_slab_destroy(http_slab* slab) {
+    for (size_t i = 0; i < HTTP_SLAB_THREAD_CACHES; ++i) {
+        if (s_slab_caches[i].slab_id == slab->id) {
+            memset(&s_slab_caches[i], 0, sizeof(http_slab_cache));
+        }
+    }
+    http_slab_chunk* chunk = slab->chunks;
+    while (chunk) {
+        http_slab_chunk* next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+    slab->chunks = NULL;
+    slab->depot = NULL;
+    pthread_mutex_destroy(&slab->mutex);
+}
+
+// NULL if all of this thread's caches belong to other slabs
+static http_slab_cache* http_slab_thread_cache(http_slab* slab) {
+    http_slab_cache* unused = NULL;
+    for (size_t i = 0; i < HTTP_SLAB_THREAD_CACHES; ++i) {
+        if (s_slab_caches[i].slab_id == slab->id) {
+            return &s_slab_caches[i];
+        }
+        if (!unused && s_slab_caches[i].slab_id == 0) {
+            unused = &s_slab_caches[i];
+        }
+    }
+    if (unused) {
+        unused->slab_id = slab->id;
+    }
+    return unused;
+}
+
+// requires the mutex
+static void http_slab_grow(http_slab* slab, http_error_t* ep) {
+    http_slab_chunk* chunk = safe_malloc(sizeof(http_slab_chunk) + HTTP_SLAB_BATCH * slab->object_size, ep);
+    if (http_is_error(*ep)) {
+        return;
+    }
+    chunk->next = slab->chunks;
+    slab->chunks = chunk;
+    atomic_fetch_add_explicit(&slab->chunks_count, 1, memory_order_relaxed);
+    for (size_t i = HTTP_SLAB_BATCH; i > 0; --i) {
+        void* object = chunk->objects + (i - 1) * slab->object_size;
+        *(void**)object = slab->depot;
+        slab->depot = object;
+    }
+}
+
+void* http_slab_alloc(http_slab* slab, http_error_t* ep) {
+    *ep = http_new_error_ok();
+    http_slab_cache* cache = http_slab_thread_cache(slab);
+    if (cache && cache->head) {
+        void* object = cache->head;
+        cache->head = *(void**)object;
+        --cache->count;
+        return object;
+    }
+    pthread_mutex_lock(&slab->mutex);
+    if (!slab->depot) {
+        http_slab_grow(slab, ep);
+        if (http_is_error(*ep)) {
+            pthread_mutex_unlock(&slab->mutex);
+            return NULL;
+        }
+    }
+    void* object = slab->depot;
+    slab->depot = *(void**)object;
+    // refill the cache, so the next allocations don't need the lock
+    for (size_t i = 1; cache && i < HTTP_SLAB_BATCH && slab->depot; ++i) {
+        void* cached = slab->depot;
+        slab->depot = *(void**)cached;
+        *(void**)cached = cache->head;
+        cache->head = cached;
+        ++cache->count;
+    }
+    pthread_mutex_unlock(&slab->mutex);
+    return object;
+}
+
+void http_slab_free(http_slab* slab, void* object) {
+    if (!object) {
+        return;
+    }
+    http_slab_cache* cache = http_slab_thread_cache(slab);
+    if (!cache) {
+        pthread_mutex_lock(&slab->mutex);
+        *(void**)object = slab->depot;
+        slab->depot = object;
+        pthread_mutex_unlock(&slab->mutex);
+        return;
+    }
+    *(void**)object = cache->head;
+    cache->head = object;
+    ++cache->count;
+    if (cache->count < 2 * HTTP_SLAB_BATCH) {
+        return;
+    }
+    // threads which only free (workers closing connections) hand the
+    // objects back to the one which allocates (the event loop)
+    void* first = cache->head;
+    void* last = first;
+    for (size_t i = 1; i < HTTP_SLAB_BATCH; ++i) {
+        last = *(void**)last;
+    }
+    cache->head = *(void**)last;
+    cache->count -= HTTP_SLAB_BATCH;
+    pthread_mutex_lock(&slab->mutex);
+    *(void**)last = slab->depot;
+    slab->depot = first;
+    pthread_mutex_unlock(&slab->mutex);
+}
+
+static http_arena_block* http_arena_new_block(http_arena* arena, size_t min_size, http_error_t* ep) {
+    size_t size = arena->block_size > 0 ? arena->block_size : HTTP_ARENA_BLOCK_SIZE;
+    if (size < min_size) {
+        size = min_size;
+    }
+    http_arena_block* block = safe_malloc(sizeof(http_arena_block) + size, ep);
+    if (http_is_error(*ep)) {
+        return NULL;
+    }
+    block->size = size;
+    block->used = 0;
+    block->next = arena->blocks;
+    arena->blocks = block;
+    return block;
+}
+
+void* http_arena_alloc(http_arena* arena, size_t size, http_error_t* ep) {
+    *ep = http_new_error_ok();
+    size = align16(size);
+    http_arena_block* block = arena->blocks;
+    if (!block || block->size - block->used < size) {
+        block = http_arena_new_block(arena, size, ep);
+        if (http_is_error(*ep)) {
+            return NULL;
+        }
+    }
+    char* ptr = block->data + block->used;
+    block->used += size;
+    arena->last = ptr;
+    return ptr;
+}
+
+void* http_arena_grow(http_arena* arena, void* ptr, size_t old_size, size_t new_size, http_error_t* ep) {
+    *ep = http_new_error_ok();
+    http_arena_block* block = arena->blocks;
+    if (ptr && ptr == arena->last && block) {
+        // the last allocation ends at block->used, so it can be extended
+        size_t offset = (size_t)((char*)ptr - block->data);
+        if (block->size - offset >= new_size) {
+            block->used = offset + align16(new_size);
+            return ptr;
+        }
+    }
+    void* new_ptr = http_arena_alloc(arena, new_size, ep);
+    if (http_is_error(*ep)) {
+        return NULL;
+    }
+    if (ptr) {
+        memcpy(new_ptr, ptr, old_size < new_size ? old_size : new_size);
+    }
+    return new_ptr;
+}
+
+void http_arena_reset(http_arena* arena) {
+    arena->last = NULL;
+    http_arena_block* block = arena->blocks;
+    if (!block) {
+        return;
+    }
+    if (!block->next && block->size <= HTTP_ARENA_RETAIN_MAX) {
+        // the common case, nothing to give back
+        block->used = 0;
+        return;
+    }
+    // the next request gets one block big enough for all of this one
+    size_t total = 0;
+    while (block) {
+        http_arena_block* next = block->next;
+        total += block->size;
+        free(block);
+        block = next;
+    }
+    arena->blocks = NULL;
+    arena->block_size = total <= HTTP_ARENA_RETAIN_MAX ? total : 0;
+}
+
+void http_arena_free(http_arena* arena) {
+    http_arena_block* block = arena->blocks;
+    while (block) {
+        http_arena_block* next = block->next;
+        free(block);
+        block = next;
+    }
+    memset(arena, 0, sizeof(http_arena));
+}
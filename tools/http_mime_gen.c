@@ -0,0 +1,239 @@
+// generates the extension -> MIME type table used by src/http_mime.c.
+// usage: http-mime-gen <http_mime_types.txt> <http_mime_table.h>
+//
+// the table is a perfect hash ("hash and displace"): every extension's hash
+// with seed 0 picks one of a few buckets, and each bucket gets a seed which
+// sends all of its extensions to distinct free slots. a lookup is then two
+// hashes and one string compare, whatever the size of the table.
+
+#include "http_mime.h"
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define HTTP_MIME_GEN_TYPES_MAX 4096
+#define HTTP_MIME_GEN_LINE_MAX 512
+
+typedef struct {
+    char extension[HTTP_MIME_EXTENSION_MAX + 1];
+    char content_type[HTTP_MIME_GEN_LINE_MAX];
+    bool compressible;
+} mime_entry;
+
+typedef struct {
+    size_t bucket;
+    size_t count;
+} bucket_size;
+
+static mime_entry s_entries[HTTP_MIME_GEN_TYPES_MAX];
+static size_t s_entries_count = 0;
+
+static size_t next_pow2(size_t n) {
+    size_t p = 1;
+    while (p < n) {
+        p <<= 1;
+    }
+    return p;
+}
+
+static bool read_types(const char* path) {
+    FILE* file = fopen(path, "r");
+    if (!file) {
+        perror(path);
+        return false;
+    }
+    char line[HTTP_MIME_GEN_LINE_MAX];
+    size_t line_no = 0;
+    bool ok = true;
+    while (ok && fgets(line, sizeof(line), file)) {
+        ++line_no;
+        char* hash = strchr(line, '#');
+        if (hash) {
+            *hash = '\0';
+        }
+        char* ext = strtok(line, " \t\r\n");
+        if (!ext) {
+            continue;
+        }
+        char* type = strtok(NULL, " \t\r\n");
+        char* flag = strtok(NULL, " \t\r\n");
+        if (!type || strtok(NULL, " \t\r\n") || (flag && strcmp(flag, "compressible") != 0)) {
+            fprintf(stderr, "%s:%zu: expected <extension> <type> [compressible]\n", path, line_no);
+            ok = false;
+            break;
+        }
+        if (strlen(ext) > HTTP_MIME_EXTENSION_MAX) {
+            fprintf(stderr, "%s:%zu: extension longer than %d\n", path, line_no, HTTP_MIME_EXTENSION_MAX);
+            ok = false;
+            break;
+        }
+        for (const char* c = ext; *c; ++c) {
+            if (isupper((unsigned char)*c) || *c == '"' || *c == '\\') {
+                fprintf(stderr, "%s:%zu: extension must be lowercase\n", path, line_no);
+                ok = false;
+            }
+        }
+        for (const char* c = type; *c; ++c) {
+            if (*c == '"' || *c == '\\') {
+                fprintf(stderr, "%s:%zu: invalid type\n", path, line_no);
+                ok = false;
+            }
+        }
+        for (size_t i = 0; ok && i < s_entries_count; ++i) {
+            if (strcmp(s_entries[i].extension, ext) == 0) {
+                fprintf(stderr, "%s:%zu: duplicate extension '%s'\n", path, line_no, ext);
+                ok = false;
+            }
+        }
+        if (ok && s_entries_count == HTTP_MIME_GEN_TYPES_MAX) {
+            fprintf(stderr, "%s:%zu: more than %d types\n", path, line_no, HTTP_MIME_GEN_TYPES_MAX);
+            ok = false;
+        }
+        if (ok) {
+            mime_entry* entry = &s_entries[s_entries_count++];
+            strcpy(entry->extension, ext);
+            strcpy(entry->content_type, type);
+            entry->compressible = flag != NULL;
+        }
+    }
+    fclose(file);
+    if (ok && s_entries_count == 0) {
+        fprintf(stderr, "%s: no types\n", path);
+        ok = false;
+    }
+    return ok;
+}
+
+static int compare_bucket_sizes(const void* a, const void* b) {
+    const bucket_size* x = a;
+    const bucket_size* y = b;
+    // largest first, they are the hardest to place
+    if (x->count != y->count) {
+        return x->count < y->count ? 1 : -1;
+    }
+    return x->bucket < y->bucket ? -1 : (x->bucket > y->bucket);
+}
+
+// fills `seeds` and `slots`, false if some bucket can't be placed
+static bool build(size_t buckets, size_t slots_count, uint16_t* seeds, int16_t* slots) {
+    bucket_size* sizes = calloc(buckets, sizeof(bucket_size));
+    size_t* members = malloc(s_entries_count * sizeof(size_t));
+    size_t* taken = malloc(s_entries_count * sizeof(size_t));
+    if (!sizes || !members || !taken) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+    for (size_t i = 0; i < buckets; ++i) {
+        sizes[i].bucket = i;
+        seeds[i] = 0;
+    }
+    for (size_t i = 0; i < slots_count; ++i) {
+        slots[i] = -1;
+    }
+    for (size_t i = 0; i < s_entries_count; ++i) {
+        const char* ext = s_entries[i].extension;
+        ++sizes[http_mime_hash(ext, strlen(ext), 0) & (buckets - 1)].count;
+    }
+    qsort(sizes, buckets, sizeof(bucket_size), compare_bucket_sizes);
+    bool ok = true;
+    for (size_t b = 0; ok && b < buckets && sizes[b].count > 0; ++b) {
+        size_t count = 0;
+        for (size_t i = 0; i < s_entries_count; ++i) {
+            const char* ext = s_entries[i].extension;
+            if ((http_mime_hash(ext, strlen(ext), 0) & (buckets - 1)) == sizes[b].bucket) {
+                members[count++] = i;
+            }
+        }
+        ok = false;
+        for (uint32_t seed = 1; seed <= UINT16_MAX && !ok; ++seed) {
+            ok = true;
+            for (size_t m = 0; m < count && ok; ++m) {
+                const char* ext = s_entries[members[m]].extension;
+                taken[m] = http_mime_hash(ext, strlen(ext), seed) & (slots_count - 1);
+                ok = slots[taken[m]] < 0;
+                for (size_t k = 0; k < m && ok; ++k) {
+                    ok = taken[k] != taken[m];
+                }
+            }
+            if (ok) {
+                seeds[sizes[b].bucket] = (uint16_t)seed;
+                for (size_t m = 0; m < count; ++m) {
+                    slots[taken[m]] = (int16_t)members[m];
+                }
+            }
+        }
+    }
+    free(sizes);
+    free(members);
+    free(taken);
+    return ok;
+}
+
+static bool write_table(const char* path, size_t buckets, size_t slots_count, const uint16_t* seeds, const int16_t* slots) {
+    FILE* file = fopen(path, "w");
+    if (!file) {
+        perror(path);
+        return false;
+    }
+    fprintf(file, "// generated by tools/http_mime_gen.c from src/http_mime_types.txt, do not edit\n\n");
+    fprintf(file, "#define HTTP_MIME_TABLE_BUCKETS %zu\n", buckets);
+    fprintf(file, "#define HTTP_MIME_TABLE_SLOTS %zu\n\n", slots_count);
+    fprintf(file, "static const http_mime_type http_mime_types[] = {\n");
+    for (size_t i = 0; i < s_entries_count; ++i) {
+        fprintf(file, "    { \"%s\", \"%s\", %s },\n", s_entries[i].extension, s_entries[i].content_type,
+            s_entries[i].compressible ? "true" : "false");
+    }
+    fprintf(file, "};\n\n");
+    fprintf(file, "static const uint16_t http_mime_seeds[HTTP_MIME_TABLE_BUCKETS] = {");
+    for (size_t i = 0; i < buckets; ++i) {
+        fprintf(file, "%s%u,", i % 16 == 0 ? "\n    " : " ", seeds[i]);
+    }
+    fprintf(file, "\n};\n\n");
+    fprintf(file, "// index into http_mime_types, -1 for none\n");
+    fprintf(file, "static const int16_t http_mime_slots[HTTP_MIME_TABLE_SLOTS] = {");
+    for (size_t i = 0; i < slots_count; ++i) {
+        fprintf(file, "%s%d,", i % 16 == 0 ? "\n    " : " ", slots[i]);
+    }
+    fprintf(file, "\n};\n");
+    if (fclose(file) != 0) {
+        perror(path);
+        return false;
+    }
+    return true;
+}
+
+int main(int argc, char** argv) {
+    if (argc != 3) {
+        fprintf(stderr, "usage: %s <http_mime_types.txt> <http_mime_table.h>\n", argv[0]);
+        return 1;
+    }
+    if (!read_types(argv[1])) {
+        return 1;
+    }
+    // about four extensions per bucket, and a load factor of at most 3/4
+    size_t buckets = next_pow2((s_entries_count + 3) / 4);
+    size_t slots_count = next_pow2(s_entries_count + s_entries_count / 3 + 1);
+    uint16_t* seeds = malloc(buckets * sizeof(uint16_t));
+    int16_t* slots = NULL;
+    for (;; slots_count *= 2) {
+        if (slots_count > INT16_MAX) {
+            fprintf(stderr, "no perfect hash found\n");
+            return 1;
+        }
+        free(slots);
+        slots = malloc(slots_count * sizeof(int16_t));
+        if (!seeds || !slots) {
+            fprintf(stderr, "out of memory\n");
+            return 1;
+        }
+        if (build(buckets, slots_count, seeds, slots)) {
+            break;
+        }
+    }
+    bool ok = write_table(argv[2], buckets, slots_count, seeds, slots);
+    free(seeds);
+    free(slots);
+    return ok ? 0 : 1;
+}